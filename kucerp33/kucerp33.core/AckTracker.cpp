@@ -0,0 +1,149 @@
+#include "AckTracker.h"
+
+#include <bit>
+#include <algorithm>
+#include <chrono>
+
+using namespace UDP;
+
+/// <summary>
+/// Ring holds at least two windows, so feedback of sequences still in flight never shares a slot
+/// </summary>
+/// <param name="receiver">socket with ACKs, only ACK thread reads it until Stop()</param>
+/// <param name="window"></param>
+AckTracker::AckTracker(Receiver& receiver, size_t window)
+	: mReceiver(receiver),
+	mFeedback(std::bit_ceil((std::max)(2 * window, size_t(64)))),
+	mDirty(mFeedback.size() / 64)
+{
+	mMask = mFeedback.size() - 1;
+}
+
+AckTracker::~AckTracker()
+{
+	Stop();
+}
+
+void AckTracker::Start()
+{
+	if (mThread.joinable()) return;
+
+	mStop = false;
+	mHasLeftover = false;
+	mThread = std::thread(&AckTracker::Run, this);
+}
+
+void AckTracker::Stop()
+{
+	mStop = true;
+	mWake.notify_all();
+	if (mThread.joinable()) mThread.join();
+}
+
+bool AckTracker::Leftover(ControlMessage& out) const
+{
+	if (!mHasLeftover) return false;
+
+	out = mLeftover;
+	return true;
+}
+
+/// <summary>
+/// ACK thread: takes whatever comes back, ACK/NACK are recorded right away
+/// </summary>
+void AckTracker::Run()
+{
+	ControlMessage msg;
+	while (!mStop.load(std::memory_order_relaxed))
+	{
+		if (!mReceiver.ReceiveControl(msg, POLL_TIMEOUT)) continue;
+
+		if (msg.type == ControlType::Ack || msg.type == ControlType::Nack)
+		{
+			Record(msg.value, msg.type == ControlType::Nack);
+		}
+		else
+		{
+			mLeftover = msg;
+			mHasLeftover = true;
+		}
+	}
+}
+
+/// <summary>
+/// ACK thread: feedback goes into slot of the sequence, then its dirty bit is set.
+/// ACK is final, later NACK of the same sequence does not overwrite it.
+/// Base only grows, so what slot holds is either the same sequence or an older one.
+/// </summary>
+/// <param name="seq"></param>
+/// <param name="isNack"></param>
+void AckTracker::Record(uint32_t seq, bool isNack)
+{
+	// Late feedback of acked sequence, or sequence from corrupted header
+	size_t base = mBase.load(std::memory_order_acquire);
+	if (seq < base || seq - base >= mFeedback.size()) return;
+
+	size_t slot = seq & mMask;
+
+	uint64_t current = mFeedback[slot].load(std::memory_order_relaxed);
+	if (current == (((static_cast<uint64_t>(seq) + 1) << 1) | 1) && isNack) return;
+
+	mFeedback[slot].store(((static_cast<uint64_t>(seq) + 1) << 1) | (isNack ? 0 : 1), std::memory_order_release);
+	mDirty[slot >> 6].fetch_or(uint64_t(1) << (slot & 63), std::memory_order_release);
+	mRecorded.fetch_add(1, std::memory_order_release);
+
+	// Empty lock, transmit thread is either before its check or already waiting
+	{
+		std::lock_guard<std::mutex> lock(mWakeMutex);
+	}
+	mWake.notify_one();
+}
+
+/// <summary>
+/// Transmit thread: walks dirty bits word by word, each word is taken with one exchange
+/// </summary>
+/// <param name="seq"></param>
+/// <param name="isNack"></param>
+/// <returns></returns>
+bool AckTracker::Next(uint32_t& seq, bool& isNack)
+{
+	if (!mTaken)
+	{
+		// Nothing recorded since last full pass
+		uint64_t recorded = mRecorded.load(std::memory_order_acquire);
+		if (recorded == mSeen) return false;
+		mSeen = recorded;
+	}
+
+	for (size_t scanned = 0; ; )
+	{
+		while (mTaken)
+		{
+			size_t slot = (mTakenWord << 6) + std::countr_zero(mTaken);
+			mTaken &= mTaken - 1;
+
+			uint64_t value = mFeedback[slot].load(std::memory_order_acquire);
+			if (!value) continue;
+
+			seq = static_cast<uint32_t>((value >> 1) - 1);
+			isNack = !(value & 1);
+			return true;
+		}
+
+		if (scanned == mDirty.size()) return false;
+		++scanned;
+
+		mTakenWord = mCursor;
+		mCursor = (mCursor + 1 < mDirty.size()) ? mCursor + 1 : 0;
+		mTaken = mDirty[mTakenWord].exchange(0, std::memory_order_acquire);
+	}
+}
+
+void AckTracker::WaitForFeedback(uint64_t timeoutUs)
+{
+	std::unique_lock<std::mutex> lock(mWakeMutex);
+	mWake.wait_for(lock, std::chrono::microseconds(timeoutUs), [this]()
+	{
+		return mRecorded.load(std::memory_order_acquire) != mSeen || mStop.load(std::memory_order_relaxed);
+	});
+}
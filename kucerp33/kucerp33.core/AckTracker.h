@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "UDPCommunication.h"
+
+namespace UDP
+{
+	/// <summary>
+	/// ACK/NACK of selective repeat received on a thread of its own, so transmit thread never
+	/// blocks in recvfrom. Feedback is recorded per sequence in a ring of atomics the moment it
+	/// arrives and transmit thread takes it with Next() without any lock. Slot keeps sequence
+	/// number, so late feedback of an old sequence is never taken for a new one in same slot.
+	/// Only feedback from base of the window up to one ring is recorded: NACK of a packet with
+	/// corrupted header carries any sequence number and must not take a slot of real ones.
+	/// </summary>
+	class AckTracker
+	{
+	public:
+		// How often ACK thread checks whether it should stop, microseconds
+		static constexpr int POLL_TIMEOUT = 20 * 1000;
+
+		AckTracker(Receiver& receiver, size_t window);
+		~AckTracker();
+
+		AckTracker(const AckTracker&) = delete;
+		AckTracker& operator=(const AckTracker&) = delete;
+
+		void Start();
+		void Stop();
+
+		// Transmit thread: next recorded ACK/NACK, false if there is none
+		bool Next(uint32_t& seq, bool& isNack);
+		// Transmit thread: everything below base is acked
+		void SetBase(size_t base) { mBase.store(base, std::memory_order_release); }
+		// Transmit thread: sleeps until new feedback arrives or timeout (microseconds) runs out
+		void WaitForFeedback(uint64_t timeoutUs);
+
+		// Last control message other than ACK/NACK (FACK, LEAF...), valid after Stop()
+		bool Leftover(ControlMessage& out) const;
+
+	private:
+		void Run();
+		void Record(uint32_t seq, bool isNack);
+
+		Receiver& mReceiver;
+		size_t mMask = 0;
+
+		// Slot seq & mMask: 0 = nothing, else ((seq + 1) << 1) | isAck. Written by ACK thread only.
+		// Sequences in [base, base + ring) never share a slot
+		std::vector<std::atomic<uint64_t>> mFeedback;
+		// Bit per slot with feedback transmit thread did not take yet
+		std::vector<std::atomic<uint64_t>> mDirty;
+		std::atomic<uint64_t> mRecorded{ 0 };
+		std::atomic<size_t> mBase{ 0 };
+
+		// Transmit thread: dirty bits taken but not walked through yet
+		uint64_t mSeen = 0;
+		size_t mCursor = 0;
+		size_t mTakenWord = 0;
+		uint64_t mTaken = 0;
+
+		// Only for sleeping of transmit thread, feedback itself does not lock
+		std::mutex mWakeMutex;
+		std::condition_variable mWake;
+
+		std::atomic<bool> mStop{ false };
+		std::thread mThread;
+
+		ControlMessage mLeftover{};
+		bool mHasLeftover = false;
+	};
+}
@@ -0,0 +1,60 @@
+#include "AllocationCounter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef KUCERP33_COUNT_ALLOCATIONS
+
+static std::atomic<uint64_t> gAllocations{ 0 };
+static thread_local bool tUncounted = false;
+
+/// ------------------------------------------------------------------------------------------------
+/// Replacement of global operator new/delete, only in allocation counting builds.
+/// Array and nothrow forms forward to these by default.
+/// ------------------------------------------------------------------------------------------------
+
+void* operator new(std::size_t size)
+{
+	if (!tUncounted) gAllocations.fetch_add(1, std::memory_order_relaxed);
+
+	if (void* ptr = std::malloc(size ? size : 1)) return ptr;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+
+uint64_t UDP::AllocationCount()
+{
+	return gAllocations.load(std::memory_order_relaxed);
+}
+
+UDP::UncountedAllocations::UncountedAllocations() : mPrevious(tUncounted)
+{
+	tUncounted = true;
+}
+
+UDP::UncountedAllocations::~UncountedAllocations()
+{
+	tUncounted = mPrevious;
+}
+
+#else
+
+uint64_t UDP::AllocationCount()
+{
+	return 0;
+}
+
+UDP::UncountedAllocations::UncountedAllocations() {}
+UDP::UncountedAllocations::~UncountedAllocations() {}
+
+#endif
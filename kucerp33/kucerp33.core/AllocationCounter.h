@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+
+namespace UDP
+{
+	// Number of heap allocations made by the whole process so far.
+	// Counting is only compiled in with KUCERP33_COUNT_ALLOCATIONS (Debug|x64),
+	// otherwise it always returns 0.
+	uint64_t AllocationCount();
+
+	constexpr bool ALLOCATION_COUNTING =
+#ifdef KUCERP33_COUNT_ALLOCATIONS
+		true;
+#else
+		false;
+#endif
+
+	/// <summary>
+	/// Allocations of calling thread are not counted while it exists. Only for background
+	/// threads which are off the packet path by design (exporters), so probes see the transfer only.
+	/// </summary>
+	class UncountedAllocations
+	{
+	public:
+		UncountedAllocations();
+		~UncountedAllocations();
+
+		UncountedAllocations(const UncountedAllocations&) = delete;
+		UncountedAllocations& operator=(const UncountedAllocations&) = delete;
+
+	private:
+		bool mPrevious = false;
+	};
+
+	/// <summary>
+	/// Counts allocations made on the per packet path of a transfer.
+	/// Resume()/Pause() fence the measured part, CountPacket() is called once per packet.
+	/// </summary>
+	struct AllocationProbe
+	{
+		const char* name = "";
+		uint64_t allocations = 0;
+		size_t packets = 0;
+
+		explicit AllocationProbe(const char* name) : name(name) {}
+
+		void Resume() { start = AllocationCount(); }
+		void Pause() { allocations += AllocationCount() - start; }
+		void CountPacket() { ++packets; }
+
+		void Report() const
+		{
+			if (!ALLOCATION_COUNTING) return;
+
+			double perPacket = packets ? static_cast<double>(allocations) / packets : 0.0;
+			std::cout << "[alloc] " << name << ": " << allocations << " allocations over "
+				<< packets << " packets (" << perPacket << " per packet)\n";
+
+			// Steady state path must not touch the heap
+			if (allocations != 0)
+				std::cerr << "[alloc] " << name << ": packet path allocates, this is a regression!\n";
+		}
+
+	private:
+		uint64_t start = 0;
+	};
+}
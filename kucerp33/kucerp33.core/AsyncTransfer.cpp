@@ -0,0 +1,472 @@
+#include "AsyncTransfer.h"
+#include "SendWindow.h"
+#include "SmartDebug.h"
+#include "Log.h"
+#include "Trace.h"
+
+#include <sstream>
+#include <algorithm>
+
+using namespace UDP;
+
+/// ------------------------------------------------------------------------------------------------
+/// SENDER
+/// ------------------------------------------------------------------------------------------------
+
+AsyncSender::AsyncSender(EventLoop& loop, Sender& sender, Receiver& ackReceiver)
+	: mLoop(loop), mSender(sender), mAckReceiver(ackReceiver)
+{
+}
+
+bool AsyncSender::Mailbox::Push(const ControlMessage& message)
+{
+	if (count == messages.size()) return false;
+
+	messages[(head + count) % messages.size()] = message;
+	++count;
+	return true;
+}
+
+bool AsyncSender::Mailbox::Pop(ControlMessage& message)
+{
+	if (count == 0) return false;
+
+	message = messages[head];
+	head = (head + 1) % messages.size();
+	--count;
+	return true;
+}
+
+/// <summary>
+/// Transfer registers its mailbox, dispatcher is started with first transfer
+/// </summary>
+/// <param name="session"></param>
+/// <param name="window">packets in flight, at least 1</param>
+/// <returns>true if receiver confirmed the file</returns>
+Task<bool> AsyncSender::Send(FileSession& session, size_t window)
+{
+	if (session.ChunkCount() == 0) co_return false;
+
+	Mailbox mailbox(MAILBOX_MESSAGES);
+	if (!mMailboxes.emplace(session.sessionId, &mailbox).second)
+	{
+		std::cerr << "Sender: Session " << std::hex << session.sessionId << std::dec << " is already being sent\n";
+		co_return false;
+	}
+
+	if (!mDispatching)
+	{
+		mDispatching = true;
+		mLoop.Spawn(Dispatch());
+	}
+
+	TransferMetrics& metrics = Metrics::Open(session.sessionId, TransferMetrics::Direction::Send);
+	TraceSpan span("Send file", "session", session.sessionId, session.sessionId);
+
+	ControlMessage leftover;
+	bool hasLeftover = false;
+	bool ok = co_await Transmit(session, mailbox, metrics, std::clamp<size_t>(window, 1, FileSession::MAX_WINDOW), leftover, hasLeftover);
+	if (ok) ok = co_await ServeRepairs(session, mailbox, metrics, hasLeftover ? &leftover : nullptr);
+
+	Metrics::Close(metrics);
+	mMailboxes.erase(session.sessionId);
+	co_return ok;
+}
+
+/// <summary>
+/// Reads ACK socket while any transfer runs
+/// </summary>
+/// <returns></returns>
+Task<void> AsyncSender::Dispatch()
+{
+	while (!mMailboxes.empty())
+	{
+		bool readable = co_await mLoop.Readable(mAckReceiver.Handle(), POLL_TIMEOUT);
+		if (!readable) continue;
+
+		ControlMessage message;
+		for (size_t i = 0; i < BURST_MESSAGES && mAckReceiver.ReceiveControl(message, 0); ++i) Route(message);
+	}
+	mDispatching = false;
+}
+
+/// <summary>
+/// Message goes to transfer of its session. Receiver which does not send session id
+/// can be served only when there is one transfer
+/// </summary>
+/// <param name="message"></param>
+void AsyncSender::Route(const ControlMessage& message)
+{
+	Mailbox* mailbox = nullptr;
+	if (message.session == 0 && mMailboxes.size() == 1)
+	{
+		mailbox = mMailboxes.begin()->second;
+	}
+	else
+	{
+		auto it = mMailboxes.find(message.session);
+		if (it == mMailboxes.end()) return; // Late message of finished transfer
+		mailbox = it->second;
+	}
+
+	if (!mailbox->Push(message)) return;
+	if (EventLoop::Waiter* waiter = std::exchange(mailbox->waiter, nullptr)) mLoop.Signal(*waiter);
+}
+
+/// <summary>
+/// Selective repeat of one transfer, same as blocking sender but waiting suspends only this coroutine
+/// </summary>
+/// <param name="session"></param>
+/// <param name="mailbox"></param>
+/// <param name="metrics"></param>
+/// <param name="window"></param>
+/// <param name="leftover">FACK or LEAF request which came before last ACK</param>
+/// <param name="hasLeftover"></param>
+/// <returns>false if sending failed</returns>
+Task<bool> AsyncSender::Transmit(FileSession& session, Mailbox& mailbox, TransferMetrics& metrics, size_t window,
+	ControlMessage& leftover, bool& hasLeftover)
+{
+	const size_t totalChunks = session.ChunkCount();
+	SendWindow state(totalChunks, window);
+
+	uint64_t now = 0;
+	auto sendChunk = [&](size_t seq)
+	{
+		if (state.SendTime(seq)) TRACE_INSTANT("Retransmit", "seq", seq);
+
+		const Chunk& chunk = session.GetChunk(seq);
+		if (!mSender.SendData(chunk))
+		{
+			std::cerr << "Sender: SendData failed for seq=" << seq << "\n";
+			return false;
+		}
+		state.MarkSent(seq, now);
+		metrics.PacketSent(chunk.packetSize, state.Retransmits(seq) > 0);
+		return true;
+	};
+
+	while (!state.IsDone())
+	{
+		uint64_t feedbackAt = NowMicroseconds();
+		ControlMessage message;
+		while (mailbox.Pop(message))
+		{
+			if (message.type != ControlType::Ack && message.type != ControlType::Nack)
+			{
+				leftover = message;
+				hasLeftover = true;
+				continue;
+			}
+			if (message.value >= totalChunks) continue;
+
+			if (message.type == ControlType::Nack)
+			{
+				if (!state.IsAcked(message.value))
+				{
+					LOG_EVENT(LogEvent::NackResend, message.value);
+					TRACE_INSTANT("NACK", "seq", message.value);
+					metrics.NackReceived();
+					state.MarkLost(message.value);
+				}
+				continue;
+			}
+
+			uint64_t sentAt = state.SendTime(message.value);
+			uint64_t rtt = state.Retransmits(message.value) == 0 && sentAt ? feedbackAt - sentAt : 0;
+			uint64_t firstSentAt = state.FirstSendTime(message.value);
+			if (state.MarkAcked(message.value))
+			{
+				metrics.AckReceived(session.DataBytes(message.value), rtt);
+				if (firstSentAt) session.latency.AckReceived(rtt, feedbackAt - firstSentAt);
+			}
+		}
+
+		if (state.IsDone()) break;
+
+		now = NowMicroseconds();
+		TraceSpan round("Send window");
+		size_t sent = 0;
+
+		// Packets without ACK for too long are sent again
+		uint64_t deadline = now > ACK_RECEIVER_TIMEOUT ? now - ACK_RECEIVER_TIMEOUT : 0;
+		for (size_t seq = state.NextExpired(state.Base(), deadline); seq < state.Limit(); seq = state.NextExpired(seq + 1, deadline))
+		{
+			LOG_EVENT(LogEvent::TimeoutResend, seq);
+			TRACE_INSTANT("Timeout", "seq", seq);
+			metrics.Timeout();
+			if (!sendChunk(seq)) co_return false;
+			++sent;
+		}
+
+		for (size_t seq = state.NextUnsent(state.Base()); seq < state.Limit(); seq = state.NextUnsent(seq + 1))
+		{
+			if (!sendChunk(seq)) co_return false;
+			++sent;
+		}
+		metrics.Window(state.InFlightCount());
+		round.SetArg("packets", sent);
+		round.End();
+
+		// Until feedback or oldest packet expires
+		uint64_t wait = ACK_RECEIVER_TIMEOUT;
+		uint64_t sentAt = state.SendTime(state.Base());
+		if (sentAt && sentAt + ACK_RECEIVER_TIMEOUT > now) wait = sentAt + ACK_RECEIVER_TIMEOUT - now;
+		if (mailbox.count == 0)
+		{
+			// Other transfers run while this one waits, so the span is async
+			TraceSpan ackWait("ACK wait", "in_flight", state.InFlightCount(), session.sessionId);
+			co_await mLoop.Event(mailbox.waiter, wait);
+		}
+	}
+
+	std::cout << "Sender: Session " << std::hex << session.sessionId << std::dec << ", "
+		<< state.TotalRetransmits() << " packets sent again\n";
+	co_return true;
+}
+
+/// <summary>
+/// After all chunks are delivered, receiver checks the hash. Until it says FACK/FNACK
+/// we answer its LEAF requests and send again chunks of corrupted blocks it NACKs.
+/// </summary>
+/// <param name="session"></param>
+/// <param name="mailbox"></param>
+/// <param name="metrics">repaired chunks count as resent</param>
+/// <param name="pending">message which already came, handled first</param>
+/// <returns>true if receiver confirmed the file</returns>
+Task<bool> AsyncSender::ServeRepairs(FileSession& session, Mailbox& mailbox, TransferMetrics& metrics, const ControlMessage* pending)
+{
+	// Receiver can take a while to finish hash, it is ~3 s without any message
+	constexpr uint32_t MAX_IDLE = 15;
+	uint32_t idle = 0;
+
+	while (idle < MAX_IDLE)
+	{
+		ControlMessage message;
+		if (pending)
+		{
+			message = *pending;
+			pending = nullptr;
+		}
+		else if (!mailbox.Pop(message))
+		{
+			bool signaled = co_await mLoop.Event(mailbox.waiter, ACK_RECEIVER_TIMEOUT);
+			if (!signaled) ++idle;
+			continue;
+		}
+		idle = 0;
+
+		switch (message.type)
+		{
+		case ControlType::FileAck:
+			std::cout << "Sender: Receiver confirmed session " << std::hex << session.sessionId << std::dec << "\n";
+			co_return true;
+
+		case ControlType::FileNack:
+			std::cerr << "Sender: Receiver rejected session " << std::hex << session.sessionId << std::dec << "!\n";
+			co_return false;
+
+		case ControlType::Leaf:
+			mSender.SendData(session.GetLeafChunk(message.value));
+			break;
+
+		case ControlType::Nack:
+			if (message.value < session.ChunkCount())
+			{
+				LOG_EVENT(LogEvent::RepairResend, message.value);
+				TRACE_INSTANT("Repair resend", "seq", message.value);
+				const Chunk& chunk = session.GetChunk(message.value);
+				if (mSender.SendData(chunk)) metrics.PacketSent(chunk.packetSize, true);
+			}
+			break;
+
+		default:
+			break; // Late ACKs
+		}
+	}
+
+	std::cout << "Sender: No verdict about session " << std::hex << session.sessionId << std::dec << " from receiver\n";
+	co_return false;
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// RECEIVER
+/// ------------------------------------------------------------------------------------------------
+
+AsyncReceiver::AsyncReceiver(EventLoop& loop, Receiver& receiver)
+	: mLoop(loop), mReceiver(receiver)
+{
+}
+
+void AsyncReceiver::Start()
+{
+	if (mRunning) return;
+
+	mRunning = true;
+	mStop.store(false, std::memory_order_relaxed);
+	mLoop.Spawn(Receive());
+}
+
+/// <summary>
+/// Waits for a finished file
+/// </summary>
+/// <param name="out"></param>
+/// <returns>false once receiving ended and every file was handed out</returns>
+Task<bool> AsyncReceiver::NextFile(File& out)
+{
+	while (mFiles.empty())
+	{
+		if (!mRunning) co_return false;
+		co_await mLoop.Event(mFileWaiter, EventLoop::NO_TIMEOUT);
+	}
+
+	out = std::move(mFiles.front());
+	mFiles.pop_front();
+	co_return true;
+}
+
+/// <summary>
+/// Drains socket whenever it is readable, transfers get their timeouts every RECEIVER_TIMEOUT
+/// </summary>
+/// <returns></returns>
+Task<void> AsyncReceiver::Receive()
+{
+	uint64_t lastSweep = NowMicroseconds();
+
+	while (!mStop.load(std::memory_order_relaxed))
+	{
+		bool readable = co_await mLoop.Readable(mReceiver.Handle(), RECEIVER_TIMEOUT);
+		uint64_t now = NowMicroseconds();
+
+		for (size_t i = 0; readable && i < BURST_PACKETS && mReceiver.ReceivePacket(mPacket, &mIp, &mPort, 0); ++i)
+		{
+			TakePacket(now);
+		}
+
+		if (now - lastSweep < RECEIVER_TIMEOUT) continue;
+		lastSweep = now;
+		Sweep(now);
+	}
+
+	std::cout << "Receiver: Stopped, " << mTransfers.size() << " transfers were not finished\n";
+	mTransfers.clear();
+	mRunning = false;
+
+	if (EventLoop::Waiter* waiter = std::exchange(mFileWaiter, nullptr)) mLoop.Signal(*waiter);
+}
+
+/// <summary>
+/// Packet is checked (DATA checksum as its session announced), valid one goes to transfer
+/// of its peer and session, new transfer is made for unknown one. Packet is ACKed only once
+/// it has its transfer, so the one dropped for too many transfers is sent again
+/// </summary>
+/// <param name="now"></param>
+void AsyncReceiver::TakePacket(uint64_t now)
+{
+	mKey.ip = mIp;
+	mKey.port = mPort;
+	mKey.session = mPacket.session;
+
+	auto it = mTransfers.find(mKey);
+	ChecksumPolicy policy = it != mTransfers.end() ? it->second->session.checksumPolicy : ChecksumPolicy::Crc32;
+
+	bool ack = Receiver::CheckCRC(mPacket, policy);
+	if (!ack)
+	{
+		if (!AckSender(mIp).SendAckOrNack(false, mPacket.seq, mPacket.session))
+			std::cerr << "Error: ACK or NACK could not be sent.\n";
+		return;
+	}
+
+	if (it == mTransfers.end())
+	{
+		// Not ACKed, it comes again once a transfer ends
+		if (mTransfers.size() >= MAX_TRANSFERS) return;
+
+		auto transfer = std::make_unique<IncomingTransfer>();
+		// Two senders may send file of the same name
+		std::ostringstream prefix;
+		prefix << std::hex << std::setw(8) << std::setfill('0') << mKey.session << "_";
+		transfer->session.outputPath = prefix.str();
+		transfer->session.sessionId = mKey.session;
+		transfer->session.ReserveReorder(REORDER_RESERVE);
+		transfer->ackSender.emplace(mIp, SEND_PORT_ACK);
+		transfer->ackIp = mIp;
+
+		std::cout << "Receiver: New transfer " << prefix.str() << " from " << mIp << ":" << mPort
+			<< " (" << mTransfers.size() + 1 << " running)\n";
+		it = mTransfers.emplace(mKey, std::move(transfer)).first;
+	}
+
+	if (!AckSender(mIp).SendAckOrNack(true, mPacket.seq, mPacket.session))
+	{
+		std::cerr << "Error: ACK or NACK could not be sent.\n";
+		return;
+	}
+
+	IncomingTransfer& transfer = *it->second;
+	transfer.lastPacket = now;
+	transfer.idle = 0;
+
+	if (transfer.finished) return;
+
+	if (!transfer.TakePacket(mPacket))
+	{
+		// Sender gets FNACK, rest of its packets go to a new transfer
+		transfer.ackSender->SendFileAckOrNack(false, mKey.session);
+		mTransfers.erase(it);
+		return;
+	}
+
+	transfer.CheckComplete();
+	if (transfer.finished) Finished(transfer);
+}
+
+/// <summary>
+/// Transfers without packet for a while get their timeout, finished ones are dropped
+/// once verdict was repeated long enough, unfinished once they are abandoned
+/// </summary>
+/// <param name="now"></param>
+void AsyncReceiver::Sweep(uint64_t now)
+{
+	for (auto it = mTransfers.begin(); it != mTransfers.end();)
+	{
+		IncomingTransfer& transfer = *it->second;
+		bool wasFinished = transfer.finished;
+		bool keep = now - transfer.lastPacket < RECEIVER_TIMEOUT || transfer.Idle();
+
+		// Repair could not go on
+		if (!wasFinished && transfer.finished) Finished(transfer);
+
+		if (keep && !transfer.finished && now - transfer.lastPacket >= ABANDON_TIMEOUT)
+		{
+			std::cerr << "Receiver: Transfer from " << it->first.ip << ":" << it->first.port << " abandoned\n";
+			keep = false;
+		}
+
+		it = keep ? std::next(it) : mTransfers.erase(it);
+	}
+}
+
+/// <summary>
+/// File is handed out, transfer itself stays to repeat the verdict
+/// </summary>
+/// <param name="transfer"></param>
+void AsyncReceiver::Finished(IncomingTransfer& transfer)
+{
+	mFiles.push_back({ transfer.session.outputPath + transfer.session.fileName, transfer.session.sessionId, transfer.hashOk });
+	if (EventLoop::Waiter* waiter = std::exchange(mFileWaiter, nullptr)) mLoop.Signal(*waiter);
+}
+
+/// <summary>
+/// ACK socket of peer, all of them are closed when there are too many peers
+/// </summary>
+/// <param name="ip"></param>
+/// <returns></returns>
+Sender& AsyncReceiver::AckSender(const std::string& ip)
+{
+	auto it = mAckSenders.find(ip);
+	if (it != mAckSenders.end()) return *it->second;
+
+	if (mAckSenders.size() >= ACK_PEERS) mAckSenders.clear();
+	return *mAckSenders.emplace(ip, std::make_unique<Sender>(ip, SEND_PORT_ACK)).first->second;
+}
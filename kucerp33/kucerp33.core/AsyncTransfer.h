@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+
+#include "UDPCommunication.h"
+#include "FileTransfer.h"
+#include "IncomingTransfer.h"
+#include "EventLoop.h"
+#include "Coroutine.h"
+#include "Metrics.h"
+
+namespace UDP
+{
+	/// <summary>
+	/// Sends files as coroutines on EventLoop, any number of them at once over one data socket.
+	/// ACK socket is read by one dispatcher coroutine, control messages go to transfer by their
+	/// session id. Every transfer is selective repeat (window 1 = stop-and-wait) followed by
+	/// repairs until receiver says FACK/FNACK, like the blocking sender.
+	/// </summary>
+	class AsyncSender
+	{
+	public:
+		// Control messages waiting for one transfer, more are dropped like lost ACKs
+		static constexpr size_t MAILBOX_MESSAGES = 256;
+		// Messages taken from ACK socket before others get their turn
+		static constexpr size_t BURST_MESSAGES = 64;
+		// Dispatcher looks this often whether it still has transfers, microseconds
+		static constexpr uint64_t POLL_TIMEOUT = 20 * 1000;
+
+		AsyncSender(EventLoop& loop, Sender& sender, Receiver& ackReceiver);
+
+		// Session must stay alive and have unique session id until the task is done
+		Task<bool> Send(FileSession& session, size_t window);
+
+	private:
+		struct Mailbox
+		{
+			explicit Mailbox(size_t capacity) : messages(capacity) {}
+
+			bool Push(const ControlMessage& message);
+			bool Pop(ControlMessage& message);
+
+			std::vector<ControlMessage> messages; // ring
+			size_t head = 0;
+			size_t count = 0;
+			EventLoop::Waiter* waiter = nullptr;
+		};
+
+		Task<void> Dispatch();
+		void Route(const ControlMessage& message);
+		Task<bool> Transmit(FileSession& session, Mailbox& mailbox, TransferMetrics& metrics, size_t window,
+			ControlMessage& leftover, bool& hasLeftover);
+		Task<bool> ServeRepairs(FileSession& session, Mailbox& mailbox, TransferMetrics& metrics, const ControlMessage* pending);
+
+		EventLoop& mLoop;
+		Sender& mSender;
+		Receiver& mAckReceiver;
+
+		std::unordered_map<uint32_t, Mailbox*> mMailboxes; // by session id
+		bool mDispatching = false;
+	};
+
+	/// <summary>
+	/// Receives files from many senders at once as one coroutine on EventLoop, without
+	/// threads of ReceivePipeline. Packets are checked and ACKed right away and go to transfer
+	/// of their peer and session, finished files are handed out by NextFile. Packet of new
+	/// transfer over MAX_TRANSFERS is not ACKed, sender sends it again later.
+	/// </summary>
+	class AsyncReceiver
+	{
+	public:
+		static constexpr size_t MAX_TRANSFERS = 4096;
+		// Transfer without any packet for this long is dropped, its .part file stays (microseconds)
+		static constexpr uint64_t ABANDON_TIMEOUT = 30ull * 1000 * 1000;
+		// Packets taken from socket before others get their turn
+		static constexpr size_t BURST_PACKETS = 64;
+		// ACK sockets kept open, one per peer address
+		static constexpr size_t ACK_PEERS = 16;
+		// Reorder ring of new transfer is ready before first DATA, so it does not grow on packet path
+		static constexpr size_t REORDER_RESERVE = 256;
+
+		struct File
+		{
+			std::string path;
+			uint32_t session = 0;
+			bool hashOk = false;
+		};
+
+		AsyncReceiver(EventLoop& loop, Receiver& receiver);
+
+		// Receiving coroutine is spawned on the loop
+		void Start();
+		// Any thread, receiving ends within RECEIVER_TIMEOUT
+		void Stop() { mStop.store(true, std::memory_order_relaxed); }
+
+		// Next finished file (saved or thrown away), false once receiving ended.
+		// One coroutine at a time may wait here
+		Task<bool> NextFile(File& out);
+
+	private:
+		Task<void> Receive();
+		void TakePacket(uint64_t now);
+		void Sweep(uint64_t now);
+		void Finished(IncomingTransfer& transfer);
+		Sender& AckSender(const std::string& ip);
+
+		using TransferMap = std::unordered_map<TransferKey, std::unique_ptr<IncomingTransfer>, TransferKeyHash>;
+
+		EventLoop& mLoop;
+		Receiver& mReceiver;
+
+		TransferMap mTransfers;
+		TransferKey mKey; // reused for lookup, so it does not allocate
+		Chunk mPacket;
+		std::string mIp;
+		uint16_t mPort = 0;
+
+		std::unordered_map<std::string, std::unique_ptr<Sender>> mAckSenders;
+
+		std::deque<File> mFiles;
+		EventLoop::Waiter* mFileWaiter = nullptr;
+
+		std::atomic<bool> mStop{ false };
+		bool mRunning = false;
+	};
+}
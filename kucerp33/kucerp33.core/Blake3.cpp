@@ -0,0 +1,469 @@
+#include "Blake3.h"
+#include "CpuFeatures.h"
+
+#include <cstring>
+#include <algorithm>
+
+using namespace UDP;
+
+static const uint32_t IV[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// Message word order of every round (permutation applied round after round)
+static const uint8_t SCHEDULE[7][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+	{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+	{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+	{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+	{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+	{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+// Domain flags
+static constexpr uint32_t CHUNK_START = 1;
+static constexpr uint32_t CHUNK_END = 2;
+static constexpr uint32_t PARENT = 4;
+static constexpr uint32_t ROOT = 8;
+
+static inline uint32_t LoadLE32(const uint8_t* p)
+{
+	return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline void StoreLE32(uint8_t* p, uint32_t v)
+{
+	p[0] = uint8_t(v);
+	p[1] = uint8_t(v >> 8);
+	p[2] = uint8_t(v >> 16);
+	p[3] = uint8_t(v >> 24);
+}
+
+static inline uint32_t Rotr(uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static inline void LoadBlock(const uint8_t* block, uint32_t m[16])
+{
+	for (int i = 0; i < 16; ++i) m[i] = LoadLE32(block + 4 * i);
+}
+
+
+/// ------------------------------------------------------------------------------------------------
+/// COMPRESSION
+/// ------------------------------------------------------------------------------------------------
+
+static inline void G(uint32_t v[16], int a, int b, int c, int d, uint32_t x, uint32_t y)
+{
+	v[a] = v[a] + v[b] + x; v[d] = Rotr(v[d] ^ v[a], 16);
+	v[c] = v[c] + v[d];     v[b] = Rotr(v[b] ^ v[c], 12);
+	v[a] = v[a] + v[b] + y; v[d] = Rotr(v[d] ^ v[a], 8);
+	v[c] = v[c] + v[d];     v[b] = Rotr(v[b] ^ v[c], 7);
+}
+
+/// <summary>
+/// Full 16 word state after 7 rounds, first half xor second half is the chaining value
+/// </summary>
+static void CompressState(const uint32_t cv[8], const uint32_t m[16], uint32_t blockLength, uint64_t counter, uint32_t flags, uint32_t v[16])
+{
+	for (int i = 0; i < 8; ++i) v[i] = cv[i];
+	v[8] = IV[0]; v[9] = IV[1]; v[10] = IV[2]; v[11] = IV[3];
+	v[12] = static_cast<uint32_t>(counter);
+	v[13] = static_cast<uint32_t>(counter >> 32);
+	v[14] = blockLength;
+	v[15] = flags;
+
+	for (int round = 0; round < 7; ++round)
+	{
+		const uint8_t* s = SCHEDULE[round];
+		G(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+		G(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+		G(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+		G(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+		G(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+		G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+		G(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+		G(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+	}
+}
+
+static void CompressCv(uint32_t cv[8], const uint32_t m[16], uint32_t blockLength, uint64_t counter, uint32_t flags)
+{
+	uint32_t v[16];
+	CompressState(cv, m, blockLength, counter, flags, v);
+	for (int i = 0; i < 8; ++i) cv[i] = v[i] ^ v[i + 8];
+}
+
+static void ParentCv(const uint32_t left[8], const uint32_t right[8], uint32_t out[8])
+{
+	uint32_t m[16];
+	memcpy(m, left, 8 * sizeof(uint32_t));
+	memcpy(m + 8, right, 8 * sizeof(uint32_t));
+	memcpy(out, IV, sizeof(IV));
+	CompressCv(out, m, Blake3::BLOCK_SIZE, 0, PARENT);
+}
+
+
+/// ------------------------------------------------------------------------------------------------
+/// AVX2 MULTI-CHUNK, lane i of every register belongs to chunk i
+/// ------------------------------------------------------------------------------------------------
+
+#ifdef KUCERP33_X64
+
+static constexpr size_t LANES = Blake3::LANES;
+
+KUCERP33_TARGET("avx2")
+static inline __m256i Rotr16x8(__m256i x)
+{
+	const __m256i mask = _mm256_setr_epi8(
+		2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+		2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+	return _mm256_shuffle_epi8(x, mask);
+}
+
+KUCERP33_TARGET("avx2")
+static inline __m256i Rotr8x8(__m256i x)
+{
+	const __m256i mask = _mm256_setr_epi8(
+		1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+		1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12);
+	return _mm256_shuffle_epi8(x, mask);
+}
+
+KUCERP33_TARGET("avx2")
+static inline __m256i RotrShift(__m256i x, int n)
+{
+	return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+KUCERP33_TARGET("avx2")
+static inline void G8(__m256i v[16], int a, int b, int c, int d, __m256i x, __m256i y)
+{
+	v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), x); v[d] = Rotr16x8(_mm256_xor_si256(v[d], v[a]));
+	v[c] = _mm256_add_epi32(v[c], v[d]);                      v[b] = RotrShift(_mm256_xor_si256(v[b], v[c]), 12);
+	v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), y); v[d] = Rotr8x8(_mm256_xor_si256(v[d], v[a]));
+	v[c] = _mm256_add_epi32(v[c], v[d]);                      v[b] = RotrShift(_mm256_xor_si256(v[b], v[c]), 7);
+}
+
+/// <summary>
+/// 8x8 transpose of 32-bit words: row i word j -> row j word i
+/// </summary>
+KUCERP33_TARGET("avx2")
+static inline void Transpose8(__m256i r[8])
+{
+	__m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]), t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+	__m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]), t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+	__m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]), t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+	__m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]), t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+	__m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2);
+	__m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3);
+	__m256i u4 = _mm256_unpacklo_epi64(t4, t6), u5 = _mm256_unpackhi_epi64(t4, t6);
+	__m256i u6 = _mm256_unpacklo_epi64(t5, t7), u7 = _mm256_unpackhi_epi64(t5, t7);
+
+	r[0] = _mm256_permute2x128_si256(u0, u4, 0x20); r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+	r[1] = _mm256_permute2x128_si256(u1, u5, 0x20); r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+	r[2] = _mm256_permute2x128_si256(u2, u6, 0x20); r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+	r[3] = _mm256_permute2x128_si256(u3, u7, 0x20); r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+/// <summary>
+/// Hashes 8 consecutive whole chunks starting at counter, cvs[i] = chaining value of chunk i
+/// </summary>
+KUCERP33_TARGET("avx2")
+static void HashChunksAVX2(const uint8_t* data, uint64_t counter, uint32_t cvs[LANES][8])
+{
+	__m256i h[8];
+	for (int j = 0; j < 8; ++j) h[j] = _mm256_set1_epi32(static_cast<int>(IV[j]));
+
+	uint32_t counterLow[LANES], counterHigh[LANES];
+	for (size_t lane = 0; lane < LANES; ++lane)
+	{
+		counterLow[lane] = static_cast<uint32_t>(counter + lane);
+		counterHigh[lane] = static_cast<uint32_t>((counter + lane) >> 32);
+	}
+	const __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(counterLow));
+	const __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(counterHigh));
+
+	for (size_t block = 0; block < Blake3::CHUNK_SIZE / Blake3::BLOCK_SIZE; ++block)
+	{
+		__m256i m[16];
+		for (size_t lane = 0; lane < LANES; ++lane)
+		{
+			const uint8_t* p = data + lane * Blake3::CHUNK_SIZE + block * Blake3::BLOCK_SIZE;
+			m[lane] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+			m[lane + 8] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 32));
+		}
+		Transpose8(m);
+		Transpose8(m + 8);
+
+		uint32_t flags = 0;
+		if (block == 0) flags |= CHUNK_START;
+		if (block == Blake3::CHUNK_SIZE / Blake3::BLOCK_SIZE - 1) flags |= CHUNK_END;
+
+		__m256i v[16];
+		for (int i = 0; i < 8; ++i) v[i] = h[i];
+		for (int i = 0; i < 4; ++i) v[8 + i] = _mm256_set1_epi32(static_cast<int>(IV[i]));
+		v[12] = low;
+		v[13] = high;
+		v[14] = _mm256_set1_epi32(static_cast<int>(Blake3::BLOCK_SIZE));
+		v[15] = _mm256_set1_epi32(static_cast<int>(flags));
+
+		for (int round = 0; round < 7; ++round)
+		{
+			const uint8_t* s = SCHEDULE[round];
+			G8(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+			G8(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+			G8(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+			G8(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+			G8(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+			G8(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+			G8(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+			G8(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+		}
+
+		for (int i = 0; i < 8; ++i) h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+	}
+
+	Transpose8(h);
+	for (size_t lane = 0; lane < LANES; ++lane)
+	{
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(cvs[lane]), h[lane]);
+	}
+}
+
+#endif
+
+static Blake3Impl SelectImplementation()
+{
+#ifdef KUCERP33_X64
+	if (CpuFeatures::Get().avx2) return Blake3Impl::AVX2;
+#endif
+	return Blake3Impl::Portable;
+}
+
+static Blake3Impl ActiveImpl = SelectImplementation();
+
+
+/// ------------------------------------------------------------------------------------------------
+/// BLAKE3
+/// ------------------------------------------------------------------------------------------------
+
+void Blake3::Init()
+{
+	memcpy(mChunkCv, IV, sizeof(mChunkCv));
+	mBlockLength = 0;
+	mBlocksCompressed = 0;
+	mChunkCounter = 0;
+	mStackSize = 0;
+	mLanes = ActiveImpl == Blake3Impl::AVX2;
+	mPendingLength = 0;
+}
+
+void Blake3::CompressBlock(const uint8_t* block)
+{
+	uint32_t m[16];
+	LoadBlock(block, m);
+	CompressCv(mChunkCv, m, BLOCK_SIZE, mChunkCounter, mBlocksCompressed == 0 ? CHUNK_START : 0);
+	++mBlocksCompressed;
+}
+
+/// <summary>
+/// Adds chaining value of finished chunk. Every time the chunk count is even
+/// a subtree is complete and two top values merge into their parent.
+/// </summary>
+/// <param name="cv"></param>
+/// <param name="totalChunks">chunks finished so far, this one included</param>
+void Blake3::PushChunk(const uint32_t cv[8], uint64_t totalChunks)
+{
+	uint32_t merged[8];
+	memcpy(merged, cv, sizeof(merged));
+
+	while ((totalChunks & 1) == 0)
+	{
+		ParentCv(mStack[--mStackSize], merged, merged);
+		totalChunks >>= 1;
+	}
+
+	memcpy(mStack[mStackSize++], merged, sizeof(merged));
+}
+
+void Blake3::Update(const uint8_t* data, size_t length)
+{
+	if (mLanes)
+		UpdateLanes(data, length);
+	else
+		UpdateChunks(data, length);
+}
+
+/// <summary>
+/// Adds data chunk by chunk. Chunk or block is closed only when more input follows,
+/// the last one has to stay open because it is compressed with ROOT flag.
+/// </summary>
+/// <param name="data"></param>
+/// <param name="length"></param>
+void Blake3::UpdateChunks(const uint8_t* data, size_t length)
+{
+	while (length > 0)
+	{
+		if (ChunkLength() == CHUNK_SIZE)
+		{
+			uint32_t m[16];
+			LoadBlock(mBlock, m);
+			CompressCv(mChunkCv, m, static_cast<uint32_t>(mBlockLength), mChunkCounter, CHUNK_END);
+			PushChunk(mChunkCv, mChunkCounter + 1);
+
+			memcpy(mChunkCv, IV, sizeof(mChunkCv));
+			mBlockLength = 0;
+			mBlocksCompressed = 0;
+			++mChunkCounter;
+		}
+
+		if (mBlockLength == BLOCK_SIZE)
+		{
+			CompressBlock(mBlock);
+			mBlockLength = 0;
+		}
+
+		// Whole blocks straight from input, last block of chunk stays buffered
+		if (mBlockLength == 0)
+		{
+			while (length > BLOCK_SIZE && mBlocksCompressed + 1 < CHUNK_SIZE / BLOCK_SIZE)
+			{
+				CompressBlock(data);
+				data += BLOCK_SIZE;
+				length -= BLOCK_SIZE;
+			}
+		}
+
+		size_t take = (std::min)(BLOCK_SIZE - mBlockLength, length);
+		memcpy(mBlock + mBlockLength, data, take);
+		mBlockLength += take;
+		data += take;
+		length -= take;
+	}
+}
+
+/// <summary>
+/// Adds data 8 chunks at a time, chunk state stays empty. Input is gathered in pending buffer
+/// (straight from input when there is enough of it), full buffer is hashed only when more
+/// input follows, so Finish always has something for the root chunk.
+/// </summary>
+/// <param name="data"></param>
+/// <param name="length"></param>
+void Blake3::UpdateLanes(const uint8_t* data, size_t length)
+{
+#ifdef KUCERP33_X64
+	uint32_t cvs[LANES][8];
+
+	while (length > 0)
+	{
+		if (mPendingLength == sizeof(mPending))
+		{
+			HashChunksAVX2(mPending, mChunkCounter, cvs);
+			for (size_t lane = 0; lane < LANES; ++lane) PushChunk(cvs[lane], mChunkCounter + lane + 1);
+			mChunkCounter += LANES;
+			mPendingLength = 0;
+		}
+
+		if (mPendingLength == 0 && length > sizeof(mPending))
+		{
+			HashChunksAVX2(data, mChunkCounter, cvs);
+			for (size_t lane = 0; lane < LANES; ++lane) PushChunk(cvs[lane], mChunkCounter + lane + 1);
+			mChunkCounter += LANES;
+			data += sizeof(mPending);
+			length -= sizeof(mPending);
+			continue;
+		}
+
+		size_t take = (std::min)(sizeof(mPending) - mPendingLength, length);
+		memcpy(mPending + mPendingLength, data, take);
+		mPendingLength += take;
+		data += take;
+		length -= take;
+	}
+#else
+	UpdateChunks(data, length);
+#endif
+}
+
+/// <summary>
+/// Open chunk is merged with the stack from top to bottom, last compression gets ROOT flag.
+/// Object has to be Init()ed to be used again
+/// </summary>
+/// <returns></returns>
+Blake3::Digest Blake3::Finish()
+{
+	// Last (at most 8) chunks one by one, the final one is the open one
+	if (mPendingLength > 0)
+	{
+		UpdateChunks(mPending, mPendingLength);
+		mPendingLength = 0;
+	}
+
+	memset(mBlock + mBlockLength, 0, BLOCK_SIZE - mBlockLength);
+
+	uint32_t cv[8];
+	uint32_t m[16];
+	memcpy(cv, mChunkCv, sizeof(cv));
+	LoadBlock(mBlock, m);
+	uint32_t blockLength = static_cast<uint32_t>(mBlockLength);
+	uint64_t counter = mChunkCounter;
+	uint32_t flags = CHUNK_END | (mBlocksCompressed == 0 ? CHUNK_START : 0);
+
+	for (size_t i = mStackSize; i-- > 0;)
+	{
+		uint32_t child[8];
+		memcpy(child, cv, sizeof(child));
+		CompressCv(child, m, blockLength, counter, flags);
+
+		memcpy(m, mStack[i], 8 * sizeof(uint32_t));
+		memcpy(m + 8, child, 8 * sizeof(uint32_t));
+		memcpy(cv, IV, sizeof(cv));
+		blockLength = BLOCK_SIZE;
+		counter = 0;
+		flags = PARENT;
+	}
+
+	uint32_t v[16];
+	CompressState(cv, m, blockLength, counter, flags | ROOT, v);
+
+	Digest digest;
+	for (int i = 0; i < 8; ++i) StoreLE32(digest.data() + 4 * i, v[i] ^ v[i + 8]);
+	return digest;
+}
+
+Blake3::Digest Blake3::Hash(const uint8_t* data, size_t length)
+{
+	Blake3 hasher;
+	hasher.Update(data, length);
+	return hasher.Finish();
+}
+
+Blake3Impl Blake3::Implementation()
+{
+	return ActiveImpl;
+}
+
+bool Blake3::SetImplementation(Blake3Impl impl)
+{
+#ifdef KUCERP33_X64
+	if (impl == Blake3Impl::AVX2 && !CpuFeatures::Get().avx2) return false;
+#else
+	if (impl != Blake3Impl::Portable) return false;
+#endif
+
+	ActiveImpl = impl;
+	return true;
+}
+
+const char* Blake3::ImplementationName(Blake3Impl impl)
+{
+	switch (impl)
+	{
+	case Blake3Impl::AVX2: return "AVX2 x8";
+	default: return "portable";
+	}
+}
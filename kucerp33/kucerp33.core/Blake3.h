@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+
+namespace UDP
+{
+	enum class Blake3Impl
+	{
+		Portable,
+		AVX2  // 8 chunks at once
+	};
+
+	/// <summary>
+	/// Incremental BLAKE3 (unkeyed, 256-bit output).
+	/// Input is split into 1 KiB chunks which are independent leaves of a binary tree,
+	/// so with AVX2 8 whole chunks are compressed side by side. Small updates (DATA payloads)
+	/// are gathered until 8 chunks are there. Parents are merged on a stack as chunks complete.
+	/// Nothing is allocated.
+	/// </summary>
+	class Blake3
+	{
+	public:
+		static constexpr size_t DIGEST_SIZE = 32;
+		static constexpr size_t BLOCK_SIZE = 64;
+		static constexpr size_t CHUNK_SIZE = 1024;
+		static constexpr size_t LANES = 8;
+		using Digest = std::array<uint8_t, DIGEST_SIZE>;
+
+		Blake3() { Init(); }
+
+		void Init();
+		void Update(const uint8_t* data, size_t length);
+		Digest Finish();
+
+		// One shot
+		static Digest Hash(const uint8_t* data, size_t length);
+
+		// Active implementation, can be forced (benchmarks), false if CPU does not support it
+		static Blake3Impl Implementation();
+		static bool SetImplementation(Blake3Impl impl);
+		static const char* ImplementationName(Blake3Impl impl);
+
+	private:
+		size_t ChunkLength() const { return mBlocksCompressed * BLOCK_SIZE + mBlockLength; }
+		// One chunk at a time
+		void UpdateChunks(const uint8_t* data, size_t length);
+		// LANES chunks at a time, gathered in mPending
+		void UpdateLanes(const uint8_t* data, size_t length);
+		void CompressBlock(const uint8_t* block);
+		void PushChunk(const uint32_t cv[8], uint64_t totalChunks);
+
+		// Chunk being filled
+		uint32_t mChunkCv[8];
+		uint8_t mBlock[BLOCK_SIZE];
+		size_t mBlockLength = 0;
+		size_t mBlocksCompressed = 0;
+		uint64_t mChunkCounter = 0;
+
+		// Chaining values of complete subtrees, one per level (2^54 chunks is enough)
+		uint32_t mStack[54][8];
+		size_t mStackSize = 0;
+
+		// Multi-chunk path, picked at Init. Pending chunks are not in the state yet
+		bool mLanes = false;
+		uint8_t mPending[LANES * CHUNK_SIZE];
+		size_t mPendingLength = 0;
+	};
+}
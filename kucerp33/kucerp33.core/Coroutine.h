@@ -0,0 +1,132 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+namespace UDP
+{
+	template <typename T>
+	class Task;
+
+	namespace Detail
+	{
+		// Shared part of promises: who waits for the task (co_await), or who is told it finished (root)
+		struct TaskPromiseBase
+		{
+			std::coroutine_handle<> continuation;
+			void (*finished)(void* context) = nullptr;
+			void* finishedContext = nullptr;
+
+			// Whoever awaited us goes on right away (symmetric transfer, stack does not grow)
+			struct FinalAwaiter
+			{
+				bool await_ready() const noexcept { return false; }
+
+				template <typename Promise>
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+				{
+					TaskPromiseBase& promise = handle.promise();
+					if (promise.continuation) return promise.continuation;
+					if (promise.finished) promise.finished(promise.finishedContext);
+					return std::noop_coroutine();
+				}
+
+				void await_resume() const noexcept {}
+			};
+
+			// Lazy, task runs once it is awaited or spawned on EventLoop
+			std::suspend_always initial_suspend() const noexcept { return {}; }
+			FinalAwaiter final_suspend() const noexcept { return {}; }
+
+			// Project does not use exceptions, one escaping a transfer is a bug
+			void unhandled_exception() const noexcept { std::terminate(); }
+		};
+
+		template <typename T>
+		struct TaskPromise : TaskPromiseBase
+		{
+			T value{};
+
+			Task<T> get_return_object() noexcept;
+			void return_value(T result) noexcept { value = std::move(result); }
+			T Result() { return std::move(value); }
+		};
+
+		template <>
+		struct TaskPromise<void> : TaskPromiseBase
+		{
+			Task<void> get_return_object() noexcept;
+			void return_void() const noexcept {}
+			void Result() const noexcept {}
+		};
+	}
+
+	/// <summary>
+	/// Coroutine returning T. Starts only when awaited (or spawned on EventLoop), awaiting
+	/// coroutine is resumed with the result once it is done. Owns its frame.
+	/// </summary>
+	template <typename T = void>
+	class Task
+	{
+	public:
+		using promise_type = Detail::TaskPromise<T>;
+
+		Task() = default;
+		explicit Task(std::coroutine_handle<promise_type> handle) : mHandle(handle) {}
+		~Task() { if (mHandle) mHandle.destroy(); }
+
+		Task(Task&& other) noexcept : mHandle(std::exchange(other.mHandle, {})) {}
+		Task& operator=(Task&& other) noexcept
+		{
+			if (this != &other)
+			{
+				if (mHandle) mHandle.destroy();
+				mHandle = std::exchange(other.mHandle, {});
+			}
+			return *this;
+		}
+
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+
+		bool Done() const { return !mHandle || mHandle.done(); }
+		std::coroutine_handle<promise_type> Handle() const { return mHandle; }
+
+		auto operator co_await() const noexcept
+		{
+			struct Awaiter
+			{
+				std::coroutine_handle<promise_type> handle;
+
+				bool await_ready() const noexcept { return !handle || handle.done(); }
+
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+				{
+					handle.promise().continuation = awaiting;
+					return handle;
+				}
+
+				T await_resume() { return handle.promise().Result(); }
+			};
+			return Awaiter{ mHandle };
+		}
+
+	private:
+		std::coroutine_handle<promise_type> mHandle;
+	};
+
+	namespace Detail
+	{
+		template <typename T>
+		Task<T> TaskPromise<T>::get_return_object() noexcept
+		{
+			return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+		}
+
+		inline Task<void> TaskPromise<void>::get_return_object() noexcept
+		{
+			return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+		}
+	}
+}
@@ -0,0 +1,74 @@
+#include "CpuFeatures.h"
+
+#if !defined(_MSC_VER) && defined(KUCERP33_X64)
+#include <cpuid.h>
+#endif
+
+using namespace UDP;
+
+#ifdef KUCERP33_X64
+
+static void CpuId(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#if defined(_MSC_VER)
+	int out[4];
+	__cpuidex(out, static_cast<int>(leaf), static_cast<int>(subleaf));
+	for (int i = 0; i < 4; ++i) regs[i] = static_cast<uint32_t>(out[i]);
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// OS has to save YMM registers, otherwise AVX can't be used even if CPU has it
+static uint64_t ReadXCR0()
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t eax = 0, edx = 0;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+static CpuFeatures Detect()
+{
+	CpuFeatures features;
+
+	uint32_t regs[4] = {}; // eax, ebx, ecx, edx
+	CpuId(0, 0, regs);
+	uint32_t maxLeaf = regs[0];
+
+	CpuId(1, 0, regs);
+	features.sse41 = (regs[2] >> 19) & 1;
+	features.sse42 = (regs[2] >> 20) & 1;
+	features.pclmul = (regs[2] >> 1) & 1;
+
+	bool osxsave = (regs[2] >> 27) & 1;
+	bool avx = (regs[2] >> 28) & 1;
+	bool ymmSaved = osxsave && (ReadXCR0() & 0x6) == 0x6;
+
+	if (maxLeaf >= 7)
+	{
+		CpuId(7, 0, regs);
+		features.avx2 = avx && ymmSaved && ((regs[1] >> 5) & 1);
+		features.sha = (regs[1] >> 29) & 1;
+	}
+
+	return features;
+}
+
+#else
+
+static CpuFeatures Detect()
+{
+	return CpuFeatures{};
+}
+
+#endif
+
+const CpuFeatures& CpuFeatures::Get()
+{
+	static const CpuFeatures features = Detect();
+	return features;
+}
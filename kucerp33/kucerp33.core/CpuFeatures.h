@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+// MSVC emits any intrinsic without extra flags
+#define KUCERP33_TARGET(features)
+#else
+// GCC/Clang need the instruction set enabled per function
+#define KUCERP33_TARGET(features) __attribute__((target(features)))
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define KUCERP33_X64 1
+#include <immintrin.h>
+#endif
+
+namespace UDP
+{
+	/// <summary>
+	/// Instruction set extensions of the CPU we run on, detected once via cpuid.
+	/// Used for runtime dispatch of vectorized code paths.
+	/// </summary>
+	struct CpuFeatures
+	{
+		bool sse41 = false;
+		bool sse42 = false;
+		bool pclmul = false;
+		bool avx2 = false;
+		bool sha = false;
+
+		static const CpuFeatures& Get();
+	};
+}
@@ -0,0 +1,305 @@
+#include "Crc32.h"
+#include "CpuFeatures.h"
+#include "CrcMath.h"
+
+#include <cstring>
+#include <algorithm>
+
+using namespace UDP;
+
+static constexpr uint32_t POLYNOMIAL = 0xEDB88320; // reflected 0x04C11DB7
+
+static_assert(CrcMath::SLICES<POLYNOMIAL>[0][1] == 0x77073096, "CRC-32 table does not match IEEE polynomial");
+
+/// ------------------------------------------------------------------------------------------------
+/// PORTABLE
+/// ------------------------------------------------------------------------------------------------
+
+// With COPY every block is stored to dst right after it was loaded, so bytes are read once
+template <bool COPY>
+static uint32_t ProcessPortable(uint32_t crc, uint8_t* dst, const uint8_t* src, size_t length)
+{
+	for (; length >= 8; src += 8, length -= 8)
+	{
+		crc = CrcMath::UpdateSlice8<POLYNOMIAL>(crc, src);
+		if constexpr (COPY)
+		{
+			memcpy(dst, src, 8);
+			dst += 8;
+		}
+	}
+	for (; length; ++src, --length)
+	{
+		crc = CrcMath::UpdateByte<POLYNOMIAL>(crc, *src);
+		if constexpr (COPY) *dst++ = *src;
+	}
+	return crc;
+}
+
+static uint32_t UpdatePortable(uint32_t crc, const uint8_t* data, size_t length)
+{
+	return ProcessPortable<false>(crc, nullptr, data, length);
+}
+
+static uint32_t CopyPortable(uint32_t crc, uint8_t* dst, const uint8_t* src, size_t length)
+{
+	return ProcessPortable<true>(crc, dst, src, length);
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// PCLMUL
+/// ------------------------------------------------------------------------------------------------
+
+#ifdef KUCERP33_X64
+
+// Folding constants x^(n) mod P in bit reflected form, from Intel's
+// "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction"
+alignas(16) static const uint64_t K1K2[2] = { 0x0154442bd4, 0x01c6e41596 }; // fold 512 bits
+alignas(16) static const uint64_t K3K4[2] = { 0x01751997d0, 0x00ccaa009e }; // fold 128 bits
+alignas(16) static const uint64_t K5K0[2] = { 0x0163cd6124, 0x0000000000 }; // 64 -> 32 bits
+alignas(16) static const uint64_t POLY_MU[2] = { 0x01db710641, 0x01f7011641 }; // P(x) and Barrett mu
+
+KUCERP33_TARGET("pclmul,sse4.1")
+static inline __m128i Fold(__m128i acc, __m128i k, __m128i next)
+{
+	__m128i low = _mm_clmulepi64_si128(acc, k, 0x00);
+	__m128i high = _mm_clmulepi64_si128(acc, k, 0x11);
+	return _mm_xor_si128(_mm_xor_si128(high, low), next);
+}
+
+// Loads 16 bytes at src + at, with COPY they are stored to dst + at as well
+template <bool COPY>
+KUCERP33_TARGET("sse4.1")
+static inline __m128i Load(uint8_t* dst, const uint8_t* src, size_t at)
+{
+	__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + at));
+	if constexpr (COPY) _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + at), v);
+	return v;
+}
+
+// Four 128-bit accumulators folded 64 bytes ahead, then reduced to 32 bits. Needs length >= 64
+template <bool COPY>
+KUCERP33_TARGET("pclmul,sse4.1")
+static uint32_t FoldPCLMUL(uint32_t crc, uint8_t* dst, const uint8_t* data, size_t length)
+{
+	__m128i x1 = Load<COPY>(dst, data, 0x00);
+	__m128i x2 = Load<COPY>(dst, data, 0x10);
+	__m128i x3 = Load<COPY>(dst, data, 0x20);
+	__m128i x4 = Load<COPY>(dst, data, 0x30);
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+	size_t done = 64;
+
+	__m128i k = _mm_load_si128(reinterpret_cast<const __m128i*>(K1K2));
+	for (; length - done >= 64; done += 64)
+	{
+		x1 = Fold(x1, k, Load<COPY>(dst, data, done + 0x00));
+		x2 = Fold(x2, k, Load<COPY>(dst, data, done + 0x10));
+		x3 = Fold(x3, k, Load<COPY>(dst, data, done + 0x20));
+		x4 = Fold(x4, k, Load<COPY>(dst, data, done + 0x30));
+	}
+
+	// 4 accumulators into one
+	k = _mm_load_si128(reinterpret_cast<const __m128i*>(K3K4));
+	x1 = Fold(x1, k, x2);
+	x1 = Fold(x1, k, x3);
+	x1 = Fold(x1, k, x4);
+
+	for (; length - done >= 16; done += 16)
+		x1 = Fold(x1, k, Load<COPY>(dst, data, done));
+
+	// 128 -> 64 bits
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	__m128i x2r = _mm_clmulepi64_si128(x1, k, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2r);
+
+	// 64 -> 32 bits
+	k = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(K5K0));
+	x2r = _mm_srli_si128(x1, 4);
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x00);
+	x1 = _mm_xor_si128(x1, x2r);
+
+	// Barrett reduction
+	k = _mm_load_si128(reinterpret_cast<const __m128i*>(POLY_MU));
+	x2r = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x10);
+	x2r = _mm_clmulepi64_si128(_mm_and_si128(x2r, mask32), k, 0x00);
+	x1 = _mm_xor_si128(x1, x2r);
+
+	return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+}
+
+template <bool COPY>
+static uint32_t ProcessPCLMUL(uint32_t crc, uint8_t* dst, const uint8_t* src, size_t length)
+{
+	if (length >= 64)
+	{
+		size_t folded = length & ~static_cast<size_t>(15);
+		crc = FoldPCLMUL<COPY>(crc, dst, src, folded);
+		src += folded;
+		length -= folded;
+		if constexpr (COPY) dst += folded;
+	}
+	return ProcessPortable<COPY>(crc, dst, src, length);
+}
+
+static uint32_t UpdatePCLMUL(uint32_t crc, const uint8_t* data, size_t length)
+{
+	return ProcessPCLMUL<false>(crc, nullptr, data, length);
+}
+
+static uint32_t CopyPCLMUL(uint32_t crc, uint8_t* dst, const uint8_t* src, size_t length)
+{
+	return ProcessPCLMUL<true>(crc, dst, src, length);
+}
+
+#endif
+
+/// ------------------------------------------------------------------------------------------------
+/// DISPATCH
+/// ------------------------------------------------------------------------------------------------
+
+using UpdateFn = uint32_t(*)(uint32_t crc, const uint8_t* data, size_t length);
+using CopyFn = uint32_t(*)(uint32_t crc, uint8_t* dst, const uint8_t* src, size_t length);
+using MultiplyFn = uint32_t(*)(uint32_t a, uint32_t b);
+
+static Crc32Impl SelectImplementation()
+{
+#ifdef KUCERP33_X64
+	const CpuFeatures& cpu = CpuFeatures::Get();
+	if (cpu.pclmul && cpu.sse41) return Crc32Impl::PCLMUL;
+#endif
+	return Crc32Impl::Portable;
+}
+static Crc32Impl ActiveImpl = SelectImplementation();
+
+static UpdateFn UpdateKernel()
+{
+#ifdef KUCERP33_X64
+	if (ActiveImpl == Crc32Impl::PCLMUL) return UpdatePCLMUL;
+#endif
+	return UpdatePortable;
+}
+
+static UpdateFn ActiveUpdate = UpdateKernel();
+
+static CopyFn CopyKernel()
+{
+#ifdef KUCERP33_X64
+	if (ActiveImpl == Crc32Impl::PCLMUL) return CopyPCLMUL;
+#endif
+	return CopyPortable;
+}
+
+static CopyFn ActiveCopy = CopyKernel();
+
+static MultiplyFn MultiplyKernel()
+{
+#ifdef KUCERP33_X64
+	if (ActiveImpl == Crc32Impl::PCLMUL) return CrcMath::MultiplyPCLMUL<POLYNOMIAL>;
+#endif
+	return CrcMath::MultiplyPortable<POLYNOMIAL>;
+}
+
+static MultiplyFn ActiveMultiply = MultiplyKernel();
+
+void Crc32::Update(const void* data, size_t length)
+{
+	mState = ActiveUpdate(mState, static_cast<const uint8_t*>(data), length);
+}
+
+uint32_t Crc32::Compute(const void* data, size_t length)
+{
+	return ~ActiveUpdate(0xFFFFFFFF, static_cast<const uint8_t*>(data), length);
+}
+
+void Crc32::UpdateCopy(void* dst, const void* src, size_t length)
+{
+	mState = ActiveCopy(mState, static_cast<uint8_t*>(dst), static_cast<const uint8_t*>(src), length);
+}
+
+uint32_t Crc32::CopyAndCompute(void* dst, const void* src, size_t length)
+{
+	return ~ActiveCopy(0xFFFFFFFF, static_cast<uint8_t*>(dst), static_cast<const uint8_t*>(src), length);
+}
+
+/// <summary>
+/// CRC(A) is shifted over length of B (multiplied by x^(8 * lengthB) mod P), then CRC(B) is added.
+/// Init and final xor cancel out, so finished values are combined directly (same as zlib crc32_combine).
+/// Below 64 KiB shift is 2 table lookups and at most 2 multiplies, nothing of B is read.
+/// </summary>
+/// <param name="crcA"></param>
+/// <param name="crcB"></param>
+/// <param name="lengthB">in bytes</param>
+/// <returns>CRC of A followed by B</returns>
+uint32_t Crc32::Combine(uint32_t crcA, uint32_t crcB, size_t lengthB)
+{
+	return CrcMath::Shift<POLYNOMIAL>(crcA, lengthB, ActiveMultiply) ^ crcB;
+}
+
+/// <summary>
+/// CRC of every buffer in the batch. PCLMUL already keeps 4 folds in flight per buffer,
+/// so it goes buffer by buffer. Portable slicing-by-8 is latency bound on one buffer,
+/// so 2 buffers are stepped together over their common length and tails are finished one by one.
+/// </summary>
+/// <param name="data">buffers</param>
+/// <param name="lengths">length of every buffer</param>
+/// <param name="count">number of buffers</param>
+/// <param name="out">CRC of every buffer</param>
+void Crc32::ComputeMany(const uint8_t* const* data, const size_t* lengths, size_t count, uint32_t* out)
+{
+	size_t i = 0;
+
+	if (ActiveImpl == Crc32Impl::Portable)
+	{
+		constexpr size_t WAYS = 2;
+		for (; i + WAYS <= count; i += WAYS)
+		{
+			size_t common = *std::min_element(lengths + i, lengths + i + WAYS) & ~static_cast<size_t>(7);
+
+			uint32_t crc[WAYS];
+			for (size_t lane = 0; lane < WAYS; ++lane) crc[lane] = 0xFFFFFFFF;
+
+			for (size_t done = 0; done < common; done += 8)
+			{
+				for (size_t lane = 0; lane < WAYS; ++lane) crc[lane] = CrcMath::UpdateSlice8<POLYNOMIAL>(crc[lane], data[i + lane] + done);
+			}
+
+			for (size_t lane = 0; lane < WAYS; ++lane)
+				out[i + lane] = ~UpdatePortable(crc[lane], data[i + lane] + common, lengths[i + lane] - common);
+		}
+	}
+
+	for (; i < count; ++i)
+	{
+		out[i] = Compute(data[i], lengths[i]);
+	}
+}
+
+Crc32Impl Crc32::Implementation()
+{
+	return ActiveImpl;
+}
+
+bool Crc32::SetImplementation(Crc32Impl impl)
+{
+#ifdef KUCERP33_X64
+	const CpuFeatures& cpu = CpuFeatures::Get();
+	if (impl == Crc32Impl::PCLMUL && !(cpu.pclmul && cpu.sse41)) return false;
+#else
+	if (impl != Crc32Impl::Portable) return false;
+#endif
+
+	ActiveImpl = impl;
+	ActiveUpdate = UpdateKernel();
+	ActiveCopy = CopyKernel();
+	ActiveMultiply = MultiplyKernel();
+	return true;
+}
+
+const char* Crc32::ImplementationName(Crc32Impl impl)
+{
+	switch (impl)
+	{
+	case Crc32Impl::PCLMUL: return "PCLMUL";
+	default: return "slicing-by-8";
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace UDP
+{
+	enum class Crc32Impl
+	{
+		Portable, // slicing-by-8
+		PCLMUL    // carry-less multiply folding, 64 bytes per step
+	};
+
+	/// <summary>
+	/// CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320, init and final xor 0xFFFFFFFF).
+	/// Same value as boost::crc_32_type / zlib crc32, so packets stay wire compatible.
+	/// Nothing is allocated, tables are built at compile time.
+	/// </summary>
+	class Crc32
+	{
+	public:
+		Crc32() = default;
+
+		void Reset() { mState = 0xFFFFFFFF; }
+		void Update(const void* data, size_t length);
+		uint32_t Value() const { return ~mState; }
+
+		// Copies src to dst and checksums it in the same pass, bytes are read only once.
+		// Buffers must not overlap
+		void UpdateCopy(void* dst, const void* src, size_t length);
+
+		// One shot
+		static uint32_t Compute(const void* data, size_t length);
+		static uint32_t CopyAndCompute(void* dst, const void* src, size_t length);
+
+		// CRC of A followed by B from CRC(A), CRC(B) and length of B. Lets cached payload CRC
+		// be merged with CRC of a rewritten header without reading the payload again
+		static uint32_t Combine(uint32_t crcA, uint32_t crcB, size_t lengthB);
+
+		// Batch of independent buffers (e.g. received datagrams): out[i] = Compute(data[i], lengths[i]).
+		// Portable path walks several buffers side by side so their table lookups overlap
+		static void ComputeMany(const uint8_t* const* data, const size_t* lengths, size_t count, uint32_t* out);
+
+		// Active implementation, can be forced (benchmarks), false if CPU does not support it
+		static Crc32Impl Implementation();
+		static bool SetImplementation(Crc32Impl impl);
+		static const char* ImplementationName(Crc32Impl impl);
+
+	private:
+		// Register before final xor
+		uint32_t mState = 0xFFFFFFFF;
+	};
+}
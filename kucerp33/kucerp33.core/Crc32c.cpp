@@ -0,0 +1,135 @@
+#include "Crc32c.h"
+#include "CpuFeatures.h"
+#include "CrcMath.h"
+
+#include <cstring>
+
+using namespace UDP;
+
+static constexpr uint32_t POLYNOMIAL = 0x82F63B78; // reflected 0x1EDC6F41
+
+static_assert(CrcMath::SLICES<POLYNOMIAL>[0][1] == 0xF26B8303, "CRC-32C table does not match Castagnoli polynomial");
+
+/// ------------------------------------------------------------------------------------------------
+/// PORTABLE
+/// ------------------------------------------------------------------------------------------------
+
+static uint32_t UpdatePortable(uint32_t crc, const uint8_t* data, size_t length)
+{
+	for (; length >= 8; data += 8, length -= 8) crc = CrcMath::UpdateSlice8<POLYNOMIAL>(crc, data);
+	for (; length; ++data, --length) crc = CrcMath::UpdateByte<POLYNOMIAL>(crc, *data);
+	return crc;
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// SSE4.2
+/// ------------------------------------------------------------------------------------------------
+
+#ifdef KUCERP33_X64
+
+static inline uint64_t Load64(const uint8_t* p)
+{
+	uint64_t value;
+	memcpy(&value, p, 8);
+	return value;
+}
+
+// crc32 instruction has 3 cycles latency and 1 cycle throughput, so three independent
+// streams over thirds of the buffer run at full speed. The first two are then moved
+// over the rest with carry-less multiply (CRC combine) and merged
+KUCERP33_TARGET("sse4.2,pclmul")
+static uint32_t UpdateSSE42(uint32_t crc, const uint8_t* data, size_t length)
+{
+	constexpr size_t MIN_SPLIT = 3 * 64; // below this merge costs more than it saves
+
+	if (length >= MIN_SPLIT)
+	{
+		size_t third = (length / 3) & ~static_cast<size_t>(7);
+		const uint8_t* b = data + third;
+		const uint8_t* c = data + 2 * third;
+
+		uint64_t crcA = crc, crcB = 0, crcC = 0;
+		for (size_t done = 0; done < third; done += 8)
+		{
+			crcA = _mm_crc32_u64(crcA, Load64(data + done));
+			crcB = _mm_crc32_u64(crcB, Load64(b + done));
+			crcC = _mm_crc32_u64(crcC, Load64(c + done));
+		}
+
+		auto multiply = CrcMath::MultiplyPCLMUL<POLYNOMIAL>;
+		crc = CrcMath::Shift<POLYNOMIAL>(static_cast<uint32_t>(crcA), 2 * third, multiply)
+			^ CrcMath::Shift<POLYNOMIAL>(static_cast<uint32_t>(crcB), third, multiply)
+			^ static_cast<uint32_t>(crcC);
+
+		data += 3 * third;
+		length -= 3 * third;
+	}
+
+	uint64_t wide = crc;
+	for (; length >= 8; data += 8, length -= 8) wide = _mm_crc32_u64(wide, Load64(data));
+
+	crc = static_cast<uint32_t>(wide);
+	for (; length; ++data, --length) crc = _mm_crc32_u8(crc, *data);
+	return crc;
+}
+
+#endif
+
+/// ------------------------------------------------------------------------------------------------
+/// DISPATCH
+/// ------------------------------------------------------------------------------------------------
+
+using UpdateFn = uint32_t(*)(uint32_t crc, const uint8_t* data, size_t length);
+
+static Crc32cImpl SelectImplementation()
+{
+#ifdef KUCERP33_X64
+	const CpuFeatures& cpu = CpuFeatures::Get();
+	if (cpu.sse42 && cpu.pclmul) return Crc32cImpl::SSE42;
+#endif
+	return Crc32cImpl::Portable;
+}
+static Crc32cImpl ActiveImpl = SelectImplementation();
+
+static UpdateFn UpdateKernel()
+{
+#ifdef KUCERP33_X64
+	if (ActiveImpl == Crc32cImpl::SSE42) return UpdateSSE42;
+#endif
+	return UpdatePortable;
+}
+
+static UpdateFn ActiveUpdate = UpdateKernel();
+
+uint32_t Crc32c::Compute(const void* data, size_t length)
+{
+	return ~ActiveUpdate(0xFFFFFFFF, static_cast<const uint8_t*>(data), length);
+}
+
+Crc32cImpl Crc32c::Implementation()
+{
+	return ActiveImpl;
+}
+
+bool Crc32c::SetImplementation(Crc32cImpl impl)
+{
+#ifdef KUCERP33_X64
+	const CpuFeatures& cpu = CpuFeatures::Get();
+	if (impl == Crc32cImpl::SSE42 && !(cpu.sse42 && cpu.pclmul)) return false;
+#else
+	if (impl != Crc32cImpl::Portable) return false;
+#endif
+
+	ActiveImpl = impl;
+	ActiveUpdate = UpdateKernel();
+	return true;
+}
+
+const char* Crc32c::ImplementationName(Crc32cImpl impl)
+{
+	switch (impl)
+	{
+	case Crc32cImpl::SSE42: return "SSE4.2 x3";
+	default: return "slicing-by-8";
+	}
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace UDP
+{
+	enum class Crc32cImpl
+	{
+		Portable, // slicing-by-8
+		SSE42     // crc32 instruction, 3 streams merged by carry-less multiply
+	};
+
+	/// <summary>
+	/// CRC-32C (Castagnoli, reflected polynomial 0x82F63B78, init and final xor 0xFFFFFFFF),
+	/// same as iSCSI / ext4. SSE4.2 computes it in hardware, so it is the cheap full packet
+	/// checksum when both sides agree on it (see ChecksumPolicy).
+	/// </summary>
+	class Crc32c
+	{
+	public:
+		static uint32_t Compute(const void* data, size_t length);
+
+		// Active implementation, can be forced (benchmarks), false if CPU does not support it
+		static Crc32cImpl Implementation();
+		static bool SetImplementation(Crc32cImpl impl);
+		static const char* ImplementationName(Crc32cImpl impl);
+	};
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <array>
+
+#include "CpuFeatures.h"
+
+// Table driven math of reflected 32-bit CRCs, shared by Crc32 (IEEE) and Crc32c (Castagnoli).
+// Everything is built at compile time from the polynomial.
+namespace UDP::CrcMath
+{
+	using SliceTables = std::array<std::array<uint32_t, 256>, 8>;
+	using ShiftTable = std::array<uint32_t, 256>;
+	using PowerTable = std::array<uint32_t, 64>;
+
+	// Polynomials mod P in reflected form: bit 31 is x^0, bit 0 is x^31. CRC register is one of them
+	constexpr uint32_t X0 = uint32_t(1) << 31;
+
+	// SLICES[0] is the classic byte table, SLICES[k] advances a byte through k more zero bytes
+	template <uint32_t POLYNOMIAL>
+	constexpr SliceTables BuildSlices()
+	{
+		SliceTables tables{};
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			uint32_t crc = i;
+			for (int bit = 0; bit < 8; ++bit) crc = (crc >> 1) ^ (POLYNOMIAL & (0u - (crc & 1)));
+			tables[0][i] = crc;
+		}
+		for (size_t k = 1; k < 8; ++k)
+		{
+			for (uint32_t i = 0; i < 256; ++i)
+				tables[k][i] = (tables[k - 1][i] >> 8) ^ tables[0][tables[k - 1][i] & 0xFF];
+		}
+		return tables;
+	}
+
+	template <uint32_t POLYNOMIAL>
+	inline constexpr SliceTables SLICES = BuildSlices<POLYNOMIAL>();
+
+	template <uint32_t POLYNOMIAL>
+	inline uint32_t UpdateByte(uint32_t crc, uint8_t byte)
+	{
+		return (crc >> 8) ^ SLICES<POLYNOMIAL>[0][(crc ^ byte) & 0xFF];
+	}
+
+	// 8 bytes with 8 independent lookups instead of 8 dependent ones
+	template <uint32_t POLYNOMIAL>
+	inline uint32_t UpdateSlice8(uint32_t crc, const uint8_t* p)
+	{
+		const SliceTables& t = SLICES<POLYNOMIAL>;
+
+		uint32_t lo, hi;
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+
+		return t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+			^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+	}
+
+	// Reflected product of two polynomials is 63 bits, one shift aligns it so high half is
+	// already reduced and low half still has to be multiplied by x^32 (what 4 zero bytes do to CRC)
+	template <uint32_t POLYNOMIAL>
+	constexpr uint32_t Reduce(uint64_t product)
+	{
+		const SliceTables& t = SLICES<POLYNOMIAL>;
+
+		uint64_t wide = product << 1;
+		uint32_t low = static_cast<uint32_t>(wide);
+		return static_cast<uint32_t>(wide >> 32)
+			^ t[3][low & 0xFF] ^ t[2][(low >> 8) & 0xFF] ^ t[1][(low >> 16) & 0xFF] ^ t[0][low >> 24];
+	}
+
+	// a * b mod P, carry-less product 4 bits of a at a time
+	template <uint32_t POLYNOMIAL>
+	constexpr uint32_t MultiplyPortable(uint32_t a, uint32_t b)
+	{
+		uint64_t multiples[16] = {};
+		for (uint32_t i = 1; i < 16; ++i) multiples[i] = (multiples[i >> 1] << 1) ^ ((i & 1) ? b : 0);
+
+		uint64_t product = 0;
+		for (int shift = 28; shift >= 0; shift -= 4) product = (product << 4) ^ multiples[(a >> shift) & 0xF];
+		return Reduce<POLYNOMIAL>(product);
+	}
+
+#ifdef KUCERP33_X64
+	template <uint32_t POLYNOMIAL>
+	KUCERP33_TARGET("pclmul,sse4.1")
+	inline uint32_t MultiplyPCLMUL(uint32_t a, uint32_t b)
+	{
+		__m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(static_cast<int>(a)), _mm_cvtsi32_si128(static_cast<int>(b)), 0x00);
+		return Reduce<POLYNOMIAL>(static_cast<uint64_t>(_mm_cvtsi128_si64(product)));
+	}
+#endif
+
+	// Multiplying CRC by SHIFT_BYTES[n] * SHIFT_PAGES[m] moves it over n + 256 * m zero bytes
+	template <uint32_t POLYNOMIAL>
+	constexpr ShiftTable BuildShiftBytes()
+	{
+		const SliceTables& t = SLICES<POLYNOMIAL>;
+
+		ShiftTable table{};
+		table[0] = X0;
+		for (size_t i = 1; i < table.size(); ++i) table[i] = (table[i - 1] >> 8) ^ t[0][table[i - 1] & 0xFF]; // * x^8
+		return table;
+	}
+
+	template <uint32_t POLYNOMIAL>
+	inline constexpr ShiftTable SHIFT_BYTES = BuildShiftBytes<POLYNOMIAL>();
+
+	template <uint32_t POLYNOMIAL>
+	constexpr ShiftTable BuildShiftPages()
+	{
+		// x^2048 = one more zero byte after x^(8 * 255)
+		const uint32_t last = SHIFT_BYTES<POLYNOMIAL>[255];
+		const uint32_t page = (last >> 8) ^ SLICES<POLYNOMIAL>[0][last & 0xFF];
+
+		ShiftTable table{};
+		table[0] = X0;
+		for (size_t i = 1; i < table.size(); ++i) table[i] = MultiplyPortable<POLYNOMIAL>(table[i - 1], page);
+		return table;
+	}
+
+	template <uint32_t POLYNOMIAL>
+	inline constexpr ShiftTable SHIFT_PAGES = BuildShiftPages<POLYNOMIAL>();
+
+	// X2N[k] = x^(2^k) mod P, for shifts over 64 KiB
+	template <uint32_t POLYNOMIAL>
+	constexpr PowerTable BuildPowers()
+	{
+		PowerTable powers{};
+		powers[0] = X0 >> 1; // x^1
+		for (size_t k = 1; k < powers.size(); ++k) powers[k] = MultiplyPortable<POLYNOMIAL>(powers[k - 1], powers[k - 1]);
+		return powers;
+	}
+
+	template <uint32_t POLYNOMIAL>
+	inline constexpr PowerTable X2N = BuildPowers<POLYNOMIAL>();
+
+	// crc * x^(8 * length) mod P = CRC register moved over length zero bytes without reading them.
+	// Below 64 KiB it is 2 table lookups and at most 2 multiplies
+	template <uint32_t POLYNOMIAL, typename Multiply>
+	inline uint32_t Shift(uint32_t crc, size_t length, Multiply multiply)
+	{
+		if (length & 0xFF) crc = multiply(SHIFT_BYTES<POLYNOMIAL>[length & 0xFF], crc);
+		if ((length >> 8) & 0xFF) crc = multiply(SHIFT_PAGES<POLYNOMIAL>[(length >> 8) & 0xFF], crc);
+
+		// Rest by powers x^(2^k), 65536 bytes = x^(2^19)
+		uint64_t rest = static_cast<uint64_t>(length) >> 16;
+		for (size_t k = 19; rest; ++k, rest >>= 1)
+		{
+			if (rest & 1) crc = multiply(X2N<POLYNOMIAL>[k], crc);
+		}
+		return crc;
+	}
+}
@@ -0,0 +1,233 @@
+#include "EventLoop.h"
+#include "SendWindow.h"
+#include "SmartDebug.h"
+
+#include <algorithm>
+#include <thread>
+#include <chrono>
+
+using namespace UDP;
+
+/// ------------------------------------------------------------------------------------------------
+/// WAIT
+/// ------------------------------------------------------------------------------------------------
+
+void EventLoop::Wait::await_suspend(std::coroutine_handle<> handle)
+{
+	mWaiter.handle = handle;
+	mWaiter.due = mTimeout == NO_TIMEOUT ? NO_TIMEOUT : NowMicroseconds() + mTimeout;
+	if (mSlot) *mSlot = &mWaiter;
+
+	mLoop.Arm(mWaiter);
+}
+
+bool EventLoop::Wait::await_resume()
+{
+	// Timed out, whoever has the slot must not signal us anymore
+	if (mSlot && *mSlot == &mWaiter) *mSlot = nullptr;
+	return mWaiter.signaled;
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// LOOP
+/// ------------------------------------------------------------------------------------------------
+
+EventLoop::~EventLoop()
+{
+	// Frames are destroyed with their waiters, nothing may point to them anymore
+	mTimers.clear();
+	mSocketWaiters.clear();
+	mRoots.clear();
+}
+
+void EventLoop::Spawn(Task<void> task)
+{
+	auto handle = task.Handle();
+	if (!handle) return;
+
+	handle.promise().finished = &EventLoop::RootFinished;
+	handle.promise().finishedContext = this;
+
+	mReady.push_back(handle);
+	mRoots.push_back(std::move(task));
+}
+
+void EventLoop::RootFinished(void* loop)
+{
+	++static_cast<EventLoop*>(loop)->mFinishedRoots;
+}
+
+/// <summary>
+/// Waiter goes to timer heap (unless it has no timeout) and to sockets watched by select()
+/// </summary>
+/// <param name="waiter"></param>
+void EventLoop::Arm(Waiter& waiter)
+{
+	waiter.signaled = false;
+	waiter.queued = false;
+
+	if (waiter.due != NO_TIMEOUT)
+	{
+		waiter.heapIndex = mTimers.size();
+		mTimers.push_back(&waiter);
+		HeapUp(waiter.heapIndex);
+	}
+
+	if (waiter.socket != INVALID_SOCKET)
+	{
+		waiter.socketIndex = mSocketWaiters.size();
+		mSocketWaiters.push_back(&waiter);
+	}
+}
+
+/// <summary>
+/// Waiter leaves heap and socket list and its coroutine is resumed in next round.
+/// Second call (e.g. signal after timeout) does nothing
+/// </summary>
+/// <param name="waiter"></param>
+/// <param name="signaled"></param>
+void EventLoop::Ready(Waiter& waiter, bool signaled)
+{
+	if (waiter.queued) return;
+	waiter.queued = true;
+	waiter.signaled = signaled;
+
+	if (waiter.heapIndex != NOT_LISTED) HeapRemove(waiter);
+
+	if (waiter.socketIndex != NOT_LISTED)
+	{
+		Waiter* last = mSocketWaiters.back();
+		mSocketWaiters[waiter.socketIndex] = last;
+		last->socketIndex = waiter.socketIndex;
+		mSocketWaiters.pop_back();
+		waiter.socketIndex = NOT_LISTED;
+	}
+
+	mReady.push_back(waiter.handle);
+}
+
+/// <summary>
+/// Ready coroutines run, then expired timeouts and readable sockets make others ready.
+/// We block in select() (or sleep) only when nothing is ready
+/// </summary>
+void EventLoop::Run()
+{
+	while (!mRoots.empty())
+	{
+		// What they make ready runs in next round, so one coroutine can't starve the rest
+		mResuming.swap(mReady);
+		for (std::coroutine_handle<> handle : mResuming) handle.resume();
+		mResuming.clear();
+
+		if (mFinishedRoots)
+		{
+			std::erase_if(mRoots, [](const Task<void>& task) { return task.Done(); });
+			mFinishedRoots = 0;
+			if (mRoots.empty()) break;
+		}
+
+		uint64_t now = NowMicroseconds();
+		while (!mTimers.empty() && mTimers.front()->due <= now) Ready(*mTimers.front(), false);
+
+		uint64_t timeout = NO_TIMEOUT;
+		if (!mReady.empty()) timeout = 0;
+		else if (!mTimers.empty()) timeout = mTimers.front()->due - now;
+
+		if (!mSocketWaiters.empty())
+		{
+			PollSockets(timeout);
+		}
+		else if (timeout == NO_TIMEOUT)
+		{
+			// Nobody can wake them up, signals come only from coroutines of this loop
+			ERR("EventLoop: " << mRoots.size() << " tasks wait for a signal that can't come");
+			break;
+		}
+		else if (timeout > 0)
+		{
+			std::this_thread::sleep_for(std::chrono::microseconds(timeout));
+		}
+	}
+}
+
+/// <summary>
+/// One select() over all sockets somebody waits for, every waiter of readable socket is resumed
+/// </summary>
+/// <param name="timeoutUs"></param>
+void EventLoop::PollSockets(uint64_t timeoutUs)
+{
+	fd_set readfds;
+	FD_ZERO(&readfds);
+	for (Waiter* waiter : mSocketWaiters) FD_SET(waiter->socket, &readfds);
+
+	timeval tv{};
+	tv.tv_sec = static_cast<long>(timeoutUs / 1000000);
+	tv.tv_usec = static_cast<long>(timeoutUs % 1000000);
+
+	int sel = select(0, &readfds, nullptr, nullptr, timeoutUs == NO_TIMEOUT ? nullptr : &tv);
+	if (sel == SOCKET_ERROR)
+	{
+		ERR("EventLoop: select() failed, error: " << WSAGetLastError());
+		return;
+	}
+
+	// From the back, ready waiter is replaced by the last one
+	for (size_t i = mSocketWaiters.size(); sel > 0 && i-- > 0;)
+	{
+		if (i < mSocketWaiters.size() && FD_ISSET(mSocketWaiters[i]->socket, &readfds)) Ready(*mSocketWaiters[i], true);
+	}
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// TIMER HEAP
+/// ------------------------------------------------------------------------------------------------
+
+void EventLoop::HeapUp(size_t index)
+{
+	Waiter* waiter = mTimers[index];
+	while (index > 0)
+	{
+		size_t parent = (index - 1) / 2;
+		if (mTimers[parent]->due <= waiter->due) break;
+
+		mTimers[index] = mTimers[parent];
+		mTimers[index]->heapIndex = index;
+		index = parent;
+	}
+	mTimers[index] = waiter;
+	waiter->heapIndex = index;
+}
+
+void EventLoop::HeapDown(size_t index)
+{
+	Waiter* waiter = mTimers[index];
+	const size_t count = mTimers.size();
+	while (true)
+	{
+		size_t child = 2 * index + 1;
+		if (child >= count) break;
+		if (child + 1 < count && mTimers[child + 1]->due < mTimers[child]->due) ++child;
+		if (waiter->due <= mTimers[child]->due) break;
+
+		mTimers[index] = mTimers[child];
+		mTimers[index]->heapIndex = index;
+		index = child;
+	}
+	mTimers[index] = waiter;
+	waiter->heapIndex = index;
+}
+
+void EventLoop::HeapRemove(Waiter& waiter)
+{
+	size_t index = waiter.heapIndex;
+	Waiter* last = mTimers.back();
+	mTimers.pop_back();
+	waiter.heapIndex = NOT_LISTED;
+
+	if (last == &waiter) return;
+
+	mTimers[index] = last;
+	last->heapIndex = index;
+	HeapUp(index);
+	HeapDown(last->heapIndex);
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <coroutine>
+#include <winsock2.h>
+
+#include "Coroutine.h"
+
+namespace UDP
+{
+	/// <summary>
+	/// Single-threaded event loop for coroutine transfers. Coroutines wait for a socket to become
+	/// readable, for a timeout or for a signal from another coroutine (e.g. ACK dispatcher),
+	/// all sockets are watched by one select(). Thousands of transfers run on one thread,
+	/// one waiting costs only its coroutine frame. Everything but Spawn before Run is for
+	/// coroutines running on the loop.
+	/// </summary>
+	class EventLoop
+	{
+	public:
+		static constexpr uint64_t NO_TIMEOUT = UINT64_MAX;
+		static constexpr size_t NOT_LISTED = SIZE_MAX;
+
+		// Suspended coroutine, lives in its frame (inside Wait)
+		struct Waiter
+		{
+			std::coroutine_handle<> handle;
+			uint64_t due = NO_TIMEOUT; // microseconds
+			SOCKET socket = INVALID_SOCKET;
+			bool signaled = false;     // resumed by socket or Signal, not by timeout
+			bool queued = false;       // already on its way to be resumed
+
+			size_t heapIndex = NOT_LISTED;
+			size_t socketIndex = NOT_LISTED;
+		};
+
+		// Awaitable of all waits, true if resumed by socket or Signal, false on timeout
+		class Wait
+		{
+		public:
+			Wait(EventLoop& loop, uint64_t timeoutUs, SOCKET socket, Waiter** slot)
+				: mLoop(loop), mTimeout(timeoutUs), mSlot(slot)
+			{
+				mWaiter.socket = socket;
+			}
+
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> handle);
+			bool await_resume();
+
+		private:
+			EventLoop& mLoop;
+			uint64_t mTimeout;
+			Waiter** mSlot;
+			Waiter mWaiter;
+		};
+
+		EventLoop() = default;
+		// Tasks which did not finish are destroyed, whatever they use must outlive the loop
+		~EventLoop();
+
+		EventLoop(const EventLoop&) = delete;
+		EventLoop& operator=(const EventLoop&) = delete;
+
+		// Task runs on the loop, it is owned by the loop until it finishes
+		void Spawn(Task<void> task);
+		// Until every spawned task finished
+		void Run();
+		size_t Running() const { return mRoots.size(); }
+
+		Wait Sleep(uint64_t delayUs) { return Wait(*this, delayUs, INVALID_SOCKET, nullptr); }
+		// Other ready coroutines run first
+		Wait Yield() { return Sleep(0); }
+		Wait Readable(SOCKET socket, uint64_t timeoutUs) { return Wait(*this, timeoutUs, socket, nullptr); }
+		// Waiter is put into slot while suspended, whoever has the slot resumes it by Signal
+		Wait Event(Waiter*& slot, uint64_t timeoutUs) { return Wait(*this, timeoutUs, INVALID_SOCKET, &slot); }
+		void Signal(Waiter& waiter) { Ready(waiter, true); }
+
+	private:
+		void Arm(Waiter& waiter);
+		void Ready(Waiter& waiter, bool signaled);
+		void PollSockets(uint64_t timeoutUs);
+		static void RootFinished(void* loop);
+
+		// Min-heap of timeouts, waiter knows its index so it can leave early
+		void HeapUp(size_t index);
+		void HeapDown(size_t index);
+		void HeapRemove(Waiter& waiter);
+
+		std::vector<std::coroutine_handle<>> mReady;
+		std::vector<std::coroutine_handle<>> mResuming; // swapped with mReady every round
+		std::vector<Waiter*> mTimers;
+		std::vector<Waiter*> mSocketWaiters;
+
+		std::vector<Task<void>> mRoots;
+		size_t mFinishedRoots = 0;
+	};
+}
@@ -0,0 +1,88 @@
+#include "FileHash.h"
+
+#include <cstring>
+
+using namespace UDP;
+
+bool FileHasher::IsSupported(uint32_t algorithm)
+{
+	return DigestSize(algorithm) != 0;
+}
+
+size_t FileHasher::DigestSize(uint32_t algorithm)
+{
+	switch (algorithm)
+	{
+	case HASH_SHA256:
+	case HASH_MERKLE_SHA256: return Sha256::DIGEST_SIZE;
+	case HASH_BLAKE3: return Blake3::DIGEST_SIZE;
+	case HASH_XXH3_128: return Xxh3::DIGEST_SIZE;
+	default: return 0;
+	}
+}
+
+const char* FileHasher::AlgorithmName(uint32_t algorithm)
+{
+	switch (algorithm)
+	{
+	case HASH_SHA256: return "SHA-256";
+	case HASH_MERKLE_SHA256: return "SHA-256 Merkle";
+	case HASH_BLAKE3: return "BLAKE3";
+	case HASH_XXH3_128: return "XXH3-128";
+	default: return "unknown";
+	}
+}
+
+bool FileHasher::Reset(uint32_t algorithm, uint64_t merkleBlockSize, uint64_t totalSize)
+{
+	if (!IsSupported(algorithm)) return false;
+
+	mAlgorithm = algorithm;
+	switch (algorithm)
+	{
+	case HASH_MERKLE_SHA256: mMerkle.Reset(merkleBlockSize, totalSize); break;
+	case HASH_BLAKE3: mBlake3.Init(); break;
+	case HASH_XXH3_128: mXxh3.Init(); break;
+	default: mSha256.Init(); break;
+	}
+
+	return true;
+}
+
+void FileHasher::Update(const uint8_t* data, size_t length)
+{
+	switch (mAlgorithm)
+	{
+	case HASH_MERKLE_SHA256: mMerkle.Update(data, length); break;
+	case HASH_BLAKE3: mBlake3.Update(data, length); break;
+	case HASH_XXH3_128: mXxh3.Update(data, length); break;
+	default: mSha256.Update(data, length); break;
+	}
+}
+
+FileDigest FileHasher::Finish()
+{
+	FileDigest digest{};
+
+	switch (mAlgorithm)
+	{
+	case HASH_MERKLE_SHA256:
+		mMerkle.Finish();
+		digest = mMerkle.Root();
+		break;
+	case HASH_BLAKE3:
+		digest = mBlake3.Finish();
+		break;
+	case HASH_XXH3_128:
+	{
+		Xxh3::Digest short128 = mXxh3.Finish();
+		memcpy(digest.data(), short128.data(), short128.size());
+		break;
+	}
+	default:
+		digest = mSha256.Finish();
+		break;
+	}
+
+	return digest;
+}
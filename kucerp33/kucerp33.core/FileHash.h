@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+
+#include "PacketHeader.h"
+#include "Sha256.h"
+#include "MerkleTree.h"
+#include "Blake3.h"
+#include "Xxh3.h"
+
+namespace UDP
+{
+	// Big enough for every algorithm, shorter digest is zero padded
+	static constexpr size_t MAX_DIGEST_SIZE = 32;
+	using FileDigest = std::array<uint8_t, MAX_DIGEST_SIZE>;
+
+	/// <summary>
+	/// Whole file hash, algorithm is picked by tag from NAME/HASH chunk:
+	/// HASH_SHA256, HASH_MERKLE_SHA256, HASH_BLAKE3, HASH_XXH3_128.
+	/// Sender and receiver feed the same bytes in file order.
+	/// </summary>
+	class FileHasher
+	{
+	public:
+		static bool IsSupported(uint32_t algorithm);
+		static size_t DigestSize(uint32_t algorithm);
+		static const char* AlgorithmName(uint32_t algorithm);
+
+		// false if algorithm is not known, hasher then stays on previous one.
+		// Merkle block size is used only by HASH_MERKLE_SHA256
+		bool Reset(uint32_t algorithm, uint64_t merkleBlockSize, uint64_t totalSize);
+
+		void Update(const uint8_t* data, size_t length);
+		FileDigest Finish();
+
+		uint32_t Algorithm() const { return mAlgorithm; }
+		size_t DigestSize() const { return DigestSize(mAlgorithm); }
+
+		// Leaves of Merkle tree, for repairs
+		MerkleTree& Merkle() { return mMerkle; }
+		const MerkleTree& Merkle() const { return mMerkle; }
+
+	private:
+		uint32_t mAlgorithm = HASH_SHA256;
+		Sha256 mSha256;
+		MerkleTree mMerkle;
+		Blake3 mBlake3;
+		Xxh3 mXxh3;
+	};
+}
@@ -0,0 +1,126 @@
+#include "FileSink.h"
+#include "SmartDebug.h"
+
+#include <windows.h>
+
+using namespace UDP;
+
+FileSink::~FileSink()
+{
+	Close();
+}
+
+/// <summary>
+/// Creates file and reserves its final size, same as fallocate on Linux
+/// </summary>
+/// <param name="path"></param>
+/// <param name="size"></param>
+/// <returns></returns>
+bool FileSink::Open(const std::string& path, uint64_t size)
+{
+	Close();
+
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		ERR("Could not create file: \"" << path << "\", error: " << GetLastError());
+		return false;
+	}
+
+	// Preallocation -> move end of file to final size
+	LARGE_INTEGER end{};
+	end.QuadPart = static_cast<LONGLONG>(size);
+	if (!SetFilePointerEx(file, end, nullptr, FILE_BEGIN) || !SetEndOfFile(file))
+	{
+		ERR("Could not preallocate " << size << " bytes for \"" << path << "\", error: " << GetLastError());
+		CloseHandle(file);
+		return false;
+	}
+
+	mFile = file;
+	mPath = path;
+	return true;
+}
+
+void FileSink::Close()
+{
+	if (mFile) CloseHandle(mFile);
+	mFile = nullptr;
+}
+
+/// <summary>
+/// Positional write (pwrite), file pointer is not used
+/// </summary>
+/// <param name="offset"></param>
+/// <param name="data"></param>
+/// <param name="length"></param>
+/// <returns></returns>
+bool FileSink::WriteAt(uint64_t offset, const uint8_t* data, size_t length)
+{
+	if (!mFile) return false;
+
+	OVERLAPPED position{};
+	position.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+	position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+	DWORD written = 0;
+	if (!WriteFile(mFile, data, static_cast<DWORD>(length), &written, &position) || written != length)
+	{
+		ERR("Write of " << length << " bytes at offset " << offset << " failed, error: " << GetLastError());
+		return false;
+	}
+
+	return true;
+}
+
+/// <summary>
+/// Positional read (pread)
+/// </summary>
+/// <param name="offset"></param>
+/// <param name="data"></param>
+/// <param name="length"></param>
+/// <returns></returns>
+bool FileSink::ReadAt(uint64_t offset, uint8_t* data, size_t length)
+{
+	if (!mFile) return false;
+
+	OVERLAPPED position{};
+	position.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+	position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+	DWORD read = 0;
+	if (!ReadFile(mFile, data, static_cast<DWORD>(length), &read, &position) || read != length)
+	{
+		ERR("Read of " << length << " bytes at offset " << offset << " failed, error: " << GetLastError());
+		return false;
+	}
+
+	return true;
+}
+
+/// <summary>
+/// Closes file and moves it to final path, existing file is replaced
+/// </summary>
+/// <param name="finalPath"></param>
+/// <returns></returns>
+bool FileSink::Commit(const std::string& finalPath)
+{
+	Close();
+
+	if (!MoveFileExA(mPath.c_str(), finalPath.c_str(), MOVEFILE_REPLACE_EXISTING))
+	{
+		ERR("Could not create file in specified path: \"" << finalPath << "\", error: " << GetLastError());
+		return false;
+	}
+
+	mPath = finalPath;
+	return true;
+}
+
+void FileSink::Discard()
+{
+	Close();
+	if (!mPath.empty()) DeleteFileA(mPath.c_str());
+	mPath.clear();
+}
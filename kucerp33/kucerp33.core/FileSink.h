@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+namespace UDP
+{
+	/// <summary>
+	/// Output file of the receiver. Space for whole file is reserved when it is created,
+	/// payloads are then written straight to their offset (positional write),
+	/// so nothing has to be buffered in memory.
+	/// </summary>
+	class FileSink
+	{
+	public:
+		FileSink() = default;
+		~FileSink();
+
+		FileSink(const FileSink&) = delete;
+		FileSink& operator=(const FileSink&) = delete;
+
+		// Creates (truncates) file and preallocates size bytes
+		bool Open(const std::string& path, uint64_t size);
+		void Close();
+
+		bool IsOpen() const { return mFile != nullptr; }
+		const std::string& Path() const { return mPath; }
+
+		bool WriteAt(uint64_t offset, const uint8_t* data, size_t length);
+		// Reads back what was written (block rehash after repair)
+		bool ReadAt(uint64_t offset, uint8_t* data, size_t length);
+
+		// Closed file is renamed to its final path (replaces existing) / deleted
+		bool Commit(const std::string& finalPath);
+		void Discard();
+
+	private:
+		void* mFile = nullptr; // HANDLE
+		std::string mPath;
+	};
+}
@@ -0,0 +1,124 @@
+#include "FileSource.h"
+#include "SmartDebug.h"
+
+#include <windows.h>
+
+using namespace UDP;
+
+FileSource::~FileSource()
+{
+	Close();
+}
+
+/// <summary>
+/// Opens file for reading and creates its mapping. Nothing is read yet.
+/// </summary>
+/// <param name="path"></param>
+/// <returns></returns>
+bool FileSource::Open(const std::string& path)
+{
+	Close();
+
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		ERR("File could not be opened: " << path << ", error: " << GetLastError());
+		return false;
+	}
+
+	LARGE_INTEGER size{};
+	if (!GetFileSizeEx(file, &size))
+	{
+		ERR("Size of file could not be received: " << path);
+		CloseHandle(file);
+		return false;
+	}
+
+	mFile = file;
+	mSize = static_cast<uint64_t>(size.QuadPart);
+
+	// Empty file can't be mapped, but there is nothing to read anyway
+	if (mSize == 0) return true;
+
+	mMapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mMapping)
+	{
+		ERR("File could not be mapped: " << path << ", error: " << GetLastError());
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void FileSource::Close()
+{
+	mView.Release();
+	if (mMapping) CloseHandle(mMapping);
+	if (mFile) CloseHandle(mFile);
+
+	mMapping = nullptr;
+	mFile = nullptr;
+	mSize = 0;
+}
+
+
+FileView::~FileView()
+{
+	Release();
+}
+
+void FileView::Release()
+{
+	if (mView) UnmapViewOfFile(mView);
+
+	mView = nullptr;
+	mMapping = nullptr;
+	mViewOffset = 0;
+	mViewSize = 0;
+}
+
+/// <summary>
+/// Returns pointer to requested bytes, moves the mapped view if they are not in it
+/// </summary>
+/// <param name="source"></param>
+/// <param name="offset"></param>
+/// <param name="length"></param>
+/// <returns></returns>
+const uint8_t* FileView::Map(const FileSource& source, uint64_t offset, size_t length)
+{
+	if (!source.mMapping || offset + length > source.mSize) return nullptr;
+
+	// View of file which was closed since
+	if (mMapping != source.mMapping) Release();
+
+	// Already in current view
+	if (mView && offset >= mViewOffset && offset + length <= mViewOffset + mViewSize)
+		return mView + (offset - mViewOffset);
+
+	if (mView) UnmapViewOfFile(mView);
+	mView = nullptr;
+
+	// View has to start on allocation granularity (64 KiB on Windows)
+	SYSTEM_INFO info{};
+	GetSystemInfo(&info);
+	uint64_t granularity = info.dwAllocationGranularity ? info.dwAllocationGranularity : 65536;
+
+	mMapping = source.mMapping;
+	mViewOffset = offset - (offset % granularity);
+	mViewSize = (std::min)(FileSource::VIEW_SIZE, source.mSize - mViewOffset);
+
+	void* view = MapViewOfFile(source.mMapping, FILE_MAP_READ,
+		static_cast<DWORD>(mViewOffset >> 32), static_cast<DWORD>(mViewOffset & 0xFFFFFFFF),
+		static_cast<size_t>(mViewSize));
+	if (!view)
+	{
+		ERR("MapViewOfFile failed at offset " << mViewOffset << ", error: " << GetLastError());
+		mViewSize = 0;
+		return nullptr;
+	}
+
+	mView = static_cast<const uint8_t*>(view);
+	return mView + (offset - mViewOffset);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+namespace UDP
+{
+	class FileSource;
+
+	/// <summary>
+	/// Sliding view over mapping of a FileSource. Each thread reading the file in parallel
+	/// has its own, so views of threads don't move under each other.
+	/// </summary>
+	class FileView
+	{
+	public:
+		FileView() = default;
+		~FileView();
+
+		FileView(const FileView&) = delete;
+		FileView& operator=(const FileView&) = delete;
+
+		// Same as FileSource::Map. Source has to stay open while pointer is used
+		const uint8_t* Map(const FileSource& source, uint64_t offset, size_t length);
+		void Release();
+
+	private:
+		const void* mMapping = nullptr; // of source the view belongs to
+
+		const uint8_t* mView = nullptr;
+		uint64_t mViewOffset = 0;
+		uint64_t mViewSize = 0;
+	};
+
+	/// <summary>
+	/// Read-only memory mapped file. Only a view of VIEW_SIZE bytes is mapped at once
+	/// and it slides with requested offsets, so even huge files use constant memory
+	/// and address space. Pages are loaded by OS when touched.
+	/// </summary>
+	class FileSource
+	{
+	public:
+		static constexpr uint64_t VIEW_SIZE = 64ull << 20; // 64 MiB
+
+		FileSource() = default;
+		~FileSource();
+
+		FileSource(const FileSource&) = delete;
+		FileSource& operator=(const FileSource&) = delete;
+
+		bool Open(const std::string& path);
+		void Close();
+
+		bool IsOpen() const { return mFile != nullptr; }
+		uint64_t Size() const { return mSize; }
+
+		// Pointer to bytes [offset, offset + length), nullptr if outside of file.
+		// Valid until next Map() call. length must be small compared to VIEW_SIZE.
+		const uint8_t* Map(uint64_t offset, size_t length) { return mView.Map(*this, offset, length); }
+
+	private:
+		friend class FileView;
+
+		void* mFile = nullptr;    // HANDLE
+		void* mMapping = nullptr; // HANDLE, null for empty file
+
+		FileView mView;
+
+		uint64_t mSize = 0;
+	};
+}
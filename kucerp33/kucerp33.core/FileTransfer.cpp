@@ -1,153 +1,767 @@
 #include "FileTransfer.h"
 #include "SmartDebug.h"
+#include "SendWindow.h"
+#include "Trace.h"
 
-#include "crc.hpp"
-#include "picosha2.h"
 #include <filesystem>
+#include <bit>
+#include <algorithm>
+#include <random>
 
 using namespace UDP;
 namespace fs = std::filesystem;
 
-uint32_t Chunk::ComputeCRC() {
-	boost::crc_32_type result;
+/// <summary>
+/// Random id of a new transfer. Never 0, that is packet of sender which does not set any
+/// </summary>
+/// <returns></returns>
+static uint32_t NewSessionId()
+{
+	static std::mt19937 generator{ std::random_device{}() };
 
-	result.process_bytes(data.data() + Chunk::seq_padding, packetSize - Chunk::seq_padding);
-	crc = result.checksum();
+	uint32_t id = 0;
+	while (id == 0) id = generator();
+	return id;
+}
+
+uint32_t Chunk::ComputeCRC(ChecksumPolicy policy) {
+	crc = ComputePacketCRC(data.data(), packetSize, policy);
 
-	return result.checksum();
+	return crc;
 }
 
 /// <summary>
-/// Opens file and fills its self with data
+/// Opens file and prepares chunks. Control chunks (NAME, SIZE, HASH, STOP) are built here,
+/// DATA chunks either now (preload) or later in GetChunk (streaming).
+/// With hash trailer the layout is NAME SIZE DATA... HASH STOP and file is hashed
+/// as DATA chunks are built, so it is read only once. HASH is built when it is requested.
+/// Large files get DATA chunks built on worker threads, each worker owns a range of them.
 /// </summary>
 /// <param name="path"></param>
+/// <param name="streaming">map the file and build DATA chunks on demand</param>
+/// <param name="hashTrailer">send HASH after last DATA</param>
+/// <param name="hashAlgorithm">HASH_SHA256, HASH_MERKLE_SHA256, HASH_BLAKE3 or HASH_XXH3_128</param>
 /// <returns></returns>
-bool FileSession::SetFromFile(const std::string& path)
+bool FileSession::SetFromFile(const std::string& path, bool streaming, bool hashTrailer, uint32_t hashAlgorithm,
+	ChecksumPolicy checksumPolicy)
 {
-	this->chunks.clear();
+	TRACE_SCOPE("SetFromFile");
 
-	// Try to open the file
-	std::ifstream file(path, std::ios::binary | std::ios::ate);
-	if (!file)
-	{
-		ERR("File could not be opened: " << path);
-		return false;
-	}
+	// Workers may still build ahead for previous file
+	if (prepareScheduler) prepareScheduler->Wait(prepareGroup);
+	for (FileView& view : prepareViews) view.Release();
+	prepareCount = 0;
 
-	std::streamsize size = file.tellg();
-	if (size < 0)
-	{
-		ERR("Size of file could not be received: " << path);
-		return false;
-	}
-	file.seekg(0, std::ios::beg);
+	this->chunks.clear();
+	this->streamRing.clear();
+	this->currentSequence = 0;
+	this->streaming = streaming;
+	this->hashTrailer = hashTrailer;
+	this->hashAlgorithm = hashAlgorithm;
+	this->checksumPolicy = checksumPolicy;
+	this->sessionId = NewSessionId();
+
+	// Try to open the file, it is mapped, not read
+	TraceSpan open("SetFromFile: open");
+	if (!source.Open(path)) return false;
+	open.End();
 	
 	fs::path p(path);
 	// Get name
 	std::string name = p.filename().string();
 
 	this->fileName = name;
-	this->totalSize = size;
-	// todo hash
+	this->totalSize = static_cast<size_t>(source.Size());
+
+	if (!HashReset())
+	{
+		ERR("Unknown hash algorithm!");
+		return false;
+	}
+	hashedBytes = 0;
+	hashFinished = false;
+
+	const size_t payloadCapacity = UDP::PACKET_MAX_LENGTH - Chunk::data_padding;
 	
 	// Create sequences
 	CreateNameChunk();
 	CreateSizeChunk();
-	CreateHashChunk(file);
+	if (!hashTrailer) CreateHashChunk();
+
+	firstDataSeq = currentSequence;
+	dataChunkCount = (totalSize + payloadCapacity - 1) / payloadCapacity;
+
+	TraceSpan prepare("SetFromFile: prepare", "chunks", dataChunkCount);
+	if (streaming)
+	{
+		// Only slots, chunks get built as the window reaches them.
+		// Buffers are allocated now so building does not touch the heap
+		streamRing.resize((std::min)(STREAM_RING_CHUNKS, dataChunkCount));
+		for (Chunk& slot : streamRing) slot.data.reserve(UDP::PACKET_MAX_LENGTH);
+
+		currentSequence += dataChunkCount;
+		preparedEnd = firstDataSeq;
+		if (StartPreparePool()) PrepareAhead(firstDataSeq);
+	}
+	else if (StartPreparePool())
+	{
+		if (!PrepareAll()) return false;
+	}
+	else
+	{
+		for (size_t i = 0; i < dataChunkCount; ++i)
+		{
+			Chunk& chunk = EmplaceChunk();
+			if (!BuildDataChunk(currentSequence, chunk)) return false;
+			HashBuilt(chunk);
+			++currentSequence;
+		}
+	}
+	prepare.End();
+
+	// Empty slot only, built in GetChunk once all DATA went through the hash
+	if (hashTrailer)
+	{
+		hashSeq = currentSequence;
+		EmplaceChunk().data.reserve(Chunk::data_padding + hash.size());
+		++currentSequence;
+	}
+
+	CreateStopChunk();
+
+	return true;
+}
+
+
+const Chunk& FileSession::GetChunk(size_t seq)
+{
+	if (streaming && seq >= firstDataSeq && seq < firstDataSeq + dataChunkCount)
+	{
+		// Retransmission of recent chunk reuses what was already built
+		WaitPrepared(seq);
+
+		Chunk& slot = streamRing[seq % streamRing.size()];
+		if (slot.packetSize == 0 || slot.seq != seq)
+		{
+			if (!BuildDataChunk(seq, slot))
+				ERR("DATA chunk (seq=" << seq << ") could not be built");
+		}
+		HashBuilt(slot);
+
+		PrepareAhead(seq + 1);
+		return slot;
+	}
+
+	if (hashTrailer && seq == hashSeq)
+	{
+		Chunk& hashChunk = chunks.at(seq);
+		if (hashChunk.packetSize == 0 && !BuildHashChunk(seq, hashChunk))
+			ERR("HASH chunk was built from incomplete file");
+		return hashChunk;
+	}
 
-	// Start to read file
-	std::vector<unsigned char> buffer(UDP::PACKET_MAX_LENGTH);
-	uint32_t offset = 0;
-	while (file)
+	return chunks.at(seq);
+}
+
+size_t FileSession::DataBytes(size_t seq) const
+{
+	if (seq < firstDataSeq || seq >= firstDataSeq + dataChunkCount) return 0;
+
+	size_t offset = (seq - firstDataSeq) * PAYLOAD_CAPACITY;
+	return (std::min)(PAYLOAD_CAPACITY, totalSize - offset);
+}
+
+
+/// <summary>
+/// LEAF chunk with Merkle leaf hashes from firstLeaf on, as many as fit into one packet.
+/// Chunk is reused, it is valid until next call.
+/// </summary>
+/// <param name="firstLeaf"></param>
+/// <returns></returns>
+const Chunk& FileSession::GetLeafChunk(size_t firstLeaf)
+{
+	FinishFileHash();
+
+	const auto& leaves = hasher.Merkle().Leaves();
+	size_t count = 0;
+	if (hashAlgorithm == HASH_MERKLE_SHA256 && firstLeaf < leaves.size())
 	{
-		Chunk fileChunk{};
+		count = (std::min)(leaves.size() - firstLeaf, PAYLOAD_CAPACITY / Sha256::DIGEST_SIZE);
+	}
 
-		std::memcpy(buffer.data() + Chunk::seq_padding, &currentSequence, 4);
-		std::memcpy(buffer.data() + Chunk::command_padding, "DATA", 4);
-		std::memcpy(buffer.data() + Chunk::offset_padding, &offset, sizeof(offset));
+	// Leaves are not part of the transfer, seq is past STOP
+	PacketBuilder builder = leafChunk.Builder(count * Sha256::DIGEST_SIZE);
+	builder.Header(Command::Leaf, static_cast<uint32_t>(ChunkCount()), firstLeaf, sessionId);
+	if (count > 0) builder.Payload(leaves[firstLeaf].data(), count * Sha256::DIGEST_SIZE);
+	leafChunk.Seal(builder);
 
-		// Pointer arithmetic -> 'skip' the first 13 bytes -> CRC+COMMAND+OFFSET
-		file.read(
-			reinterpret_cast<char*>(buffer.data() + Chunk::data_padding), 
-			UDP::PACKET_MAX_LENGTH - Chunk::data_padding);
+	return leafChunk;
+}
 
-		std::streamsize bytesRead = file.gcount();
-		if (bytesRead <= 0) break; // We're on the EOF
 
-		int packetSize = Chunk::data_padding + static_cast<int>(bytesRead); // Max 1024 Bytes
+/// <summary>
+/// Builds DATA chunk: header, payload copied from mapped file and CRC
+/// </summary>
+/// <param name="seq"></param>
+/// <param name="out"></param>
+/// <param name="view">view of worker thread, null on thread which owns the session</param>
+/// <returns></returns>
+bool FileSession::BuildDataChunk(size_t seq, Chunk& out, FileView* view)
+{
+	const size_t payloadCapacity = UDP::PACKET_MAX_LENGTH - Chunk::data_padding;
+
+	uint64_t offset = static_cast<uint64_t>(seq - firstDataSeq) * payloadCapacity;
+	size_t length = static_cast<size_t>((std::min<uint64_t>)(payloadCapacity, totalSize - offset));
 
-		fileChunk.data.resize(packetSize); // Resize so we don't waste space on our prescius RAM
-		std::memcpy(fileChunk.data.data(), buffer.data(), packetSize);
-		fileChunk.packetSize = packetSize;
+	const uint8_t* payload = view ? view->Map(source, offset, length) : source.Map(offset, length);
+	if (!payload) return false;
 
-		// Do CRC
-		uint32_t crc = fileChunk.ComputeCRC();
-		std::memcpy(fileChunk.data.data(), &crc, Chunk::seq_padding);
+	PacketBuilder builder = out.Builder(payloadCapacity);
+	builder.Checksum(checksumPolicy)
+		.Header(Command::Data, static_cast<uint32_t>(seq), offset, sessionId)
+		.Payload(payload, length);
+	out.Seal(builder);
 
-		this->chunks.insert({ currentSequence, fileChunk });
+	return true;
+}
+
+
+/// <summary>
+/// First DATA chunk handed out in order -> its payload is hashed now, while it is still in cache
+/// </summary>
+/// <param name="chunk"></param>
+void FileSession::HashBuilt(const Chunk& chunk)
+{
+	if (hashFinished || chunk.offset != hashedBytes) return;
 
-		offset += static_cast<uint32_t>(bytesRead);
+	auto [payload, length] = chunk.GetData();
+	if (length == 0) return;
 
+	hasher.Update(payload, length);
+	hashedBytes += length;
+}
+
+
+/// ------------------------------------------------------------------------------------------------
+/// PARALLEL PREPARATION of DATA chunks (sender)
+/// ------------------------------------------------------------------------------------------------
+
+/// <summary>
+/// Workers are started for first large file and stay for next ones
+/// </summary>
+/// <returns>false if chunks are built on this thread</returns>
+bool FileSession::StartPreparePool()
+{
+	if (dataChunkCount < PARALLEL_MIN_CHUNKS) return false;
+
+	if (!prepareScheduler)
+	{
+		// Single core, building on workers would only take turns with the sender
+		if (TaskScheduler::DefaultThreads() == 0) return false;
+
+		prepareScheduler = &TaskScheduler::Shared();
+		prepareViews = std::vector<FileView>(prepareScheduler->Size());
+	}
+	return true;
+}
+
+/// <summary>
+/// Preload: slots of all DATA chunks are created first, so workers only look into the map.
+/// With hash trailer this thread hashes the file while workers build.
+/// </summary>
+/// <returns></returns>
+bool FileSession::PrepareAll()
+{
+	for (size_t i = 0; i < dataChunkCount; ++i)
+	{
+		EmplaceChunk();
 		++currentSequence;
 	}
 
-	CreateStopChunk();
+	prepareBegin = firstDataSeq;
+	DispatchPrepare(dataChunkCount);
+
+	bool hashed = FinishFileHash();
+	prepareScheduler->Wait(prepareGroup);
+	prepareCount = 0;
+
+	for (auto it = chunks.find(firstDataSeq); it != chunks.end() && it->first < firstDataSeq + dataChunkCount; ++it)
+	{
+		if (it->second.packetSize == 0)
+		{
+			ERR("DATA chunk (seq=" << it->first << ") could not be built");
+			return false;
+		}
+	}
+
+	return hashed;
+}
+
+/// <summary>
+/// Streaming: once sender gets within PREPARE_AHEAD_CHUNKS of what is built, next
+/// PREPARE_AHEAD_CHUNKS are given to workers. Sender does not wait for running job.
+/// Job never reaches slot of chunk sender holds, ring is more than twice as large.
+/// </summary>
+/// <param name="next">first chunk sender does not hold yet</param>
+void FileSession::PrepareAhead(size_t next)
+{
+	static_assert(2 * PREPARE_AHEAD_CHUNKS < STREAM_RING_CHUNKS, "Job ahead could overwrite chunk in use");
+
+	const size_t dataEnd = firstDataSeq + dataChunkCount;
+	if (!prepareScheduler || preparedEnd >= dataEnd || next + PREPARE_AHEAD_CHUNKS <= preparedEnd) return;
+	if (!prepareGroup.Done()) return;
+
+	size_t begin = (std::max)(preparedEnd, next);
+	if (begin >= dataEnd) return;
+
+	prepareBegin = begin;
+	preparedEnd = begin + (std::min)(PREPARE_AHEAD_CHUNKS, dataEnd - begin);
+	DispatchPrepare(preparedEnd - begin);
+}
+
+/// <summary>
+/// Streaming: slot of seq may be written by running job, then we wait for it
+/// </summary>
+/// <param name="seq"></param>
+void FileSession::WaitPrepared(size_t seq)
+{
+	if (prepareCount == 0) return;
+
+	const size_t ring = streamRing.size();
+	size_t distance = (seq % ring + ring - prepareBegin % ring) % ring;
+	if (distance >= prepareCount) return;
+
+	prepareScheduler->Wait(prepareGroup);
+	prepareCount = 0;
+}
+
+/// <summary>
+/// Part of job on worker thread: builds its range of DATA chunks through its own file view
+/// </summary>
+void FileSession::PrepareTask(TaskScheduler::Task& task, size_t worker)
+{
+	FileSession& session = *static_cast<FileSession*>(task.context);
+	// Task ran on the spawning thread (queue was full), that one owns the session
+	FileView* view = worker < session.prepareViews.size() ? &session.prepareViews[worker] : nullptr;
+
+	size_t begin = task.index;
+	size_t end = (std::min)(begin + PREPARE_TASK_CHUNKS, session.prepareCount);
+	TRACE_SCOPE("Prepare chunks", "seq", session.prepareBegin + begin);
+
+	if (session.streaming)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			size_t seq = session.prepareBegin + i;
+			session.BuildDataChunk(seq, session.streamRing[seq % session.streamRing.size()], view);
+		}
+		return;
+	}
+
+	auto it = session.chunks.find(session.prepareBegin + begin);
+	for (size_t i = begin; i < end && it != session.chunks.end(); ++i, ++it)
+		session.BuildDataChunk(it->first, it->second, view);
+}
+
+
+/// <summary>
+/// Job of count chunks from prepareBegin, split into tasks of PREPARE_TASK_CHUNKS.
+/// Task objects are reused, vector grows only for bigger job
+/// </summary>
+/// <param name="count"></param>
+void FileSession::DispatchPrepare(size_t count)
+{
+	prepareCount = count;
+	prepareTasks.resize((count + PREPARE_TASK_CHUNKS - 1) / PREPARE_TASK_CHUNKS);
+
+	for (size_t i = 0; i < prepareTasks.size(); ++i)
+	{
+		TaskScheduler::Task& task = prepareTasks[i];
+		task.function = PrepareTask;
+		task.context = this;
+		task.index = i * PREPARE_TASK_CHUNKS;
+		prepareScheduler->Spawn(task, prepareGroup);
+	}
+}
+
+
+/// <summary>
+/// Hashes rest of the file which was not hashed while building DATA and finishes digest
+/// </summary>
+/// <returns></returns>
+bool FileSession::FinishFileHash()
+{
+	if (hashFinished) return true;
+
+	TRACE_SCOPE("Hash file", "bytes", totalSize - hashedBytes);
+
+	// Mapped file goes through view by view
+	while (hashedBytes < totalSize)
+	{
+		size_t length = static_cast<size_t>((std::min<uint64_t>)(FileSource::VIEW_SIZE / 2, totalSize - hashedBytes));
+		const uint8_t* data = source.Map(hashedBytes, length);
+		if (!data)
+		{
+			ERR("File could not be read for hashing at offset " << hashedBytes);
+			return false;
+		}
+		hasher.Update(data, length);
+		hashedBytes += length;
+	}
+
+	hash = hasher.Finish();
+	hashFinished = true;
+
+	return true;
+}
+
+
+/// <summary>
+/// Builds HASH chunk, algorithm type goes into offset field
+/// </summary>
+/// <param name="seq"></param>
+/// <param name="out"></param>
+/// <returns></returns>
+bool FileSession::BuildHashChunk(size_t seq, Chunk& out)
+{
+	bool ok = FinishFileHash();
+
+	PacketBuilder builder = out.Builder(hasher.DigestSize());
+	builder.Header(Command::Hash, static_cast<uint32_t>(seq), hashAlgorithm, sessionId)
+		.Payload(hash.data(), hasher.DigestSize());
+	out.Seal(builder);
+
+	return ok;
+}
+
+
+/// <summary>
+/// Starts hash of the file by algorithm tag, Merkle blocks are MERKLE_BLOCK_CHUNKS DATA chunks
+/// </summary>
+/// <returns>false for unknown algorithm</returns>
+bool FileSession::HashReset()
+{
+	return hasher.Reset(hashAlgorithm, MERKLE_BLOCK_CHUNKS * PAYLOAD_CAPACITY, totalSize);
+}
+
+
+bool FileSession::HasChunk(size_t seq) const
+{
+	size_t word = seq >> 6;
+	return word < receivedSeqs.size() && ((receivedSeqs[word] >> (seq & 63)) & 1);
+}
+
+/// <summary>
+/// Checks seq of received chunk before bitmap or reorder ring are sized by it.
+/// Chunk may be at most MAX_WINDOW ahead of hashed prefix, once SIZE is known it has to fit
+/// the file layout too. Offset of DATA has to agree with its seq, firstDataSeq comes from them.
+/// Forged packet or bit flip in header of DATA without checksum fails here.
+/// </summary>
+/// <param name="chunk"></param>
+/// <returns>false if chunk can't belong to this transfer</returns>
+bool FileSession::InSequence(const Chunk& chunk) const
+{
+	// Not part of the sequence, answer to our LEAF request
+	if (chunk.command == Command::Leaf) return true;
+
+	size_t seq = chunk.seq;
+	if (seq >= hashedSeq + MAX_WINDOW) return false;
+
+	size_t dataChunks = totalSize / PAYLOAD_CAPACITY + (totalSize % PAYLOAD_CAPACITY != 0);
+	if (sizeReceived && seq >= dataChunks + CONTROL_CHUNKS) return false;
+
+	if (chunk.command != Command::Data) return true;
+
+	// Only NAME, SIZE and HASH can be before DATA
+	uint64_t index = chunk.offset / PAYLOAD_CAPACITY;
+	if (chunk.offset % PAYLOAD_CAPACITY != 0 || index > seq || seq - index >= CONTROL_CHUNKS) return false;
+	if (dataSeen && seq - index != firstDataSeq) return false;
+	if (sizeReceived && index >= dataChunks) return false;
+
+	return true;
+}
+
+void FileSession::ClearChunk(size_t seq)
+{
+	if (!HasChunk(seq)) return;
+
+	receivedSeqs[seq >> 6] &= ~(uint64_t(1) << (seq & 63));
+	--receivedCount;
+}
+
+
+/// <summary>
+/// Takes valid received chunk. Control chunks are parsed into properties of session,
+/// DATA payload is written to disk at its offset right away. Payload is hashed when it
+/// continues hashed prefix, otherwise chunk is held in reorder ring until the gap is filled.
+/// </summary>
+/// <param name="chunk">may be swapped with spare buffer</param>
+/// <returns>false if chunk has invalid data or could not be written</returns>
+bool FileSession::AcceptChunk(Chunk& chunk)
+{
+	// Not part of the sequence, answer to our LEAF request
+	if (chunk.command == Command::Leaf) return AcceptLeafChunk(chunk);
+
+	size_t seq = chunk.seq;
+	if (HasChunk(seq)) return true; // duplicate
+	if (!InSequence(chunk)) return true; // dropped, caller reports it
+
+	size_t word = seq >> 6;
+	if (word >= receivedSeqs.size()) receivedSeqs.resize(word + 1, 0);
+	receivedSeqs[word] |= uint64_t(1) << (seq & 63);
+	++receivedCount;
+
+	if (chunk.command == Command::Data)
+	{
+		if (!dataSeen)
+		{
+			firstDataSeq = seq - static_cast<size_t>(chunk.offset / PAYLOAD_CAPACITY);
+			dataSeen = true;
+		}
+
+		// We can't write before we know where and how big
+		if (!sink.IsOpen())
+		{
+			pendingData.push_back(chunk);
+		}
+		else if (!WriteData(chunk))
+		{
+			return false;
+		}
+
+		// Chunk of reopened block, hash is already done
+		if (repairing)
+		{
+			RepairChunkArrived(chunk);
+			return true;
+		}
+
+		if (seq == hashedSeq)
+		{
+			HashPrefix(chunk);
+			++hashedSeq;
+			AdvanceHash();
+		}
+		else
+		{
+			HoldChunk(chunk);
+		}
+		return true;
+	}
+
+	if (!ParseControlChunk(chunk)) return false;
+
+	if (chunk.command == Command::Stop)
+	{
+		stopReceived = true;
+		stopSeq = seq;
+	}
+
+	// NAME and SIZE known -> file can be created and held back data written
+	if (!sink.IsOpen() && nameReceived && sizeReceived)
+	{
+		if (!OpenSink()) return false;
+
+		for (const Chunk& pending : pendingData)
+		{
+			if (!WriteData(pending)) return false;
+		}
+		pendingData.clear();
+		pendingData.shrink_to_fit();
+	}
+
+	// Control chunk has nothing to hash, it only may close the gap
+	AdvanceHash();
 
 	return true;
 }
 
 
 /// <summary>
-/// Parses chunk data into properties of file session.
+/// Grows reorder ring so chunk up to given distance ahead of hashed prefix fits.
+/// Held chunks are moved to their slots in the new ring. Never more than MAX_WINDOW,
+/// InSequence drops chunks further ahead.
 /// </summary>
+/// <param name="chunks"></param>
+void FileSession::ReserveReorder(size_t chunks)
+{
+	chunks = (std::min)(chunks, MAX_WINDOW);
+	if (chunks <= reorderRing.size()) return;
+
+	std::vector<Chunk> grown(std::bit_ceil((std::max)(chunks, size_t(256))));
+	for (Chunk& slot : grown)
+	{
+		slot.data.reserve(PACKET_MAX_LENGTH);
+	}
+
+	for (Chunk& slot : reorderRing)
+	{
+		if (slot.packetSize == 0 || slot.seq < hashedSeq) continue;
+		std::swap(grown[slot.seq & (grown.size() - 1)], slot);
+	}
+	reorderRing = std::move(grown);
+}
+
+
+/// <summary>
+/// Puts DATA chunk which is ahead of hashed prefix into reorder ring.
+/// Ring grows when chunk would not fit, caller gets old buffer of the slot.
+/// </summary>
+/// <param name="chunk"></param>
+void FileSession::HoldChunk(Chunk& chunk)
+{
+	ReserveReorder(chunk.seq - hashedSeq + 1);
+
+	chunk.heldAt = NowMicroseconds();
+	std::swap(reorderRing[chunk.seq & (reorderRing.size() - 1)], chunk);
+	chunk.packetSize = 0;
+}
+
+
+/// <summary>
+/// Feeds DATA payload into running hash, it has to continue right where hash ended
+/// </summary>
+/// <param name="chunk"></param>
 /// <returns></returns>
-bool FileSession::ParseChunkData()
+bool FileSession::HashPrefix(const Chunk& chunk)
+{
+	if (chunk.command != Command::Data) return true;
+
+	auto [ptr, len] = chunk.GetData();
+	if (len == 0) return true;
+
+	if (chunk.offset != hashedBytes)
+	{
+		ERR("Chunk (seq=" << chunk.seq << ") with offset=" << chunk.offset
+			<< " does not continue hashed data, expected offset=" << hashedBytes);
+		hashBroken = true;
+		return false;
+	}
+
+	hasher.Update(ptr, len);
+	hashedBytes += len;
+	return true;
+}
+
+
+/// <summary>
+/// Moves hashed prefix over every chunk we already have.
+/// Time every held chunk spent in reorder ring goes into latency.
+/// Once the last chunk is in, digest is finished.
+/// </summary>
+void FileSession::AdvanceHash()
 {
-	for (auto [seq, chunk] : chunks)
+	uint64_t now = 0;
+	while (HasChunk(hashedSeq))
 	{
-		// Name
-		if (chunk.CommandReceived("NAME"))
+		if (!reorderRing.empty())
 		{
-			auto [ptr, len] = chunk.GetData();
-			if (!ptr || len == 0)
+			Chunk& slot = reorderRing[hashedSeq & (reorderRing.size() - 1)];
+			if (slot.packetSize != 0 && slot.seq == hashedSeq)
 			{
-				std::cerr << "ParseChunkData: NAME has invalid data!" << "\n";
-				return false;
+				if (now == 0) now = NowMicroseconds();
+				latency.reorder.Record(now > slot.heldAt ? now - slot.heldAt : 0);
+				HashPrefix(slot);
+				slot.packetSize = 0;
 			}
-			fileName = std::string(reinterpret_cast<const char*>(ptr), len);
 		}
+		++hashedSeq;
+	}
+
+	if (!hashFinished && stopReceived && hashedSeq > stopSeq)
+	{
+		TRACE_SCOPE("Hash finish", "bytes", hashedBytes);
+		computedHash = hasher.Finish();
+		hashFinished = true;
+	}
+}
+
+
+/// <summary>
+/// Parses control chunk data into properties of file session.
+/// </summary>
+/// <returns></returns>
+bool FileSession::ParseControlChunk(const Chunk& chunk)
+{
+	auto [ptr, len] = chunk.GetData();
+
+	switch (chunk.command)
+	{
+	// Name
+	case Command::Name:
+		if (!ptr || len == 0)
+		{
+			std::cerr << "ParseChunkData: NAME has invalid data!" << "\n";
+			return false;
+		}
+		fileName = std::string(reinterpret_cast<const char*>(ptr), len);
+		nameReceived = true;
+
+		// Hash algorithm, old senders leave it empty. Nothing is hashed before NAME and SIZE
+		hashAlgorithm = static_cast<uint32_t>(chunk.offset) ? static_cast<uint32_t>(chunk.offset) : HASH_SHA256;
+		if (!HashReset())
+		{
+			char tag[5]{};
+			TagToChars(hashAlgorithm, tag);
+			ERR("NAME announces unknown hash algorithm " << tag << ", file can't be verified");
+			hashBroken = true;
+		}
+		if (hashReceived) CheckHashAlgorithm();
+
+		// DATA checksum, old senders leave it 0 = CRC-32. Unknown one can't be checked at all
+		if (!IsKnownChecksum(static_cast<uint32_t>(chunk.offset >> 32)))
+		{
+			ERR("NAME announces unknown checksum policy " << (chunk.offset >> 32));
+			return false;
+		}
+		checksumPolicy = static_cast<ChecksumPolicy>(chunk.offset >> 32);
+		break;
 	
-		// Size
-		if (chunk.CommandReceived("SIZE"))
+	// Size
+	case Command::Size:
+		if (!ptr || len < sizeof(totalSize))
 		{
-			auto [ptr, len] = chunk.GetData();
-			if (!ptr || len < sizeof(totalSize))
-			{
-				std::cerr << "ParseChunkData: SIZE has invalid data!" << "\n";
-				return false;
-			}
-			memcpy(&totalSize, ptr, sizeof(totalSize));
+			std::cerr << "ParseChunkData: SIZE has invalid data!" << "\n";
+			return false;
 		}
+		memcpy(&totalSize, ptr, sizeof(totalSize));
+		sizeReceived = true;
+		HashReset();
+		break;
 
-		// Hash
-		if (chunk.CommandReceived("HASH")) 
+	// Hash
+	case Command::Hash:
+	{
+		// Unknown algorithm gives size 0, such HASH is kept and mismatch below breaks the hash
+		size_t digestSize = FileHasher::DigestSize(static_cast<uint32_t>(chunk.offset));
+		if (!ptr || len < digestSize)
 		{
-			auto [ptr, len] = chunk.GetData();
-			if (!ptr || len < sizeof(totalSize)) 
-			{
-				std::cerr << "ParseChunkData: HASH has invalid data!" << "\n";
-				return false;
-			}
-			memcpy(&hash, ptr, sizeof(hash));
+			std::cerr << "ParseChunkData: HASH has invalid data!" << "\n";
+			return false;
 		}
+		hash.fill(0);
+		memcpy(hash.data(), ptr, digestSize);
+		hashReceived = true;
+		hashReceivedAlgorithm = static_cast<uint32_t>(chunk.offset);
+
+		// Reordered HASH before NAME is checked once NAME comes
+		if (nameReceived) CheckHashAlgorithm();
+		break;
+	}
+
+	default:
+		break;
 	}
 
 	return true;
 }
 
 
-
-bool FileSession::SaveToFile(bool& hashOk, const std::string& path)
+/// <summary>
+/// Creates output file, it stays with .part suffix until hash is checked
+/// </summary>
+/// <returns></returns>
+bool FileSession::OpenSink()
 {
 	if (this->fileName.size() == 0)
 	{
@@ -155,175 +769,304 @@ bool FileSession::SaveToFile(bool& hashOk, const std::string& path)
 		return false;
 	}
 
-	// Create bytestream for picosha2
-	std::vector<uint8_t> fileData(totalSize, 0);
+	return sink.Open(outputPath + fileName + ".part", totalSize);
+}
 
-	for (auto& [seq, chunk] : chunks)
+
+bool FileSession::WriteData(const Chunk& chunk)
+{
+	auto [ptr, payloadSize] = chunk.GetData();
+	uint64_t offset = chunk.offset;
+
+	// Check if we're larger than file
+	if (offset + payloadSize > totalSize)
 	{
-		// We need only data
-		if (!chunk.CommandReceived("DATA")) continue;
-		uint32_t offset = chunk.RetrieveOffset();
+		ERR("Chunk (seq=" << chunk.seq << ") with offset=" << offset
+			<< " and size=" << payloadSize
+			<< " exceeds totalSize=" << totalSize);
+		return true;
+	}
 
-		size_t payloadSize = chunk.packetSize - UDP::Chunk::data_padding;
+	if (payloadSize == 0) return true;
 
-		// Check if we're larger than file
-		if (offset + payloadSize > fileData.size())
-		{
-			ERR("Chunk (seq=" << seq << ") with offset=" << offset
-				<< " and size=" << payloadSize
-				<< " exceeds totalSize=" << fileData.size());
-			continue;
-		}
+	if (!sink.WriteAt(offset, ptr, payloadSize)) return false;
 
-		// We copy data from chunk into file data
-		std::memcpy(
-			fileData.data() + offset,
-			chunk.data.data() + UDP::Chunk::data_padding,
-			payloadSize
-		);
-	}
+	receivedBytes += payloadSize;
+	return true;
+}
 
-	// Hash check
-	picosha2::hash256_one_by_one hasher;
-	hasher.process(fileData.begin(), fileData.end());
-	hasher.finish();
 
-	std::array<uint8_t, 32> possibleHash;
-	hasher.get_hash_bytes(possibleHash.begin(), possibleHash.end());
+/// <summary>
+/// HASH must use the algorithm announced in NAME, otherwise file can't be verified
+/// </summary>
+void FileSession::CheckHashAlgorithm()
+{
+	if (hashReceivedAlgorithm == hashAlgorithm) return;
 
-	std::string hash1(reinterpret_cast<const char*>(hash.data()), hash.size());
-	std::string hash2(reinterpret_cast<const char*>(possibleHash.data()), possibleHash.size());
+	char tag[5]{};
+	TagToChars(hashReceivedAlgorithm, tag);
+	ERR("HASH uses algorithm " << tag << " which differs from the one announced in NAME");
+	hashBroken = true;
+}
+
+
+/// <summary>
+/// Finishes received file: checks its hash and gives it final name. On hash mismatch file is deleted.
+/// </summary>
+/// <param name="hashOk"></param>
+/// <returns></returns>
+bool FileSession::SaveToFile(bool& hashOk)
+{
+	hashOk = false;
+	TRACE_SCOPE("SaveToFile", "bytes", totalSize);
 
-	std::cout << "Received hash: " << hash1 << "\n";
-	std::cout << "Computed hash: " << hash2 << "\n";
+	// Empty file has no DATA, sink is created here
+	if (!sink.IsOpen() && !OpenSink()) return false;
+
+	// Hash was computed while receiving
+	if (!hashFinished)
+	{
+		ERR("File is not complete, hash was not computed!");
+		sink.Discard();
+		return false;
+	}
+
+	size_t digestSize = hasher.DigestSize();
+	std::cout << "Hash algorithm: " << FileHasher::AlgorithmName(hashAlgorithm) << "\n";
+	std::cout << "Received hash: " << ToHex(hash.data(), digestSize) << "\n";
+	std::cout << "Computed hash: " << ToHex(computedHash.data(), digestSize) << "\n";
 	
 	// We compare the hashes
-	if (possibleHash != hash) 
+	TraceSpan verify("SaveToFile: hash");
+	if (!HashMatches()) 
 	{
 		std::cout << "Hash is not correct!\n";
-		hashOk = false;
+		sink.Discard();
 		return false;
 	}
-	else
+	verify.End();
+
+	hashOk = true;
+
+	TRACE_SCOPE("SaveToFile: write");
+	return sink.Commit(outputPath + this->fileName);
+}
+
+
+bool FileSession::HashMatches() const
+{
+	return hashFinished && hashReceived && !hashBroken && computedHash == hash;
+}
+
+
+/// ------------------------------------------------------------------------------------------------
+/// REPAIR of corrupted Merkle blocks (receiver)
+/// ------------------------------------------------------------------------------------------------
+
+/// <summary>
+/// Starts repair round after hash mismatch: leaves of sender are needed first.
+/// </summary>
+/// <returns>false if file can't be repaired (no Merkle tree, too many rounds)</returns>
+bool FileSession::BeginRepair()
+{
+	if (hashAlgorithm != HASH_MERKLE_SHA256 || !hashFinished || hashBroken) return false;
+	if (repairRounds >= MAX_REPAIR_ROUNDS) return false;
+
+	++repairRounds;
+	repairing = true;
+	reopened = false;
+
+	senderLeaves.assign(hasher.Merkle().LeafCount(), Sha256::Digest{});
+	senderLeafKnown.assign(hasher.Merkle().LeafCount(), false);
+
+	return true;
+}
+
+size_t FileSession::MissingLeaf() const
+{
+	for (size_t i = 0; i < senderLeafKnown.size(); ++i)
 	{
-		hashOk = true;
+		if (!senderLeafKnown[i]) return i;
 	}
+	return NO_LEAF;
+}
+
+bool FileSession::AcceptLeafChunk(const Chunk& chunk)
+{
+	if (!repairing || reopened) return true; // Late answer
 
-	std::ofstream out(path + this->fileName, std::ios::binary);
-	if (!out)
+	auto [ptr, len] = chunk.GetData();
+	size_t first = static_cast<size_t>(chunk.offset);
+	size_t count = len / Sha256::DIGEST_SIZE;
+
+	for (size_t i = 0; i < count && first + i < senderLeaves.size(); ++i)
 	{
-		ERR("Could not create file in specified path: \"" + path + "\"");
+		memcpy(senderLeaves[first + i].data(), ptr + i * Sha256::DIGEST_SIZE, Sha256::DIGEST_SIZE);
+		senderLeafKnown[first + i] = true;
+	}
+
+	return true;
+}
+
+/// <summary>
+/// All leaves of sender are here: blocks with different leaf are marked as not received,
+/// their chunks are then requested again by NACK.
+/// </summary>
+/// <returns>false if there is nothing we could repair</returns>
+bool FileSession::ReopenCorruptBlocks()
+{
+	if (reopened) return true;
+	if (!repairing || MissingLeaf() != NO_LEAF) return false;
+
+	// Leaves have to give the root we got in HASH
+	if (MerkleTree::RootOf(senderLeaves.data(), senderLeaves.size()) != hash)
+	{
+		ERR("Leaf hashes of sender do not match received root!");
 		return false;
 	}
 
-	// We write the data
-	out.write(
-		reinterpret_cast<const char*>(fileData.data()),
-		static_cast<std::streamsize>(fileData.size())
-	);
+	const size_t dataEnd = firstDataSeq + (totalSize + PAYLOAD_CAPACITY - 1) / PAYLOAD_CAPACITY;
+
+	blockMissing.assign(senderLeaves.size(), 0);
+	blocksInRepair = 0;
+
+	for (size_t block = 0; block < senderLeaves.size(); ++block)
+	{
+		if (senderLeaves[block] == hasher.Merkle().Leaves()[block]) continue;
+
+		size_t first = firstDataSeq + block * MERKLE_BLOCK_CHUNKS;
+		size_t last = (std::min)(first + MERKLE_BLOCK_CHUNKS, dataEnd);
 
+		for (size_t seq = first; seq < last; ++seq)
+		{
+			uint64_t offset = static_cast<uint64_t>(seq - firstDataSeq) * PAYLOAD_CAPACITY;
+			receivedBytes -= static_cast<size_t>((std::min<uint64_t>)(PAYLOAD_CAPACITY, totalSize - offset));
+			ClearChunk(seq);
+		}
+
+		blockMissing[block] = static_cast<uint32_t>(last - first);
+		if (blockMissing[block] > 0) ++blocksInRepair;
+
+		std::cout << "Receiver: Block " << block << " (seq " << first << "-" << last - 1 << ") is corrupted, requesting it again\n";
+	}
+
+	if (blocksInRepair == 0)
+	{
+		ERR("Hash mismatch, but no block differs!");
+		return false;
+	}
+
+	reopened = true;
 	return true;
 }
 
-
-void FileSession::CreateNameChunk()
+void FileSession::MissingSequences(std::vector<uint32_t>& out, size_t max) const
 {
-	// Name
-	Chunk nameChunk;
-	std::string nameCommand = "NAME";
-	nameChunk.packetSize = Chunk::data_padding + fileName.size();
+	out.clear();
 
-	// Cuz we dont have the memory yet
-	nameChunk.data.resize(nameChunk.packetSize); 
-	std::memset(nameChunk.data.data(), 0, Chunk::data_padding);
+	for (size_t block = 0; block < blockMissing.size() && out.size() < max; ++block)
+	{
+		if (blockMissing[block] == 0) continue;
 
-	memcpy(nameChunk.data.data() + Chunk::data_padding, fileName.data(), fileName.size());
-	memcpy(nameChunk.data.data() + Chunk::seq_padding, &currentSequence, 4);
-	memcpy(nameChunk.data.data() + Chunk::command_padding, nameCommand.c_str(), 4);
-	uint32_t nameCRC = nameChunk.ComputeCRC();
-	memcpy(nameChunk.data.data() + Chunk::crc_padding, &nameCRC, 4);
+		size_t first = firstDataSeq + block * MERKLE_BLOCK_CHUNKS;
+		for (size_t seq = first; seq < first + MERKLE_BLOCK_CHUNKS && out.size() < max; ++seq)
+		{
+			if (!HasChunk(seq) && seq < stopSeq) out.push_back(static_cast<uint32_t>(seq));
+		}
+	}
+}
 
-	chunks.insert({ currentSequence, nameChunk });
+/// <summary>
+/// DATA chunk of reopened block is on disk. Once whole block is there, its leaf is computed
+/// again and after last block the root too.
+/// </summary>
+/// <param name="chunk"></param>
+void FileSession::RepairChunkArrived(const Chunk& chunk)
+{
+	size_t block = (chunk.seq - firstDataSeq) / MERKLE_BLOCK_CHUNKS;
+	if (block >= blockMissing.size() || blockMissing[block] == 0) return;
 
-	++currentSequence;
-}
+	if (--blockMissing[block] > 0) return;
 
+	RehashBlock(block);
 
-void FileSession::CreateSizeChunk()
+	if (--blocksInRepair == 0)
+	{
+		computedHash = hasher.Merkle().Root();
+		repairing = false;
+	}
+}
+
+bool FileSession::RehashBlock(size_t block)
 {
-	// Name
-	Chunk sizeChunk;
-	std::string sizeCommand = "SIZE";
+	uint64_t offset = static_cast<uint64_t>(block) * hasher.Merkle().BlockSize();
+	size_t length = static_cast<size_t>((std::min<uint64_t>)(hasher.Merkle().BlockSize(), totalSize - offset));
 
-	sizeChunk.packetSize = Chunk::data_padding + sizeof(totalSize);
-	
-	// Cuz we dont have the memory yet
-	sizeChunk.data.resize(sizeChunk.packetSize);
-	std::memset(sizeChunk.data.data(), 0, Chunk::data_padding);
+	// Only in repair, allocation does not matter here
+	std::vector<uint8_t> buffer(length);
+	if (!sink.ReadAt(offset, buffer.data(), length)) return false;
 
-	memcpy(sizeChunk.data.data() + Chunk::data_padding, &totalSize, sizeof(totalSize));
-	memcpy(sizeChunk.data.data() + Chunk::seq_padding, &currentSequence, 4);
-	memcpy(sizeChunk.data.data() + Chunk::command_padding, sizeCommand.c_str(), 4);
-	uint32_t sizeCRC = sizeChunk.ComputeCRC();
-	memcpy(sizeChunk.data.data() + Chunk::crc_padding, &sizeCRC, 4);
+	hasher.Merkle().SetLeaf(block, Sha256::Hash(buffer.data(), length));
+	return true;
+}
 
-	chunks.insert({ currentSequence, sizeChunk });
 
-	++currentSequence;
+Chunk& FileSession::EmplaceChunk()
+{
+	return chunks[currentSequence];
 }
 
 
-void FileSession::CreateStopChunk()
+void FileSession::CreateNameChunk()
 {
 	// Name
-	Chunk stopChunk;
-	std::string stopCommand = "STOP";
-	
-	stopChunk.packetSize = Chunk::data_padding;
-	
-	// Cuz we dont have the memory yet
-	stopChunk.data.resize(stopChunk.packetSize);
-	std::memset(stopChunk.data.data(), 0, Chunk::data_padding);
+	Chunk& nameChunk = EmplaceChunk();
 
-	memcpy(stopChunk.data.data() + Chunk::seq_padding, &currentSequence, 4);
-	memcpy(stopChunk.data.data() + Chunk::command_padding, stopCommand.c_str(), 4);
-	uint32_t stopCRC = stopChunk.ComputeCRC();
-	memcpy(stopChunk.data.data() + Chunk::crc_padding, &stopCRC, 4);
+	// Hash algorithm goes into offset so receiver can hash before HASH arrives,
+	// checksum policy of DATA into its high half
+	uint64_t offset = hashAlgorithm | (static_cast<uint64_t>(checksumPolicy) << 32);
 
-	chunks.insert({ currentSequence, stopChunk });
+	PacketBuilder builder = nameChunk.Builder(fileName.size());
+	builder.Header(Command::Name, static_cast<uint32_t>(currentSequence), offset, sessionId)
+		.Payload(fileName.data(), fileName.size());
+	nameChunk.Seal(builder);
 
 	++currentSequence;
 }
 
 
-void FileSession::CreateHashChunk(std::ifstream& file)
+void FileSession::CreateSizeChunk()
 {
-	// Name
-	Chunk hashChunk;
-	std::string hashCommand = "HASH";
-	std::string hashType = "S256";
+	// Size
+	Chunk& sizeChunk = EmplaceChunk();
+
+	PacketBuilder builder = sizeChunk.Builder(sizeof(totalSize));
+	builder.Header(Command::Size, static_cast<uint32_t>(currentSequence), 0, sessionId)
+		.Payload(&totalSize, sizeof(totalSize));
+	sizeChunk.Seal(builder);
+
+	++currentSequence;
+}
 
-	hashChunk.packetSize = Chunk::data_padding + picosha2::k_digest_size;
 
-	// Hash computation
-	picosha2::hash256(file, hash.begin(), hash.end());
+void FileSession::CreateStopChunk()
+{
+	// Stop
+	Chunk& stopChunk = EmplaceChunk();
 
-	// We reset file stream
-	file.clear();
-	file.seekg(0, std::ios::beg);
+	PacketBuilder builder = stopChunk.Builder(0);
+	builder.Header(Command::Stop, static_cast<uint32_t>(currentSequence), 0, sessionId);
+	stopChunk.Seal(builder);
 
-	// Cuz we dont have the memory yet
-	hashChunk.data.resize(hashChunk.packetSize);
-	std::memset(hashChunk.data.data(), 0, Chunk::data_padding);
+	++currentSequence;
+}
 
-	memcpy(hashChunk.data.data() + Chunk::seq_padding, &currentSequence, 4);
-	memcpy(hashChunk.data.data() + Chunk::command_padding, hashCommand.c_str(), 4);
-	memcpy(hashChunk.data.data() + Chunk::offset_padding, hashType.c_str(), 4);
-	memcpy(hashChunk.data.data() + Chunk::data_padding, hash.data(), hash.size());
-	uint32_t stopCRC = hashChunk.ComputeCRC();
-	memcpy(hashChunk.data.data() + Chunk::crc_padding, &stopCRC, 4);
 
-	chunks.insert({ currentSequence, hashChunk });
+void FileSession::CreateHashChunk()
+{
+	// Whole file is hashed before anything is sent
+	if (!BuildHashChunk(currentSequence, EmplaceChunk()))
+		ERR("HASH chunk was built from incomplete file");
 
 	++currentSequence;
-}
\ No newline at end of file
+}
@@ -1,24 +1,32 @@
 #pragma once
 
 #include <string>
+#include <cstring>
 #include <map>
 #include <cstdint>
 #include <vector>
 #include <iostream>
 #include <fstream>
 #include <array>
+#include <memory>
 
 #include "UDPCommunication.h"
+#include "PacketHeader.h"
+#include "FileSource.h"
+#include "FileSink.h"
+#include "FileHash.h"
+#include "TaskScheduler.h"
+#include "HdrHistogram.h"
 
 namespace UDP
 {
 	struct Chunk
 	{
-		static const uint32_t crc_padding = 0; // padding for CRC
-		static const uint32_t seq_padding = 4; // padding for sequence number
-		static const uint32_t command_padding = 8; // padding for command
-		static const uint32_t offset_padding = 12; // padding for offset
-		static const uint32_t data_padding = 16; // padding for sent data
+		static const uint32_t crc_padding = offsetof(PacketHeader, crc); // padding for CRC
+		static const uint32_t seq_padding = offsetof(PacketHeader, seq); // padding for sequence number
+		static const uint32_t command_padding = offsetof(PacketHeader, command); // padding for command
+		static const uint32_t offset_padding = offsetof(PacketHeader, offset); // padding for offset
+		static const uint32_t data_padding = sizeof(PacketHeader); // padding for sent data
 
 		size_t packetSize = 0;
 		//! !!! Raw data with offset and indentation !!!
@@ -29,61 +37,92 @@ namespace UDP
 		// Properties
 		uint32_t crc = 0xFFFFFFFF;
 		uint32_t retrievedCRC = 0xFFFFFFFF;
+		uint32_t payloadCRC = 0; // only for chunks we built, see RewriteHeader
+		ChecksumPolicy checksum = ChecksumPolicy::Crc32; // how chunk we built was sealed
 		uint32_t seq = 0;
-		uint32_t offset = 0;
+		uint64_t offset = 0;
+		uint32_t session = 0;
+		Command command = Command::None;
+		uint64_t heldAt = 0; // receiver: when chunk went into reorder ring, microseconds
 
 		bool CheckValidity()
 		{
 			return data.size() <= UDP::PACKET_MAX_LENGTH;
 		}
 
-		uint32_t RetrieveCRC() {
-			uint32_t toRetrieve = 0xFFFFFFFF;
+		// Zero-copy view of the wire header
+		HeaderView View() const { return HeaderView(data.data(), data.size()); }
+		PacketHeader Header() const { return View().Load(); }
 
-			memcpy(&toRetrieve, data.data(), seq_padding);
-			retrievedCRC = toRetrieve;
+		// Decodes header in one load and fills properties. False if packet is too short
+		bool LoadHeader()
+		{
+			if (!View().IsValid()) return false;
 
-			return toRetrieve;
+			PacketHeader header = Header();
+			retrievedCRC = header.crc;
+			seq = header.seq;
+			command = header.command;
+			offset = header.offset;
+			session = header.session;
+			return true;
 		}
 
-		uint32_t RetrieveSeq()
+		// File bytes carried by DATA packet, 0 for others
+		size_t FileBytes() const
 		{
-			uint32_t raw = 0;
-			if (data.size() < seq_padding + sizeof(uint32_t))
-				return 0;
-
-			std::memcpy(&raw, data.data() + seq_padding, sizeof(uint32_t));
-			seq = raw;
-			return seq;
+			return command == Command::Data && packetSize > data_padding ? packetSize - data_padding : 0;
 		}
 
-		uint32_t RetrieveOffset()
+		// Checks if stop command was received and returns true
+		bool StopReceived() const
 		{
-			uint32_t raw = 0;
-			if (data.size() < offset_padding + sizeof(uint32_t))
-				return 0;
+			return CommandReceived(Command::Stop);
+		}
 
-			std::memcpy(&raw, data.data() + offset_padding, sizeof(uint32_t));
-			offset = raw;
-			return offset;
+		bool CommandReceived(Command expected) const
+		{
+			return View().IsValid() && Header().command == expected;
 		}
 
-		// Checks if stop command was received and returns true
-		bool StopReceived()
+		// Builder writing straight into this chunk's buffer
+		PacketBuilder Builder(size_t payloadCapacity)
 		{
-			return CommandReceived("STOP");
+			data.resize(Chunk::data_padding + payloadCapacity);
+			return PacketBuilder(data.data(), data.size());
 		}
 
-		bool CommandReceived(const std::string& command)
+		// Shrinks buffer to sealed packet and fills properties
+		void Seal(PacketBuilder& builder)
 		{
-			// Check if stop is received
-			if (data.size() < UDP::Chunk::command_padding + 4)
-				return false;
+			packetSize = builder.Seal();
+			payloadCRC = builder.PayloadCRC();
+			checksum = builder.Policy();
+			data.resize(packetSize);
+			LoadHeader();
+			crc = retrievedCRC;
+		}
 
-			// Exactly 4 chars
-			std::string cmd(reinterpret_cast<const char*>(data.data() + UDP::Chunk::command_padding), 4);
+		// Header change per transmission (e.g. retransmit), CRC is fixed from cached
+		// payload CRC, so payload is not read again. CRC field of header is ignored.
+		// Only CRC-32C has no cached payload CRC, it is computed again (in hardware)
+		void RewriteHeader(const PacketHeader& header)
+		{
+			if (packetSize < data_padding) return;
 
-			return cmd == command;
+			constexpr size_t fields = crc_padding + sizeof(uint32_t);
+			std::memcpy(data.data() + fields, reinterpret_cast<const uint8_t*>(&header) + fields, sizeof(PacketHeader) - fields);
+			if (checksum == ChecksumPolicy::Crc32)
+			{
+				ResealPacket(data.data(), payloadCRC, packetSize - data_padding);
+			}
+			else
+			{
+				uint32_t sealed = ComputePacketCRC(data.data(), packetSize, checksum);
+				std::memcpy(data.data() + crc_padding, &sealed, sizeof(sealed));
+			}
+			LoadHeader();
+			crc = retrievedCRC;
 		}
 
 		/// <summary>
@@ -100,38 +139,195 @@ namespace UDP
 			return { ptr, dataLength };
 		}
 
-		uint32_t ComputeCRC();
+		uint32_t ComputeCRC(ChecksumPolicy policy = ChecksumPolicy::Crc32);
 	};
 	
 	struct FileSession
 	{
+		// How many DATA chunks the streaming sender keeps built at once
+		static constexpr size_t STREAM_RING_CHUNKS = 4096;
+		// From this many DATA chunks on they are built on worker threads
+		static constexpr size_t PARALLEL_MIN_CHUNKS = STREAM_RING_CHUNKS;
+		// Streaming: DATA chunks built ahead of the sender by one job of workers
+		static constexpr size_t PREPARE_AHEAD_CHUNKS = STREAM_RING_CHUNKS / 4;
+		// DATA chunks built by one task, job is split into these so idle workers can steal
+		static constexpr size_t PREPARE_TASK_CHUNKS = 64;
+		// Payload of one DATA chunk
+		static constexpr size_t PAYLOAD_CAPACITY = PACKET_MAX_LENGTH - Chunk::data_padding;
+		// Merkle block = this many whole DATA chunks, so every chunk belongs to one block
+		static constexpr size_t MERKLE_BLOCK_CHUNKS = 256;
+		static constexpr int MAX_REPAIR_ROUNDS = 3;
+		static constexpr size_t NO_LEAF = SIZE_MAX;
+		// Largest send window. Receiver drops chunk further ahead of its hashed prefix,
+		// so forged or corrupted seq can't grow bitmap and reorder ring. Senders clamp to it
+		static constexpr size_t MAX_WINDOW = 4096;
+		// NAME, SIZE, HASH and STOP around DATA
+		static constexpr size_t CONTROL_CHUNKS = 4;
+
 		std::string fileName = "";
 		size_t totalSize = 0;
 
 		size_t receivedBytes = 0; // To check if we were successful
 
-		std::map<size_t, Chunk> chunks; // <sequence number, chunk>
+		// Receiver: received file is written here, prefix of its name
+		std::string outputPath = "";
+
+		std::map<size_t, Chunk> chunks; // <sequence number, chunk> of sender, when streaming only control chunks
 		size_t currentSequence = 0;
 
-		std::array<uint8_t, 32> hash;
+		FileDigest hash{};
+		uint32_t hashAlgorithm = HASH_SHA256; // tag, see FileHasher
+		ChecksumPolicy checksumPolicy = ChecksumPolicy::Crc32; // of DATA, announced in NAME
 
 		bool stopReceived = false;
 
-		bool SetFromFile(const std::string& path);
+		// Sender: random id of this transfer in every header, new one for every file.
+		// Receiver: only informative, sessions are told apart by caller (see server mode)
+		uint32_t sessionId = 0;
+
+		// Latency histograms of this transfer. Sender loops record RTT and delivery,
+		// receiver records reorder residency in AdvanceHash
+		TransferLatency latency;
+
+		// Streaming maps the file and builds DATA chunks on demand, otherwise whole file is preloaded.
+		// Hash trailer sends HASH after DATA, file is hashed while it is being sent
+		bool SetFromFile(const std::string& path, bool streaming = true, bool hashTrailer = false,
+			uint32_t hashAlgorithm = HASH_SHA256, ChecksumPolicy checksumPolicy = ChecksumPolicy::Crc32);
+
+		// Number of chunks to send, control chunks included
+		size_t ChunkCount() const { return currentSequence; }
+
+		// Chunk with given sequence number. When streaming, DATA chunks are built here
+		// and stay valid at least until STREAM_RING_CHUNKS other chunks are requested.
+		const Chunk& GetChunk(size_t seq);
+		// Merkle leaves for receiver repairing the file
+		const Chunk& GetLeafChunk(size_t firstLeaf);
+		// File bytes in chunk with this sequence (0 for control chunks), chunk is not built
+		size_t DataBytes(size_t seq) const;
 
-		bool ParseChunkData();
-		bool SaveToFile(bool& hashOk, const std::string& path = "");
+		// Receiver: chunk with this sequence was already accepted
+		bool HasChunk(size_t seq) const;
+		// Receiver: seq (and offset of DATA) can belong to this transfer, other chunks are dropped
+		bool InSequence(const Chunk& chunk) const;
+		// Receiver: takes valid chunk, DATA go straight to disk. Chunk ahead of hashed
+		// prefix is swapped into reorder ring, caller gets spare buffer back in it
+		bool AcceptChunk(Chunk& chunk);
+		// Receiver: reorder ring for at least this many chunks ahead, so it does not grow
+		// on the packet path when chunks come out of order (e.g. from several validators)
+		void ReserveReorder(size_t chunks);
+		bool SaveToFile(bool& hashOk);
+		bool HashMatches() const;
 
-		bool IsReceived()
+		bool IsReceived() const
 		{
-			return stopReceived && chunks.rbegin()->first == chunks.size() - 1;
+			return stopReceived && receivedCount == stopSeq + 1 && !repairing;
 		}
 
+		// Receiver repair (Merkle only): get leaves of sender, reopen blocks which differ,
+		// receive their chunks again. IsReceived() is false until reopened blocks are back
+		bool BeginRepair();
+		bool IsRepairing() const { return repairing; }
+		size_t MissingLeaf() const; // NO_LEAF when we have all
+		bool ReopenCorruptBlocks();
+		void MissingSequences(std::vector<uint32_t>& out, size_t max) const;
+
 
 	private:
+		// New chunk with current sequence in the session, filled by PacketBuilder
+		Chunk& EmplaceChunk();
+
 		void CreateNameChunk();
 		void CreateSizeChunk();
-		void CreateHashChunk(std::ifstream& file);
+		void CreateHashChunk();
 		void CreateStopChunk();
+
+		// DATA chunk with seq built straight from mapped file. Workers pass their own view,
+		// different chunks can be built at once. Payload is not hashed here, see HashBuilt
+		bool BuildDataChunk(size_t seq, Chunk& out, FileView* view = nullptr);
+		void HashBuilt(const Chunk& chunk);
+		bool BuildHashChunk(size_t seq, Chunk& out);
+		bool FinishFileHash();
+
+		bool HashReset();
+
+		FileSource source;
+		bool streaming = false;
+
+		size_t firstDataSeq = 0;
+		size_t dataChunkCount = 0;
+
+		bool hashTrailer = false;
+		size_t hashSeq = 0;
+
+		std::vector<Chunk> streamRing;
+
+		// Parallel preparation of DATA chunks, as tasks on scheduler shared by all sessions
+		bool StartPreparePool();
+		bool PrepareAll();
+		void PrepareAhead(size_t next);
+		void WaitPrepared(size_t seq);
+		void DispatchPrepare(size_t count);
+		static void PrepareTask(TaskScheduler::Task& task, size_t worker);
+
+		TaskScheduler* prepareScheduler = nullptr;
+		std::vector<TaskScheduler::Task> prepareTasks; // one per PREPARE_TASK_CHUNKS of job
+		std::vector<FileView> prepareViews; // one per worker
+		size_t prepareBegin = 0;  // first seq of last job
+		size_t prepareCount = 0;  // chunks in last job
+		size_t preparedEnd = 0;   // streaming: DATA below this seq are built or being built
+
+		// Receiver state
+		bool ParseControlChunk(const Chunk& chunk);
+		bool OpenSink();
+		bool WriteData(const Chunk& chunk);
+		void CheckHashAlgorithm();
+
+		void ClearChunk(size_t seq);
+
+		std::vector<uint64_t> receivedSeqs; // bitset of accepted sequences
+		size_t receivedCount = 0;
+		size_t stopSeq = 0;
+
+		bool nameReceived = false;
+		bool sizeReceived = false;
+		bool hashReceived = false;
+		uint32_t hashReceivedAlgorithm = 0; // checked against NAME, HASH may come first
+
+		FileSink sink;
+		std::vector<Chunk> pendingData; // DATA that came before NAME and SIZE
+
+		// Running hash of contiguous prefix, digest is done once last chunk is in.
+		// Sender uses same hasher for DATA built in order
+		void HoldChunk(Chunk& chunk);
+		bool HashPrefix(const Chunk& chunk);
+		void AdvanceHash();
+
+		FileHasher hasher;
+		FileDigest computedHash{};
+		size_t hashedSeq = 0;     // receiver: every chunk below this is in hash
+		uint64_t hashedBytes = 0; // = offset of next expected DATA
+		bool hashFinished = false;
+		bool hashBroken = false;
+
+		std::vector<Chunk> reorderRing; // index seq & (size - 1), power of two
+
+		Chunk leafChunk; // sender: answer to LEAF request
+
+		// Receiver repair
+		bool AcceptLeafChunk(const Chunk& chunk);
+		void RepairChunkArrived(const Chunk& chunk);
+		bool RehashBlock(size_t block);
+
+		bool dataSeen = false;
+		bool repairing = false;
+		bool reopened = false;
+		int repairRounds = 0;
+		std::vector<Sha256::Digest> senderLeaves;
+		std::vector<bool> senderLeafKnown;
+		std::vector<uint32_t> blockMissing; // per block, chunks still missing after reopen
+		size_t blocksInRepair = 0;
+
+		// Last, so its tasks are waited for before anything they write to is destroyed
+		TaskScheduler::Group prepareGroup;
 	};
 }
\ No newline at end of file
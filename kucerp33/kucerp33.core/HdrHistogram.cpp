@@ -0,0 +1,123 @@
+#include "HdrHistogram.h"
+
+#include <cmath>
+#include <algorithm>
+
+using namespace UDP;
+
+/// <summary>
+/// Sub-buckets per power of two are the smallest power of two keeping the precision,
+/// buckets are added until highest fits. Values below sub-bucket count are exact.
+/// </summary>
+/// <param name="highest">larger values are recorded as this</param>
+/// <param name="significantDigits">1..4, 2 = 1 % error</param>
+HdrHistogram::HdrHistogram(uint64_t highest, int significantDigits)
+{
+	significantDigits = (std::clamp)(significantDigits, 1, 4);
+
+	uint64_t largestExact = 2;
+	for (int i = 0; i < significantDigits; ++i) largestExact *= 10;
+
+	int subBucketCountMagnitude = std::bit_width(largestExact - 1);
+	mSubBucketHalfCountMagnitude = subBucketCountMagnitude - 1;
+	mSubBucketHalfCount = size_t(1) << mSubBucketHalfCountMagnitude;
+	mSubBucketMask = (uint64_t(1) << subBucketCountMagnitude) - 1;
+	mHighest = (std::max)(highest, mSubBucketMask);
+
+	// First bucket covers [0, sub-bucket count), every next one doubles the range
+	size_t buckets = 1;
+	uint64_t smallestUntrackable = uint64_t(1) << subBucketCountMagnitude;
+	while (smallestUntrackable <= mHighest && smallestUntrackable < (uint64_t(1) << 62))
+	{
+		smallestUntrackable <<= 1;
+		++buckets;
+	}
+	if (smallestUntrackable <= mHighest) mHighest = smallestUntrackable - 1;
+
+	mCounts.assign((buckets + 1) << mSubBucketHalfCountMagnitude, 0);
+}
+
+void HdrHistogram::Reset()
+{
+	std::fill(mCounts.begin(), mCounts.end(), 0);
+	mTotal = 0;
+	mSum = 0;
+	mMin = UINT64_MAX;
+	mMax = 0;
+}
+
+/// <summary>
+/// Merges counts of other histogram, e.g. of several transfers
+/// </summary>
+/// <param name="other"></param>
+/// <returns>false if layouts differ, nothing is added then</returns>
+bool HdrHistogram::Add(const HdrHistogram& other)
+{
+	if (other.mCounts.size() != mCounts.size() || other.mSubBucketMask != mSubBucketMask) return false;
+
+	for (size_t i = 0; i < mCounts.size(); ++i) mCounts[i] += other.mCounts[i];
+	mTotal += other.mTotal;
+	mSum += other.mSum;
+	mMin = (std::min)(mMin, other.mMin);
+	mMax = (std::max)(mMax, other.mMax);
+	return true;
+}
+
+uint64_t HdrHistogram::ValueAtIndex(size_t index) const
+{
+	int bucket = static_cast<int>(index >> mSubBucketHalfCountMagnitude) - 1;
+	uint64_t subBucket = (index & (mSubBucketHalfCount - 1)) + mSubBucketHalfCount;
+	if (bucket < 0)
+	{
+		subBucket -= mSubBucketHalfCount;
+		bucket = 0;
+	}
+	return subBucket << bucket;
+}
+
+uint64_t HdrHistogram::HighestEquivalent(uint64_t value) const
+{
+	int bucket = std::bit_width(value | mSubBucketMask) - mSubBucketHalfCountMagnitude - 1;
+	uint64_t lowest = (value >> bucket) << bucket;
+	return lowest + (uint64_t(1) << bucket) - 1;
+}
+
+/// <summary>
+/// Walks counts until percentile of recorded values is reached.
+/// Result is within precision of the histogram and never above recorded maximum.
+/// </summary>
+/// <param name="percentile">0..100</param>
+/// <returns></returns>
+uint64_t HdrHistogram::ValueAtPercentile(double percentile) const
+{
+	if (mTotal == 0) return 0;
+
+	percentile = (std::clamp)(percentile, 0.0, 100.0);
+	uint64_t target = static_cast<uint64_t>(std::ceil(percentile / 100.0 * static_cast<double>(mTotal)));
+	target = (std::max<uint64_t>)(target, 1);
+
+	uint64_t running = 0;
+	for (size_t i = 0; i < mCounts.size(); ++i)
+	{
+		running += mCounts[i];
+		if (running >= target) return (std::min)(HighestEquivalent(ValueAtIndex(i)), mMax);
+	}
+	return mMax;
+}
+
+void HdrHistogram::Print(std::ostream& out, const char* label) const
+{
+	out << label << ": n=" << mTotal;
+	if (mTotal == 0)
+	{
+		out << "\n";
+		return;
+	}
+
+	out << " p50=" << ValueAtPercentile(50.0)
+		<< " p90=" << ValueAtPercentile(90.0)
+		<< " p99=" << ValueAtPercentile(99.0)
+		<< " p99.9=" << ValueAtPercentile(99.9)
+		<< " max=" << mMax
+		<< " mean=" << static_cast<uint64_t>(Mean() + 0.5) << "\n";
+}
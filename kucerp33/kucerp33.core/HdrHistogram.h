@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <ostream>
+#include <bit>
+
+namespace UDP
+{
+	/// <summary>
+	/// High dynamic range histogram of non-negative integers (we record microseconds).
+	/// Values are kept with fixed number of significant digits from 1 up to highest:
+	/// every power of two range has the same number of linear sub-buckets.
+	/// Counts are allocated by constructor, Record is a few shifts and one add and never allocates.
+	/// Not thread-safe, one transfer records from one thread.
+	/// </summary>
+	class HdrHistogram
+	{
+	public:
+		// One minute in microseconds, larger values are counted as this
+		static constexpr uint64_t DEFAULT_HIGHEST = 60ull * 1000 * 1000;
+
+		// Relative precision is 10^-significantDigits (1..4)
+		explicit HdrHistogram(uint64_t highest = DEFAULT_HIGHEST, int significantDigits = 2);
+
+		void Record(uint64_t value)
+		{
+			if (value > mHighest) value = mHighest;
+			++mCounts[CountsIndex(value)];
+			++mTotal;
+			mSum += value;
+			if (value < mMin) mMin = value;
+			if (value > mMax) mMax = value;
+		}
+
+		void Reset();
+		// Other histogram has to have same highest and precision
+		bool Add(const HdrHistogram& other);
+
+		uint64_t Count() const { return mTotal; }
+		uint64_t Min() const { return mTotal ? mMin : 0; }
+		uint64_t Max() const { return mMax; }
+		double Mean() const { return mTotal ? static_cast<double>(mSum) / static_cast<double>(mTotal) : 0.0; }
+		// Highest value equivalent to the value at this percentile (0..100), 0 when empty
+		uint64_t ValueAtPercentile(double percentile) const;
+
+		// One line: label n=.. p50=.. p90=.. p99=.. p99.9=.. max=..
+		void Print(std::ostream& out, const char* label) const;
+
+	private:
+		size_t CountsIndex(uint64_t value) const
+		{
+			// Bucket = power of two range above first one, sub-bucket = position inside it
+			int bucket = std::bit_width(value | mSubBucketMask) - mSubBucketHalfCountMagnitude - 1;
+			size_t subBucket = static_cast<size_t>(value >> bucket);
+			return (static_cast<size_t>(bucket + 1) << mSubBucketHalfCountMagnitude) + subBucket - mSubBucketHalfCount;
+		}
+		uint64_t ValueAtIndex(size_t index) const;
+		uint64_t HighestEquivalent(uint64_t value) const;
+
+		uint64_t mHighest = 0;
+		int mSubBucketHalfCountMagnitude = 0;
+		size_t mSubBucketHalfCount = 0;
+		uint64_t mSubBucketMask = 0;
+
+		std::vector<uint64_t> mCounts;
+		uint64_t mTotal = 0;
+		uint64_t mSum = 0;
+		uint64_t mMin = UINT64_MAX;
+		uint64_t mMax = 0;
+	};
+
+	// Latencies of one transfer in microseconds, see FileSession::latency
+	struct TransferLatency
+	{
+		HdrHistogram rtt;      // sender: send to ACK of packets sent once
+		HdrHistogram delivery; // sender: first send to ACK, retransmits included
+		HdrHistogram reorder;  // receiver: time chunk waited in reorder ring for the gap before it
+
+		// Sender, RTT 0 = unknown (packet was sent more than once)
+		void AckReceived(uint64_t rttUs, uint64_t deliveryUs)
+		{
+			if (rttUs) rtt.Record(rttUs);
+			delivery.Record(deliveryUs);
+		}
+	};
+}
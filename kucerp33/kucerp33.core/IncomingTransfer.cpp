@@ -0,0 +1,139 @@
+#include "IncomingTransfer.h"
+#include "SmartDebug.h"
+#include "Log.h"
+
+#include <vector>
+
+using namespace UDP;
+
+/// <summary>
+/// Asks sender for what the repair of corrupted Merkle blocks still needs:
+/// leaf hashes first, then chunks of blocks which differ.
+/// </summary>
+/// <returns>false if file can't be repaired</returns>
+bool IncomingTransfer::DriveRepair()
+{
+	size_t leaf = session.MissingLeaf();
+	if (leaf != FileSession::NO_LEAF)
+	{
+		return ackSender->SendLeafRequest(static_cast<uint32_t>(leaf), session.sessionId);
+	}
+
+	if (!session.ReopenCorruptBlocks()) return false;
+
+	std::vector<uint32_t> missing;
+	session.MissingSequences(missing, MAX_REPAIR_NACKS);
+	for (uint32_t seq : missing)
+	{
+		ackSender->SendAckOrNack(false, seq, session.sessionId);
+	}
+
+	return true;
+}
+
+IncomingTransfer::~IncomingTransfer()
+{
+	// Abandoned before finish
+	if (metrics) Metrics::Close(*metrics);
+}
+
+/// <summary>
+/// Saves (or throws away) the file and tells sender the verdict
+/// </summary>
+void IncomingTransfer::Finish()
+{
+	finished = true;
+
+	if (metrics) Metrics::Close(*metrics);
+	metrics = nullptr;
+
+	std::cout << "Receiver: File is complete, saving file..." << "\n";
+	session.latency.reorder.Print(std::cout, "Receiver: Reorder residency [us]");
+
+	if (!session.SaveToFile(hashOk))
+	{
+		std::cerr << "Receiver: File could not be saved!\n";
+	}
+
+	ackSender->SendFileAckOrNack(hashOk, session.sessionId);
+}
+
+/// <summary>
+/// Puts valid packet into the session. Duplicates and chunks out of sequence are skipped,
+/// DATA are written to disk right away, so packet can go back to pool
+/// </summary>
+/// <param name="data"></param>
+/// <returns>false if chunk could not be parsed</returns>
+bool IncomingTransfer::TakePacket(Chunk& data)
+{
+	if (!metrics && !finished) metrics = &Metrics::Open(data.session, TransferMetrics::Direction::Receive);
+	Stats().PacketReceived(data.packetSize);
+
+	if (session.HasChunk(data.seq))
+	{
+		Stats().Duplicate();
+		return true;
+	}
+
+	// Forged or corrupted header, it would grow the bitmap and reorder ring of session
+	if (!session.InSequence(data))
+	{
+		LOG_EVENT(LogEvent::ChunkOutOfSequence, data.seq);
+		return true;
+	}
+
+	PacketHeader header = data.Header();
+	LOG_EVENT(LogEvent::ChunkReceived, header.crc, header.seq, header.command, header.offset, header.session);
+
+	// Chunk may be swapped for spare buffer by AcceptChunk
+	size_t fileBytes = data.FileBytes();
+	if (!session.AcceptChunk(data))
+	{
+		std::cerr << "Receiver: Chunk data could not be parsed!\n";
+		return false;
+	}
+	Stats().Delivered(fileBytes);
+
+	// Leaves came, ask for next ones or for corrupted blocks
+	if (data.command == Command::Leaf && session.IsRepairing() && !DriveRepair())
+	{
+		Finish();
+	}
+	return true;
+}
+
+/// <summary>
+/// Once we got everything, hash decides: file is saved, or repair of corrupted blocks starts
+/// </summary>
+void IncomingTransfer::CheckComplete()
+{
+	if (!session.IsReceived() || finished) return;
+
+	if (!session.HashMatches() && session.BeginRepair())
+	{
+		std::cout << "Receiver: Hash mismatch, asking sender which blocks are corrupted..." << "\n";
+		if (!DriveRepair()) Finish();
+	}
+	else
+	{
+		Finish();
+	}
+}
+
+/// <summary>
+/// No packet came within timeout. Repair requests or their answers could have been lost,
+/// after finish the verdict is repeated, it could get lost too
+/// </summary>
+/// <returns>false once we waited long enough after finish</returns>
+bool IncomingTransfer::Idle()
+{
+	if (!finished && session.IsRepairing() && !DriveRepair())
+	{
+		Finish();
+	}
+
+	if (!finished) return true;
+
+	ackSender->SendFileAckOrNack(hashOk, session.sessionId);
+	return ++idle <= MAX_IDLE_AFTER_FINISH;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <optional>
+#include <functional>
+
+#include "UDPCommunication.h"
+#include "FileTransfer.h"
+#include "Metrics.h"
+
+namespace UDP
+{
+	/// <summary>
+	/// One file being received and what the receiver knows about it: chunks go into the session
+	/// (hash, disk), repair of corrupted blocks is driven and sender gets the verdict.
+	/// Used by threaded receiver (ReceivePipeline) and by AsyncReceiver alike.
+	/// </summary>
+	struct IncomingTransfer
+	{
+		// Waiting after verdict, it is repeated on every timeout in case it got lost
+		static constexpr uint32_t MAX_IDLE_AFTER_FINISH = 10;
+		// Not to flood the sender, rest of repair is asked on next timeout
+		static constexpr size_t MAX_REPAIR_NACKS = 64;
+
+		FileSession session;
+
+		// Repair requests and verdict go to this peer, ACKs may go through other sockets
+		std::optional<Sender> ackSender;
+		std::string ackIp;
+
+		bool finished = false;
+		bool hashOk = false;
+		uint32_t idle = 0;       // timeouts without packet
+		uint64_t lastPacket = 0; // server mode, microseconds
+
+		// Opened by first packet, closed by Finish; later packets count only into process totals
+		TransferMetrics* metrics = nullptr;
+
+		IncomingTransfer() = default;
+		~IncomingTransfer();
+
+		IncomingTransfer(const IncomingTransfer&) = delete;
+		IncomingTransfer& operator=(const IncomingTransfer&) = delete;
+
+		// Puts valid packet into the session, duplicates are skipped. False if chunk could not be parsed
+		bool TakePacket(Chunk& data);
+		// Once we got everything, hash decides: file is saved, or repair starts
+		void CheckComplete();
+		// No packet within timeout, false once we waited long enough after finish
+		bool Idle();
+		// Saves (or throws away) the file and tells sender the verdict
+		void Finish();
+
+	private:
+		bool DriveRepair();
+		TransferMetrics& Stats() { return metrics ? *metrics : Metrics::Process(); }
+	};
+
+	// Server mode: transfer is identified by peer address and session id from header
+	struct TransferKey
+	{
+		std::string ip;
+		uint16_t port = 0;
+		uint32_t session = 0;
+
+		bool operator==(const TransferKey& other) const = default;
+	};
+
+	struct TransferKeyHash
+	{
+		size_t operator()(const TransferKey& key) const
+		{
+			size_t hash = std::hash<std::string>{}(key.ip);
+			size_t rest = std::hash<uint64_t>{}((static_cast<uint64_t>(key.port) << 32) | key.session);
+			return hash ^ (rest + 0x9E3779B9 + (hash << 6) + (hash >> 2));
+		}
+	};
+}
@@ -0,0 +1,219 @@
+#include "Log.h"
+#include "SpscRing.h"
+#include "PacketHeader.h"
+#include "SmartDebug.h"
+
+#include <mutex>
+#include <fstream>
+#include <iostream>
+#include <charconv>
+#include <cstring>
+#include <string_view>
+
+using namespace UDP;
+
+std::atomic<bool> Log::sEnabled{ false };
+
+struct LogState
+{
+	~LogState() { Log::Stop(); }
+
+	ThreadRingPool<LogRecord> rings;
+
+	std::ofstream file;
+	LogLevel consoleLevel = LogLevel::Info;
+	std::chrono::steady_clock::time_point start;
+
+	DrainThread drain;
+	std::string line; // console text, made by Start so background thread never allocates
+	std::mutex lifecycle; // Start/Stop
+};
+
+static LogState gLog;
+
+static void Drain();
+
+/// ------------------------------------------------------------------------------------------------
+/// WRITING
+/// ------------------------------------------------------------------------------------------------
+
+/// <summary>
+/// Record goes to ring of calling thread, first record of the thread claims one
+/// </summary>
+/// <param name="record"></param>
+void Log::Push(LogRecord& record)
+{
+	ThreadRingPool<LogRecord>::Ring* ring = gLog.rings.Mine();
+	if (!ring) return;
+
+	record.time = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - gLog.start).count());
+	record.thread = ring->index;
+	ring->Push(record);
+}
+
+void Log::WriteBytes(LogEvent event, const void* data, size_t size)
+{
+	if (!Enabled()) return;
+
+	LogRecord record;
+	record.event = static_cast<uint16_t>(event);
+	record.count = static_cast<uint8_t>((std::min)(size, sizeof(record.args)));
+	std::memcpy(record.args, data, record.count);
+	Push(record);
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// START / STOP
+/// ------------------------------------------------------------------------------------------------
+
+/// <summary>
+/// Opens the file, writes its header and starts background thread
+/// </summary>
+/// <param name="path">empty = only console</param>
+/// <param name="consoleLevel">records from this level up are also printed</param>
+/// <returns>false if file could not be opened</returns>
+bool Log::Start(const std::string& path, LogLevel consoleLevel)
+{
+	std::lock_guard<std::mutex> lock(gLog.lifecycle);
+	if (sEnabled.load()) return true;
+
+	gLog.rings.Create(MAX_THREADS, RING_RECORDS);
+
+	if (!path.empty())
+	{
+		gLog.file.open(path, std::ios::binary | std::ios::trunc);
+		if (!gLog.file)
+		{
+			ERR("Log file " << path << " could not be opened");
+			return false;
+		}
+
+		LogFileHeader header;
+		header.startUnixNs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count());
+		gLog.file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	}
+
+	gLog.consoleLevel = consoleLevel;
+	gLog.line.reserve(256);
+	gLog.start = std::chrono::steady_clock::now();
+	gLog.drain.Start(DRAIN_INTERVAL, Drain);
+
+	sEnabled = true;
+	gLog.rings.Mine();
+	return true;
+}
+
+void Log::Stop()
+{
+	std::lock_guard<std::mutex> lock(gLog.lifecycle);
+	if (!sEnabled.load()) return;
+
+	sEnabled = false;
+	gLog.drain.Stop();
+
+	if (gLog.file.is_open())
+	{
+		gLog.file.flush();
+		gLog.file.close();
+	}
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// BACKGROUND THREAD
+/// ------------------------------------------------------------------------------------------------
+
+static void Emit(const LogRecord& record, std::string& line)
+{
+	if (gLog.file.is_open()) gLog.file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+
+	if (record.event >= static_cast<uint16_t>(LogEvent::Count)) return;
+	LogLevel level = LOG_EVENTS[record.event].level;
+	if (level < gLog.consoleLevel) return;
+
+	Log::Format(record, line);
+	line += '\n';
+	(level >= LogLevel::Warning ? std::cerr : std::cout) << line;
+}
+
+/// <summary>
+/// One pass over every ring, lost records are reported as one record per ring
+/// </summary>
+static void Drain()
+{
+	gLog.rings.Drain([](const LogRecord& record) { Emit(record, gLog.line); },
+		[](uint64_t count, uint8_t ring)
+	{
+		LogRecord lost;
+		lost.event = static_cast<uint16_t>(LogEvent::RecordsDropped);
+		lost.count = 2;
+		lost.args[0] = count;
+		lost.args[1] = ring;
+		Emit(lost, gLog.line);
+	});
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// TEXT
+/// ------------------------------------------------------------------------------------------------
+
+/// <summary>
+/// Fills format of the event with arguments of the record, in order
+/// </summary>
+/// <param name="record"></param>
+/// <param name="out"></param>
+void Log::Format(const LogRecord& record, std::string& out)
+{
+	out.clear();
+	char number[24];
+
+	if (record.event >= static_cast<uint16_t>(LogEvent::Count))
+	{
+		out += "Unknown event ";
+		out.append(number, std::to_chars(number, number + sizeof(number), record.event).ptr);
+		return;
+	}
+
+	const char* format = LOG_EVENTS[record.event].format;
+	size_t arg = 0;
+
+	while (*format)
+	{
+		const char* end = *format == '{' ? std::strchr(format, '}') : nullptr;
+		if (!end)
+		{
+			out += *format++;
+			continue;
+		}
+
+		std::string_view spec(format + 1, end - format - 1);
+		format = end + 1;
+
+		if (spec == "bytes")
+		{
+			out.append(reinterpret_cast<const char*>(record.args), (std::min<size_t>)(record.count, sizeof(record.args)));
+			continue;
+		}
+
+		uint64_t value = arg < LogRecord::ARGS ? record.args[arg] : 0;
+		++arg;
+
+		if (spec == "x8")
+		{
+			char* last = std::to_chars(number, number + sizeof(number), value, 16).ptr;
+			for (ptrdiff_t pad = 8 - (last - number); pad > 0; --pad) out += '0';
+			out.append(number, last);
+		}
+		else if (spec == "tag")
+		{
+			char tag[5];
+			TagToChars(static_cast<uint32_t>(value), tag);
+			out += tag;
+		}
+		else
+		{
+			out.append(number, std::to_chars(number, number + sizeof(number), value).ptr);
+		}
+	}
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <atomic>
+
+// Events below this level are compiled out (arguments are not even evaluated).
+// 0 = trace, 1 = debug (per packet), 2 = info, 3 = warning, 4 = error
+#ifndef KUCERP33_LOG_LEVEL
+#define KUCERP33_LOG_LEVEL 1
+#endif
+
+// Binary record of event into ring of calling thread, text is made later by background thread
+// (console) or by "logdump" tool (file). Arguments are integers, see format of the event
+#define LOG_EVENT(event, ...) \
+	do { \
+		if constexpr (static_cast<int>(::UDP::LOG_EVENTS[static_cast<size_t>(event)].level) >= KUCERP33_LOG_LEVEL) \
+			::UDP::Log::Write(event, __VA_ARGS__); \
+	} while (0)
+
+#define LOG_BYTES(event, data, size) \
+	do { \
+		if constexpr (static_cast<int>(::UDP::LOG_EVENTS[static_cast<size_t>(event)].level) >= KUCERP33_LOG_LEVEL) \
+			::UDP::Log::WriteBytes(event, data, size); \
+	} while (0)
+
+namespace UDP
+{
+	enum class LogLevel : uint8_t
+	{
+		Trace,
+		Debug,
+		Info,
+		Warning,
+		Error
+	};
+
+	enum class LogEvent : uint16_t
+	{
+		ChunkSent,
+		ChunkReceived,
+		ControlSent,
+		PacketSent,
+		AckReceived,
+		NackResend,
+		TimeoutResend,
+		StopAndWaitTimeout,
+		StopAndWaitNack,
+		AckOutOfRange,
+		RepairResend,
+		CrcMismatch,
+		RecordsDropped,
+		ChunkOutOfSequence,
+		Count
+	};
+
+	// Format: {u} decimal, {x8} 8 hex digits, {tag} command tag, {bytes} whole payload as text
+	struct LogEventInfo
+	{
+		LogLevel level;
+		const char* format;
+	};
+
+	// Indexed by LogEvent, same text as was printed before
+	inline constexpr LogEventInfo LOG_EVENTS[] =
+	{
+		{ LogLevel::Debug,   "Chunk: CRC=0x{x8} SEQ={u} CMD={tag} OFFSET={u} SESSION=0x{x8}" },
+		{ LogLevel::Debug,   "Chunk: CRC=0x{x8} SEQ={u} CMD={tag} OFFSET={u} SESSION=0x{x8}" },
+		{ LogLevel::Debug,   "Sending message: \"{bytes}\"" },
+		{ LogLevel::Debug,   "Sender: Sent packet with sequence {u}" },
+		{ LogLevel::Debug,   "Sender: ACK received for seq={u}" },
+		{ LogLevel::Info,    "Sender: NACK for seq={u}, sending again" },
+		{ LogLevel::Info,    "Sender: Timeout for seq={u}, sending again" },
+		{ LogLevel::Info,    "Timeout, sending again seq={u}" },
+		{ LogLevel::Info,    "NACK, sending again seq={u}" },
+		{ LogLevel::Warning, "Sender: ACK/NACK for out-of-range seq={u} ignored." },
+		{ LogLevel::Info,    "Sender: Repair of seq={u}" },
+		{ LogLevel::Warning, "Receiver: CRC mismatch (seq={u}, offset={u})" },
+		{ LogLevel::Warning, "Log: {u} records dropped, ring of thread {u} was full" },
+		{ LogLevel::Warning, "Receiver: Chunk (seq={u}) does not belong to the transfer, dropped" },
+	};
+	static_assert(sizeof(LOG_EVENTS) / sizeof(LOG_EVENTS[0]) == static_cast<size_t>(LogEvent::Count), "Every event needs its format");
+
+	// One cache line per record
+	struct LogRecord
+	{
+		static constexpr size_t ARGS = 6;
+
+		uint64_t time = 0;   // nanoseconds since Log::Start
+		uint16_t event = 0;
+		uint8_t thread = 0;  // ring index
+		uint8_t count = 0;   // arguments, bytes for LOG_BYTES
+		uint32_t reserved = 0;
+		uint64_t args[ARGS] = {};
+	};
+	static_assert(sizeof(LogRecord) == 64, "Log record must stay one cache line");
+
+	// File: header, then records in the order they were drained (per thread in time order)
+	struct LogFileHeader
+	{
+		static constexpr uint32_t MAGIC = 0x474F4C4B; // "KLOG"
+		static constexpr uint32_t VERSION = 1;
+
+		uint32_t magic = MAGIC;
+		uint32_t version = VERSION;
+		uint32_t recordSize = sizeof(LogRecord);
+		uint32_t reserved = 0;
+		uint64_t startUnixNs = 0; // wall clock at Log::Start
+	};
+
+	/// <summary>
+	/// Asynchronous binary log. Every thread writes fixed-size records into its own lock-free ring
+	/// (claimed from a pool made by Start, given back when the thread ends, so writing never allocates),
+	/// background thread drains them into file and prints those at console level or above. Ring full = record dropped and counted.
+	/// </summary>
+	class Log
+	{
+	public:
+		// Rings made by Start, threads beyond that lose their records
+		static constexpr size_t MAX_THREADS = 32;
+		static constexpr size_t RING_RECORDS = 2048;
+		// How often background thread drains rings, microseconds
+		static constexpr uint64_t DRAIN_INTERVAL = 10 * 1000;
+
+		// Empty path = console only. Calling thread gets its ring right away
+		static bool Start(const std::string& path, LogLevel consoleLevel = LogLevel::Info);
+		// Everything written so far is drained, file is closed
+		static void Stop();
+		static bool Enabled() { return sEnabled.load(std::memory_order_relaxed); }
+
+		template <typename... Args>
+		static void Write(LogEvent event, Args... args)
+		{
+			static_assert(sizeof...(Args) <= LogRecord::ARGS, "Too many log arguments");
+			if (!Enabled()) return;
+
+			LogRecord record;
+			record.event = static_cast<uint16_t>(event);
+			record.count = static_cast<uint8_t>(sizeof...(Args));
+			size_t i = 0;
+			((record.args[i++] = static_cast<uint64_t>(args)), ...);
+			Push(record);
+		}
+
+		// Up to sizeof(LogRecord::args) bytes, rest is cut off
+		static void WriteBytes(LogEvent event, const void* data, size_t size);
+
+		// Text of record, as it was printed before. Reuses out, so it does not allocate once warm
+		static void Format(const LogRecord& record, std::string& out);
+
+	private:
+		static void Push(LogRecord& record);
+
+		static std::atomic<bool> sEnabled;
+	};
+}
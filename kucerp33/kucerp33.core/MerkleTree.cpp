@@ -0,0 +1,184 @@
+#include "MerkleTree.h"
+#include "TaskScheduler.h"
+
+#include <algorithm>
+
+using namespace UDP;
+
+// Below this many blocks a task costs more than it saves
+static constexpr size_t MIN_BLOCKS_PER_TASK = 8;
+
+// Whole blocks of one HashBlocks call, task.index is first block of its range
+struct BlockJob
+{
+	const uint8_t* const* pointers = nullptr;
+	const size_t* lengths = nullptr;
+	MerkleTree::Digest* leaves = nullptr;
+	size_t blocks = 0;
+	size_t perTask = 0;
+};
+
+static void HashBlockRange(const BlockJob& job, size_t begin)
+{
+	size_t count = (std::min)(job.perTask, job.blocks - begin);
+	Sha256::HashMany(job.pointers + begin, job.lengths + begin, count, job.leaves + begin);
+}
+
+static void HashBlocksTask(TaskScheduler::Task& task, size_t)
+{
+	HashBlockRange(*static_cast<const BlockJob*>(task.context), task.index);
+}
+
+void MerkleTree::Reset(uint64_t blockSize, uint64_t totalSize)
+{
+	mBlockSize = blockSize;
+	mCurrent.Init();
+	mCurrentFill = 0;
+	mLeaves.clear();
+	mLeaves.reserve(LeafCountFor(blockSize, totalSize));
+	mScratch.reserve(LeafCountFor(blockSize, totalSize));
+}
+
+/// <summary>
+/// Adds data in file order. Partial block goes through running hash,
+/// whole blocks at block boundary are hashed straight from input (in parallel when there is many).
+/// </summary>
+/// <param name="data"></param>
+/// <param name="length"></param>
+void MerkleTree::Update(const uint8_t* data, size_t length)
+{
+	while (length > 0)
+	{
+		if (mCurrentFill == 0 && length >= mBlockSize)
+		{
+			size_t blocks = static_cast<size_t>(length / mBlockSize);
+			HashBlocks(data, blocks);
+
+			data += blocks * mBlockSize;
+			length -= static_cast<size_t>(blocks * mBlockSize);
+			continue;
+		}
+
+		size_t take = static_cast<size_t>((std::min<uint64_t>)(length, mBlockSize - mCurrentFill));
+		mCurrent.Update(data, take);
+		mCurrentFill += take;
+		data += take;
+		length -= take;
+
+		if (mCurrentFill == mBlockSize)
+		{
+			mLeaves.push_back(mCurrent.Finish());
+			mCurrent.Init();
+			mCurrentFill = 0;
+		}
+	}
+}
+
+void MerkleTree::Finish()
+{
+	if (mCurrentFill > 0 || mLeaves.empty())
+	{
+		mLeaves.push_back(mCurrent.Finish());
+	}
+	mCurrent.Init();
+	mCurrentFill = 0;
+}
+
+/// <summary>
+/// Hashes whole blocks, leaves are independent so work is split into ranges. Ranges run as
+/// tasks on the scheduler shared by all transfers, calling thread hashes the first one itself.
+/// Every range is hashed with Sha256::HashMany
+/// </summary>
+/// <param name="data"></param>
+/// <param name="blocks"></param>
+void MerkleTree::HashBlocks(const uint8_t* data, size_t blocks)
+{
+	size_t first = mLeaves.size();
+	mLeaves.resize(first + blocks);
+
+	std::vector<const uint8_t*> pointers(blocks);
+	std::vector<size_t> lengths(blocks, static_cast<size_t>(mBlockSize));
+	for (size_t i = 0; i < blocks; ++i) pointers[i] = data + i * mBlockSize;
+
+	BlockJob job;
+	job.pointers = pointers.data();
+	job.lengths = lengths.data();
+	job.leaves = mLeaves.data() + first;
+	job.blocks = blocks;
+
+	TaskScheduler& scheduler = TaskScheduler::Shared();
+	size_t ranges = (std::min)(scheduler.Size() + 1, blocks / MIN_BLOCKS_PER_TASK);
+	if (ranges <= 1)
+	{
+		job.perTask = blocks;
+		HashBlockRange(job, 0);
+		return;
+	}
+
+	job.perTask = (blocks + ranges - 1) / ranges;
+	std::vector<TaskScheduler::Task> tasks((blocks - 1) / job.perTask);
+
+	// Declared last, tasks are waited for before anything they use is gone
+	TaskScheduler::Group group;
+	for (size_t i = 0; i < tasks.size(); ++i)
+	{
+		tasks[i].function = HashBlocksTask;
+		tasks[i].context = &job;
+		tasks[i].index = (i + 1) * job.perTask;
+		scheduler.Spawn(tasks[i], group);
+	}
+
+	HashBlockRange(job, 0);
+	scheduler.Wait(group);
+}
+
+void MerkleTree::SetLeaf(size_t index, const Digest& leaf)
+{
+	if (index < mLeaves.size()) mLeaves[index] = leaf;
+}
+
+MerkleTree::Digest MerkleTree::Root() const
+{
+	mScratch.assign(mLeaves.begin(), mLeaves.end());
+	return RootInPlace(mScratch.data(), mScratch.size());
+}
+
+size_t MerkleTree::LeafCountFor(uint64_t blockSize, uint64_t totalSize)
+{
+	if (blockSize == 0 || totalSize == 0) return 1;
+	return static_cast<size_t>((totalSize + blockSize - 1) / blockSize);
+}
+
+MerkleTree::Digest MerkleTree::RootOf(const Digest* leaves, size_t count)
+{
+	std::vector<Digest> level(leaves, leaves + count);
+	return RootInPlace(level.data(), level.size());
+}
+
+/// <summary>
+/// Root from leaves, level by level. Parent i is written over node i,
+/// its children 2i and 2i+1 were already read.
+/// </summary>
+/// <param name="level"></param>
+/// <param name="count"></param>
+/// <returns></returns>
+MerkleTree::Digest MerkleTree::RootInPlace(Digest* level, size_t count)
+{
+	if (count == 0) return Sha256::Hash(nullptr, 0);
+
+	while (count > 1)
+	{
+		size_t pairCount = count / 2;
+		for (size_t i = 0; i < pairCount; ++i)
+		{
+			level[i] = Sha256::Hash(level[2 * i].data(), 2 * Sha256::DIGEST_SIZE);
+		}
+
+		// Odd one goes up as it is
+		if (count % 2) level[pairCount] = level[count - 1];
+
+		count = pairCount + count % 2;
+	}
+
+	return level[0];
+}
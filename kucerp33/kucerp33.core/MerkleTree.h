@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "Sha256.h"
+
+namespace UDP
+{
+	/// <summary>
+	/// SHA-256 Merkle tree over fixed-size blocks of a file.
+	/// Leaf = SHA-256(block), node = SHA-256(left | right), odd node is carried one level up.
+	/// Block size is fixed for the whole transfer, so leaf and node inputs can't be mixed up.
+	/// Data is fed in file order; large inputs are hashed block-parallel as tasks on TaskScheduler::Shared().
+	/// </summary>
+	class MerkleTree
+	{
+	public:
+		using Digest = Sha256::Digest;
+
+		// Empty tree for file of totalSize bytes, leaves are reserved so Update does not allocate
+		void Reset(uint64_t blockSize, uint64_t totalSize);
+
+		void Update(const uint8_t* data, size_t length);
+		// Closes last (partial) block. Empty file has one leaf = hash of nothing
+		void Finish();
+
+		uint64_t BlockSize() const { return mBlockSize; }
+		size_t LeafCount() const { return mLeaves.size(); }
+		const std::vector<Digest>& Leaves() const { return mLeaves; }
+
+		// Leaf rehashed after repair of its block
+		void SetLeaf(size_t index, const Digest& leaf);
+		Digest Root() const;
+
+		static size_t LeafCountFor(uint64_t blockSize, uint64_t totalSize);
+		static Digest RootOf(const Digest* leaves, size_t count);
+
+	private:
+		void HashBlocks(const uint8_t* data, size_t blocks);
+		// Level by level in place, level is overwritten
+		static Digest RootInPlace(Digest* level, size_t count);
+
+		uint64_t mBlockSize = 0;
+		Sha256 mCurrent;
+		uint64_t mCurrentFill = 0;
+		std::vector<Digest> mLeaves;
+		mutable std::vector<Digest> mScratch; // reserved like leaves, so Root() does not allocate
+	};
+}
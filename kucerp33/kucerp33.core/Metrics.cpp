@@ -0,0 +1,532 @@
+#include "Metrics.h"
+#include "SendWindow.h"
+#include "SpscRing.h"
+#include "AllocationCounter.h"
+#include "SmartDebug.h"
+
+#include <bit>
+#include <mutex>
+#include <thread>
+#include <fstream>
+#include <charconv>
+#include <filesystem>
+
+using namespace UDP;
+
+namespace
+{
+	enum SlotState : uint8_t
+	{
+		FREE,
+		CLAIMING,
+		OPEN,
+		CLOSED // exported once more, then free
+	};
+
+	struct MetricsState
+	{
+		~MetricsState() { Metrics::Stop(); }
+
+		TransferMetrics process;
+		TransferMetrics unlisted; // transfers without slot, only process totals matter
+		TransferMetrics slots[Metrics::MAX_TRANSFERS];
+
+		std::string jsonPath;
+		std::string prometheusPath;
+		uint64_t interval = Metrics::EXPORT_INTERVAL;
+
+		std::thread exporter;
+		Doorbell bell;
+		std::atomic<bool> running{ false };
+		std::atomic<bool> stop{ false };
+		std::mutex lifecycle; // Start/Stop
+	};
+
+	MetricsState gMetrics;
+
+	void AppendNumber(std::string& out, uint64_t value)
+	{
+		char number[24];
+		out.append(number, std::to_chars(number, number + sizeof(number), value).ptr);
+	}
+
+	void AppendNumber(std::string& out, double value)
+	{
+		char number[32];
+		out.append(number, std::to_chars(number, number + sizeof(number), value, std::chars_format::general, 6).ptr);
+	}
+
+	void AppendSession(std::string& out, uint32_t session)
+	{
+		char number[8];
+		char* last = std::to_chars(number, number + sizeof(number), session, 16).ptr;
+		for (ptrdiff_t pad = 8 - (last - number); pad > 0; --pad) out += '0';
+		out.append(number, last);
+	}
+
+	const char* DirectionName(TransferMetrics::Direction direction)
+	{
+		switch (direction)
+		{
+		case TransferMetrics::Direction::Send: return "send";
+		case TransferMetrics::Direction::Receive: return "receive";
+		default: return "process";
+		}
+	}
+
+	uint64_t UnixMilliseconds()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count());
+	}
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// TRANSFER METRICS
+/// ------------------------------------------------------------------------------------------------
+
+void TransferMetrics::Reset(uint32_t session, Direction direction, uint64_t nowUs)
+{
+	for (auto& counter : mCounters) counter.store(0, std::memory_order_relaxed);
+	for (auto& bucket : mRtt) bucket.store(0, std::memory_order_relaxed);
+	mRttSum.store(0, std::memory_order_relaxed);
+	mInFlight.store(0, std::memory_order_relaxed);
+	mInFlightMax.store(0, std::memory_order_relaxed);
+	mInFlightSum.store(0, std::memory_order_relaxed);
+	mWindowSamples.store(0, std::memory_order_relaxed);
+
+	mSession = session;
+	mDirection = direction;
+	mOpened = nowUs;
+	mClosed.store(0, std::memory_order_relaxed);
+}
+
+void TransferMetrics::Add(Counter counter, uint64_t value)
+{
+	AddOwn(counter, value);
+	if (mProcess) mProcess->AddOwn(counter, value);
+}
+
+void TransferMetrics::PacketSent(size_t bytes, bool again)
+{
+	Add(Counter::PacketsSent);
+	Add(Counter::BytesSent, bytes);
+	if (again) Add(Counter::PacketsResent);
+}
+
+/// <summary>
+/// ACK of packet not acked before. RTT goes to histogram of transfer and process
+/// </summary>
+/// <param name="payload">file bytes in the packet</param>
+/// <param name="rttUs">0 = packet was sent more than once, we don't know which one was acked</param>
+void TransferMetrics::AckReceived(size_t payload, uint64_t rttUs)
+{
+	Add(Counter::AcksReceived);
+	Add(Counter::PayloadBytes, payload);
+	if (rttUs == 0) return;
+
+	size_t bucket = (std::min)(static_cast<size_t>(std::bit_width(rttUs)), RTT_BUCKETS - 1);
+	for (TransferMetrics* metrics = this; metrics; metrics = metrics->mProcess)
+	{
+		metrics->mRtt[bucket].fetch_add(1, std::memory_order_relaxed);
+		metrics->mRttSum.fetch_add(rttUs, std::memory_order_relaxed);
+	}
+}
+
+void TransferMetrics::Window(size_t inFlight)
+{
+	mInFlight.store(inFlight, std::memory_order_relaxed);
+	mInFlightSum.fetch_add(inFlight, std::memory_order_relaxed);
+	mWindowSamples.fetch_add(1, std::memory_order_relaxed);
+
+	// Only the owning thread samples, plain compare is enough
+	if (inFlight > mInFlightMax.load(std::memory_order_relaxed)) mInFlightMax.store(inFlight, std::memory_order_relaxed);
+}
+
+double TransferMetrics::Goodput(uint64_t nowUs) const
+{
+	uint64_t end = mClosed.load(std::memory_order_relaxed);
+	if (end == 0) end = nowUs;
+	if (end <= mOpened) return 0.0;
+	return static_cast<double>(Get(Counter::PayloadBytes)) * 1e6 / static_cast<double>(end - mOpened);
+}
+
+/// <summary>
+/// {"session":"...","direction":"send","open":true,"packets_sent":1,...,"rtt_us":{...}}
+/// </summary>
+/// <param name="out"></param>
+/// <param name="nowUs"></param>
+void TransferMetrics::AppendJson(std::string& out, uint64_t nowUs) const
+{
+	out += "{\"session\":\"";
+	AppendSession(out, mSession);
+	out += "\",\"direction\":\"";
+	out += DirectionName(mDirection);
+	out += "\",\"open\":";
+	out += mClosed.load(std::memory_order_relaxed) == 0 ? "true" : "false";
+
+	uint64_t end = mClosed.load(std::memory_order_relaxed);
+	out += ",\"seconds\":";
+	AppendNumber(out, static_cast<double>((end ? end : nowUs) - mOpened) / 1e6);
+
+	for (size_t i = 0; i < static_cast<size_t>(Counter::Count); ++i)
+	{
+		out += ",\"";
+		out += COUNTER_NAMES[i];
+		out += "\":";
+		AppendNumber(out, mCounters[i].load(std::memory_order_relaxed));
+	}
+
+	out += ",\"goodput_bytes_per_second\":";
+	AppendNumber(out, Goodput(nowUs));
+
+	// Window belongs to one transfer, process totals have none
+	if (mDirection != Direction::Process)
+	{
+		uint64_t samples = mWindowSamples.load(std::memory_order_relaxed);
+		out += ",\"window\":{\"in_flight\":";
+		AppendNumber(out, mInFlight.load(std::memory_order_relaxed));
+		out += ",\"max\":";
+		AppendNumber(out, mInFlightMax.load(std::memory_order_relaxed));
+		out += ",\"average\":";
+		AppendNumber(out, samples ? static_cast<double>(mInFlightSum.load(std::memory_order_relaxed)) / samples : 0.0);
+		out += '}';
+	}
+
+	out += ",\"rtt_us\":{\"sum\":";
+	AppendNumber(out, mRttSum.load(std::memory_order_relaxed));
+	out += ",\"buckets\":[";
+	for (size_t i = 0; i < RTT_BUCKETS; ++i)
+	{
+		if (i) out += ',';
+		AppendNumber(out, mRtt[i].load(std::memory_order_relaxed));
+	}
+	out += "]}}";
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// REGISTRY
+/// ------------------------------------------------------------------------------------------------
+
+TransferMetrics& Metrics::Process()
+{
+	return gMetrics.process;
+}
+
+/// <summary>
+/// Free slot for the transfer. Closed slots are reused right away when nobody exports them
+/// </summary>
+/// <param name="session"></param>
+/// <param name="direction"></param>
+/// <returns>slot, or shared one which counts only into process totals</returns>
+TransferMetrics& Metrics::Open(uint32_t session, TransferMetrics::Direction direction)
+{
+	bool exporting = gMetrics.running.load(std::memory_order_acquire);
+
+	for (TransferMetrics& slot : gMetrics.slots)
+	{
+		uint8_t state = slot.mState.load(std::memory_order_relaxed);
+		if (state != FREE && (exporting || state != CLOSED)) continue;
+		if (!slot.mState.compare_exchange_strong(state, CLAIMING, std::memory_order_acquire)) continue;
+
+		slot.Reset(session, direction, NowMicroseconds());
+		slot.mProcess = &gMetrics.process;
+		slot.mState.store(OPEN, std::memory_order_release);
+		return slot;
+	}
+
+	gMetrics.unlisted.mProcess = &gMetrics.process;
+	return gMetrics.unlisted;
+}
+
+void Metrics::Close(TransferMetrics& metrics)
+{
+	if (&metrics == &gMetrics.unlisted) return;
+
+	metrics.mClosed.store(NowMicroseconds(), std::memory_order_relaxed);
+	metrics.mState.store(gMetrics.running.load(std::memory_order_acquire) ? CLOSED : FREE, std::memory_order_release);
+}
+
+void Metrics::ExportJson(std::string& out)
+{
+	uint64_t now = NowMicroseconds();
+
+	out += "{\"time_unix_ms\":";
+	AppendNumber(out, UnixMilliseconds());
+	out += ",\"process\":";
+	gMetrics.process.AppendJson(out, now);
+	out += ",\"transfers\":[";
+
+	bool first = true;
+	for (const TransferMetrics& slot : gMetrics.slots)
+	{
+		uint8_t state = slot.mState.load(std::memory_order_acquire);
+		if (state != OPEN && state != CLOSED) continue;
+
+		if (!first) out += ',';
+		first = false;
+		slot.AppendJson(out, now);
+	}
+	out += "]}\n";
+}
+
+/// <summary>
+/// Text format 0.0.4: every family once with HELP/TYPE, process totals as kucerp33_process_*,
+/// transfers as kucerp33_transfer_* labeled by session and direction
+/// </summary>
+/// <param name="out"></param>
+void Metrics::ExportPrometheus(std::string& out)
+{
+	uint64_t now = NowMicroseconds();
+
+	auto forTransfers = [](auto&& write)
+	{
+		for (const TransferMetrics& slot : gMetrics.slots)
+		{
+			uint8_t state = slot.mState.load(std::memory_order_acquire);
+			if (state == OPEN || state == CLOSED) write(slot);
+		}
+	};
+
+	auto labels = [&](const TransferMetrics& slot, const char* extra)
+	{
+		out += "{session=\"";
+		AppendSession(out, slot.mSession);
+		out += "\",direction=\"";
+		out += DirectionName(slot.mDirection);
+		out += '"';
+		if (extra)
+		{
+			out += ',';
+			out += extra;
+		}
+		out += '}';
+	};
+
+	auto family = [&](const char* scope, const char* name, const char* suffix, const char* type)
+	{
+		out += "# TYPE kucerp33_";
+		out += scope;
+		out += name;
+		out += suffix;
+		out += ' ';
+		out += type;
+		out += '\n';
+	};
+
+	for (size_t i = 0; i < static_cast<size_t>(Counter::Count); ++i)
+	{
+		family("process_", COUNTER_NAMES[i], "_total", "counter");
+		out += "kucerp33_process_";
+		out += COUNTER_NAMES[i];
+		out += "_total ";
+		AppendNumber(out, gMetrics.process.mCounters[i].load(std::memory_order_relaxed));
+		out += '\n';
+
+		family("transfer_", COUNTER_NAMES[i], "_total", "counter");
+		forTransfers([&](const TransferMetrics& slot)
+		{
+			out += "kucerp33_transfer_";
+			out += COUNTER_NAMES[i];
+			out += "_total";
+			labels(slot, nullptr);
+			out += ' ';
+			AppendNumber(out, slot.mCounters[i].load(std::memory_order_relaxed));
+			out += '\n';
+		});
+	}
+
+	family("transfer_", "goodput_bytes_per_second", "", "gauge");
+	forTransfers([&](const TransferMetrics& slot)
+	{
+		out += "kucerp33_transfer_goodput_bytes_per_second";
+		labels(slot, nullptr);
+		out += ' ';
+		AppendNumber(out, slot.Goodput(now));
+		out += '\n';
+	});
+
+	family("transfer_", "window_in_flight", "", "gauge");
+	forTransfers([&](const TransferMetrics& slot)
+	{
+		out += "kucerp33_transfer_window_in_flight";
+		labels(slot, nullptr);
+		out += ' ';
+		AppendNumber(out, slot.mInFlight.load(std::memory_order_relaxed));
+		out += '\n';
+	});
+
+	family("transfer_", "window_in_flight_max", "", "gauge");
+	forTransfers([&](const TransferMetrics& slot)
+	{
+		out += "kucerp33_transfer_window_in_flight_max";
+		labels(slot, nullptr);
+		out += ' ';
+		AppendNumber(out, slot.mInFlightMax.load(std::memory_order_relaxed));
+		out += '\n';
+	});
+
+	// Buckets are cumulative, upper bound of bucket i is 2^i microseconds
+	auto histogram = [&](const char* scope, const TransferMetrics& metrics, bool labeled)
+	{
+		uint64_t total = 0;
+		for (size_t b = 0; b < TransferMetrics::RTT_BUCKETS; ++b)
+		{
+			total += metrics.mRtt[b].load(std::memory_order_relaxed);
+
+			char le[48] = "le=\"+Inf\"";
+			if (b + 1 < TransferMetrics::RTT_BUCKETS)
+			{
+				char* end = std::to_chars(le + 4, le + sizeof(le) - 2, static_cast<double>(uint64_t(1) << b) / 1e6).ptr;
+				end[0] = '"';
+				end[1] = '\0';
+			}
+
+			out += "kucerp33_";
+			out += scope;
+			out += "rtt_seconds_bucket";
+			if (labeled)
+			{
+				labels(metrics, le);
+			}
+			else
+			{
+				out += '{';
+				out += le;
+				out += '}';
+			}
+			out += ' ';
+			AppendNumber(out, total);
+			out += '\n';
+		}
+
+		out += "kucerp33_";
+		out += scope;
+		out += "rtt_seconds_sum";
+		if (labeled) labels(metrics, nullptr);
+		out += ' ';
+		AppendNumber(out, static_cast<double>(metrics.mRttSum.load(std::memory_order_relaxed)) / 1e6);
+		out += "\nkucerp33_";
+		out += scope;
+		out += "rtt_seconds_count";
+		if (labeled) labels(metrics, nullptr);
+		out += ' ';
+		AppendNumber(out, total);
+		out += '\n';
+	};
+
+	family("process_", "rtt_seconds", "", "histogram");
+	histogram("process_", gMetrics.process, false);
+
+	family("transfer_", "rtt_seconds", "", "histogram");
+	forTransfers([&](const TransferMetrics& slot) { histogram("transfer_", slot, true); });
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// EXPORT THREAD
+/// ------------------------------------------------------------------------------------------------
+
+/// <summary>
+/// Text goes to path.tmp first and replaces the file at once
+/// </summary>
+/// <param name="path"></param>
+/// <param name="text"></param>
+static void ReplaceFile(const std::string& path, const std::string& text)
+{
+	std::string temporary = path + ".tmp";
+	{
+		std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+		if (!file)
+		{
+			ERR("Metrics: " << temporary << " could not be opened");
+			return;
+		}
+		file.write(text.data(), static_cast<std::streamsize>(text.size()));
+	}
+
+	std::error_code error;
+	std::filesystem::rename(temporary, path, error);
+	if (error) ERR("Metrics: " << path << " could not be replaced, " << error.message());
+}
+
+/// <summary>
+/// Writes both files. Transfers closed before this pass are written for the last time
+/// </summary>
+void Metrics::ExportOnce(std::string& text)
+{
+	// Taken before writing, so a transfer closed while we write is exported once more
+	bool closed[Metrics::MAX_TRANSFERS];
+	for (size_t i = 0; i < Metrics::MAX_TRANSFERS; ++i)
+	{
+		closed[i] = gMetrics.slots[i].mState.load(std::memory_order_acquire) == CLOSED;
+	}
+
+	if (!gMetrics.jsonPath.empty())
+	{
+		text.clear();
+		Metrics::ExportJson(text);
+		ReplaceFile(gMetrics.jsonPath, text);
+	}
+
+	if (!gMetrics.prometheusPath.empty())
+	{
+		text.clear();
+		Metrics::ExportPrometheus(text);
+		ReplaceFile(gMetrics.prometheusPath, text);
+	}
+
+	for (size_t i = 0; i < Metrics::MAX_TRANSFERS; ++i)
+	{
+		if (closed[i]) gMetrics.slots[i].mState.store(FREE, std::memory_order_release);
+	}
+}
+
+void Metrics::ExportLoop()
+{
+	// Exporting is not on packet path, probes must not see it
+	UncountedAllocations uncounted;
+
+	std::string text;
+	uint64_t seen = 0;
+
+	while (!gMetrics.stop.load())
+	{
+		ExportOnce(text);
+		gMetrics.bell.Wait(seen, gMetrics.interval);
+	}
+	ExportOnce(text);
+}
+
+/// <summary>
+/// Starts exporter thread, process totals count from now
+/// </summary>
+/// <param name="jsonPath">empty = no JSON</param>
+/// <param name="prometheusPath">empty = no Prometheus text file</param>
+/// <param name="intervalUs"></param>
+/// <returns>false if it is running already</returns>
+bool Metrics::Start(const std::string& jsonPath, const std::string& prometheusPath, uint64_t intervalUs)
+{
+	std::lock_guard<std::mutex> lock(gMetrics.lifecycle);
+	if (gMetrics.running.load()) return false;
+
+	gMetrics.jsonPath = jsonPath;
+	gMetrics.prometheusPath = prometheusPath;
+	gMetrics.interval = intervalUs;
+	gMetrics.process.Reset(0, TransferMetrics::Direction::Process, NowMicroseconds());
+
+	gMetrics.stop = false;
+	gMetrics.running = true;
+	gMetrics.exporter = std::thread(&Metrics::ExportLoop);
+	return true;
+}
+
+void Metrics::Stop()
+{
+	std::lock_guard<std::mutex> lock(gMetrics.lifecycle);
+	if (!gMetrics.running.load()) return;
+
+	gMetrics.stop = true;
+	gMetrics.bell.Ring();
+	if (gMetrics.exporter.joinable()) gMetrics.exporter.join();
+	gMetrics.running = false;
+}
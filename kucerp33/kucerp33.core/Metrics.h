@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <atomic>
+
+namespace UDP
+{
+	enum class Counter : uint8_t
+	{
+		PacketsSent,     // including resent ones
+		PacketsResent,
+		AcksReceived,
+		NacksReceived,
+		Timeouts,
+		PacketsReceived, // valid ones, CRC failures are not here
+		Duplicates,
+		CrcFailures,     // process only, header of such packet can't be trusted
+		BytesSent,
+		BytesReceived,
+		PayloadBytes,    // file data acked (sender) or accepted (receiver)
+		Count
+	};
+
+	// Names used in JSON and in Prometheus (kucerp33_process_<name>_total, kucerp33_transfer_...), indexed by Counter
+	inline constexpr const char* COUNTER_NAMES[] =
+	{
+		"packets_sent",
+		"packets_resent",
+		"acks_received",
+		"nacks_received",
+		"timeouts",
+		"packets_received",
+		"duplicates",
+		"crc_failures",
+		"bytes_sent",
+		"bytes_received",
+		"payload_bytes",
+	};
+	static_assert(sizeof(COUNTER_NAMES) / sizeof(COUNTER_NAMES[0]) == static_cast<size_t>(Counter::Count), "Every counter needs its name");
+
+	/// <summary>
+	/// Counters of one transfer (or of the whole process). Every update is one relaxed atomic
+	/// add, so any thread can record without locks; exporter reads them while they change.
+	/// Updates of a transfer go to the process totals as well.
+	/// </summary>
+	class TransferMetrics
+	{
+	public:
+		// RTT bucket i holds samples below 2^i microseconds, last one everything above (~67 s)
+		static constexpr size_t RTT_BUCKETS = 27;
+
+		enum class Direction : uint8_t { Process, Send, Receive };
+
+		void Add(Counter counter, uint64_t value = 1);
+
+		// Sender side
+		void PacketSent(size_t bytes, bool again);
+		// Payload of acked packet, RTT 0 = unknown (packet was sent more than once)
+		void AckReceived(size_t payload, uint64_t rttUs);
+		void NackReceived() { Add(Counter::NacksReceived); }
+		void Timeout() { Add(Counter::Timeouts); }
+		// Packets in flight, sampled after every send round
+		void Window(size_t inFlight);
+
+		// Receiver side
+		void PacketReceived(size_t bytes) { Add(Counter::PacketsReceived); Add(Counter::BytesReceived, bytes); }
+		void Duplicate() { Add(Counter::Duplicates); }
+		void Delivered(size_t payload) { Add(Counter::PayloadBytes, payload); }
+
+		uint64_t Get(Counter counter) const { return mCounters[static_cast<size_t>(counter)].load(std::memory_order_relaxed); }
+		uint32_t Session() const { return mSession; }
+		Direction GetDirection() const { return mDirection; }
+		// Payload bytes per second from open until close (or now)
+		double Goodput(uint64_t nowUs) const;
+
+		// JSON object of this transfer, appended to out
+		void AppendJson(std::string& out, uint64_t nowUs) const;
+
+	private:
+		friend class Metrics;
+
+		void Reset(uint32_t session, Direction direction, uint64_t nowUs);
+		void AddOwn(Counter counter, uint64_t value) { mCounters[static_cast<size_t>(counter)].fetch_add(value, std::memory_order_relaxed); }
+
+		std::atomic<uint64_t> mCounters[static_cast<size_t>(Counter::Count)] = {};
+
+		// Window occupancy, of the transfer only (not in process totals)
+		std::atomic<uint64_t> mInFlight{ 0 };
+		std::atomic<uint64_t> mInFlightMax{ 0 };
+		std::atomic<uint64_t> mInFlightSum{ 0 };
+		std::atomic<uint64_t> mWindowSamples{ 0 };
+
+		std::atomic<uint64_t> mRtt[RTT_BUCKETS] = {};
+		std::atomic<uint64_t> mRttSum{ 0 };
+
+		uint32_t mSession = 0;
+		Direction mDirection = Direction::Process;
+		uint64_t mOpened = 0; // microseconds
+		std::atomic<uint64_t> mClosed{ 0 };
+
+		// Slot state in registry
+		std::atomic<uint8_t> mState{ 0 };
+		TransferMetrics* mProcess = nullptr;
+	};
+
+	/// <summary>
+	/// Registry of transfer metrics. Slots are fixed, so opening a transfer never allocates;
+	/// when all are taken, transfer counts only into process totals. Exporter thread writes
+	/// JSON and Prometheus text file (for node exporter textfile collector) every interval,
+	/// files are replaced at once so scraper never reads half of them.
+	/// </summary>
+	class Metrics
+	{
+	public:
+		static constexpr size_t MAX_TRANSFERS = 256;
+		// How often files are written, microseconds
+		static constexpr uint64_t EXPORT_INTERVAL = 1000 * 1000;
+
+		// Empty path = that format is not written
+		static bool Start(const std::string& jsonPath, const std::string& prometheusPath, uint64_t intervalUs = EXPORT_INTERVAL);
+		// Files are written one last time
+		static void Stop();
+
+		// Transfer stays in export until Close, then once more with final values
+		static TransferMetrics& Open(uint32_t session, TransferMetrics::Direction direction);
+		static void Close(TransferMetrics& metrics);
+
+		static TransferMetrics& Process();
+
+		// Whole registry, as it is written into files
+		static void ExportJson(std::string& out);
+		static void ExportPrometheus(std::string& out);
+
+	private:
+		static void ExportLoop();
+		static void ExportOnce(std::string& text);
+	};
+}
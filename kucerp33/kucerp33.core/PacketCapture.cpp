@@ -0,0 +1,195 @@
+#include "PacketCapture.h"
+#include "SpscRing.h"
+#include "AllocationCounter.h"
+#include "SmartDebug.h"
+
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+
+using namespace UDP;
+
+std::atomic<bool> PacketCapture::sEnabled{ false };
+
+struct CapturedPacket
+{
+	uint64_t timeNs = 0; // wall clock, since 1970
+	CaptureEndpoint from;
+	CaptureEndpoint to;
+	uint32_t length = 0;   // of datagram
+	uint32_t captured = 0; // bytes in data
+	uint8_t data[PacketCapture::MAX_CAPTURED];
+};
+
+struct CaptureState
+{
+	~CaptureState() { PacketCapture::Stop(); }
+
+	// Made once by first Start and kept
+	std::unique_ptr<MpscRing<CapturedPacket>> ring;
+	std::atomic<uint64_t> dropped{ 0 };
+	uint64_t written = 0;
+	uint16_t ipId = 0;
+
+	std::ofstream file;
+	std::string path;
+
+	DrainThread drain;
+	std::mutex lifecycle; // Start/Stop
+};
+
+static CaptureState gCapture;
+
+static void Drain();
+
+/// ------------------------------------------------------------------------------------------------
+/// CAPTURE
+/// ------------------------------------------------------------------------------------------------
+
+/// <summary>
+/// Copies datagram into the ring, called by socket wrappers right after sendto/recvfrom
+/// </summary>
+/// <param name="data"></param>
+/// <param name="size"></param>
+/// <param name="from"></param>
+/// <param name="to"></param>
+void PacketCapture::Record(const void* data, size_t size, CaptureEndpoint from, CaptureEndpoint to)
+{
+	if (!Enabled() || !gCapture.ring) return;
+
+	uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count());
+
+	bool pushed = gCapture.ring->TryPush([&](CapturedPacket& packet)
+	{
+		packet.timeNs = now;
+		packet.from = from;
+		packet.to = to;
+		packet.length = static_cast<uint32_t>(size);
+		packet.captured = static_cast<uint32_t>((std::min)(size, MAX_CAPTURED));
+		std::memcpy(packet.data, data, packet.captured);
+	});
+
+	if (!pushed) gCapture.dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// START / STOP
+/// ------------------------------------------------------------------------------------------------
+
+/// <summary>
+/// Opens the file, writes pcap header and starts background thread
+/// </summary>
+/// <param name="path"></param>
+/// <returns>false if file could not be opened</returns>
+bool PacketCapture::Start(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(gCapture.lifecycle);
+	if (sEnabled.load()) return true;
+
+	if (!gCapture.ring) gCapture.ring = std::make_unique<MpscRing<CapturedPacket>>(RING_PACKETS);
+
+	gCapture.file.open(path, std::ios::binary | std::ios::trunc);
+	if (!gCapture.file)
+	{
+		ERR("Capture file " << path << " could not be opened");
+		return false;
+	}
+
+	PcapFileHeader header;
+	gCapture.file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	gCapture.path = path;
+	gCapture.written = 0;
+	gCapture.dropped = 0;
+	gCapture.drain.Start(DRAIN_INTERVAL, Drain);
+
+	sEnabled = true;
+	return true;
+}
+
+void PacketCapture::Stop()
+{
+	std::lock_guard<std::mutex> lock(gCapture.lifecycle);
+	if (!sEnabled.load()) return;
+
+	sEnabled = false;
+	gCapture.drain.Stop();
+	gCapture.file.close();
+
+	std::cout << "Capture: " << gCapture.written << " packets written to " << gCapture.path;
+	uint64_t dropped = gCapture.dropped.load();
+	if (dropped) std::cout << ", " << dropped << " dropped (ring was full)";
+	std::cout << "\n";
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// BACKGROUND THREAD
+/// ------------------------------------------------------------------------------------------------
+
+static void PutBig16(uint8_t* out, uint16_t value)
+{
+	out[0] = static_cast<uint8_t>(value >> 8);
+	out[1] = static_cast<uint8_t>(value);
+}
+
+// Checksum of IPv4 header, header checksum field has to be 0
+static uint16_t IpChecksum(const uint8_t* header, size_t size)
+{
+	uint32_t sum = 0;
+	for (size_t i = 0; i + 1 < size; i += 2) sum += (uint32_t(header[i]) << 8) | header[i + 1];
+	while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+	return static_cast<uint16_t>(~sum);
+}
+
+/// <summary>
+/// Record header, IPv4 and UDP header around captured datagram
+/// </summary>
+/// <param name="packet"></param>
+static void WritePacket(const CapturedPacket& packet)
+{
+	constexpr size_t IP_HEADER = 20;
+	constexpr size_t UDP_HEADER = 8;
+
+	uint8_t headers[IP_HEADER + UDP_HEADER] = {};
+	uint8_t* ip = headers;
+	uint8_t* udp = headers + IP_HEADER;
+
+	ip[0] = 0x45; // IPv4, 5 words
+	PutBig16(ip + 2, static_cast<uint16_t>((std::min<size_t>)(IP_HEADER + UDP_HEADER + packet.length, 0xFFFF)));
+	PutBig16(ip + 4, gCapture.ipId++);
+	PutBig16(ip + 6, 0x4000); // don't fragment
+	ip[8] = 64;  // TTL
+	ip[9] = 17;  // UDP
+	std::memcpy(ip + 12, &packet.from.address, 4);
+	std::memcpy(ip + 16, &packet.to.address, 4);
+	PutBig16(ip + 10, IpChecksum(ip, IP_HEADER));
+
+	PutBig16(udp + 0, packet.from.port);
+	PutBig16(udp + 2, packet.to.port);
+	PutBig16(udp + 4, static_cast<uint16_t>((std::min<size_t>)(UDP_HEADER + packet.length, 0xFFFF)));
+	// UDP checksum 0 = none
+
+	PcapRecordHeader record;
+	record.seconds = static_cast<uint32_t>(packet.timeNs / 1000000000);
+	record.fraction = static_cast<uint32_t>(packet.timeNs % 1000000000);
+	record.capturedLength = static_cast<uint32_t>(sizeof(headers) + packet.captured);
+	record.originalLength = static_cast<uint32_t>(sizeof(headers) + packet.length);
+
+	gCapture.file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+	gCapture.file.write(reinterpret_cast<const char*>(headers), sizeof(headers));
+	gCapture.file.write(reinterpret_cast<const char*>(packet.data), packet.captured);
+	++gCapture.written;
+}
+
+/// <summary>
+/// Drains the ring into the file. Packets of different threads can be slightly out of time order
+/// </summary>
+static void Drain()
+{
+	UncountedAllocations uncounted;
+	while (gCapture.ring->TryPop(WritePacket)) {}
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <atomic>
+
+namespace UDP
+{
+	// Address in network byte order (as in sockaddr_in), port in host order. 0.0.0.0 = this process
+	struct CaptureEndpoint
+	{
+		uint32_t address = 0;
+		uint16_t port = 0;
+	};
+
+	// pcap file with nanosecond timestamps, packets are IPv4 + UDP made up around the datagram
+	struct PcapFileHeader
+	{
+		static constexpr uint32_t MAGIC_NANOSECONDS = 0xA1B23C4D;
+		static constexpr uint32_t MAGIC_MICROSECONDS = 0xA1B2C3D4;
+		static constexpr uint32_t LINKTYPE_NULL = 0;     // 4 byte address family (Windows loopback)
+		static constexpr uint32_t LINKTYPE_ETHERNET = 1;
+		static constexpr uint32_t LINKTYPE_RAW = 101;
+		static constexpr uint32_t LINKTYPE_IPV4 = 228;
+
+		uint32_t magic = MAGIC_NANOSECONDS;
+		uint16_t versionMajor = 2;
+		uint16_t versionMinor = 4;
+		int32_t thisZone = 0;
+		uint32_t sigFigs = 0;
+		uint32_t snapLength = 65535;
+		uint32_t linkType = LINKTYPE_IPV4;
+	};
+	static_assert(sizeof(PcapFileHeader) == 24, "pcap file header is 24 bytes");
+
+	struct PcapRecordHeader
+	{
+		uint32_t seconds = 0;
+		uint32_t fraction = 0;       // nanoseconds or microseconds, see magic
+		uint32_t capturedLength = 0;
+		uint32_t originalLength = 0;
+	};
+	static_assert(sizeof(PcapRecordHeader) == 16, "pcap record header is 16 bytes");
+
+	/// <summary>
+	/// Capture of every datagram this process sends and receives (DATA, control, ACK) into a pcap file,
+	/// which Wireshark opens (see kucerp33.lua) or "pcapdump" tool decodes.
+	/// Socket calls copy the datagram into one lock-free ring shared by all threads, background
+	/// thread writes the file. Ring full = packet dropped and counted, sockets never wait for disk.
+	/// Sent packets come from 0.0.0.0 (our port is not known), received ones go to 0.0.0.0:bound port.
+	/// </summary>
+	class PacketCapture
+	{
+	public:
+		static constexpr size_t RING_PACKETS = 4096;
+		// Longer datagrams are cut, pcap keeps their original length
+		static constexpr size_t MAX_CAPTURED = 1024;
+		// How often background thread drains the ring, microseconds
+		static constexpr uint64_t DRAIN_INTERVAL = 10 * 1000;
+
+		static bool Start(const std::string& path);
+		// Everything captured so far is written, file is closed
+		static void Stop();
+		static bool Enabled() { return sEnabled.load(std::memory_order_relaxed); }
+
+		static void Record(const void* data, size_t size, CaptureEndpoint from, CaptureEndpoint to);
+
+		static void Sent(const void* data, size_t size, CaptureEndpoint to)
+		{
+			if (Enabled()) Record(data, size, CaptureEndpoint{}, to);
+		}
+		static void Received(const void* data, size_t size, CaptureEndpoint from, uint16_t localPort)
+		{
+			if (Enabled()) Record(data, size, from, CaptureEndpoint{ 0, localPort });
+		}
+
+	private:
+		static std::atomic<bool> sEnabled;
+	};
+}
@@ -0,0 +1,158 @@
+#include "PacketHeader.h"
+#include "Crc32c.h"
+
+#include <algorithm>
+
+using namespace UDP;
+
+const char* UDP::ChecksumName(ChecksumPolicy policy)
+{
+	switch (policy)
+	{
+	case ChecksumPolicy::Crc32: return "CRC-32";
+	case ChecksumPolicy::Crc32c: return "CRC-32C";
+	case ChecksumPolicy::HeaderOnly: return "header CRC-32";
+	case ChecksumPolicy::None: return "none";
+	default: return "unknown";
+	}
+}
+
+PacketBuilder& PacketBuilder::Checksum(ChecksumPolicy policy)
+{
+	mPolicy = policy;
+	return *this;
+}
+
+/// <summary>
+/// Writes header fields, CRC is written later by Seal()
+/// </summary>
+/// <param name="command"></param>
+/// <param name="seq"></param>
+/// <param name="offset"></param>
+/// <param name="session">id of the transfer, 0 when sender does not set any</param>
+/// <returns></returns>
+PacketBuilder& PacketBuilder::Header(Command command, uint32_t seq, uint64_t offset, uint32_t session)
+{
+	PacketHeader header{};
+	header.seq = seq;
+	header.command = command;
+	header.offset = offset;
+	header.session = session;
+
+	std::memcpy(mBuffer, &header, sizeof(header));
+	return *this;
+}
+
+/// <summary>
+/// Copies payload right behind the header. With CRC-32 payload CRC is computed by the same pass
+/// </summary>
+/// <param name="data"></param>
+/// <param name="size"></param>
+/// <returns></returns>
+PacketBuilder& PacketBuilder::Payload(const void* data, size_t size)
+{
+	if (size > PayloadCapacity()) size = PayloadCapacity();
+
+	if (mPolicy == ChecksumPolicy::Crc32)
+	{
+		mPayloadCrc = Crc32::CopyAndCompute(PayloadPtr(), data, size);
+		mPayloadCrcValid = true;
+	}
+	else
+	{
+		if (size) std::memcpy(PayloadPtr(), data, size);
+		mPayloadCrcValid = false;
+	}
+	mSize = sizeof(PacketHeader) + size;
+	return *this;
+}
+
+PacketBuilder& PacketBuilder::PayloadSize(size_t size)
+{
+	if (size > PayloadCapacity()) size = PayloadCapacity();
+
+	mSize = sizeof(PacketHeader) + size;
+	mPayloadCrcValid = false; // filled in place, Seal has to read it
+	return *this;
+}
+
+size_t PacketBuilder::Seal()
+{
+	if (mPolicy != ChecksumPolicy::Crc32)
+	{
+		uint32_t crc = ComputePacketCRC(mBuffer, mSize, mPolicy);
+		std::memcpy(mBuffer + offsetof(PacketHeader, crc), &crc, sizeof(crc));
+		return mSize;
+	}
+
+	size_t payloadSize = mSize - sizeof(PacketHeader);
+	if (!mPayloadCrcValid)
+	{
+		mPayloadCrc = Crc32::Compute(PayloadPtr(), payloadSize);
+		mPayloadCrcValid = true;
+	}
+
+	ResealPacket(mBuffer, mPayloadCrc, payloadSize);
+	return mSize;
+}
+
+/// <summary>
+/// CRC(header fields + payload) = combine of CRC(header fields) and CRC(payload),
+/// so only the 20 bytes of header after CRC field are read
+/// </summary>
+/// <param name="packet"></param>
+/// <param name="payloadCRC">CRC of payload alone</param>
+/// <param name="payloadSize"></param>
+/// <returns>written CRC</returns>
+uint32_t UDP::ResealPacket(uint8_t* packet, uint32_t payloadCRC, size_t payloadSize)
+{
+	constexpr size_t crcEnd = offsetof(PacketHeader, crc) + sizeof(uint32_t);
+
+	uint32_t headerCrc = Crc32::Compute(packet + crcEnd, sizeof(PacketHeader) - crcEnd);
+	uint32_t crc = Crc32::Combine(headerCrc, payloadCRC, payloadSize);
+
+	std::memcpy(packet + offsetof(PacketHeader, crc), &crc, sizeof(crc));
+	return crc;
+}
+
+uint32_t UDP::ComputePacketCRC(const uint8_t* packet, size_t packetSize, ChecksumPolicy policy)
+{
+	constexpr size_t crcEnd = offsetof(PacketHeader, crc) + sizeof(uint32_t);
+	if (packetSize < crcEnd) return 0;
+
+	switch (policy)
+	{
+	case ChecksumPolicy::Crc32c: return Crc32c::Compute(packet + crcEnd, packetSize - crcEnd);
+	case ChecksumPolicy::HeaderOnly:
+		return Crc32::Compute(packet + crcEnd, (std::min)(packetSize, sizeof(PacketHeader)) - crcEnd);
+	case ChecksumPolicy::None: return 0;
+	default: return Crc32::Compute(packet + crcEnd, packetSize - crcEnd);
+	}
+}
+
+void UDP::ComputePacketCRCs(const uint8_t* const* packets, const size_t* packetSizes, size_t count, uint32_t* out)
+{
+	constexpr size_t crcEnd = offsetof(PacketHeader, crc) + sizeof(uint32_t);
+	constexpr size_t BATCH = 64;
+
+	// Skip CRC field of every packet, batch goes through multi-buffer CRC in pieces
+	const uint8_t* bodies[BATCH];
+	size_t lengths[BATCH];
+
+	for (size_t first = 0; first < count; first += BATCH)
+	{
+		size_t n = (std::min)(BATCH, count - first);
+		for (size_t i = 0; i < n; ++i)
+		{
+			bool valid = packetSizes[first + i] >= crcEnd;
+			bodies[i] = valid ? packets[first + i] + crcEnd : packets[first + i];
+			lengths[i] = valid ? packetSizes[first + i] - crcEnd : 0;
+		}
+		Crc32::ComputeMany(bodies, lengths, n, out + first);
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			if (packetSizes[first + i] < crcEnd) out[first + i] = 0;
+		}
+	}
+}
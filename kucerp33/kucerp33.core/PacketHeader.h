@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include "Crc32.h"
+
+namespace UDP
+{
+	// Builds 32-bit tag from 4 chars. Byte order matches the wire,
+	// so tag compared as integer equals the old 4 char string compare.
+	constexpr uint32_t MakeTag(const char(&text)[5])
+	{
+		return static_cast<uint32_t>(static_cast<uint8_t>(text[0]))
+			| static_cast<uint32_t>(static_cast<uint8_t>(text[1])) << 8
+			| static_cast<uint32_t>(static_cast<uint8_t>(text[2])) << 16
+			| static_cast<uint32_t>(static_cast<uint8_t>(text[3])) << 24;
+	}
+
+	enum class Command : uint32_t
+	{
+		None = 0,
+		Name = MakeTag("NAME"),
+		Size = MakeTag("SIZE"),
+		Hash = MakeTag("HASH"),
+		Data = MakeTag("DATA"),
+		Stop = MakeTag("STOP"),
+		Leaf = MakeTag("LEAF"), // Merkle leaf hashes on request, OFFSET = index of first leaf
+	};
+
+	// Hash algorithm tags, HASH chunk carries them in offset field, NAME chunk too
+	// so receiver knows how to hash before HASH arrives
+	constexpr uint32_t HASH_SHA256 = MakeTag("S256");
+	constexpr uint32_t HASH_MERKLE_SHA256 = MakeTag("M256"); // root of SHA-256 Merkle tree
+	constexpr uint32_t HASH_BLAKE3 = MakeTag("BLK3");
+	constexpr uint32_t HASH_XXH3_128 = MakeTag("X128");    // not cryptographic, 16 byte digest
+
+	// Checksum of DATA packets, agreed for whole session by NAME (high half of its offset).
+	// Control packets (NAME, SIZE, HASH, STOP, LEAF) always carry full CRC-32
+	enum class ChecksumPolicy : uint32_t
+	{
+		Crc32 = 0,      // IEEE CRC-32 of header fields + payload, old senders send 0
+		Crc32c = 1,     // CRC-32C of header fields + payload, SSE4.2 instruction
+		HeaderOnly = 2, // CRC-32 of header fields, payload left to UDP checksum and file hash
+		None = 3        // CRC field is 0, trusted links (loopback, datacenter)
+	};
+
+	constexpr bool IsKnownChecksum(uint32_t policy)
+	{
+		return policy <= static_cast<uint32_t>(ChecksumPolicy::None);
+	}
+
+	const char* ChecksumName(ChecksumPolicy policy);
+
+	/// <summary>
+	/// Wire header of every chunk: CRC | SEQ | COMMAND | OFFSET | SESSION, little endian.
+	/// CRC covers everything after itself (header rest + payload).
+	/// OFFSET is 64-bit so files over 4 GiB can be sent.
+	/// SESSION is random id of the transfer chosen by sender, so receiver can tell apart
+	/// several transfers from one peer (see receiver server mode).
+	/// </summary>
+#pragma pack(push, 1)
+	struct PacketHeader
+	{
+		uint32_t crc = 0;
+		uint32_t seq = 0;
+		Command command = Command::None;
+		uint64_t offset = 0;
+		uint32_t session = 0;
+	};
+#pragma pack(pop)
+
+	static_assert(sizeof(PacketHeader) == 24, "Wire header must be exactly 24 bytes");
+	static_assert(offsetof(PacketHeader, crc) == 0, "CRC must be first on the wire");
+	static_assert(offsetof(PacketHeader, seq) == 4, "SEQ must follow CRC");
+	static_assert(offsetof(PacketHeader, command) == 8, "COMMAND must follow SEQ");
+	static_assert(offsetof(PacketHeader, offset) == 12, "OFFSET must follow COMMAND");
+	static_assert(offsetof(PacketHeader, session) == 20, "SESSION must follow OFFSET");
+
+	/// <summary>
+	/// Zero-copy view of the header at the start of a raw packet buffer.
+	/// Load() decodes whole header in a single 24 byte load.
+	/// </summary>
+	struct HeaderView
+	{
+		const uint8_t* raw = nullptr;
+		size_t size = 0;
+
+		HeaderView(const uint8_t* raw, size_t size) : raw(raw), size(size) {}
+
+		bool IsValid() const { return raw && size >= sizeof(PacketHeader); }
+
+		PacketHeader Load() const
+		{
+			PacketHeader header{};
+			if (IsValid()) std::memcpy(&header, raw, sizeof(header));
+			return header;
+		}
+	};
+
+	/// <summary>
+	/// Writes header and payload directly into packet buffer and seals it with CRC.
+	/// Buffer has to be big enough for header + payload (see PACKET_MAX_LENGTH).
+	/// Payload is checksummed while it is copied, Seal adds CRC of header fields with CRC combine.
+	/// Payload CRC is kept, so header can be rewritten later without reading payload again.
+	/// Other checksum policy has to be set before Payload, payload is then only copied.
+	/// </summary>
+	class PacketBuilder
+	{
+	public:
+		PacketBuilder(uint8_t* buffer, size_t capacity) : mBuffer(buffer), mCapacity(capacity) {}
+
+		PacketBuilder& Checksum(ChecksumPolicy policy);
+		PacketBuilder& Header(Command command, uint32_t seq, uint64_t offset = 0, uint32_t session = 0);
+		PacketBuilder& Payload(const void* data, size_t size);
+
+		// Payload can be also filled in place (e.g. file read), then only its size is set
+		uint8_t* PayloadPtr() const { return mBuffer + sizeof(PacketHeader); }
+		size_t PayloadCapacity() const { return mCapacity - sizeof(PacketHeader); }
+		PacketBuilder& PayloadSize(size_t size);
+
+		// Computes and writes CRC, returns size of the packet
+		size_t Seal();
+
+		// CRC of payload alone, valid after Seal (ChecksumPolicy::Crc32 only)
+		uint32_t PayloadCRC() const { return mPayloadCrc; }
+		ChecksumPolicy Policy() const { return mPolicy; }
+
+	private:
+		uint8_t* mBuffer = nullptr;
+		size_t mCapacity = 0;
+		size_t mSize = sizeof(PacketHeader);
+		ChecksumPolicy mPolicy = ChecksumPolicy::Crc32;
+
+		// Known from fused copy, in place fill has to be read in Seal
+		uint32_t mPayloadCrc = 0;
+		bool mPayloadCrcValid = true;
+	};
+
+	// CRC of packet as sent on the wire: everything after the CRC field (header fields only
+	// for ChecksumPolicy::HeaderOnly, 0 for None)
+	uint32_t ComputePacketCRC(const uint8_t* packet, size_t packetSize, ChecksumPolicy policy = ChecksumPolicy::Crc32);
+	// CRC from header fields (read from packet) and already known payload CRC, written into CRC field.
+	// Used after header rewrite, cost does not depend on payload size
+	uint32_t ResealPacket(uint8_t* packet, uint32_t payloadCRC, size_t payloadSize);
+	// Same for a whole batch of received datagrams at once, out[i] belongs to packets[i]
+	void ComputePacketCRCs(const uint8_t* const* packets, const size_t* packetSizes, size_t count, uint32_t* out);
+
+	// 4 chars of tag, for printing
+	inline void TagToChars(uint32_t tag, char(&out)[5])
+	{
+		std::memcpy(out, &tag, 4);
+		out[4] = '\0';
+	}
+}
@@ -0,0 +1,320 @@
+#include "ReceivePipeline.h"
+#include "SendWindow.h"
+
+using namespace UDP;
+
+/// <summary>
+/// Pool of packets is allocated here, stages then only pass their indexes around
+/// </summary>
+/// <param name="receiver"></param>
+/// <param name="validators">number of validation workers</param>
+ReceivePipeline::ReceivePipeline(Receiver& receiver, size_t validators)
+	: mReceiver(receiver), mPackets(POOL_PACKETS), mWriterFree(POOL_PACKETS)
+{
+	mFree.reserve(POOL_PACKETS);
+	for (size_t i = 0; i < mPackets.size(); ++i)
+	{
+		mPackets[i].chunk.data.reserve(PACKET_MAX_LENGTH);
+		mPackets[i].ip.reserve(INET_ADDRSTRLEN);
+		mPackets[i].index = static_cast<uint32_t>(i);
+		mFree.push_back(static_cast<uint32_t>(mPackets.size() - 1 - i));
+	}
+
+	for (size_t i = 0; i < (std::max<size_t>)(1, validators); ++i)
+		mValidators.push_back(std::make_unique<Validator>(POOL_PACKETS));
+}
+
+ReceivePipeline::~ReceivePipeline()
+{
+	Stop();
+}
+
+void ReceivePipeline::Start()
+{
+	if (mNetwork.joinable()) return;
+
+	mStop = false;
+	for (auto& validator : mValidators)
+		validator->thread = std::thread(&ReceivePipeline::RunValidator, this, std::ref(*validator));
+	mNetwork = std::thread(&ReceivePipeline::RunNetwork, this);
+}
+
+void ReceivePipeline::Stop()
+{
+	mStop = true;
+	mFreeBell.Ring();
+	for (auto& validator : mValidators) validator->bell.Ring();
+
+	if (mNetwork.joinable()) mNetwork.join();
+	for (auto& validator : mValidators)
+	{
+		if (validator->thread.joinable()) validator->thread.join();
+	}
+}
+
+/// <summary>
+/// Network thread: receive, hand over to validators round robin, nothing else
+/// </summary>
+void ReceivePipeline::RunNetwork()
+{
+	uint64_t freeSeen = 0;
+	size_t next = 0;
+
+	while (!mStop.load(std::memory_order_relaxed))
+	{
+		uint32_t index = 0;
+		if (!TakeFree(index))
+		{
+			// Writer is behind and whole pool waits for it, kernel buffer holds packets meanwhile
+			mFreeBell.Wait(freeSeen, POLL_TIMEOUT);
+			continue;
+		}
+
+		Packet& packet = mPackets[index];
+		if (!mReceiver.ReceivePacket(packet.chunk, &packet.ip, &packet.port))
+		{
+			mFree.push_back(index);
+			continue;
+		}
+
+		Validator& validator = *mValidators[next];
+		next = (next + 1 < mValidators.size()) ? next + 1 : 0;
+
+		validator.in.TryPush(index); // holds whole pool, can't be full
+		validator.bell.Ring();
+	}
+}
+
+/// <summary>
+/// Network thread: packets come back from writer and validators in batches, when it runs out
+/// </summary>
+/// <param name="index"></param>
+/// <returns>false if whole pool is still in use</returns>
+bool ReceivePipeline::TakeFree(uint32_t& index)
+{
+	if (mFree.empty())
+	{
+		uint32_t back = 0;
+		while (mWriterFree.TryPop(back)) mFree.push_back(back);
+		for (auto& validator : mValidators)
+		{
+			while (validator->free.TryPop(back)) mFree.push_back(back);
+		}
+		if (mFree.empty()) return false;
+	}
+
+	index = mFree.back();
+	mFree.pop_back();
+	return true;
+}
+
+/// <summary>
+/// Validation worker: CRC, ACK/NACK to sender (ACK socket is its own), valid packet to writer.
+/// Valid NAME sets DATA checksum of its session before it is ACKed
+/// </summary>
+/// <param name="validator"></param>
+void ReceivePipeline::RunValidator(Validator& validator)
+{
+	uint64_t seen = 0;
+
+	while (!mStop.load(std::memory_order_relaxed))
+	{
+		uint32_t index = 0;
+		if (!validator.in.TryPop(index))
+		{
+			validator.bell.Wait(seen, POLL_TIMEOUT);
+			continue;
+		}
+
+		Packet& packet = mPackets[index];
+		bool ack = Receiver::CheckCRC(packet.chunk, DataChecksum(packet.chunk.session));
+
+		// No room for its transfer, packet is neither ACKed nor used
+		if (ack && !Admit(packet.chunk.session))
+		{
+			validator.free.TryPush(index);
+			mFreeBell.Ring();
+			continue;
+		}
+
+		// DATA sent in the same window as NAME are checked by its policy, not by CRC-32 until writer
+		// gets to NAME. Unknown policy is left to the writer, it rejects the transfer
+		uint32_t announced = static_cast<uint32_t>(packet.chunk.offset >> 32);
+		if (ack && packet.chunk.command == Command::Name && IsKnownChecksum(announced))
+		{
+			SetDataChecksum(packet.chunk.session, static_cast<ChecksumPolicy>(announced));
+		}
+
+		if (!AckSender(validator, packet.ip).SendAckOrNack(ack, packet.chunk.seq, packet.chunk.session))
+		{
+			std::cerr << "Error: ACK or NACK could not be sent.\n";
+			ack = false;
+		}
+
+		// NACKed packet is not used, it goes straight back to network
+		if (ack)
+		{
+			validator.out.TryPush(index);
+			mWriterBell.Ring();
+		}
+		else
+		{
+			validator.free.TryPush(index);
+			mFreeBell.Ring();
+		}
+	}
+}
+
+/// <summary>
+/// Validator: ACK socket of peer. Sockets of last ACK_PEERS peers stay open, so packets
+/// of several senders in turn do not create a socket each
+/// </summary>
+/// <param name="validator"></param>
+/// <param name="ip"></param>
+/// <returns></returns>
+Sender& ReceivePipeline::AckSender(Validator& validator, const std::string& ip)
+{
+	for (size_t i = 0; i < validator.ackPeers; ++i)
+	{
+		if (validator.ackIps[i] == ip) return *validator.ackSenders[i];
+	}
+
+	size_t slot = validator.ackPeers < ACK_PEERS ? validator.ackPeers++ : validator.nextReplaced++ % ACK_PEERS;
+	validator.ackSenders[slot].emplace(ip, SEND_PORT_ACK);
+	validator.ackIps[slot] = ip;
+	return *validator.ackSenders[slot];
+}
+
+/// <summary>
+/// Slot of session in table, linear probing from slot given by its (random) id
+/// </summary>
+/// <param name="session"></param>
+/// <returns>SESSION_SLOTS if session is not there</returns>
+size_t ReceivePipeline::FindSession(uint32_t session) const
+{
+	for (size_t probe = 0, slot = session; probe < SESSION_SLOTS; ++probe, ++slot)
+	{
+		size_t index = slot & (SESSION_SLOTS - 1);
+		uint64_t entry = mSessions[index].load(std::memory_order_acquire);
+		if (entry == EMPTY_SLOT) break;
+		if ((entry & LIVE_SLOT) && (entry >> 32) == session) return index;
+	}
+	return SESSION_SLOTS;
+}
+
+/// <summary>
+/// Under mSessionsLock: slot of session, new one is taken when it is not there yet
+/// </summary>
+/// <param name="session"></param>
+/// <returns>SESSION_SLOTS if table is full</returns>
+size_t ReceivePipeline::InsertSession(uint32_t session)
+{
+	size_t target = FindSession(session);
+	if (target != SESSION_SLOTS) return target;
+
+	// First free slot, tombstone or empty one
+	for (size_t probe = 0, slot = session; probe < SESSION_SLOTS; ++probe, ++slot)
+	{
+		size_t index = slot & (SESSION_SLOTS - 1);
+		if (mSessions[index].load(std::memory_order_relaxed) & LIVE_SLOT) continue;
+
+		mSessions[index].store((static_cast<uint64_t>(session) << 32) | LIVE_SLOT, std::memory_order_release);
+		++mLiveSessions;
+		return index;
+	}
+	return SESSION_SLOTS;
+}
+
+/// <summary>
+/// Validator: DATA checksum of session
+/// </summary>
+/// <param name="session"></param>
+/// <returns>policy of the session or the common one</returns>
+ChecksumPolicy ReceivePipeline::DataChecksum(uint32_t session) const
+{
+	size_t index = FindSession(session);
+	if (index != SESSION_SLOTS)
+	{
+		uint64_t entry = mSessions[index].load(std::memory_order_acquire);
+		if ((entry & POLICY_SLOT) && (entry >> 32) == session) return static_cast<ChecksumPolicy>(entry & 0xFF);
+	}
+	return mDataChecksum.load(std::memory_order_relaxed);
+}
+
+/// <summary>
+/// Validator: decides before the first ACK whether packet of session is taken, so writer
+/// never gets packet which sender counts as delivered but which has no transfer to go to.
+/// Known session is taken without lock, new one gets slot while there are fewer than limit
+/// </summary>
+/// <param name="session"></param>
+/// <returns>false if limit is reached</returns>
+bool ReceivePipeline::Admit(uint32_t session)
+{
+	if (mSessionLimit == 0 || FindSession(session) != SESSION_SLOTS) return true;
+
+	std::lock_guard<std::mutex> lock(mSessionsLock);
+	if (FindSession(session) != SESSION_SLOTS) return true;
+	if (mLiveSessions >= mSessionLimit) return false;
+	return InsertSession(session) != SESSION_SLOTS;
+}
+
+/// <summary>
+/// Validator (valid NAME) or writer: sets DATA checksum of session. Slot is one 64-bit word, so validator always
+/// reads id and policy of the same session
+/// </summary>
+/// <param name="session"></param>
+/// <param name="policy"></param>
+/// <returns>false if there is no free slot, session then uses the common policy</returns>
+bool ReceivePipeline::SetDataChecksum(uint32_t session, ChecksumPolicy policy)
+{
+	std::lock_guard<std::mutex> lock(mSessionsLock);
+	size_t index = InsertSession(session);
+	if (index == SESSION_SLOTS) return false;
+
+	mSessions[index].store((static_cast<uint64_t>(session) << 32) | LIVE_SLOT | POLICY_SLOT | static_cast<uint64_t>(policy),
+		std::memory_order_release);
+	return true;
+}
+
+void ReceivePipeline::ForgetSession(uint32_t session)
+{
+	std::lock_guard<std::mutex> lock(mSessionsLock);
+	size_t index = FindSession(session);
+	if (index == SESSION_SLOTS) return;
+
+	mSessions[index].store(REMOVED_SLOT, std::memory_order_release);
+	--mLiveSessions;
+}
+
+ReceivePipeline::Packet* ReceivePipeline::Pop(uint64_t timeoutUs)
+{
+	const uint64_t deadline = NowMicroseconds() + timeoutUs;
+
+	while (true)
+	{
+		// Validators take turns, so none of them is starved
+		for (size_t i = 0; i < mValidators.size(); ++i)
+		{
+			size_t v = (mNextOut + i) % mValidators.size();
+
+			uint32_t index = 0;
+			if (mValidators[v]->out.TryPop(index))
+			{
+				mNextOut = v + 1;
+				return &mPackets[index];
+			}
+		}
+
+		uint64_t now = NowMicroseconds();
+		if (now >= deadline) return nullptr;
+		mWriterBell.Wait(mWriterSeen, deadline - now);
+	}
+}
+
+void ReceivePipeline::Release(Packet* packet)
+{
+	if (!packet) return;
+
+	mWriterFree.TryPush(packet->index);
+	mFreeBell.Ring();
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <array>
+#include <optional>
+
+#include "UDPCommunication.h"
+#include "FileTransfer.h"
+#include "SpscRing.h"
+
+namespace UDP
+{
+	/// <summary>
+	/// Receiving split into stages connected by lock-free SPSC rings. Network thread only drains
+	/// the socket into pooled packets, validation workers check CRC and send ACK/NACK, valid
+	/// packets go to the writer = thread calling Pop() (session, hash, disk). Socket is drained
+	/// while writer is busy, so slow disk or hash no longer overflows kernel buffer.
+	/// </summary>
+	class ReceivePipeline
+	{
+	public:
+		// Packets between socket and writer at most, every ring can hold all of them
+		static constexpr size_t POOL_PACKETS = 4096;
+		// How often idle stages check whether they should stop, microseconds
+		static constexpr uint64_t POLL_TIMEOUT = 20 * 1000;
+		// Sessions known at once (own DATA checksum, admitted by session limit), power of two.
+		// Keep it well above number of concurrent transfers, removed sessions leave tombstones behind
+		static constexpr size_t SESSION_SLOTS = 256;
+		// ACK sockets kept open by one validator, one per peer address
+		static constexpr size_t ACK_PEERS = 16;
+
+		struct Packet
+		{
+			Chunk chunk;
+			std::string ip;
+			uint16_t port = 0;
+			uint32_t index = 0; // in pool
+		};
+
+		ReceivePipeline(Receiver& receiver, size_t validators);
+		~ReceivePipeline();
+
+		ReceivePipeline(const ReceivePipeline&) = delete;
+		ReceivePipeline& operator=(const ReceivePipeline&) = delete;
+
+		// Socket of receiver is used only by network thread until Stop()
+		void Start();
+		void Stop();
+
+		// How DATA are checked, as announced in NAME (see Receiver::SetDataChecksum).
+		// Used for every session which has no policy of its own
+		void SetDataChecksum(ChecksumPolicy policy) { mDataChecksum.store(policy, std::memory_order_relaxed); }
+		// Policy of one session, false if table is full. Validator sets it from valid NAME,
+		// writer only repeats it. Forget it once session ends
+		bool SetDataChecksum(uint32_t session, ChecksumPolicy policy);
+		void ForgetSession(uint32_t session);
+		// Server mode, before Start: validators take packets of at most this many sessions at once,
+		// packet of another one is not ACKed and sender sends it again later. 0 = any session
+		void SetSessionLimit(size_t sessions) { mSessionLimit = sessions; }
+
+		// Writer: next valid packet (already ACKed), nullptr if none came within timeout (microseconds)
+		Packet* Pop(uint64_t timeoutUs);
+		// Writer: packet goes back to pool, its chunk may be swapped for another buffer meanwhile
+		void Release(Packet* packet);
+
+	private:
+		struct Validator
+		{
+			explicit Validator(size_t capacity) : in(capacity), out(capacity), free(capacity) {}
+
+			SpscRing<uint32_t> in;   // network -> validator
+			SpscRing<uint32_t> out;  // validator -> writer, valid packets
+			SpscRing<uint32_t> free; // validator -> network, broken packets
+			Doorbell bell;
+			std::thread thread;
+
+			// ACK sockets of last peers, oldest is replaced
+			std::array<std::optional<Sender>, ACK_PEERS> ackSenders;
+			std::array<std::string, ACK_PEERS> ackIps;
+			size_t ackPeers = 0;
+			size_t nextReplaced = 0;
+		};
+
+		void RunNetwork();
+		void RunValidator(Validator& validator);
+		bool TakeFree(uint32_t& index);
+		Sender& AckSender(Validator& validator, const std::string& ip);
+
+		// Session table slot: id << 32 | LIVE_SLOT | POLICY_SLOT | policy. Read without lock,
+		// changed under mSessionsLock by writer and by validators (new session, NAME)
+		static constexpr uint64_t EMPTY_SLOT = 0;
+		static constexpr uint64_t REMOVED_SLOT = 1;
+		static constexpr uint64_t LIVE_SLOT = 1 << 8;
+		static constexpr uint64_t POLICY_SLOT = 1 << 9; // session has policy of its own
+
+		size_t FindSession(uint32_t session) const;
+		size_t InsertSession(uint32_t session);
+		ChecksumPolicy DataChecksum(uint32_t session) const;
+		bool Admit(uint32_t session);
+
+		Receiver& mReceiver;
+		std::vector<Packet> mPackets;
+		std::vector<std::unique_ptr<Validator>> mValidators;
+
+		SpscRing<uint32_t> mWriterFree; // writer -> network
+		Doorbell mWriterBell;           // validators -> writer
+		Doorbell mFreeBell;             // writer, validators -> network
+		uint64_t mWriterSeen = 0;
+		size_t mNextOut = 0;            // writer: validator ring to look at first
+
+		std::vector<uint32_t> mFree;    // network: packets it can receive into
+
+		std::atomic<ChecksumPolicy> mDataChecksum{ ChecksumPolicy::Crc32 };
+		std::array<std::atomic<uint64_t>, SESSION_SLOTS> mSessions{}; // open addressing by session id
+		std::mutex mSessionsLock;
+		size_t mLiveSessions = 0; // under mSessionsLock
+		size_t mSessionLimit = 0;
+		std::atomic<bool> mStop{ false };
+		std::thread mNetwork;
+	};
+}
@@ -0,0 +1,299 @@
+#include "SendWindow.h"
+#include "CpuFeatures.h"
+
+#include <bit>
+#include <algorithm>
+
+using namespace UDP;
+
+/// ------------------------------------------------------------------------------------------------
+/// SCANS over ring slots [from, to), both return 'to' if nothing was found
+/// ------------------------------------------------------------------------------------------------
+
+using ClearScanFn = size_t(*)(const uint64_t* a, const uint64_t* b, size_t from, size_t to);
+using ExpiredScanFn = size_t(*)(const uint64_t* inFlight, const uint64_t* times, size_t from, size_t to, uint64_t deadline);
+
+/// <summary>
+/// First slot where bit is clear in both a and b. One 64-bit word covers 64 packets.
+/// </summary>
+static size_t ScanClearScalar(const uint64_t* a, const uint64_t* b, size_t from, size_t to)
+{
+	if (from >= to) return to;
+
+	size_t w = from >> 6;
+	uint64_t free = ~(a[w] | b[w]) & (~uint64_t(0) << (from & 63));
+
+	while (true)
+	{
+		if (free)
+			return (std::min)((w << 6) + std::countr_zero(free), to);
+
+		if ((++w << 6) >= to) return to;
+		free = ~(a[w] | b[w]);
+	}
+}
+
+/// <summary>
+/// First in-flight slot with send time older than deadline. Only words with packets in flight are checked.
+/// </summary>
+static size_t ScanExpiredScalar(const uint64_t* inFlight, const uint64_t* times, size_t from, size_t to, uint64_t deadline)
+{
+	if (from >= to) return to;
+
+	size_t w = from >> 6;
+	uint64_t bits = inFlight[w] & (~uint64_t(0) << (from & 63));
+
+	while (true)
+	{
+		while (bits)
+		{
+			size_t slot = (w << 6) + std::countr_zero(bits);
+			if (slot >= to) return to;
+			if (times[slot] < deadline) return slot;
+			bits &= bits - 1;
+		}
+
+		if ((++w << 6) >= to) return to;
+		bits = inFlight[w];
+	}
+}
+
+#ifdef KUCERP33_X64
+
+/// <summary>
+/// AVX2 variant, checks 4 words = 256 packets per step
+/// </summary>
+KUCERP33_TARGET("avx2")
+static size_t ScanClearAVX2(const uint64_t* a, const uint64_t* b, size_t from, size_t to)
+{
+	if (from >= to) return to;
+
+	// Head up to 4 word boundary the scalar way
+	size_t alignedFrom = ((from >> 8) + 1) << 8;
+	if (alignedFrom >= to) return ScanClearScalar(a, b, from, to);
+
+	size_t found = ScanClearScalar(a, b, from, alignedFrom);
+	if (found < alignedFrom) return found;
+
+	const __m256i ones = _mm256_set1_epi64x(-1);
+	for (size_t w = alignedFrom >> 6; (w << 6) < to; w += 4)
+	{
+		__m256i used = _mm256_or_si256(
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + w)),
+			_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + w)));
+
+		int full = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(used, ones)));
+		if (full != 0xF)
+			return ScanClearScalar(a, b, (w + std::countr_zero(static_cast<unsigned>(~full & 0xF))) << 6, to);
+	}
+
+	return to;
+}
+
+/// <summary>
+/// AVX2 variant, compares 4 send times per instruction and builds 64-bit expired mask per word
+/// </summary>
+KUCERP33_TARGET("avx2")
+static size_t ScanExpiredAVX2(const uint64_t* inFlight, const uint64_t* times, size_t from, size_t to, uint64_t deadline)
+{
+	if (from >= to) return to;
+
+	// Times are microseconds, far below 2^63 so signed compare is fine
+	const __m256i limit = _mm256_set1_epi64x(static_cast<long long>(deadline));
+
+	size_t w = from >> 6;
+	uint64_t bits = inFlight[w] & (~uint64_t(0) << (from & 63));
+
+	while (true)
+	{
+		if (bits)
+		{
+			uint64_t expired = 0;
+			const uint64_t* wordTimes = times + (w << 6);
+			for (int i = 0; i < 64; i += 4)
+			{
+				__m256i t = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(wordTimes + i));
+				int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(limit, t)));
+				expired |= static_cast<uint64_t>(mask) << i;
+			}
+
+			bits &= expired;
+			if (bits)
+				return (std::min)((w << 6) + std::countr_zero(bits), to);
+		}
+
+		if ((++w << 6) >= to) return to;
+		bits = inFlight[w];
+	}
+}
+
+#endif
+
+static ClearScanFn SelectClearScan()
+{
+#ifdef KUCERP33_X64
+	if (CpuFeatures::Get().avx2) return ScanClearAVX2;
+#endif
+	return ScanClearScalar;
+}
+
+static ExpiredScanFn SelectExpiredScan()
+{
+#ifdef KUCERP33_X64
+	if (CpuFeatures::Get().avx2) return ScanExpiredAVX2;
+#endif
+	return ScanExpiredScalar;
+}
+
+static const ClearScanFn ScanClear = SelectClearScan();
+static const ExpiredScanFn ScanExpired = SelectExpiredScan();
+
+
+/// ------------------------------------------------------------------------------------------------
+/// WINDOW
+/// ------------------------------------------------------------------------------------------------
+
+/// <summary>
+/// Creates window for totalChunks packets with at most window packets in flight
+/// </summary>
+/// <param name="totalChunks"></param>
+/// <param name="window"></param>
+SendWindow::SendWindow(size_t totalChunks, size_t window)
+	: mTotal(totalChunks), mWindow(window ? window : 1)
+{
+	// Ring has to hold whole window, 256 slots = one AVX2 step over the bitsets
+	mCapacity = std::bit_ceil((std::max)(mWindow, size_t(256)));
+	mMask = mCapacity - 1;
+
+	mAcked.assign(mCapacity / 64, 0);
+	mInFlight.assign(mCapacity / 64, 0);
+	mSendTime.assign(mCapacity, 0);
+	mFirstSendTime.assign(mCapacity, 0);
+	mRetransmits.assign(mCapacity, 0);
+}
+
+bool SendWindow::IsAcked(size_t seq) const
+{
+	if (seq < mBase) return true;
+	if (!InWindow(seq)) return false;
+	return TestBit(mAcked, Slot(seq));
+}
+
+bool SendWindow::IsInFlight(size_t seq) const
+{
+	if (!InWindow(seq)) return false;
+	return TestBit(mInFlight, Slot(seq));
+}
+
+uint64_t SendWindow::SendTime(size_t seq) const
+{
+	return InWindow(seq) ? mSendTime[Slot(seq)] : 0;
+}
+
+uint64_t SendWindow::FirstSendTime(size_t seq) const
+{
+	return InWindow(seq) ? mFirstSendTime[Slot(seq)] : 0;
+}
+
+uint32_t SendWindow::Retransmits(size_t seq) const
+{
+	return InWindow(seq) ? mRetransmits[Slot(seq)] : 0;
+}
+
+void SendWindow::MarkSent(size_t seq, uint64_t nowUs)
+{
+	if (!InWindow(seq) || seq >= mTotal) return;
+	size_t slot = Slot(seq);
+
+	// Was sent already -> retransmission
+	if (mSendTime[slot] != 0)
+	{
+		++mRetransmits[slot];
+		++mTotalRetransmits;
+	}
+	else
+	{
+		mFirstSendTime[slot] = nowUs ? nowUs : 1;
+	}
+
+	if (!TestBit(mInFlight, slot)) ++mInFlightCount;
+	SetBit(mInFlight, slot);
+	mSendTime[slot] = nowUs ? nowUs : 1; // 0 means never sent
+}
+
+bool SendWindow::MarkAcked(size_t seq)
+{
+	if (!InWindow(seq) || seq >= mTotal) return false;
+	size_t slot = Slot(seq);
+
+	if (TestBit(mAcked, slot)) return false;
+
+	if (TestBit(mInFlight, slot)) --mInFlightCount;
+	SetBit(mAcked, slot);
+	ClearBit(mInFlight, slot);
+	++mAckedCount;
+
+	// We move the window forward if possible, slots behind base are freed for new sequences
+	if (seq == mBase)
+	{
+		size_t newBase = ScanRange(mBase, Limit(), [this](size_t from, size_t to) {
+			return ScanClear(mAcked.data(), mAcked.data(), from, to);
+		});
+
+		for (; mBase < newBase; ++mBase)
+		{
+			size_t freed = Slot(mBase);
+			ClearBit(mAcked, freed);
+			ClearBit(mInFlight, freed);
+			mSendTime[freed] = 0;
+			mFirstSendTime[freed] = 0;
+			mRetransmits[freed] = 0;
+		}
+	}
+
+	return true;
+}
+
+void SendWindow::MarkLost(size_t seq)
+{
+	if (!InWindow(seq) || IsAcked(seq)) return;
+	if (TestBit(mInFlight, Slot(seq))) --mInFlightCount;
+	ClearBit(mInFlight, Slot(seq));
+}
+
+size_t SendWindow::NextUnsent(size_t from) const
+{
+	return ScanRange((std::max)(from, mBase), Limit(), [this](size_t from, size_t to) {
+		return ScanClear(mAcked.data(), mInFlight.data(), from, to);
+	});
+}
+
+size_t SendWindow::NextExpired(size_t from, uint64_t deadlineUs) const
+{
+	return ScanRange((std::max)(from, mBase), Limit(), [this, deadlineUs](size_t from, size_t to) {
+		return ScanExpired(mInFlight.data(), mSendTime.data(), from, to, deadlineUs);
+	});
+}
+
+/// <summary>
+/// Maps sequence range onto ring slots. Range is at most one ring long, so it wraps at most once.
+/// </summary>
+template <typename Scan>
+size_t SendWindow::ScanRange(size_t from, size_t to, Scan scan) const
+{
+	if (from >= to) return to;
+
+	size_t slotFrom = Slot(from);
+	size_t length = to - from;
+
+	// No wrap
+	if (slotFrom + length <= mCapacity)
+		return from + (scan(slotFrom, slotFrom + length) - slotFrom);
+
+	// Till the end of ring, then from its start
+	size_t firstPart = mCapacity - slotFrom;
+	size_t found = scan(slotFrom, mCapacity);
+	if (found < mCapacity) return from + (found - slotFrom);
+
+	return from + firstPart + scan(0, length - firstPart);
+}
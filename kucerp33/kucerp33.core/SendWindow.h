@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <chrono>
+
+namespace UDP
+{
+	// Monotonic clock for send times, in microseconds
+	inline uint64_t NowMicroseconds()
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+	}
+
+	/// <summary>
+	/// Selective repeat bookkeeping of the sender. Per-sequence state (acked, in-flight,
+	/// send time, first send time, retransmit count) is kept in parallel arrays over a ring of window size,
+	/// so memory does not grow with the file. Everything below Base() is acked,
+	/// everything from Limit() up was not sent yet.
+	/// Scans for next unsent/expired packet go word by word (AVX2 when available).
+	/// </summary>
+	class SendWindow
+	{
+	public:
+		SendWindow(size_t totalChunks, size_t window);
+
+		size_t Total() const { return mTotal; }
+		size_t Base() const { return mBase; }
+		size_t Limit() const { return (mBase + mWindow < mTotal) ? mBase + mWindow : mTotal; }
+		size_t AckedCount() const { return mAckedCount; }
+		bool IsDone() const { return mBase >= mTotal; }
+
+		bool IsAcked(size_t seq) const;
+		bool IsInFlight(size_t seq) const;
+		uint64_t SendTime(size_t seq) const;
+		// Time of first transmission, kept over retransmits
+		uint64_t FirstSendTime(size_t seq) const;
+		uint32_t Retransmits(size_t seq) const;
+		size_t TotalRetransmits() const { return mTotalRetransmits; }
+		// Sent and neither acked nor NACKed yet
+		size_t InFlightCount() const { return mInFlightCount; }
+
+		// Packet left the socket, counts retransmission if it was sent before
+		void MarkSent(size_t seq, uint64_t nowUs);
+		// Returns true if packet was not acked before. Moves the window
+		bool MarkAcked(size_t seq);
+		// NACK, packet will be returned by NextUnsent again
+		void MarkLost(size_t seq);
+
+		// First packet in [from, Limit()) that is neither acked nor in flight, Limit() if none
+		size_t NextUnsent(size_t from) const;
+		// First in-flight packet in [from, Limit()) sent before deadline, Limit() if none
+		size_t NextExpired(size_t from, uint64_t deadlineUs) const;
+
+	private:
+		size_t Slot(size_t seq) const { return seq & mMask; }
+		bool InWindow(size_t seq) const { return seq >= mBase && seq < mBase + mCapacity; }
+
+		static bool TestBit(const std::vector<uint64_t>& bits, size_t slot) { return (bits[slot >> 6] >> (slot & 63)) & 1; }
+		static void SetBit(std::vector<uint64_t>& bits, size_t slot) { bits[slot >> 6] |= uint64_t(1) << (slot & 63); }
+		static void ClearBit(std::vector<uint64_t>& bits, size_t slot) { bits[slot >> 6] &= ~(uint64_t(1) << (slot & 63)); }
+
+		// Runs ring scan over [from, to) sequence range, splitting it where the ring wraps
+		template <typename Scan>
+		size_t ScanRange(size_t from, size_t to, Scan scan) const;
+
+		size_t mTotal = 0;
+		size_t mWindow = 0;
+		size_t mCapacity = 0; // power of two, multiple of 256 slots
+		size_t mMask = 0;
+
+		size_t mBase = 0;
+		size_t mAckedCount = 0;
+		size_t mTotalRetransmits = 0;
+		size_t mInFlightCount = 0;
+
+		// Structure of arrays, indexed by Slot(seq)
+		std::vector<uint64_t> mAcked;     // bitset
+		std::vector<uint64_t> mInFlight;  // bitset
+		std::vector<uint64_t> mSendTime;  // microseconds
+		std::vector<uint64_t> mFirstSendTime;
+		std::vector<uint32_t> mRetransmits;
+	};
+}
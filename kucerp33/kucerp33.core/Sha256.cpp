@@ -0,0 +1,454 @@
+#include "Sha256.h"
+#include "CpuFeatures.h"
+
+#include <cstring>
+#include <algorithm>
+
+using namespace UDP;
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t INITIAL_STATE[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static inline uint32_t LoadBE32(const uint8_t* p)
+{
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static inline void StoreBE32(uint8_t* p, uint32_t v)
+{
+	p[0] = uint8_t(v >> 24);
+	p[1] = uint8_t(v >> 16);
+	p[2] = uint8_t(v >> 8);
+	p[3] = uint8_t(v);
+}
+
+static inline uint32_t Rotr(uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+
+/// ------------------------------------------------------------------------------------------------
+/// BLOCK COMPRESSION, state is updated with 'blocks' consecutive 64 byte blocks
+/// ------------------------------------------------------------------------------------------------
+
+using CompressFn = void(*)(uint32_t state[8], const uint8_t* data, size_t blocks);
+
+/// <summary>
+/// Portable variant, straight from FIPS 180-4
+/// </summary>
+static void CompressPortable(uint32_t state[8], const uint8_t* data, size_t blocks)
+{
+	uint32_t w[64];
+
+	for (; blocks > 0; --blocks, data += Sha256::BLOCK_SIZE)
+	{
+		for (int i = 0; i < 16; ++i) w[i] = LoadBE32(data + 4 * i);
+		for (int i = 16; i < 64; ++i)
+		{
+			uint32_t s0 = Rotr(w[i - 15], 7) ^ Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = Rotr(w[i - 2], 17) ^ Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+		for (int i = 0; i < 64; ++i)
+		{
+			uint32_t t1 = h + (Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+			uint32_t t2 = (Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+#ifdef KUCERP33_X64
+
+/// <summary>
+/// 4 rounds of SHA-NI. Step is constant after unrolling, so the schedule ifs vanish
+/// </summary>
+template <int Step>
+KUCERP33_TARGET("sha,sse4.1")
+static inline void ShaNiStep(__m128i& state0, __m128i& state1, __m128i& prev, __m128i& cur, __m128i& next)
+{
+	__m128i wk = _mm_add_epi32(cur, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&K[4 * Step])));
+	state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+
+	if constexpr (Step >= 3 && Step < 15)
+	{
+		next = _mm_add_epi32(next, _mm_alignr_epi8(cur, prev, 4));
+		next = _mm_sha256msg2_epu32(next, cur);
+	}
+
+	wk = _mm_shuffle_epi32(wk, 0x0E);
+	state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+
+	if constexpr (Step >= 1 && Step < 13)
+	{
+		prev = _mm_sha256msg1_epu32(prev, cur);
+	}
+}
+
+/// <summary>
+/// SHA-NI variant. State is kept as ABEF/CDGH pair the way sha256rnds2 wants it,
+/// one step is 4 rounds, message schedule is done by sha256msg1/msg2.
+/// </summary>
+KUCERP33_TARGET("sha,sse4.1")
+static void CompressSHANI(uint32_t state[8], const uint8_t* data, size_t blocks)
+{
+	const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	__m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0]));
+	__m128i state1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4]));
+
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);                // CDAB
+	state1 = _mm_shuffle_epi32(state1, 0x1B);          // EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);       // CDGH
+
+	for (; blocks > 0; --blocks, data += Sha256::BLOCK_SIZE)
+	{
+		const __m128i abefSave = state0;
+		const __m128i cdghSave = state1;
+
+		__m128i m0 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0)), byteSwap);
+		__m128i m1 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16)), byteSwap);
+		__m128i m2 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32)), byteSwap);
+		__m128i m3 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 48)), byteSwap);
+
+		// m0..m3 is ring of last 16 schedule words: prev, cur, next rotate every step
+		ShaNiStep<0>(state0, state1, m3, m0, m1);
+		ShaNiStep<1>(state0, state1, m0, m1, m2);
+		ShaNiStep<2>(state0, state1, m1, m2, m3);
+		ShaNiStep<3>(state0, state1, m2, m3, m0);
+		ShaNiStep<4>(state0, state1, m3, m0, m1);
+		ShaNiStep<5>(state0, state1, m0, m1, m2);
+		ShaNiStep<6>(state0, state1, m1, m2, m3);
+		ShaNiStep<7>(state0, state1, m2, m3, m0);
+		ShaNiStep<8>(state0, state1, m3, m0, m1);
+		ShaNiStep<9>(state0, state1, m0, m1, m2);
+		ShaNiStep<10>(state0, state1, m1, m2, m3);
+		ShaNiStep<11>(state0, state1, m2, m3, m0);
+		ShaNiStep<12>(state0, state1, m3, m0, m1);
+		ShaNiStep<13>(state0, state1, m0, m1, m2);
+		ShaNiStep<14>(state0, state1, m1, m2, m3);
+		ShaNiStep<15>(state0, state1, m2, m3, m0);
+
+		state0 = _mm_add_epi32(state0, abefSave);
+		state1 = _mm_add_epi32(state1, cdghSave);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);             // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);          // DCHG
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);       // DCBA
+	state1 = _mm_alignr_epi8(state1, tmp, 8);          // ABEF -> HGFE
+
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+}
+
+
+/// ------------------------------------------------------------------------------------------------
+/// AVX2 MULTI-BUFFER, lane i of every register belongs to message i
+/// ------------------------------------------------------------------------------------------------
+
+static constexpr size_t LANES = 8;
+
+KUCERP33_TARGET("avx2")
+static inline __m256i Rotr8(__m256i x, int n)
+{
+	return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+/// <summary>
+/// Compresses 'blocks' blocks of 8 messages at once, states are transposed:
+/// state[j] holds word j of all 8 messages.
+/// </summary>
+KUCERP33_TARGET("avx2")
+static void CompressAVX2x8(__m256i state[8], const uint8_t* const data[LANES], size_t blocks)
+{
+	const __m256i byteSwap = _mm256_set_epi64x(
+		0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL, 0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	__m256i w[16];
+
+	for (size_t block = 0; block < blocks; ++block)
+	{
+		const size_t at = block * Sha256::BLOCK_SIZE;
+
+		for (int i = 0; i < 16; ++i)
+		{
+			uint32_t words[LANES];
+			for (size_t lane = 0; lane < LANES; ++lane)
+			{
+				memcpy(&words[lane], data[lane] + at + 4 * i, sizeof(uint32_t));
+			}
+			w[i] = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(words)), byteSwap);
+		}
+
+		__m256i a = state[0], b = state[1], c = state[2], d = state[3];
+		__m256i e = state[4], f = state[5], g = state[6], h = state[7];
+
+		for (int i = 0; i < 64; ++i)
+		{
+			if (i >= 16)
+			{
+				__m256i w15 = w[(i - 15) & 15];
+				__m256i w2 = w[(i - 2) & 15];
+				__m256i s0 = _mm256_xor_si256(_mm256_xor_si256(Rotr8(w15, 7), Rotr8(w15, 18)), _mm256_srli_epi32(w15, 3));
+				__m256i s1 = _mm256_xor_si256(_mm256_xor_si256(Rotr8(w2, 17), Rotr8(w2, 19)), _mm256_srli_epi32(w2, 10));
+				w[i & 15] = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], s0), _mm256_add_epi32(w[(i - 7) & 15], s1));
+			}
+
+			__m256i sigma1 = _mm256_xor_si256(_mm256_xor_si256(Rotr8(e, 6), Rotr8(e, 11)), Rotr8(e, 25));
+			__m256i choose = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+			__m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, sigma1),
+				_mm256_add_epi32(_mm256_add_epi32(choose, _mm256_set1_epi32(static_cast<int>(K[i]))), w[i & 15]));
+
+			__m256i sigma0 = _mm256_xor_si256(_mm256_xor_si256(Rotr8(a, 2), Rotr8(a, 13)), Rotr8(a, 22));
+			__m256i majority = _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, c)), _mm256_and_si256(b, c));
+			__m256i t2 = _mm256_add_epi32(sigma0, majority);
+
+			h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+			d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+		}
+
+		state[0] = _mm256_add_epi32(state[0], a); state[1] = _mm256_add_epi32(state[1], b);
+		state[2] = _mm256_add_epi32(state[2], c); state[3] = _mm256_add_epi32(state[3], d);
+		state[4] = _mm256_add_epi32(state[4], e); state[5] = _mm256_add_epi32(state[5], f);
+		state[6] = _mm256_add_epi32(state[6], g); state[7] = _mm256_add_epi32(state[7], h);
+	}
+}
+
+/// <summary>
+/// Common full blocks of 8 messages go through AVX2, each message then finishes its own tail.
+/// </summary>
+KUCERP33_TARGET("avx2")
+static size_t HashLanesAVX2(const uint8_t* const data[LANES], const size_t lengths[LANES], uint32_t states[LANES][8])
+{
+	size_t blocks = lengths[0] / Sha256::BLOCK_SIZE;
+	for (size_t lane = 1; lane < LANES; ++lane)
+	{
+		blocks = (std::min)(blocks, lengths[lane] / Sha256::BLOCK_SIZE);
+	}
+
+	__m256i state[8];
+	for (int j = 0; j < 8; ++j) state[j] = _mm256_set1_epi32(static_cast<int>(INITIAL_STATE[j]));
+
+	CompressAVX2x8(state, data, blocks);
+
+	for (int j = 0; j < 8; ++j)
+	{
+		uint32_t words[LANES];
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(words), state[j]);
+		for (size_t lane = 0; lane < LANES; ++lane) states[lane][j] = words[lane];
+	}
+
+	return blocks * Sha256::BLOCK_SIZE;
+}
+
+#endif
+
+static Sha256Impl SelectImplementation()
+{
+#ifdef KUCERP33_X64
+	const CpuFeatures& cpu = CpuFeatures::Get();
+	if (cpu.sha && cpu.sse41) return Sha256Impl::SHANI;
+	if (cpu.avx2) return Sha256Impl::AVX2;
+#endif
+	return Sha256Impl::Portable;
+}
+
+static Sha256Impl ActiveImpl = SelectImplementation();
+
+static CompressFn Compress()
+{
+#ifdef KUCERP33_X64
+	if (ActiveImpl == Sha256Impl::SHANI) return CompressSHANI;
+#endif
+	return CompressPortable;
+}
+
+static CompressFn ActiveCompress = Compress();
+
+
+/// ------------------------------------------------------------------------------------------------
+/// SHA256
+/// ------------------------------------------------------------------------------------------------
+
+void Sha256::Init()
+{
+	memcpy(mState, INITIAL_STATE, sizeof(mState));
+	mBuffered = 0;
+	mTotal = 0;
+}
+
+/// <summary>
+/// Adds data to hash. Whole blocks are compressed straight from input, rest is buffered
+/// </summary>
+/// <param name="data"></param>
+/// <param name="length"></param>
+void Sha256::Update(const uint8_t* data, size_t length)
+{
+	mTotal += length;
+
+	if (mBuffered > 0)
+	{
+		size_t take = (std::min)(length, BLOCK_SIZE - mBuffered);
+		memcpy(mBuffer + mBuffered, data, take);
+		mBuffered += take;
+		data += take;
+		length -= take;
+
+		if (mBuffered < BLOCK_SIZE) return;
+
+		ActiveCompress(mState, mBuffer, 1);
+		mBuffered = 0;
+	}
+
+	size_t blocks = length / BLOCK_SIZE;
+	if (blocks > 0)
+	{
+		ActiveCompress(mState, data, blocks);
+		data += blocks * BLOCK_SIZE;
+		length -= blocks * BLOCK_SIZE;
+	}
+
+	if (length > 0)
+	{
+		memcpy(mBuffer, data, length);
+		mBuffered = length;
+	}
+}
+
+/// <summary>
+/// Padding (0x80, zeros, bit length) and digest. Object has to be Init()ed to be used again
+/// </summary>
+/// <returns></returns>
+Sha256::Digest Sha256::Finish()
+{
+	uint64_t bits = mTotal * 8;
+
+	mBuffer[mBuffered++] = 0x80;
+	if (mBuffered > BLOCK_SIZE - 8)
+	{
+		memset(mBuffer + mBuffered, 0, BLOCK_SIZE - mBuffered);
+		ActiveCompress(mState, mBuffer, 1);
+		mBuffered = 0;
+	}
+	memset(mBuffer + mBuffered, 0, BLOCK_SIZE - 8 - mBuffered);
+
+	StoreBE32(mBuffer + 56, static_cast<uint32_t>(bits >> 32));
+	StoreBE32(mBuffer + 60, static_cast<uint32_t>(bits));
+	ActiveCompress(mState, mBuffer, 1);
+
+	Digest digest;
+	for (int i = 0; i < 8; ++i) StoreBE32(digest.data() + 4 * i, mState[i]);
+	return digest;
+}
+
+Sha256::Digest Sha256::Hash(const uint8_t* data, size_t length)
+{
+	Sha256 hasher;
+	hasher.Update(data, length);
+	return hasher.Finish();
+}
+
+/// <summary>
+/// Hashes independent messages. With AVX2 and no SHA-NI they go 8 at a time,
+/// otherwise one by one (single SHA-NI stream is faster than 8 AVX2 lanes).
+/// </summary>
+/// <param name="data"></param>
+/// <param name="lengths"></param>
+/// <param name="count"></param>
+/// <param name="out"></param>
+void Sha256::HashMany(const uint8_t* const* data, const size_t* lengths, size_t count, Digest* out)
+{
+	size_t i = 0;
+
+#ifdef KUCERP33_X64
+	if (ActiveImpl == Sha256Impl::AVX2)
+	{
+		for (; i + LANES <= count; i += LANES)
+		{
+			uint32_t states[LANES][8];
+			size_t done = HashLanesAVX2(data + i, lengths + i, states);
+
+			for (size_t lane = 0; lane < LANES; ++lane)
+			{
+				Sha256 hasher;
+				memcpy(hasher.mState, states[lane], sizeof(hasher.mState));
+				hasher.mTotal = done;
+				hasher.Update(data[i + lane] + done, lengths[i + lane] - done);
+				out[i + lane] = hasher.Finish();
+			}
+		}
+	}
+#endif
+
+	for (; i < count; ++i)
+	{
+		out[i] = Hash(data[i], lengths[i]);
+	}
+}
+
+Sha256Impl Sha256::Implementation()
+{
+	return ActiveImpl;
+}
+
+bool Sha256::SetImplementation(Sha256Impl impl)
+{
+#ifdef KUCERP33_X64
+	const CpuFeatures& cpu = CpuFeatures::Get();
+	if (impl == Sha256Impl::SHANI && !(cpu.sha && cpu.sse41)) return false;
+	if (impl == Sha256Impl::AVX2 && !cpu.avx2) return false;
+#else
+	if (impl != Sha256Impl::Portable) return false;
+#endif
+
+	ActiveImpl = impl;
+	ActiveCompress = Compress();
+	return true;
+}
+
+const char* Sha256::ImplementationName(Sha256Impl impl)
+{
+	switch (impl)
+	{
+	case Sha256Impl::SHANI: return "SHA-NI";
+	case Sha256Impl::AVX2: return "AVX2 x8";
+	default: return "portable";
+	}
+}
+
+
+std::string UDP::ToHex(const uint8_t* data, size_t length)
+{
+	static const char digits[] = "0123456789abcdef";
+
+	std::string hex(length * 2, '0');
+	for (size_t i = 0; i < length; ++i)
+	{
+		hex[2 * i] = digits[data[i] >> 4];
+		hex[2 * i + 1] = digits[data[i] & 0xF];
+	}
+	return hex;
+}
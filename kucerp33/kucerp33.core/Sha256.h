@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <string>
+
+namespace UDP
+{
+	enum class Sha256Impl
+	{
+		Portable,
+		AVX2,  // 8 messages at once, only for HashMany
+		SHANI  // Intel SHA extensions
+	};
+
+	/// <summary>
+	/// Incremental SHA-256. Block compression is picked at runtime by CPU features
+	/// (SHA-NI, else portable code). HashMany hashes independent messages side by side,
+	/// with AVX2 that is 8 messages per pass when SHA-NI is missing.
+	/// Nothing is allocated, partial block lives inside the object.
+	/// </summary>
+	class Sha256
+	{
+	public:
+		static constexpr size_t DIGEST_SIZE = 32;
+		static constexpr size_t BLOCK_SIZE = 64;
+		using Digest = std::array<uint8_t, DIGEST_SIZE>;
+
+		Sha256() { Init(); }
+
+		void Init();
+		void Update(const uint8_t* data, size_t length);
+		Digest Finish();
+
+		// One shot
+		static Digest Hash(const uint8_t* data, size_t length);
+		// count independent messages, out[i] = Hash(data[i], lengths[i])
+		static void HashMany(const uint8_t* const* data, const size_t* lengths, size_t count, Digest* out);
+
+		// Active implementation, can be forced (benchmarks), false if CPU does not support it
+		static Sha256Impl Implementation();
+		static bool SetImplementation(Sha256Impl impl);
+		static const char* ImplementationName(Sha256Impl impl);
+
+	private:
+		uint32_t mState[8];
+		uint8_t mBuffer[BLOCK_SIZE];
+		size_t mBuffered = 0;
+		uint64_t mTotal = 0;
+	};
+
+	// Lowercase hex of bytes, for printing digests
+	std::string ToHex(const uint8_t* data, size_t length);
+}
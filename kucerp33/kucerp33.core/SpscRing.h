@@ -0,0 +1,328 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <bit>
+#include <algorithm>
+
+namespace UDP
+{
+	/// <summary>
+	/// Lock-free ring between exactly one producer and one consumer thread.
+	/// Head and tail live on their own cache lines, each side keeps a copy of the other
+	/// index and reads the shared one only when the ring looks full / empty.
+	/// </summary>
+	template <typename T>
+	class SpscRing
+	{
+	public:
+		explicit SpscRing(size_t capacity)
+			: mSlots(std::bit_ceil((std::max)(capacity, size_t(2))))
+		{
+			mMask = mSlots.size() - 1;
+		}
+
+		SpscRing(const SpscRing&) = delete;
+		SpscRing& operator=(const SpscRing&) = delete;
+
+		size_t Capacity() const { return mSlots.size(); }
+
+		// Producer only, false if ring is full
+		bool TryPush(const T& value)
+		{
+			size_t tail = mTail.load(std::memory_order_relaxed);
+			if (tail - mHeadCache == mSlots.size())
+			{
+				mHeadCache = mHead.load(std::memory_order_acquire);
+				if (tail - mHeadCache == mSlots.size()) return false;
+			}
+
+			mSlots[tail & mMask] = value;
+			mTail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Consumer only, false if ring is empty
+		bool TryPop(T& out)
+		{
+			size_t head = mHead.load(std::memory_order_relaxed);
+			if (head == mTailCache)
+			{
+				mTailCache = mTail.load(std::memory_order_acquire);
+				if (head == mTailCache) return false;
+			}
+
+			out = mSlots[head & mMask];
+			mHead.store(head + 1, std::memory_order_release);
+			return true;
+		}
+
+	private:
+		std::vector<T> mSlots;
+		size_t mMask = 0;
+
+		alignas(64) std::atomic<size_t> mHead{ 0 }; // consumer
+		size_t mTailCache = 0;
+
+		alignas(64) std::atomic<size_t> mTail{ 0 }; // producer
+		size_t mHeadCache = 0;
+	};
+
+	/// <summary>
+	/// Lock-free bounded ring of many producer threads and one consumer (Vyukov's queue).
+	/// Every slot has its own sequence: producers claim a position with one CAS and publish
+	/// the slot by its sequence, so a slow producer holds back only the consumer, not other producers.
+	/// Values are filled and read in place, large slots are not copied.
+	/// </summary>
+	template <typename T>
+	class MpscRing
+	{
+	public:
+		explicit MpscRing(size_t capacity)
+			: mSlots(std::bit_ceil((std::max)(capacity, size_t(2))))
+		{
+			mMask = mSlots.size() - 1;
+			for (size_t i = 0; i < mSlots.size(); ++i) mSlots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
+		MpscRing(const MpscRing&) = delete;
+		MpscRing& operator=(const MpscRing&) = delete;
+
+		size_t Capacity() const { return mSlots.size(); }
+
+		// Any thread, fill(T&) writes the value. False if ring is full
+		template <typename Fill>
+		bool TryPush(Fill&& fill)
+		{
+			size_t tail = mTail.load(std::memory_order_relaxed);
+			Slot* slot = nullptr;
+			while (true)
+			{
+				slot = &mSlots[tail & mMask];
+				size_t sequence = slot->sequence.load(std::memory_order_acquire);
+				intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(tail);
+
+				if (diff == 0)
+				{
+					if (mTail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) break;
+				}
+				else if (diff < 0)
+				{
+					return false; // consumer did not free the slot yet
+				}
+				else
+				{
+					tail = mTail.load(std::memory_order_relaxed);
+				}
+			}
+
+			fill(slot->value);
+			slot->sequence.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+
+		// Consumer only, consume(const T&) reads the value. False if ring is empty
+		template <typename Consume>
+		bool TryPop(Consume&& consume)
+		{
+			Slot& slot = mSlots[mHead & mMask];
+			if (slot.sequence.load(std::memory_order_acquire) != mHead + 1) return false;
+
+			consume(static_cast<const T&>(slot.value));
+			slot.sequence.store(mHead + mSlots.size(), std::memory_order_release);
+			++mHead;
+			return true;
+		}
+
+	private:
+		struct Slot
+		{
+			std::atomic<size_t> sequence{ 0 };
+			T value{};
+		};
+
+		std::vector<Slot> mSlots;
+		size_t mMask = 0;
+
+		alignas(64) std::atomic<size_t> mTail{ 0 }; // producers
+		alignas(64) size_t mHead = 0;               // consumer
+	};
+
+	/// <summary>
+	/// Lets consumer of lock-free rings sleep while they are empty. Producer rings after push,
+	/// mutex is touched only when somebody sleeps.
+	/// </summary>
+	class Doorbell
+	{
+	public:
+		void Ring()
+		{
+			mCount.fetch_add(1);
+			if (mSleeping.load() == 0) return;
+
+			std::lock_guard<std::mutex> lock(mMutex);
+			mWake.notify_all();
+		}
+
+		// Returns right away if it rang since seen, otherwise sleeps until it does or timeout runs out
+		void Wait(uint64_t& seen, uint64_t timeoutUs)
+		{
+			uint64_t count = mCount.load();
+			if (count == seen)
+			{
+				std::unique_lock<std::mutex> lock(mMutex);
+				mSleeping.fetch_add(1);
+				mWake.wait_for(lock, std::chrono::microseconds(timeoutUs), [&]() { return mCount.load() != seen; });
+				mSleeping.fetch_sub(1);
+				count = mCount.load();
+			}
+			seen = count;
+		}
+
+	private:
+		std::atomic<uint64_t> mCount{ 0 };
+		std::atomic<uint32_t> mSleeping{ 0 };
+		std::mutex mMutex;
+		std::condition_variable mWake;
+	};
+
+	/// <summary>
+	/// SPSC rings of many writer threads drained by one reader (Log, Trace). Thread claims a ring
+	/// on its first push and gives it back when it ends, so writing never allocates and short-lived
+	/// threads do not use the pool up. Ring full = item dropped and counted, reader reports the loss.
+	/// Thread keeps its ring in thread_local of the item type, so there is one pool per type.
+	/// </summary>
+	template <typename T>
+	class ThreadRingPool
+	{
+	public:
+		struct Ring
+		{
+			Ring(size_t capacity, uint8_t index) : items(capacity), index(index) {}
+
+			// Owner thread only
+			void Push(const T& item)
+			{
+				if (!items.TryPush(item)) dropped.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			SpscRing<T> items;
+			uint8_t index = 0;
+			std::atomic<bool> claimed{ false };
+			std::atomic<uint64_t> dropped{ 0 }; // written by owner thread
+			uint64_t reported = 0;              // reader
+		};
+
+		// Made once and kept, threads hold pointers to rings. Later calls do nothing
+		void Create(size_t threads, size_t capacity)
+		{
+			if (!mRings.empty()) return;
+
+			mRings.reserve(threads);
+			for (size_t i = 0; i < threads; ++i) mRings.push_back(std::make_unique<Ring>(capacity, static_cast<uint8_t>(i)));
+		}
+
+		// Writer: ring of calling thread, nullptr once pool was found empty
+		Ring* Mine()
+		{
+			ThreadSlot& slot = tSlot;
+			if (!slot.ring && !slot.none)
+			{
+				slot.ring = Claim();
+				slot.none = !slot.ring;
+			}
+			return slot.ring;
+		}
+
+		// Reader: consume(const T&) gets every item, lost(count, ring index) items dropped since last call
+		template <typename Consume, typename Lost>
+		void Drain(Consume&& consume, Lost&& lost)
+		{
+			T item;
+			for (auto& ring : mRings)
+			{
+				while (ring->items.TryPop(item)) consume(static_cast<const T&>(item));
+
+				uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+				if (dropped != ring->reported)
+				{
+					lost(dropped - ring->reported, ring->index);
+					ring->reported = dropped;
+				}
+			}
+		}
+
+	private:
+		// Ring goes back to pool when its thread ends, everything pushed is visible to next owner
+		struct ThreadSlot
+		{
+			~ThreadSlot()
+			{
+				if (ring) ring->claimed.store(false, std::memory_order_release);
+			}
+
+			Ring* ring = nullptr;
+			bool none = false; // pool was empty, do not look again
+		};
+
+		Ring* Claim()
+		{
+			for (auto& ring : mRings)
+			{
+				bool expected = false;
+				if (ring->claimed.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) return ring.get();
+			}
+			return nullptr;
+		}
+
+		std::vector<std::unique_ptr<Ring>> mRings;
+		static inline thread_local ThreadSlot tSlot;
+	};
+
+	/// <summary>
+	/// Background thread of Log, Trace and PacketCapture: drain() runs every interval and once more
+	/// after Stop, so nothing written before Stop is lost
+	/// </summary>
+	class DrainThread
+	{
+	public:
+		~DrainThread() { Stop(); }
+
+		template <typename Drain>
+		void Start(uint64_t intervalUs, Drain drain)
+		{
+			mStop = false;
+			mThread = std::thread([this, intervalUs, drain]() mutable
+			{
+				uint64_t seen = 0;
+				while (true)
+				{
+					bool stopping = mStop.load();
+					drain();
+
+					if (stopping) break;
+					mBell.Wait(seen, intervalUs);
+				}
+			});
+		}
+
+		void Stop()
+		{
+			mStop = true;
+			mBell.Ring();
+			if (mThread.joinable()) mThread.join();
+		}
+
+	private:
+		Doorbell mBell;
+		std::atomic<bool> mStop{ false };
+		std::thread mThread;
+	};
+}
@@ -0,0 +1,297 @@
+#include "TaskScheduler.h"
+
+#include <algorithm>
+
+using namespace UDP;
+
+// Worker running on this thread, tasks it spawns go to its own deque
+static thread_local TaskScheduler* CurrentScheduler = nullptr;
+static thread_local size_t CurrentWorker = TaskScheduler::OUTSIDE;
+
+/// ------------------------------------------------------------------------------------------------
+/// WORK DEQUE
+/// ------------------------------------------------------------------------------------------------
+
+TaskScheduler::WorkDeque::WorkDeque()
+	: mSlots(DEQUE_CAPACITY)
+{
+	static_assert((DEQUE_CAPACITY & (DEQUE_CAPACITY - 1)) == 0, "Deque capacity must be power of two");
+}
+
+bool TaskScheduler::WorkDeque::Push(Task* task)
+{
+	int64_t bottom = mBottom.load(std::memory_order_relaxed);
+	int64_t top = mTop.load(std::memory_order_acquire);
+	if (bottom - top >= static_cast<int64_t>(mSlots.size())) return false;
+
+	mSlots[static_cast<size_t>(bottom) & (mSlots.size() - 1)].store(task, std::memory_order_relaxed);
+	mBottom.store(bottom + 1, std::memory_order_release);
+	return true;
+}
+
+/// <summary>
+/// Bottom is taken first, then top is read. Thief does it the other way round, so both of them
+/// see the other one when they go for the last task and CAS on top decides
+/// </summary>
+/// <returns></returns>
+TaskScheduler::Task* TaskScheduler::WorkDeque::Pop()
+{
+	int64_t bottom = mBottom.load(std::memory_order_relaxed) - 1;
+	mBottom.store(bottom, std::memory_order_seq_cst);
+	int64_t top = mTop.load(std::memory_order_seq_cst);
+
+	if (top > bottom)
+	{
+		mBottom.store(bottom + 1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	Task* task = mSlots[static_cast<size_t>(bottom) & (mSlots.size() - 1)].load(std::memory_order_relaxed);
+	if (top == bottom)
+	{
+		if (!mTop.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			task = nullptr;
+		mBottom.store(bottom + 1, std::memory_order_relaxed);
+	}
+	return task;
+}
+
+TaskScheduler::Task* TaskScheduler::WorkDeque::Steal()
+{
+	int64_t top = mTop.load(std::memory_order_seq_cst);
+	int64_t bottom = mBottom.load(std::memory_order_seq_cst);
+
+	// Lost race only means somebody else got that task, the next one may be still there
+	while (top < bottom)
+	{
+		Task* task = mSlots[static_cast<size_t>(top) & (mSlots.size() - 1)].load(std::memory_order_relaxed);
+		if (mTop.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			return task;
+		bottom = mBottom.load(std::memory_order_seq_cst);
+	}
+	return nullptr;
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// INJECT QUEUE
+/// ------------------------------------------------------------------------------------------------
+
+TaskScheduler::InjectQueue::InjectQueue()
+	: mCells(INJECT_CAPACITY)
+{
+	static_assert((INJECT_CAPACITY & (INJECT_CAPACITY - 1)) == 0, "Queue capacity must be power of two");
+
+	for (size_t i = 0; i < mCells.size(); ++i)
+		mCells[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+/// <summary>
+/// Cell is free for position pos when its sequence is pos, full when it is pos + 1
+/// </summary>
+/// <param name="task"></param>
+/// <returns>false if queue is full</returns>
+bool TaskScheduler::InjectQueue::Push(Task* task)
+{
+	size_t pos = mEnqueue.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		Cell& cell = mCells[pos & (mCells.size() - 1)];
+		size_t sequence = cell.sequence.load(std::memory_order_acquire);
+		intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+
+		if (diff == 0)
+		{
+			if (mEnqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				cell.task = task;
+				cell.sequence.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+		}
+		else if (diff < 0)
+		{
+			return false;
+		}
+		else
+		{
+			pos = mEnqueue.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+TaskScheduler::Task* TaskScheduler::InjectQueue::Pop()
+{
+	size_t pos = mDequeue.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		Cell& cell = mCells[pos & (mCells.size() - 1)];
+		size_t sequence = cell.sequence.load(std::memory_order_acquire);
+		intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+
+		if (diff == 0)
+		{
+			if (mDequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				Task* task = cell.task;
+				cell.sequence.store(pos + mCells.size(), std::memory_order_release);
+				return task;
+			}
+		}
+		else if (diff < 0)
+		{
+			return nullptr;
+		}
+		else
+		{
+			pos = mDequeue.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// SCHEDULER
+/// ------------------------------------------------------------------------------------------------
+
+TaskScheduler::Group::~Group()
+{
+	if (TaskScheduler* scheduler = mScheduler.load(std::memory_order_relaxed)) scheduler->Wait(*this);
+}
+
+TaskScheduler::TaskScheduler(size_t threads)
+{
+	size_t count = (std::max<size_t>)(1, threads);
+
+	mWorkers.reserve(count);
+	for (size_t i = 0; i < count; ++i) mWorkers.push_back(std::make_unique<Worker>());
+
+	// Started once all deques exist, workers steal from each other right away
+	for (size_t i = 0; i < count; ++i)
+		mWorkers[i]->thread = std::thread(&TaskScheduler::WorkerLoop, this, i);
+}
+
+TaskScheduler::~TaskScheduler()
+{
+	mStop = true;
+	mWork.Ring();
+
+	for (auto& worker : mWorkers)
+	{
+		if (worker->thread.joinable()) worker->thread.join();
+	}
+}
+
+size_t TaskScheduler::DefaultThreads()
+{
+	unsigned cores = std::thread::hardware_concurrency();
+	return cores > 1 ? cores - 1 : 0;
+}
+
+TaskScheduler& TaskScheduler::Shared()
+{
+	static TaskScheduler scheduler(DefaultThreads());
+	return scheduler;
+}
+
+/// <summary>
+/// Worker puts task to its own deque, other threads to the shared queue
+/// </summary>
+/// <param name="task"></param>
+/// <param name="group"></param>
+void TaskScheduler::Spawn(Task& task, Group& group)
+{
+	task.group = &group;
+	group.mScheduler.store(this, std::memory_order_relaxed);
+	group.mPending.fetch_add(1, std::memory_order_relaxed);
+
+	if (CurrentScheduler == this && mWorkers[CurrentWorker]->deque.Push(&task))
+	{
+		mWork.Ring();
+		return;
+	}
+	Submit(&task);
+}
+
+/// <summary>
+/// Shared queue, when even that is full task runs right away on the caller
+/// </summary>
+/// <param name="task"></param>
+void TaskScheduler::Submit(Task* task)
+{
+	if (mInject.Push(task))
+	{
+		mWork.Ring();
+		return;
+	}
+	Run(*task, CurrentScheduler == this ? CurrentWorker : OUTSIDE);
+}
+
+/// <summary>
+/// Own deque first (newest task, warm cache), then shared queue, then other workers
+/// starting with the next one, so thieves do not all go for the same victim
+/// </summary>
+/// <param name="worker"></param>
+/// <returns>nullptr if there is nothing to run</returns>
+TaskScheduler::Task* TaskScheduler::FindTask(size_t worker)
+{
+	if (Task* task = mWorkers[worker]->deque.Pop()) return task;
+	if (Task* task = mInject.Pop()) return task;
+
+	const size_t count = mWorkers.size();
+	for (size_t i = 1; i < count; ++i)
+	{
+		if (Task* task = mWorkers[(worker + i) % count]->deque.Steal()) return task;
+	}
+	return nullptr;
+}
+
+/// <summary>
+/// Group is read before task runs, task may spawn itself again
+/// </summary>
+/// <param name="task"></param>
+/// <param name="worker"></param>
+void TaskScheduler::Run(Task& task, size_t worker)
+{
+	Group* group = task.group;
+	task.function(task, worker);
+
+	// Group may be gone once it is done, only scheduler is touched after that
+	if (group->mPending.fetch_sub(1, std::memory_order_acq_rel) == 1) mDone.Ring();
+}
+
+void TaskScheduler::Wait(Group& group)
+{
+	const bool worker = CurrentScheduler == this;
+	uint64_t seen = 0;
+
+	while (!group.Done())
+	{
+		if (worker)
+		{
+			if (Task* task = FindTask(CurrentWorker))
+			{
+				Run(*task, CurrentWorker);
+				continue;
+			}
+		}
+		mDone.Wait(seen, IDLE_TIMEOUT);
+	}
+}
+
+void TaskScheduler::WorkerLoop(size_t worker)
+{
+	CurrentScheduler = this;
+	CurrentWorker = worker;
+	Worker& self = *mWorkers[worker];
+
+	while (!mStop.load(std::memory_order_relaxed))
+	{
+		if (Task* task = FindTask(worker))
+		{
+			Run(*task, worker);
+			continue;
+		}
+
+		// Nothing to run, sleep until new task
+		mWork.Wait(self.seen, IDLE_TIMEOUT);
+	}
+}
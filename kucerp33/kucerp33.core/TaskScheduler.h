@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+
+#include "SpscRing.h"
+
+namespace UDP
+{
+	class TaskScheduler;
+
+	/// <summary>
+	/// Work-stealing scheduler shared by all transfers of the process. Fixed set of workers,
+	/// each owns a deque: tasks it spawns are pushed and popped at its bottom (newest first,
+	/// data still in cache), idle workers steal from the top of others (oldest first).
+	/// Threads outside the pool submit through a bounded lock-free queue every worker takes from.
+	/// Tasks are intrusive, caller owns the Task (like context of a job) until its Group is done,
+	/// so spawning does not allocate.
+	/// </summary>
+	class TaskScheduler
+	{
+	public:
+		// Tasks one worker can hold, more go to the shared queue
+		static constexpr size_t DEQUE_CAPACITY = 4096;
+		// Tasks submitted from outside the pool and not yet taken, more run right away on caller
+		static constexpr size_t INJECT_CAPACITY = 4096;
+		// How long idle worker sleeps before it looks again (stop), microseconds
+		static constexpr uint64_t IDLE_TIMEOUT = 20 * 1000;
+		// Worker index passed to tasks which run on a thread outside the pool
+		static constexpr size_t OUTSIDE = SIZE_MAX;
+
+		struct Task;
+		// worker is 0..Size()-1 (e.g. index of per-thread state), OUTSIDE when pool was full
+		using Function = void(*)(Task& task, size_t worker);
+
+		// Tasks which did not finish yet. Destructor waits for them, so a group declared after
+		// everything its tasks touch keeps it alive
+		class Group
+		{
+		public:
+			Group() = default;
+			~Group();
+
+			Group(const Group&) = delete;
+			Group& operator=(const Group&) = delete;
+
+			bool Done() const { return mPending.load(std::memory_order_acquire) == 0; }
+
+		private:
+			friend class TaskScheduler;
+
+			std::atomic<size_t> mPending{ 0 };
+			std::atomic<TaskScheduler*> mScheduler{ nullptr }; // spawners of one group may race, same value
+		};
+
+		struct Task
+		{
+			Function function = nullptr;
+			void* context = nullptr;
+			size_t index = 0; // free for the caller (first seq of a range...)
+
+			// Set by Spawn
+			Group* group = nullptr;
+		};
+
+		explicit TaskScheduler(size_t threads);
+		~TaskScheduler();
+
+		TaskScheduler(const TaskScheduler&) = delete;
+		TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+		size_t Size() const { return mWorkers.size(); }
+
+		// Any thread. Task must not be spawned again before it ran
+		void Spawn(Task& task, Group& group);
+		// Until all tasks of group finished. Worker runs other tasks meanwhile,
+		// thread outside the pool only sleeps (it has no per-worker state tasks could use)
+		void Wait(Group& group);
+
+		// Worker threads worth starting next to the calling one, 0 on single core
+		static size_t DefaultThreads();
+		// Scheduler of the process, started on first use with DefaultThreads() workers (at least one)
+		static TaskScheduler& Shared();
+
+	private:
+		// Chase-Lev deque with fixed capacity. Owner pushes and pops at bottom, anyone steals from top
+		class WorkDeque
+		{
+		public:
+			WorkDeque();
+
+			bool Push(Task* task);  // owner, false if full
+			Task* Pop();            // owner
+			Task* Steal();          // any thread, nullptr if empty or lost the race
+
+		private:
+			std::vector<std::atomic<Task*>> mSlots;
+			alignas(64) std::atomic<int64_t> mTop{ 0 };
+			alignas(64) std::atomic<int64_t> mBottom{ 0 };
+		};
+
+		// Bounded multi-producer multi-consumer queue (sequence number per cell)
+		class InjectQueue
+		{
+		public:
+			InjectQueue();
+
+			bool Push(Task* task);
+			Task* Pop();
+
+		private:
+			struct Cell
+			{
+				std::atomic<size_t> sequence{ 0 };
+				Task* task = nullptr;
+			};
+
+			std::vector<Cell> mCells;
+			alignas(64) std::atomic<size_t> mEnqueue{ 0 };
+			alignas(64) std::atomic<size_t> mDequeue{ 0 };
+		};
+
+		struct Worker
+		{
+			WorkDeque deque;
+			std::thread thread;
+			uint64_t seen = 0; // of mWork
+		};
+
+		void WorkerLoop(size_t worker);
+		Task* FindTask(size_t worker);
+		void Run(Task& task, size_t worker);
+		void Submit(Task* task);
+
+		std::vector<std::unique_ptr<Worker>> mWorkers;
+
+		InjectQueue mInject;
+		Doorbell mWork; // new task
+		Doorbell mDone; // group finished
+
+		std::atomic<bool> mStop{ false };
+	};
+}
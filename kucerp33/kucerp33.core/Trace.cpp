@@ -0,0 +1,240 @@
+#include "Trace.h"
+#include "SpscRing.h"
+#include "AllocationCounter.h"
+#include "SmartDebug.h"
+
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <charconv>
+
+using namespace UDP;
+
+std::atomic<bool> Trace::sEnabled{ false };
+
+struct TraceState
+{
+	~TraceState() { Trace::Stop(); }
+
+	ThreadRingPool<TraceEvent> rings;
+
+	std::ofstream file;
+	uint32_t processId = 1;
+	std::chrono::steady_clock::time_point start;
+
+	DrainThread drain;
+	std::string text; // JSON waiting for file, made by Start
+	std::mutex lifecycle; // Start/Stop
+};
+
+static TraceState gTrace;
+
+static void Drain();
+
+/// ------------------------------------------------------------------------------------------------
+/// RECORDING
+/// ------------------------------------------------------------------------------------------------
+
+static void Push(TraceEvent& event)
+{
+	ThreadRingPool<TraceEvent>::Ring* ring = gTrace.rings.Mine();
+	if (!ring) return;
+
+	event.thread = ring->index;
+	ring->Push(event);
+}
+
+uint64_t Trace::Now()
+{
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - gTrace.start).count());
+}
+
+void Trace::Instant(const char* name, const char* argName, uint64_t arg)
+{
+	if (!Enabled()) return;
+
+	TraceEvent event;
+	event.name = name;
+	event.argName = argName;
+	event.arg = arg;
+	event.time = Now();
+	event.phase = 'i';
+	Push(event);
+}
+
+/// <summary>
+/// Span which started at start ends now
+/// </summary>
+void Trace::Complete(const char* name, uint64_t start, const char* argName, uint64_t arg, uint64_t asyncId)
+{
+	if (!Enabled()) return;
+
+	TraceEvent event;
+	event.name = name;
+	event.argName = argName;
+	event.arg = arg;
+	event.asyncId = asyncId;
+	event.time = start;
+	uint64_t now = Now();
+	event.duration = now > start ? now - start : 0;
+	event.phase = 'X';
+	Push(event);
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// START / STOP
+/// ------------------------------------------------------------------------------------------------
+
+static void AppendNumber(std::string& out, uint64_t value)
+{
+	char number[24];
+	out.append(number, std::to_chars(number, number + sizeof(number), value).ptr);
+}
+
+/// <summary>
+/// Opens the file, writes process name and starts background thread
+/// </summary>
+/// <param name="path"></param>
+/// <param name="processName">plain text, it is not escaped</param>
+/// <param name="processId">pid in the trace</param>
+/// <returns>false if file could not be opened</returns>
+bool Trace::Start(const std::string& path, const char* processName, uint32_t processId)
+{
+	std::lock_guard<std::mutex> lock(gTrace.lifecycle);
+	if (sEnabled.load()) return true;
+
+	gTrace.rings.Create(MAX_THREADS, RING_EVENTS);
+
+	gTrace.file.open(path, std::ios::binary | std::ios::trunc);
+	if (!gTrace.file)
+	{
+		ERR("Trace file " << path << " could not be opened");
+		return false;
+	}
+
+	gTrace.processId = processId;
+	gTrace.text.clear();
+	gTrace.text.reserve(64 * 1024);
+	gTrace.text += "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":";
+	AppendNumber(gTrace.text, processId);
+	gTrace.text += ",\"args\":{\"name\":\"";
+	gTrace.text += processName;
+	gTrace.text += "\"}}";
+	gTrace.file << gTrace.text;
+	gTrace.text.clear();
+
+	gTrace.start = std::chrono::steady_clock::now();
+	gTrace.drain.Start(DRAIN_INTERVAL, Drain);
+
+	sEnabled = true;
+	return true;
+}
+
+void Trace::Stop()
+{
+	std::lock_guard<std::mutex> lock(gTrace.lifecycle);
+	if (!sEnabled.load()) return;
+
+	sEnabled = false;
+	gTrace.drain.Stop();
+
+	gTrace.file << "\n]}\n";
+	gTrace.file.close();
+}
+
+/// ------------------------------------------------------------------------------------------------
+/// BACKGROUND THREAD
+/// ------------------------------------------------------------------------------------------------
+
+// Nanoseconds as microseconds with three decimals, unit of the format
+static void AppendMicroseconds(std::string& out, uint64_t ns)
+{
+	AppendNumber(out, ns / 1000);
+	char fraction[4] = { '.', char('0' + ns / 100 % 10), char('0' + ns / 10 % 10), char('0' + ns % 10) };
+	out.append(fraction, sizeof(fraction));
+}
+
+static void AppendEvent(std::string& out, const TraceEvent& event, char phase, uint64_t time)
+{
+	out += ",\n{\"name\":\"";
+	out += event.name;
+	out += "\",\"cat\":\"kucerp33\",\"ph\":\"";
+	out += phase;
+	out += "\",\"pid\":";
+	AppendNumber(out, gTrace.processId);
+	out += ",\"tid\":";
+	AppendNumber(out, event.thread);
+	out += ",\"ts\":";
+	AppendMicroseconds(out, time);
+
+	if (phase == 'X')
+	{
+		out += ",\"dur\":";
+		AppendMicroseconds(out, event.duration);
+	}
+	else if (phase == 'i')
+	{
+		out += ",\"s\":\"t\"";
+	}
+	else
+	{
+		out += ",\"id\":";
+		AppendNumber(out, event.asyncId);
+	}
+
+	if (event.argName)
+	{
+		out += ",\"args\":{\"";
+		out += event.argName;
+		out += "\":";
+		AppendNumber(out, event.arg);
+		out += '}';
+	}
+	out += '}';
+}
+
+static void Emit(const TraceEvent& event, std::string& out)
+{
+	if (event.phase == 'X' && event.asyncId != 0)
+	{
+		AppendEvent(out, event, 'b', event.time);
+		AppendEvent(out, event, 'e', event.time + event.duration);
+	}
+	else
+	{
+		AppendEvent(out, event, static_cast<char>(event.phase), event.time);
+	}
+
+	if (out.size() > 60 * 1024)
+	{
+		gTrace.file << out;
+		out.clear();
+	}
+}
+
+/// <summary>
+/// One pass over every ring into the file, lost events are reported as one instant per ring.
+/// Events of different threads are not sorted, viewer does that
+/// </summary>
+static void Drain()
+{
+	UncountedAllocations uncounted;
+	std::string& text = gTrace.text;
+
+	gTrace.rings.Drain([&](const TraceEvent& event) { Emit(event, text); },
+		[&](uint64_t count, uint8_t ring)
+	{
+		TraceEvent lost;
+		lost.name = "Trace events dropped";
+		lost.argName = "count";
+		lost.arg = count;
+		lost.time = Trace::Now();
+		lost.phase = 'i';
+		lost.thread = ring;
+		Emit(lost, text);
+	});
+
+	gTrace.file << text;
+	text.clear();
+}
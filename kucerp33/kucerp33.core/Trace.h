@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <atomic>
+
+// 0 = tracing is compiled out, spans and instants cost nothing
+#ifndef KUCERP33_TRACE
+#define KUCERP33_TRACE 1
+#endif
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// Span from here to end of scope. Name (and argument name) must be string literals
+#define TRACE_SCOPE(...) ::UDP::TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(__VA_ARGS__)
+
+// Point in time, e.g. TRACE_INSTANT("Timeout", "seq", seq)
+#define TRACE_INSTANT(...) \
+	do { \
+		if constexpr (KUCERP33_TRACE) \
+			if (::UDP::Trace::Enabled()) ::UDP::Trace::Instant(__VA_ARGS__); \
+	} while (0)
+
+namespace UDP
+{
+	// Names point to string literals, they are turned into text only by background thread
+	struct TraceEvent
+	{
+		const char* name = nullptr;
+		const char* argName = nullptr; // no argument when null
+		uint64_t time = 0;     // nanoseconds since Trace::Start
+		uint64_t duration = 0; // spans only
+		uint64_t arg = 0;
+		uint64_t asyncId = 0;  // span which is suspended (coroutine), written as async begin/end
+		uint8_t phase = 0;     // 'X' span, 'i' instant
+		uint8_t thread = 0;    // ring index
+	};
+
+	/// <summary>
+	/// Timeline of the process in Chrome trace-event JSON, for Perfetto (ui.perfetto.dev) or chrome://tracing.
+	/// Same scheme as Log: every thread writes events into its own lock-free ring claimed from
+	/// a pool made by Start, background thread drains them into the file. Disabled tracer costs
+	/// one relaxed load per span, KUCERP33_TRACE 0 removes even that.
+	/// </summary>
+	class Trace
+	{
+	public:
+		static constexpr size_t MAX_THREADS = 32;
+		static constexpr size_t RING_EVENTS = 8192;
+		// How often background thread drains rings, microseconds
+		static constexpr uint64_t DRAIN_INTERVAL = 10 * 1000;
+
+		// Process name and id are shown by the viewer, traces of sender and receiver can be opened together
+		static bool Start(const std::string& path, const char* processName, uint32_t processId = 1);
+		// Everything recorded so far is written, file is closed
+		static void Stop();
+		static bool Enabled() { return sEnabled.load(std::memory_order_relaxed); }
+
+		// Nanoseconds since Start
+		static uint64_t Now();
+
+		static void Instant(const char* name, const char* argName = nullptr, uint64_t arg = 0);
+		static void Complete(const char* name, uint64_t start, const char* argName, uint64_t arg, uint64_t asyncId);
+
+	private:
+		static std::atomic<bool> sEnabled;
+	};
+
+	/// <summary>
+	/// Span of the scope it lives in, recorded as one event when it ends.
+	/// Span which lives across co_await should get async id (e.g. session), otherwise
+	/// spans of coroutines on one thread would overlap in the viewer
+	/// </summary>
+	class TraceSpan
+	{
+	public:
+		explicit TraceSpan(const char* name, const char* argName = nullptr, uint64_t arg = 0, uint64_t asyncId = 0)
+		{
+			if constexpr (KUCERP33_TRACE)
+			{
+				if (!Trace::Enabled()) return;
+				mName = name;
+				mArgName = argName;
+				mArg = arg;
+				mAsyncId = asyncId;
+				mStart = Trace::Now();
+			}
+		}
+		~TraceSpan() { End(); }
+
+		TraceSpan(const TraceSpan&) = delete;
+		TraceSpan& operator=(const TraceSpan&) = delete;
+
+		// Argument known only at the end (e.g. packets sent)
+		void SetArg(const char* argName, uint64_t arg)
+		{
+			mArgName = argName;
+			mArg = arg;
+		}
+
+		// Before end of scope, only first call counts
+		void End()
+		{
+			if constexpr (KUCERP33_TRACE)
+			{
+				if (!mName) return;
+				Trace::Complete(mName, mStart, mArgName, mArg, mAsyncId);
+				mName = nullptr;
+			}
+		}
+
+	private:
+		const char* mName = nullptr;
+		const char* mArgName = nullptr;
+		uint64_t mArg = 0;
+		uint64_t mAsyncId = 0;
+		uint64_t mStart = 0;
+	};
+}
@@ -1,12 +1,22 @@
 #include "UDPCommunication.h"
 #include "SmartDebug.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "PacketCapture.h"
 #include "FileTransfer.h"
-#include "crc.hpp"
+#include "Crc32.h"
+
+#include <charconv>
 
 using namespace UDP;
 
 #define _WINSOCK_DEPRECATED_NO_WARNINGS
 
+static CaptureEndpoint Endpoint(const sockaddr_in& address)
+{
+	return CaptureEndpoint{ address.sin_addr.s_addr, ntohs(address.sin_port) };
+}
+
 /// ------------------------------------------------------------------------------------------------
 /// SOCKET
 /// ------------------------------------------------------------------------------------------------
@@ -78,11 +88,11 @@ Sender::~Sender()
 /// </summary>
 /// <param name="text"></param>
 /// <returns></returns>
-bool Sender::SendText(const std::string& text)
+bool Sender::SendText(std::string_view text)
 {
 	if (mSocket == INVALID_SOCKET) return false;
 
-	int sent = sendto(mSocket, text.c_str(), static_cast<int>(text.size()), 0,
+	int sent = sendto(mSocket, text.data(), static_cast<int>(text.size()), 0,
 		reinterpret_cast<sockaddr*>(&mTarget), sizeof(mTarget));
 
 	if (sent == SOCKET_ERROR)
@@ -91,7 +101,8 @@ bool Sender::SendText(const std::string& text)
 		return false;
 	}
 
-	std::cout << "Sending message: \"" << text << "\"\n";
+	PacketCapture::Sent(text.data(), text.size(), Endpoint(mTarget));
+	LOG_BYTES(LogEvent::ControlSent, text.data(), text.size());
 
 	return true;
 }
@@ -115,47 +126,75 @@ bool Sender::SendData(const Chunk& chunk)
 		return false;
 	}
 
-	PrintChunkLine(chunk);
+	PacketCapture::Sent(chunk.data.data(), chunk.packetSize, Endpoint(mTarget));
+	PacketHeader header = chunk.Header();
+	LOG_EVENT(LogEvent::ChunkSent, header.crc, header.seq, header.command, header.offset, header.session);
 
 	return true;
 }
 
 /// <summary>
 /// Sends ACK or NACK message based on state
-// todo need to be moved as chunk packet so CRC works
 /// </summary>
 /// <param name="state"></param>
 /// <param name="seq"></param>
-/// <param name="ip"></param>
-/// <param name="port"></param>
+/// <param name="session"></param>
 /// <returns></returns>
-bool Sender::SendAckOrNack(bool state, uint32_t seq)
+bool Sender::SendAckOrNack(bool state, uint32_t seq, uint32_t session)
 {
-	std::string msg = "INVALID";
-	if (state)
-	{
-		msg = "ACK=" + std::to_string(seq);
-	}
-	else
-	{
-		msg = "NACK=" + std::to_string(seq);
-	}
+	return SendControl(state ? "ACK=" : "NACK=", &seq, session);
+}
 
-	boost::crc_32_type result;
+/// <summary>
+/// Final verdict of receiver about whole file (hash check)
+/// </summary>
+/// <param name="state"></param>
+/// <param name="session"></param>
+/// <returns></returns>
+bool Sender::SendFileAckOrNack(bool state, uint32_t session)
+{
+	return SendControl(state ? "FACK" : "FNACK", nullptr, session);
+}
 
-	result.process_bytes(msg.data(), msg.size());
-	uint32_t CRC = result.checksum();
+/// <summary>
+/// Asks sender for Merkle leaf hashes starting with firstLeaf
+/// </summary>
+/// <param name="firstLeaf"></param>
+/// <param name="session"></param>
+/// <returns></returns>
+bool Sender::SendLeafRequest(uint32_t firstLeaf, uint32_t session)
+{
+	return SendControl("LEAF=", &firstLeaf, session);
+}
 
-	std::string withCrc;
-	withCrc.reserve(sizeof(CRC) + msg.size());
+/// <summary>
+/// Control message: CRC + text (+ number), whole message lives on the stack
+/// </summary>
+/// <param name="prefix"></param>
+/// <param name="number">optional number after prefix</param>
+/// <param name="session">"@<hex>" after the rest, left out when 0</param>
+/// <returns></returns>
+bool Sender::SendControl(std::string_view prefix, const uint32_t* number, uint32_t session)
+{
+	// CRC + "NACK=" + up to 10 digits + "@" + 8 hex digits
+	char msg[sizeof(uint32_t) + 5 + 10 + 1 + 8];
+	char* payload = msg + sizeof(uint32_t);
 
-	// pilepme 4 byty CRC
-	withCrc.append(reinterpret_cast<const char*>(&CRC), sizeof(CRC));
+	std::memcpy(payload, prefix.data(), prefix.size());
+	char* end = payload + prefix.size();
+	if (number) end = std::to_chars(end, msg + sizeof(msg), *number).ptr;
+	if (session)
+	{
+		*end++ = '@';
+		end = std::to_chars(end, msg + sizeof(msg), session, 16).ptr;
+	}
 
-	// za n pvodn payload
-	withCrc.append(msg);
+	uint32_t CRC = Crc32::Compute(payload, end - payload);
 
-	return SendText(withCrc);
+	// 4 bytes of CRC in front of the payload
+	std::memcpy(msg, &CRC, sizeof(CRC));
+
+	return SendText(std::string_view(msg, end - msg));
 }
 
 
@@ -180,6 +219,7 @@ Receiver::Receiver(uint16_t port)
 	addr.sin_family = AF_INET;
 	addr.sin_addr.s_addr = INADDR_ANY;
 	addr.sin_port = htons(port);
+	mPort = port;
 
 	if (bind(mSocket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR)
 	{
@@ -222,6 +262,7 @@ bool Receiver::ReceiveText(std::string& outText, std::string* outFromIp, uint16_
 		return false;
 	}
 
+	PacketCapture::Received(buffer, received, Endpoint(from), mPort);
 	buffer[received] = '\0';
 	outText.assign(buffer, received);
 
@@ -243,18 +284,34 @@ bool Receiver::ReceiveText(std::string& outText, std::string* outFromIp, uint16_
 /// Receives data into chunk. Waits time to see if data is available or not. See: UDP::RECEIVER_TIMEOUT
 /// </summary>
 /// <param name="data"></param>
+/// <param name="ack">false if CRC does not match</param>
 /// <param name="outFromIp"></param>
 /// <param name="outFromPort"></param>
 /// <returns></returns>
 bool Receiver::ReceiveData(UDP::Chunk& data, bool& ack, std::string* outFromIp, uint16_t* outFromPort)
 {
 	ack = true;
+	if (!ReceivePacket(data, outFromIp, outFromPort)) return false;
+
+	ack = CheckCRC(data, mDataChecksum);
+	return true;
+}
+
+
+/// <summary>
+/// Receives packet into chunk and decodes its header, CRC is not checked (see CheckCRC).
+/// Waits time to see if data is available or not. See: UDP::RECEIVER_TIMEOUT
+/// </summary>
+/// <param name="data"></param>
+/// <param name="outFromIp"></param>
+/// <param name="outFromPort"></param>
+/// <param name="timeout">microseconds, 0 only takes what is already there</param>
+/// <returns></returns>
+bool Receiver::ReceivePacket(UDP::Chunk& data, std::string* outFromIp, uint16_t* outFromPort, long timeout)
+{
 	if (mSocket == INVALID_SOCKET)
 		return false;
 
-	// buffer for data
-	uint8_t buffer[UDP::PACKET_MAX_LENGTH];
-
 	sockaddr_in from{};
 	int fromLen = sizeof(from);
 
@@ -264,8 +321,8 @@ bool Receiver::ReceiveData(UDP::Chunk& data, bool& ack, std::string* outFromIp,
 	FD_SET(mSocket, &readfds);
 
 	timeval tv{};
-	tv.tv_sec = 0;
-	tv.tv_usec = UDP::RECEIVER_TIMEOUT; // 200 ms timeout
+	tv.tv_sec = timeout / 1000000;
+	tv.tv_usec = timeout % 1000000;
 
 	int sel = select(0, &readfds, nullptr, nullptr, &tv);
 	if (sel == SOCKET_ERROR)
@@ -276,7 +333,11 @@ bool Receiver::ReceiveData(UDP::Chunk& data, bool& ack, std::string* outFromIp,
 	}
 	if (sel == 0) return false; // Nothing to be read
 
-	int received = recvfrom(mSocket, reinterpret_cast<char*>(buffer), UDP::PACKET_MAX_LENGTH, 0,
+	// We receive straight into the chunk. Chunk reused by caller keeps its capacity,
+	// so this does not allocate after the first packet
+	data.data.resize(UDP::PACKET_MAX_LENGTH);
+
+	int received = recvfrom(mSocket, reinterpret_cast<char*>(data.data.data()), UDP::PACKET_MAX_LENGTH, 0,
 							reinterpret_cast<sockaddr*>(&from), &fromLen);
 
 	if (received == SOCKET_ERROR)
@@ -291,10 +352,12 @@ bool Receiver::ReceiveData(UDP::Chunk& data, bool& ack, std::string* outFromIp,
 		return false;
 	}
 
+	// Before any check, so broken packets are in capture too
+	PacketCapture::Received(data.data.data(), static_cast<size_t>(received), Endpoint(from), mPort);
+
 	// we get chunk
 	data.packetSize = static_cast<size_t>(received);
 	data.data.resize(data.packetSize);
-	std::memcpy(data.data.data(), buffer, data.packetSize);
 
 	if (!data.CheckValidity())
 	{
@@ -302,17 +365,11 @@ bool Receiver::ReceiveData(UDP::Chunk& data, bool& ack, std::string* outFromIp,
 		return false;
 	}
 
-	// We parse data into chunk for easier usage later
-	data.RetrieveCRC();
-	data.RetrieveSeq();
-	data.RetrieveOffset();
-	uint32_t crc = data.ComputeCRC();
-
-	// CRC
-	if (crc != data.retrievedCRC)
+	// We parse data into chunk for easier usage later, whole header in one load
+	if (!data.LoadHeader())
 	{
-		std::cerr << "Receiver: CRC mismatch (seq=" << data.seq << ", offset=" << data.offset << ")\n";
-		ack = false;
+		std::cerr << "Receiver: packet shorter than header (" << received << " bytes)\n";
+		return false;
 	}
 
 	// IP + port
@@ -330,67 +387,49 @@ bool Receiver::ReceiveData(UDP::Chunk& data, bool& ack, std::string* outFromIp,
 }
 
 
-
 /// <summary>
-/// Receives ACK or NACK. Checks if it has correct sequence number. Waits designated time
+/// Checks CRC of received chunk, DATA as agreed for the session, policy None has nothing to check
 /// </summary>
-/// <param name="expectedSeq"></param>
-/// <param name="timeout">timeout in microseconds! see UDP::ACK_RECEIVER_TIMEOUT</param>
-/// <param name="outIsNack">received ACK/NACK</param>
-/// <returns></returns>
-bool Receiver::ReceiveAckOrNack(uint32_t expectedSeq, int timeout, bool& outIsNack)
+/// <param name="data">chunk with loaded header</param>
+/// <param name="dataChecksum"></param>
+/// <returns>false on mismatch</returns>
+bool Receiver::CheckCRC(UDP::Chunk& data, ChecksumPolicy dataChecksum)
 {
-	if (mSocket == INVALID_SOCKET)
-		return false;
-
-	// Timeout
-	fd_set readfds;
-	FD_ZERO(&readfds);
-	FD_SET(mSocket, &readfds);
+	ChecksumPolicy policy = data.command == Command::Data ? dataChecksum : ChecksumPolicy::Crc32;
 
-	timeval tv{};
-	tv.tv_sec  = timeout / 1000000;
-	tv.tv_usec = timeout % 1000000;
-
-	int sel = select(0, &readfds, nullptr, nullptr, &tv);
-	if (sel == SOCKET_ERROR)
+	if (policy != ChecksumPolicy::None && data.ComputeCRC(policy) != data.retrievedCRC)
 	{
-		std::cerr << "Sender: select() failed, err=" << WSAGetLastError() << "\n";
+		LOG_EVENT(LogEvent::CrcMismatch, data.seq, data.offset);
+		Metrics::Process().Add(Counter::CrcFailures);
 		return false;
 	}
+	return true;
+}
 
-	// Nothing
-	if (sel == 0) return false;
-
-	// Something to read
-	char buffer[1024 + 1];
-	sockaddr_in from{};
-	int fromLen = sizeof(from);
 
-	int received = recvfrom(mSocket, buffer, 1024, 0,
-		(sockaddr*)&from, &fromLen);
 
-	if (received == SOCKET_ERROR)
+/// <summary>
+/// Checks CRC of the control message and parses "ACK=<n>", "NACK=<n>", "LEAF=<n>", "FACK" or "FNACK" in place,
+/// optionally followed by "@<hex session>". Works directly on the receive buffer, nothing is allocated.
+/// </summary>
+/// <param name="buffer">received datagram: CRC + text</param>
+/// <param name="received">length of datagram</param>
+/// <param name="out">parsed message</param>
+/// <returns></returns>
+static bool ParseControl(const char* buffer, int received, ControlMessage& out)
+{
+	std::string_view msg(buffer, received);
+	if (msg.size() < sizeof(uint32_t))
 	{
-		std::cerr << "Receiver: recvfrom() for ACK/NACK failed, err=" << WSAGetLastError() << "\n";
+		std::cerr << "Sender: acknowladgement too short (" << msg.size() << " bytes)\n";
 		return false;
 	}
 
-	buffer[received] = '\0';
-	std::string msg(buffer, received);
-
-	// We want "ACK=<n>" or "NACK=<n>"
-	bool isAck = false;
-	bool isNack = false;
-	uint32_t seq = 0;
-
 	// CRC
 	uint32_t receivedCRC = 0;
 	memcpy(&receivedCRC, msg.data(), sizeof(receivedCRC));
-	
-	boost::crc_32_type result;
-	result.process_bytes(msg.data() + sizeof(receivedCRC), msg.size() - sizeof(receivedCRC));
-	uint32_t CRC = result.checksum();
+
+	uint32_t CRC = Crc32::Compute(msg.data() + sizeof(receivedCRC), msg.size() - sizeof(receivedCRC));
 
 	if (receivedCRC != CRC)
 	{
@@ -398,37 +437,51 @@ bool Receiver::ReceiveAckOrNack(uint32_t expectedSeq, int timeout, bool& outIsNa
 		return false;
 	}
 
-	// New message 
-	const char* payloadPtr = msg.data() + sizeof(uint32_t);
-	size_t      payloadLen = msg.size() - sizeof(uint32_t);
+	// Cut off CRC
+	std::string_view payload = msg.substr(sizeof(uint32_t));
+	std::string_view number;
 
-	std::string payload(payloadPtr, payloadLen);
+	out.value = 0;
+	out.session = 0;
 
-	if (payload.rfind("ACK=", 0) == 0)
+	// Session of the transfer
+	size_t at = payload.find('@');
+	if (at != std::string_view::npos)
 	{
-		isAck = true;
-		try
-		{
-			seq = static_cast<uint32_t>(std::stoul(payload.substr(4)));
-		}
-		catch (...)
+		std::string_view session = payload.substr(at + 1);
+		auto [ptr, ec] = std::from_chars(session.data(), session.data() + session.size(), out.session, 16);
+		if (ec != std::errc() || ptr != session.data() + session.size())
 		{
-			std::cerr << "Sender: invalid ACK format: " << payload << "\n";
+			std::cerr << "Sender: invalid session in control message: " << payload << "\n";
 			return false;
 		}
+		payload = payload.substr(0, at);
 	}
-	else if (payload.rfind("NACK=", 0) == 0)
+
+	if (payload == "FACK")
 	{
-		isNack = true;
-		try
-		{
-			seq = static_cast<uint32_t>(std::stoul(payload.substr(5)));
-		}
-		catch (...)
-		{
-			std::cerr << "Sender: invalid NACK format: " << payload << "\n";
-			return false;
-		}
+		out.type = ControlType::FileAck;
+		return true;
+	}
+	else if (payload == "FNACK")
+	{
+		out.type = ControlType::FileNack;
+		return true;
+	}
+	else if (payload.starts_with("NACK="))
+	{
+		out.type = ControlType::Nack;
+		number = payload.substr(5);
+	}
+	else if (payload.starts_with("ACK="))
+	{
+		out.type = ControlType::Ack;
+		number = payload.substr(4);
+	}
+	else if (payload.starts_with("LEAF="))
+	{
+		out.type = ControlType::Leaf;
+		number = payload.substr(5);
 	}
 	else
 	{
@@ -437,29 +490,24 @@ bool Receiver::ReceiveAckOrNack(uint32_t expectedSeq, int timeout, bool& outIsNa
 		return false;
 	}
 
-	// What if the NACK or ACK is for different packet?
-	if (seq != expectedSeq)
+	auto [ptr, ec] = std::from_chars(number.data(), number.data() + number.size(), out.value);
+	if (ec != std::errc() || ptr == number.data())
 	{
-		std::cerr << "Sender: ACK/NACK for unexpected seq=" << seq
-			<< ", expected=" << expectedSeq << "\n";
-
+		std::cerr << "Sender: invalid control message format: " << payload << "\n";
 		return false;
 	}
 
-	// We have our ACK or NACk
-	outIsNack = isNack;
 	return true;
 }
 
 
 /// <summary>
-/// Receives any ACK or NACK. Waits designated time
+/// Receives any control message (ACK, NACK, LEAF, FACK, FNACK). Waits designated time
 /// </summary>
-/// <param name="expectedSeq"></param>
+/// <param name="out"></param>
 /// <param name="timeout">timeout in microseconds! see UDP::ACK_RECEIVER_TIMEOUT</param>
-/// <param name="outIsNack">received ACK/NACK</param>
 /// <returns></returns>
-bool Receiver::ReceiveAnyAckOrNack(uint32_t& sequence, int timeout, bool& outIsNack)
+bool Receiver::ReceiveControl(ControlMessage& out, int timeout)
 {
 	if (mSocket == INVALID_SOCKET)
 		return false;
@@ -497,64 +545,30 @@ bool Receiver::ReceiveAnyAckOrNack(uint32_t& sequence, int timeout, bool& outIsN
 		return false;
 	}
 
-	buffer[received] = '\0';
-	std::string msg(buffer, received);
+	PacketCapture::Received(buffer, received, Endpoint(from), mPort);
+	return ParseControl(buffer, received, out);
+}
 
-	// We want "ACK=<n>" or "NACK=<n>"
-	bool isAck = false;
-	bool isNack = false;
-	uint32_t seq = 0;
 
-	// CRC Check
-	uint32_t receivedCRC = 0;
-	memcpy(&receivedCRC, msg.data(), sizeof(receivedCRC));
-
-	boost::crc_32_type result;
-	result.process_bytes(msg.data() + sizeof(receivedCRC), msg.size() - sizeof(receivedCRC));
-	uint32_t CRC = result.checksum();
+/// <summary>
+/// Receives ACK or NACK. Checks if it has correct sequence number. Waits designated time
+/// </summary>
+/// <param name="expectedSeq"></param>
+/// <param name="timeout">timeout in microseconds! see UDP::ACK_RECEIVER_TIMEOUT</param>
+/// <param name="outIsNack">received ACK/NACK</param>
+/// <returns></returns>
+bool Receiver::ReceiveAckOrNack(uint32_t expectedSeq, int timeout, bool& outIsNack)
+{
+	uint32_t seq = 0;
+	bool isNack = false;
+	if (!ReceiveAnyAckOrNack(seq, timeout, isNack)) return false;
 
-	if (receivedCRC != CRC)
+	// What if the NACK or ACK is for different packet?
+	if (seq != expectedSeq)
 	{
-		std::cerr << "Sender: CRC missmatch for acknowladgement : " << msg << "\n";
-		return false;
-	}
-
-	// Cut off message 
-	const char* payloadPtr = msg.data() + sizeof(uint32_t);
-	size_t      payloadLen = msg.size() - sizeof(uint32_t);
-
-	std::string payload(payloadPtr, payloadLen);
+		std::cerr << "Sender: ACK/NACK for unexpected seq=" << seq
+			<< ", expected=" << expectedSeq << "\n";
 
-	if (payload.rfind("NACK=", 0) == 0)
-	{
-		isNack = true;
-		try
-		{
-			sequence = static_cast<uint32_t>(std::stoul(payload.substr(5)));
-		}
-		catch (...)
-		{
-			std::cerr << "Sender: invalid NACK format: " << payload << "\n";
-			return false;
-		}
-	}
-	else if (payload.rfind("ACK=", 0) == 0)
-	{
-		isAck = true;
-		try
-		{
-			sequence = static_cast<uint32_t>(std::stoul(payload.substr(4)));
-		}
-		catch (...)
-		{
-			std::cerr << "Sender: invalid ACK format: " << payload << "\n";
-			return false;
-		}
-	}
-	else
-	{
-		// Something different received
-		std::cerr << "Sender: unknown control message: " << payload << "\n";
 		return false;
 	}
 
@@ -564,69 +578,50 @@ bool Receiver::ReceiveAnyAckOrNack(uint32_t& sequence, int timeout, bool& outIsN
 }
 
 
-
-bool Receiver::ReceiveFileAckOrNack(int timeout, bool& outIsNack)
+/// <summary>
+/// Receives any ACK or NACK. Waits designated time
+/// </summary>
+/// <param name="expectedSeq"></param>
+/// <param name="timeout">timeout in microseconds! see UDP::ACK_RECEIVER_TIMEOUT</param>
+/// <param name="outIsNack">received ACK/NACK</param>
+/// <returns></returns>
+bool Receiver::ReceiveAnyAckOrNack(uint32_t& sequence, int timeout, bool& outIsNack)
 {
-	if (mSocket == INVALID_SOCKET)
-		return false;
-
-	// Timeout
-	fd_set readfds;
-	FD_ZERO(&readfds);
-	FD_SET(mSocket, &readfds);
-
-	timeval tv{};
-	tv.tv_sec = timeout / 1000000;
-	tv.tv_usec = timeout % 1000000;
+	ControlMessage msg;
+	if (!ReceiveControl(msg, timeout)) return false;
 
-	int sel = select(0, &readfds, nullptr, nullptr, &tv);
-	if (sel == SOCKET_ERROR)
+	if (msg.type != ControlType::Ack && msg.type != ControlType::Nack)
 	{
-		std::cerr << "Sender: select() failed, err=" << WSAGetLastError() << "\n";
+		std::cerr << "Sender: expected ACK/NACK, got other control message\n";
 		return false;
 	}
 
-	// Nothing
-	if (sel == 0) return false;
-
-	// Something to read
-	char buffer[1024 + 1];
-	sockaddr_in from{};
-	int fromLen = sizeof(from);
-
-	int received = recvfrom(mSocket, buffer, 1024, 0,
-		(sockaddr*)&from, &fromLen);
-
-	if (received == SOCKET_ERROR)
-	{
-		std::cerr << "Receiver: recvfrom() for ACK/NACK failed, err=" << WSAGetLastError() << "\n";
-		return false;
-	}
+	// We have our ACK or NACk
+	sequence = msg.value;
+	outIsNack = msg.type == ControlType::Nack;
+	return true;
+}
 
-	buffer[received] = '\0';
-	std::string msg(buffer, received);
 
-	// We want "ACK=<n>" or "NACK=<n>"
-	bool isAck = false;
-	bool isNack = false;
-	uint32_t seq = 0;
+/// <summary>
+/// Receives FACK or FNACK, verdict of receiver about whole file
+/// </summary>
+/// <param name="timeout">timeout in microseconds! see UDP::ACK_RECEIVER_TIMEOUT</param>
+/// <param name="outIsNack"></param>
+/// <returns></returns>
+bool Receiver::ReceiveFileAckOrNack(int timeout, bool& outIsNack)
+{
+	ControlMessage msg;
+	if (!ReceiveControl(msg, timeout)) return false;
 
-	if (msg.rfind("FACK", 0) == 0)
-	{
-		isAck = true;
-	}
-	else if (msg.rfind("FNACK", 0) == 0)
-	{
-		isNack = true;
-	}
-	else
+	// We want "FACK" or "FNACK"
+	if (msg.type != ControlType::FileAck && msg.type != ControlType::FileNack)
 	{
-		// Something different received
-		std::cerr << "Sender: unknown control message: " << msg << "\n";
+		std::cerr << "Sender: expected FACK/FNACK, got other control message\n";
 		return false;
 	}
 
 	// We have our ACK or NACk
-	outIsNack = isNack;
+	outIsNack = msg.type == ControlType::FileNack;
 	return true;
-}
\ No newline at end of file
+}
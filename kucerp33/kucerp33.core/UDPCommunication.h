@@ -6,6 +6,8 @@
 #include <WS2tcpip.h>
 #include <string_view>
 
+#include "PacketHeader.h"
+
 #pragma comment(lib, "Ws2_32.lib")
 
 namespace UDP
@@ -25,6 +27,24 @@ namespace UDP
 	constexpr long RECEIVER_TIMEOUT = 100 * 1000; // 200 ms
 	constexpr long ACK_RECEIVER_TIMEOUT = 200 * 1000; // 500 ms
 
+	// Messages going back from receiver to sender, see ParseControl.
+	// Session id of the transfer follows as "@<hex>", so one ACK socket can serve many transfers
+	enum class ControlType
+	{
+		Ack,      // ACK=<seq>
+		Nack,     // NACK=<seq>
+		Leaf,     // LEAF=<first leaf>, request of Merkle leaf hashes
+		FileAck,  // FACK, file hash is correct
+		FileNack  // FNACK, file is broken
+	};
+
+	struct ControlMessage
+	{
+		ControlType type = ControlType::Ack;
+		uint32_t value = 0;
+		uint32_t session = 0; // 0 = receiver did not say
+	};
+
 	class WindowsSocketInit
 	{
 	public:
@@ -44,12 +64,16 @@ namespace UDP
 		~Sender();
 
 		bool IsOk() const { return mSocket != INVALID_SOCKET; }
-		bool SendText(const std::string& text);
+		bool SendText(std::string_view text);
 		bool SendData(const Chunk& chunk);
 
-		bool SendAckOrNack(bool state, uint32_t seq);
-		bool SendFileAckOrNack(bool state);
+		// Session is id of transfer the message belongs to, 0 leaves it out
+		bool SendAckOrNack(bool state, uint32_t seq, uint32_t session = 0);
+		bool SendFileAckOrNack(bool state, uint32_t session = 0);
+		bool SendLeafRequest(uint32_t firstLeaf, uint32_t session = 0);
 	private:
+		bool SendControl(std::string_view prefix, const uint32_t* number, uint32_t session);
+
 		SOCKET mSocket = INVALID_SOCKET;
 		sockaddr_in mTarget{};
 	};
@@ -62,13 +86,24 @@ namespace UDP
 		~Receiver();
 
 		bool IsOk() const { return mSocket != INVALID_SOCKET; }
+		// For waiting on more sockets at once (see EventLoop)
+		SOCKET Handle() const { return mSocket; }
 		bool ReceiveText(std::string& outText, std::string* outFromIp = nullptr, uint16_t* outFromPort = nullptr);
 		bool ReceiveData(UDP::Chunk& data, bool& ack, std::string* outFromIp = nullptr, uint16_t* outFromPort = nullptr);
+		// ReceiveData split in two, so CRC can be checked on another thread
+		bool ReceivePacket(UDP::Chunk& data, std::string* outFromIp = nullptr, uint16_t* outFromPort = nullptr,
+			long timeout = RECEIVER_TIMEOUT);
+		static bool CheckCRC(UDP::Chunk& data, ChecksumPolicy dataChecksum);
+		// How DATA are checked, as announced in NAME. Other chunks are always full CRC-32
+		void SetDataChecksum(ChecksumPolicy policy) { mDataChecksum = policy; }
 
 		bool ReceiveAckOrNack(uint32_t expectedSeq, int timeoutMs, bool& outIsNack);
 		bool ReceiveAnyAckOrNack(uint32_t& expectedSeq, int timeoutMs, bool& outIsNack);
 		bool ReceiveFileAckOrNack(int timeoutMs, bool& outIsNack);
+		bool ReceiveControl(ControlMessage& out, int timeoutMs);
 	private:
 		SOCKET mSocket = INVALID_SOCKET;
+		uint16_t mPort = 0; // bound
+		ChecksumPolicy mDataChecksum = ChecksumPolicy::Crc32;
 	};
 }
\ No newline at end of file
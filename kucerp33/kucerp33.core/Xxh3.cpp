@@ -0,0 +1,544 @@
+#include "Xxh3.h"
+#include "CpuFeatures.h"
+
+#include <cstring>
+#include <algorithm>
+
+using namespace UDP;
+
+static constexpr uint32_t PRIME32_1 = 0x9E3779B1U;
+static constexpr uint32_t PRIME32_2 = 0x85EBCA77U;
+static constexpr uint32_t PRIME32_3 = 0xC2B2AE3DU;
+static constexpr uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static constexpr uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static constexpr uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static constexpr uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static constexpr uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+static constexpr uint64_t PRIME_MX1 = 0x165667919E3779F9ULL;
+static constexpr uint64_t PRIME_MX2 = 0x9FB21C651E98DF25ULL;
+
+// Default secret of XXH3
+alignas(64) static const uint8_t SECRET[192] = {
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+static constexpr size_t SECRET_LIMIT = sizeof(SECRET) - Xxh3::STRIPE_SIZE;
+static constexpr size_t STRIPES_PER_BLOCK = SECRET_LIMIT / 8; // secret moves by 8 bytes per stripe
+static constexpr size_t SECRET_LASTACC_START = 7;
+static constexpr size_t SECRET_MERGEACCS_START = 11;
+static constexpr size_t MIDSIZE_MAX = 240;
+static constexpr size_t MIDSIZE_STARTOFFSET = 3;
+static constexpr size_t MIDSIZE_LASTOFFSET = 17;
+static constexpr size_t SECRET_SIZE_MIN = 136;
+
+static const uint64_t INITIAL_ACC[8] = {
+	PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1
+};
+
+struct Hash128
+{
+	uint64_t low;
+	uint64_t high;
+};
+
+static inline uint32_t LoadLE32(const uint8_t* p)
+{
+	return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline uint64_t LoadLE64(const uint8_t* p)
+{
+	return uint64_t(LoadLE32(p)) | (uint64_t(LoadLE32(p + 4)) << 32);
+}
+
+static inline uint32_t Swap32(uint32_t x)
+{
+	return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+
+static inline uint64_t Swap64(uint64_t x)
+{
+	return (uint64_t(Swap32(static_cast<uint32_t>(x))) << 32) | Swap32(static_cast<uint32_t>(x >> 32));
+}
+
+static inline uint32_t Rotl32(uint32_t x, int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+static inline Hash128 Mul128(uint64_t a, uint64_t b)
+{
+	Hash128 r;
+#if defined(_MSC_VER) && defined(_M_X64)
+	r.low = _umul128(a, b, &r.high);
+#elif defined(__SIZEOF_INT128__)
+	unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+	r.low = static_cast<uint64_t>(product);
+	r.high = static_cast<uint64_t>(product >> 64);
+#else
+	uint64_t loLo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+	uint64_t hiLo = (a >> 32) * (b & 0xFFFFFFFF);
+	uint64_t loHi = (a & 0xFFFFFFFF) * (b >> 32);
+	uint64_t hiHi = (a >> 32) * (b >> 32);
+	uint64_t cross = (loLo >> 32) + (hiLo & 0xFFFFFFFF) + loHi;
+	r.high = (hiLo >> 32) + (cross >> 32) + hiHi;
+	r.low = (cross << 32) | (loLo & 0xFFFFFFFF);
+#endif
+	return r;
+}
+
+static inline uint64_t MulFold64(uint64_t a, uint64_t b)
+{
+	Hash128 product = Mul128(a, b);
+	return product.low ^ product.high;
+}
+
+static inline uint64_t XorShift(uint64_t v, int shift)
+{
+	return v ^ (v >> shift);
+}
+
+// XXH64 avalanche, for input which is not mixed yet
+static inline uint64_t Avalanche64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+static inline uint64_t Avalanche(uint64_t h)
+{
+	h = XorShift(h, 37);
+	h *= PRIME_MX1;
+	return XorShift(h, 32);
+}
+
+
+/// ------------------------------------------------------------------------------------------------
+/// SHORT INPUTS (up to 240 bytes), seed is always 0
+/// ------------------------------------------------------------------------------------------------
+
+static inline uint64_t Mix16(const uint8_t* input, const uint8_t* secret)
+{
+	return MulFold64(LoadLE64(input) ^ LoadLE64(secret), LoadLE64(input + 8) ^ LoadLE64(secret + 8));
+}
+
+static inline Hash128 Mix32(Hash128 acc, const uint8_t* input1, const uint8_t* input2, const uint8_t* secret)
+{
+	acc.low += Mix16(input1, secret);
+	acc.low ^= LoadLE64(input2) + LoadLE64(input2 + 8);
+	acc.high += Mix16(input2, secret + 16);
+	acc.high ^= LoadLE64(input1) + LoadLE64(input1 + 8);
+	return acc;
+}
+
+static Hash128 Len0To16(const uint8_t* input, size_t length)
+{
+	Hash128 h;
+
+	if (length > 8)
+	{
+		uint64_t bitflipLow = LoadLE64(SECRET + 32) ^ LoadLE64(SECRET + 40);
+		uint64_t bitflipHigh = LoadLE64(SECRET + 48) ^ LoadLE64(SECRET + 56);
+		uint64_t inputLow = LoadLE64(input);
+		uint64_t inputHigh = LoadLE64(input + length - 8);
+
+		Hash128 m = Mul128(inputLow ^ inputHigh ^ bitflipLow, PRIME64_1);
+		m.low += static_cast<uint64_t>(length - 1) << 54;
+		inputHigh ^= bitflipHigh;
+		m.high += inputHigh + static_cast<uint64_t>(static_cast<uint32_t>(inputHigh)) * (PRIME32_2 - 1);
+		m.low ^= Swap64(m.high);
+
+		h = Mul128(m.low, PRIME64_2);
+		h.high += m.high * PRIME64_2;
+		h.low = Avalanche(h.low);
+		h.high = Avalanche(h.high);
+		return h;
+	}
+
+	if (length >= 4)
+	{
+		uint64_t input64 = LoadLE32(input) + (static_cast<uint64_t>(LoadLE32(input + length - 4)) << 32);
+		uint64_t bitflip = LoadLE64(SECRET + 16) ^ LoadLE64(SECRET + 24);
+
+		h = Mul128(input64 ^ bitflip, PRIME64_1 + (length << 2));
+		h.high += h.low << 1;
+		h.low ^= h.high >> 3;
+		h.low = XorShift(h.low, 35);
+		h.low *= PRIME_MX2;
+		h.low = XorShift(h.low, 28);
+		h.high = Avalanche(h.high);
+		return h;
+	}
+
+	if (length > 0)
+	{
+		uint32_t combinedLow = (uint32_t(input[0]) << 16) | (uint32_t(input[length >> 1]) << 24)
+			| uint32_t(input[length - 1]) | (static_cast<uint32_t>(length) << 8);
+		uint32_t combinedHigh = Rotl32(Swap32(combinedLow), 13);
+		uint64_t bitflipLow = LoadLE32(SECRET) ^ LoadLE32(SECRET + 4);
+		uint64_t bitflipHigh = LoadLE32(SECRET + 8) ^ LoadLE32(SECRET + 12);
+
+		h.low = Avalanche64(combinedLow ^ bitflipLow);
+		h.high = Avalanche64(combinedHigh ^ bitflipHigh);
+		return h;
+	}
+
+	h.low = Avalanche64(LoadLE64(SECRET + 64) ^ LoadLE64(SECRET + 72));
+	h.high = Avalanche64(LoadLE64(SECRET + 80) ^ LoadLE64(SECRET + 88));
+	return h;
+}
+
+static Hash128 FinishMid(Hash128 acc, size_t length)
+{
+	Hash128 h;
+	h.low = acc.low + acc.high;
+	h.high = acc.low * PRIME64_1 + acc.high * PRIME64_4 + static_cast<uint64_t>(length) * PRIME64_2;
+	h.low = Avalanche(h.low);
+	h.high = 0 - Avalanche(h.high);
+	return h;
+}
+
+static Hash128 Len17To128(const uint8_t* input, size_t length)
+{
+	Hash128 acc{ length * PRIME64_1, 0 };
+
+	if (length > 32)
+	{
+		if (length > 64)
+		{
+			if (length > 96) acc = Mix32(acc, input + 48, input + length - 64, SECRET + 96);
+			acc = Mix32(acc, input + 32, input + length - 48, SECRET + 64);
+		}
+		acc = Mix32(acc, input + 16, input + length - 32, SECRET + 32);
+	}
+	acc = Mix32(acc, input, input + length - 16, SECRET);
+
+	return FinishMid(acc, length);
+}
+
+static Hash128 Len129To240(const uint8_t* input, size_t length)
+{
+	Hash128 acc{ length * PRIME64_1, 0 };
+
+	for (size_t i = 32; i < 160; i += 32)
+	{
+		acc = Mix32(acc, input + i - 32, input + i - 16, SECRET + i - 32);
+	}
+	acc.low = Avalanche(acc.low);
+	acc.high = Avalanche(acc.high);
+
+	for (size_t i = 160; i <= length; i += 32)
+	{
+		acc = Mix32(acc, input + i - 32, input + i - 16, SECRET + MIDSIZE_STARTOFFSET + i - 160);
+	}
+	acc = Mix32(acc, input + length - 16, input + length - 32, SECRET + SECRET_SIZE_MIN - MIDSIZE_LASTOFFSET - 16);
+
+	return FinishMid(acc, length);
+}
+
+
+/// ------------------------------------------------------------------------------------------------
+/// LONG INPUTS, 8 accumulators over 64 byte stripes, scrambled after every block of 16 stripes
+/// ------------------------------------------------------------------------------------------------
+
+using AccumulateFn = void(*)(uint64_t acc[8], const uint8_t* input, const uint8_t* secret, size_t stripes);
+using ScrambleFn = void(*)(uint64_t acc[8], const uint8_t* secret);
+
+static void AccumulatePortable(uint64_t acc[8], const uint8_t* input, const uint8_t* secret, size_t stripes)
+{
+	for (size_t n = 0; n < stripes; ++n, input += Xxh3::STRIPE_SIZE, secret += 8)
+	{
+		for (size_t lane = 0; lane < 8; ++lane)
+		{
+			uint64_t value = LoadLE64(input + 8 * lane);
+			uint64_t key = value ^ LoadLE64(secret + 8 * lane);
+			acc[lane ^ 1] += value;
+			acc[lane] += (key & 0xFFFFFFFF) * (key >> 32);
+		}
+	}
+}
+
+static void ScramblePortable(uint64_t acc[8], const uint8_t* secret)
+{
+	for (size_t lane = 0; lane < 8; ++lane)
+	{
+		uint64_t value = XorShift(acc[lane], 47) ^ LoadLE64(secret + 8 * lane);
+		acc[lane] = value * PRIME32_1;
+	}
+}
+
+#ifdef KUCERP33_X64
+
+/// <summary>
+/// Accumulators stay in two registers for all stripes
+/// </summary>
+KUCERP33_TARGET("avx2")
+static void AccumulateAVX2(uint64_t acc[8], const uint8_t* input, const uint8_t* secret, size_t stripes)
+{
+	__m256i a[2] = {
+		_mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc)),
+		_mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + 4))
+	};
+
+	for (size_t n = 0; n < stripes; ++n, input += Xxh3::STRIPE_SIZE, secret += 8)
+	{
+		for (int i = 0; i < 2; ++i)
+		{
+			__m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + 32 * i));
+			__m256i key = _mm256_xor_si256(value, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(secret + 32 * i)));
+			__m256i product = _mm256_mul_epu32(key, _mm256_srli_epi64(key, 32));
+			__m256i swapped = _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2));
+			a[i] = _mm256_add_epi64(product, _mm256_add_epi64(a[i], swapped));
+		}
+	}
+
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(acc), a[0]);
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + 4), a[1]);
+}
+
+KUCERP33_TARGET("avx2")
+static void ScrambleAVX2(uint64_t acc[8], const uint8_t* secret)
+{
+	const __m256i prime = _mm256_set1_epi32(static_cast<int>(PRIME32_1));
+
+	for (int i = 0; i < 2; ++i)
+	{
+		__m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + 4 * i));
+		value = _mm256_xor_si256(value, _mm256_srli_epi64(value, 47));
+		value = _mm256_xor_si256(value, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(secret + 32 * i)));
+
+		// 64 x 32 bit multiply from two 32 x 32 halves
+		__m256i low = _mm256_mul_epu32(value, prime);
+		__m256i high = _mm256_mul_epu32(_mm256_srli_epi64(value, 32), prime);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + 4 * i), _mm256_add_epi64(low, _mm256_slli_epi64(high, 32)));
+	}
+}
+
+#endif
+
+static Xxh3Impl SelectImplementation()
+{
+#ifdef KUCERP33_X64
+	if (CpuFeatures::Get().avx2) return Xxh3Impl::AVX2;
+#endif
+	return Xxh3Impl::Portable;
+}
+
+static Xxh3Impl ActiveImpl = SelectImplementation();
+static AccumulateFn Accumulate()
+{
+#ifdef KUCERP33_X64
+	if (ActiveImpl == Xxh3Impl::AVX2) return AccumulateAVX2;
+#endif
+	return AccumulatePortable;
+}
+
+static ScrambleFn Scramble()
+{
+#ifdef KUCERP33_X64
+	if (ActiveImpl == Xxh3Impl::AVX2) return ScrambleAVX2;
+#endif
+	return ScramblePortable;
+}
+
+static AccumulateFn ActiveAccumulate = Accumulate();
+static ScrambleFn ActiveScramble = Scramble();
+
+/// <summary>
+/// Accumulates stripes, block boundary (secret is used up) means scramble.
+/// </summary>
+/// <returns>end of consumed input</returns>
+static const uint8_t* ConsumeStripes(uint64_t acc[8], size_t& stripesSoFar, const uint8_t* input, size_t stripes)
+{
+	const uint8_t* secret = SECRET + stripesSoFar * 8;
+
+	if (stripes >= STRIPES_PER_BLOCK - stripesSoFar)
+	{
+		size_t now = STRIPES_PER_BLOCK - stripesSoFar;
+		do
+		{
+			ActiveAccumulate(acc, input, secret, now);
+			ActiveScramble(acc, SECRET + SECRET_LIMIT);
+			input += now * Xxh3::STRIPE_SIZE;
+			stripes -= now;
+			now = STRIPES_PER_BLOCK;
+			secret = SECRET;
+		} while (stripes >= STRIPES_PER_BLOCK);
+		stripesSoFar = 0;
+	}
+
+	if (stripes > 0)
+	{
+		ActiveAccumulate(acc, input, secret, stripes);
+		input += stripes * Xxh3::STRIPE_SIZE;
+		stripesSoFar += stripes;
+	}
+
+	return input;
+}
+
+static uint64_t MergeAccs(const uint64_t acc[8], const uint8_t* secret, uint64_t start)
+{
+	uint64_t result = start;
+	for (size_t i = 0; i < 4; ++i)
+	{
+		result += MulFold64(acc[2 * i] ^ LoadLE64(secret + 16 * i), acc[2 * i + 1] ^ LoadLE64(secret + 16 * i + 8));
+	}
+	return Avalanche(result);
+}
+
+
+/// ------------------------------------------------------------------------------------------------
+/// XXH3
+/// ------------------------------------------------------------------------------------------------
+
+void Xxh3::Init()
+{
+	memcpy(mAcc, INITIAL_ACC, sizeof(mAcc));
+	mBuffered = 0;
+	mStripesSoFar = 0;
+	mTotal = 0;
+}
+
+/// <summary>
+/// Adds data to hash. Up to 256 bytes are buffered, the last stripe always stays
+/// in buffer because it is accumulated with different secret in Finish.
+/// </summary>
+/// <param name="data"></param>
+/// <param name="length"></param>
+void Xxh3::Update(const uint8_t* data, size_t length)
+{
+	if (length == 0) return;
+
+	mTotal += length;
+
+	if (length <= BUFFER_SIZE - mBuffered)
+	{
+		memcpy(mBuffer + mBuffered, data, length);
+		mBuffered += length;
+		return;
+	}
+
+	const uint8_t* end = data + length;
+
+	if (mBuffered > 0)
+	{
+		size_t load = BUFFER_SIZE - mBuffered;
+		memcpy(mBuffer + mBuffered, data, load);
+		data += load;
+		ConsumeStripes(mAcc, mStripesSoFar, mBuffer, BUFFER_SIZE / STRIPE_SIZE);
+		mBuffered = 0;
+	}
+
+	if (static_cast<size_t>(end - data) > BUFFER_SIZE)
+	{
+		size_t stripes = static_cast<size_t>(end - 1 - data) / STRIPE_SIZE;
+		data = ConsumeStripes(mAcc, mStripesSoFar, data, stripes);
+		// Finish may need bytes before the tail for the last stripe
+		memcpy(mBuffer + BUFFER_SIZE - STRIPE_SIZE, data - STRIPE_SIZE, STRIPE_SIZE);
+	}
+
+	mBuffered = static_cast<size_t>(end - data);
+	memcpy(mBuffer, data, mBuffered);
+}
+
+/// <summary>
+/// Short input is hashed from buffer by its own path, long one merges accumulators twice
+/// for low and high half. Object has to be Init()ed to be used again
+/// </summary>
+/// <returns></returns>
+Xxh3::Digest Xxh3::Finish()
+{
+	Hash128 h;
+
+	if (mTotal > MIDSIZE_MAX)
+	{
+		alignas(32) uint64_t acc[8];
+		memcpy(acc, mAcc, sizeof(acc));
+
+		uint8_t lastStripe[STRIPE_SIZE];
+		const uint8_t* last = nullptr;
+		if (mBuffered >= STRIPE_SIZE)
+		{
+			size_t stripesSoFar = mStripesSoFar;
+			ConsumeStripes(acc, stripesSoFar, mBuffer, (mBuffered - 1) / STRIPE_SIZE);
+			last = mBuffer + mBuffered - STRIPE_SIZE;
+		}
+		else
+		{
+			size_t catchUp = STRIPE_SIZE - mBuffered;
+			memcpy(lastStripe, mBuffer + BUFFER_SIZE - catchUp, catchUp);
+			memcpy(lastStripe + catchUp, mBuffer, mBuffered);
+			last = lastStripe;
+		}
+		ActiveAccumulate(acc, last, SECRET + SECRET_LIMIT - SECRET_LASTACC_START, 1);
+
+		h.low = MergeAccs(acc, SECRET + SECRET_MERGEACCS_START, mTotal * PRIME64_1);
+		h.high = MergeAccs(acc, SECRET + sizeof(SECRET) - sizeof(acc) - SECRET_MERGEACCS_START, ~(mTotal * PRIME64_2));
+	}
+	else
+	{
+		size_t length = static_cast<size_t>(mTotal);
+		if (length <= 16) h = Len0To16(mBuffer, length);
+		else if (length <= 128) h = Len17To128(mBuffer, length);
+		else h = Len129To240(mBuffer, length);
+	}
+
+	Digest digest;
+	for (int i = 0; i < 8; ++i)
+	{
+		digest[i] = static_cast<uint8_t>(h.high >> (56 - 8 * i));
+		digest[8 + i] = static_cast<uint8_t>(h.low >> (56 - 8 * i));
+	}
+	return digest;
+}
+
+Xxh3::Digest Xxh3::Hash(const uint8_t* data, size_t length)
+{
+	Xxh3 hasher;
+	hasher.Update(data, length);
+	return hasher.Finish();
+}
+
+Xxh3Impl Xxh3::Implementation()
+{
+	return ActiveImpl;
+}
+
+bool Xxh3::SetImplementation(Xxh3Impl impl)
+{
+#ifdef KUCERP33_X64
+	if (impl == Xxh3Impl::AVX2 && !CpuFeatures::Get().avx2) return false;
+#else
+	if (impl != Xxh3Impl::Portable) return false;
+#endif
+
+	ActiveImpl = impl;
+	ActiveAccumulate = Accumulate();
+	ActiveScramble = Scramble();
+	return true;
+}
+
+const char* Xxh3::ImplementationName(Xxh3Impl impl)
+{
+	switch (impl)
+	{
+	case Xxh3Impl::AVX2: return "AVX2";
+	default: return "portable";
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+
+namespace UDP
+{
+	enum class Xxh3Impl
+	{
+		Portable,
+		AVX2  // whole 64 byte stripe in two registers
+	};
+
+	/// <summary>
+	/// Incremental XXH3, 128-bit variant with default secret and seed 0.
+	/// Not cryptographic, only catches damage, not tampering. Much faster than
+	/// SHA-256 (a few multiplies per 8 bytes). Digest is canonical (big endian high, low),
+	/// same as xxhsum prints. Nothing is allocated.
+	/// </summary>
+	class Xxh3
+	{
+	public:
+		static constexpr size_t DIGEST_SIZE = 16;
+		static constexpr size_t STRIPE_SIZE = 64;
+		static constexpr size_t BUFFER_SIZE = 256;
+		using Digest = std::array<uint8_t, DIGEST_SIZE>;
+
+		Xxh3() { Init(); }
+
+		void Init();
+		void Update(const uint8_t* data, size_t length);
+		Digest Finish();
+
+		// One shot
+		static Digest Hash(const uint8_t* data, size_t length);
+
+		// Active implementation, can be forced (benchmarks), false if CPU does not support it
+		static Xxh3Impl Implementation();
+		static bool SetImplementation(Xxh3Impl impl);
+		static const char* ImplementationName(Xxh3Impl impl);
+
+	private:
+		alignas(32) uint64_t mAcc[8];
+		alignas(32) uint8_t mBuffer[BUFFER_SIZE];
+		size_t mBuffered = 0;
+		size_t mStripesSoFar = 0; // stripes of current block already accumulated
+		uint64_t mTotal = 0;
+	};
+}
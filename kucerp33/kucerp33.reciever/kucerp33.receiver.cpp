@@ -2,89 +2,277 @@
 //
 
 #include <iostream>
+#include <iomanip>
+#include <sstream>
 #include <vector>
+#include <optional>
+#include <unordered_map>
+#include <memory>
+#include <atomic>
+#include <thread>
 
 #include "../kucerp33.core/UDPCommunication.h"
 #include "../kucerp33.core/FileTransfer.h"
 #include "../kucerp33.core/SmartDebug.h"
+#include "../kucerp33.core/AllocationCounter.h"
+#include "../kucerp33.core/ReceivePipeline.h"
+#include "../kucerp33.core/SendWindow.h"
+#include "../kucerp33.core/IncomingTransfer.h"
+#include "../kucerp33.core/EventLoop.h"
+#include "../kucerp33.core/AsyncTransfer.h"
+#include "../kucerp33.core/Log.h"
+#include "../kucerp33.core/Metrics.h"
+#include "../kucerp33.core/Trace.h"
+#include "../kucerp33.core/PacketCapture.h"
 
-bool ReceiveStopAndWait(UDP::Receiver& receiver, UDP::FileSession& session)
+// CRC is cheap, two workers keep up with the network and leave cores for writer
+constexpr size_t VALIDATORS = 2;
+// Validators finish packets out of order, reorder ring is ready before first DATA
+constexpr size_t REORDER_RESERVE = 256;
+// Timeline of transfers into receiver.trace.json (Chrome trace events, open in Perfetto)
+constexpr bool TRACE_TRANSFERS = false;
+// Every sent and received datagram into receiver.pcap, decode with "pcapdump" tool or kucerp33.lua in Wireshark
+constexpr bool CAPTURE_PACKETS = false;
+
+/// <summary>
+/// Writer stage of receiving: packets come from ReceivePipeline already checked and ACKed,
+/// here they are only put into the session (hash, disk) and repair is driven.
+/// </summary>
+/// <param name="receiver"></param>
+/// <param name="transfer"></param>
+/// <returns></returns>
+bool ReceiveStopAndWait(UDP::Receiver& receiver, UDP::IncomingTransfer& transfer)
 {
-    constexpr uint32_t MAX_IDLE_AFTER_FINISH = 10;
-    bool finished = false;
-    uint32_t idle = 0;
-    bool hashOk = false;
+    UDP::ReceivePipeline pipeline(receiver, VALIDATORS);
+    transfer.session.ReserveReorder(REORDER_RESERVE);
+
+    pipeline.SetDataChecksum(transfer.session.checksumPolicy);
+    pipeline.Start();
 
-    std::string ip;
-    uint16_t port;
+    UDP::AllocationProbe probe("Receiver");
 
     while (true)
     {
-        UDP::Chunk data;
-        bool ack;
-
-        bool state = receiver.ReceiveData(data, ack, &ip, &port);
-
-        if (ip.empty()) continue; // Not valid IP adress
-
-        UDP::Sender ackSender(ip, UDP::SEND_PORT_ACK);
+        probe.Resume();
+        UDP::ReceivePipeline::Packet* packet = pipeline.Pop(UDP::RECEIVER_TIMEOUT);
 
         // We wait few iterations
-        if (!state)
+        if (!packet)
         {
-            if (finished)
-            {
-                if (++idle > MAX_IDLE_AFTER_FINISH) break;
-            }
+            probe.Pause();
+            if (!transfer.ackSender) continue; // Nobody sent anything yet
+
+            if (!transfer.Idle()) break;
             continue;
         }
-        idle = 0; // We got something
+        transfer.idle = 0; // We got something
 
-        if (!ackSender.SendAckOrNack(ack, data.seq))
+        if (!transfer.ackSender || packet->ip != transfer.ackIp)
         {
-            std::cerr << "Error: ACK or NACK could not be sent.\n";
-            continue;
+            probe.Pause();
+            transfer.ackSender.emplace(packet->ip, UDP::SEND_PORT_ACK);
+            transfer.ackIp = packet->ip;
+            transfer.session.sessionId = packet->chunk.session;
+            probe.Resume();
         }
-        
-        if (!ack) continue; // We skip NACK
-        
-        // If we got duplicate packet we skip
-        if (!session.chunks.contains(data.seq)) 
-        {
-            session.chunks.insert({ data.seq, data });
-            PrintChunkLine(data);
 
-            session.stopReceived |= data.StopReceived();
-        }
-        
-        // We got everything
-        if (session.IsReceived() && !finished)
+        // Like before the split, session work (disk, hash) is not part of the packet path
+        probe.Pause();
+        probe.CountPacket();
+
+        bool ok = transfer.TakePacket(packet->chunk);
+        // Validator already set it from NAME, this is for session it had no slot for
+        pipeline.SetDataChecksum(transfer.session.checksumPolicy);
+
+        probe.Resume();
+        pipeline.Release(packet);
+        probe.Pause();
+
+        if (!ok) return false;
+
+        transfer.CheckComplete();
+    }
+
+    pipeline.Stop();
+    probe.Report();
+
+    return true;
+}
+
+
+bool ReceiveSelectiveRepeat(UDP::Receiver& receiver, UDP::IncomingTransfer& transfer)
+{
+    return ReceiveStopAndWait(receiver, transfer);
+}
+
+/// <summary>
+/// Server mode: files from many senders at once. Every packet goes to transfer of its peer
+/// address and session id, each transfer has its own reassembly, hash, repair and verdict.
+/// ACK/NACK are sent per packet by the pipeline. Runs until Enter is pressed.
+/// </summary>
+/// <param name="receiver"></param>
+/// <returns></returns>
+bool ReceiveServer(UDP::Receiver& receiver)
+{
+    constexpr size_t MAX_TRANSFERS = 64;
+    // Transfer without any packet for this long is dropped, its .part file stays (microseconds)
+    constexpr uint64_t ABANDON_TIMEOUT = 30ull * 1000 * 1000;
+
+    std::atomic<bool> stop{ false };
+    std::thread console([&stop]()
+    {
+        std::string line;
+        std::getline(std::cin, line);
+        stop = true;
+    });
+
+    std::unordered_map<UDP::TransferKey, std::unique_ptr<UDP::IncomingTransfer>, UDP::TransferKeyHash> transfers;
+    transfers.reserve(MAX_TRANSFERS);
+    UDP::TransferKey key; // reused for lookup, so it does not allocate
+
+    // Packets of transfers over the limit are not even ACKed, sender sends them again later
+    UDP::ReceivePipeline pipeline(receiver, VALIDATORS);
+    pipeline.SetSessionLimit(MAX_TRANSFERS);
+    pipeline.Start();
+
+    std::cout << "Receiver: Server is running, press Enter to stop it\n";
+
+    // Dropped transfer also forgets its DATA checksum in the pipeline
+    auto drop = [&](auto it)
+    {
+        pipeline.ForgetSession(it->first.session);
+        return transfers.erase(it);
+    };
+
+    uint64_t lastCheck = UDP::NowMicroseconds();
+    while (!stop.load())
+    {
+        UDP::ReceivePipeline::Packet* packet = pipeline.Pop(UDP::RECEIVER_TIMEOUT);
+        uint64_t now = UDP::NowMicroseconds();
+
+        if (packet)
         {
-            finished = true;
+            key.ip = packet->ip;
+            key.port = packet->port;
+            key.session = packet->chunk.session;
 
-            std::cout << "Receiver: File is complete, saving file..." << "\n";
+            auto it = transfers.find(key);
+            if (it == transfers.end())
+            {
+                // Pipeline admitted the session, only same session id from two peers gets here
+                if (transfers.size() >= MAX_TRANSFERS)
+                {
+                    std::cerr << "Receiver: Too many transfers, packet from " << key.ip << ":" << key.port << " dropped\n";
+                    pipeline.Release(packet);
+                    continue;
+                }
+
+                auto transfer = std::make_unique<UDP::IncomingTransfer>();
+                // Two senders may send file of the same name
+                std::ostringstream prefix;
+                prefix << std::hex << std::setw(8) << std::setfill('0') << key.session << "_";
+                transfer->session.outputPath = prefix.str();
+                transfer->session.sessionId = key.session;
+                transfer->session.ReserveReorder(REORDER_RESERVE);
+                transfer->ackSender.emplace(key.ip, UDP::SEND_PORT_ACK);
+                transfer->ackIp = key.ip;
+
+                std::cout << "Receiver: New transfer " << prefix.str() << " from " << key.ip << ":" << key.port
+                    << " (" << transfers.size() + 1 << " running)\n";
+                it = transfers.emplace(key, std::move(transfer)).first;
+            }
+
+            UDP::IncomingTransfer& transfer = *it->second;
+            transfer.lastPacket = now;
+            transfer.idle = 0;
 
-            if (!session.ParseChunkData()) 
+            // Validator already set checksum of session from NAME, here it only gets another try
+            bool ok = transfer.finished || transfer.TakePacket(packet->chunk);
+            if (ok && packet->chunk.command == UDP::Command::Name
+                && !pipeline.SetDataChecksum(key.session, transfer.session.checksumPolicy))
+            {
+                std::cerr << "Receiver: No slot for checksum of session, DATA are checked by CRC-32\n";
+            }
+            pipeline.Release(packet);
+
+            if (ok)
+            {
+                transfer.CheckComplete();
+            }
+            else
             {
-                std::cerr << "Receiver: Chunk data could not be parsed!\n";
-                return false;
+                // Sender gets FNACK, rest of its packets go to a new transfer
+                transfer.ackSender->SendFileAckOrNack(false, key.session);
+                drop(it);
             }
-            
-            if (!session.SaveToFile(hashOk)) 
+        }
+
+        // Transfers without packet for a while get their timeout
+        if (now - lastCheck < UDP::RECEIVER_TIMEOUT) continue;
+        lastCheck = now;
+
+        for (auto it = transfers.begin(); it != transfers.end();)
+        {
+            UDP::IncomingTransfer& transfer = *it->second;
+            bool keep = now - transfer.lastPacket < UDP::RECEIVER_TIMEOUT || transfer.Idle();
+
+            if (keep && !transfer.finished && now - transfer.lastPacket >= ABANDON_TIMEOUT)
             {
-                std::cerr << "Receiver: File could not be saved!\n";
+                std::cerr << "Receiver: Transfer from " << it->first.ip << ":" << it->first.port << " abandoned\n";
+                keep = false;
             }
 
+            it = keep ? std::next(it) : drop(it);
         }
     }
 
+    pipeline.Stop();
+    console.join();
+
+    std::cout << "Receiver: Server stopped, " << transfers.size() << " transfers were not finished\n";
     return true;
 }
 
+/// <summary>
+/// Prints every file the server finished until it stops
+/// </summary>
+UDP::Task<void> ReportFiles(UDP::AsyncReceiver& receiver)
+{
+    UDP::AsyncReceiver::File file;
+    while (true)
+    {
+        bool received = co_await receiver.NextFile(file);
+        if (!received) break;
+
+        std::cout << "Receiver: " << file.path << (file.hashOk ? " saved\n" : " is broken, thrown away\n");
+    }
+}
 
-bool ReceiveSelectiveRepeat(UDP::Receiver& receiver, UDP::FileSession& session)
+/// <summary>
+/// Server mode on one thread: every transfer is handled by coroutines on event loop,
+/// no pipeline threads. Runs until Enter is pressed.
+/// </summary>
+/// <param name="receiver"></param>
+/// <returns></returns>
+bool ReceiveServerAsync(UDP::Receiver& receiver)
 {
-    return ReceiveStopAndWait(receiver, session);
+    UDP::EventLoop loop;
+    UDP::AsyncReceiver asyncReceiver(loop, receiver);
+
+    std::thread console([&asyncReceiver]()
+    {
+        std::string line;
+        std::getline(std::cin, line);
+        asyncReceiver.Stop();
+    });
+
+    std::cout << "Receiver: Server is running on one thread, press Enter to stop it\n";
+    asyncReceiver.Start();
+    loop.Spawn(ReportFiles(asyncReceiver));
+    loop.Run();
+
+    console.join();
+    return true;
 }
 
 int main(int argc, char* argv[])
@@ -92,6 +280,13 @@ int main(int argc, char* argv[])
     std::cout << "Reciever Module Online\n";
     std::cout << "Hello World!\n";
 
+    // Every packet goes to the file, console gets only problems
+    UDP::Log::Start("receiver.klog");
+    // Scraped by node exporter textfile collector, JSON for anything else
+    UDP::Metrics::Start("receiver.metrics.json", "receiver.prom");
+    if (TRACE_TRANSFERS) UDP::Trace::Start("receiver.trace.json", "receiver", 2);
+    if (CAPTURE_PACKETS) UDP::PacketCapture::Start("receiver.pcap");
+
     UDP::WindowsSocketInit winsocket;
     if (!winsocket.IsOk()) return 1;
 
@@ -108,6 +303,8 @@ int main(int argc, char* argv[])
         std::cout << "=============================\n";
         std::cout << "1) Stop-and-Wait\n";
         std::cout << "2) Selective Repeat\n";
+        std::cout << "3) Server (many senders at once)\n";
+        std::cout << "4) Server on one thread (coroutines)\n";
         std::cout << "0) Quit\n";
         std::cout << "Select: ";
 
@@ -128,18 +325,30 @@ int main(int argc, char* argv[])
             break;
         }
 
-        if (choice != 1 && choice != 2)
+        if (choice < 1 || choice > 4)
         {
             std::cout << "Invalid choice.\n";
             continue;
         }
 
-        UDP::FileSession session;
+        if (choice == 3)
+        {
+            ReceiveServer(receiver);
+            continue;
+        }
+
+        if (choice == 4)
+        {
+            ReceiveServerAsync(receiver);
+            continue;
+        }
+
+        UDP::IncomingTransfer transfer;
         bool ok = false;
         if (choice == 1)
         {
             std::cout << "Started stop and wait...\n";
-            if (!ReceiveStopAndWait(receiver, session))
+            if (!ReceiveStopAndWait(receiver, transfer))
             {
                 std::cerr << "Error: File could not be received.\n";
                 continue;
@@ -148,12 +357,16 @@ int main(int argc, char* argv[])
         else if (choice == 2)
         {
             std::cout << "Using Selective repeat...\n";
-            if (!ReceiveSelectiveRepeat(receiver, session))
+            if (!ReceiveSelectiveRepeat(receiver, transfer))
             {
                 std::cerr << "Error: File could not be received.\n";
             }
         }
     }
 
+    UDP::PacketCapture::Stop();
+    UDP::Trace::Stop();
+    UDP::Metrics::Stop();
+    UDP::Log::Stop();
     return 0;
 }
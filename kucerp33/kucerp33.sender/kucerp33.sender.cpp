@@ -5,161 +5,196 @@
 #include <string>
 #include <limits>
 #include <algorithm>
-#include <unordered_set>
+#include <iomanip>
+#include <vector>
+#include <memory>
 
 #include "../kucerp33.core/UDPCommunication.h"
 #include "../kucerp33.core/FileTransfer.h"
+#include "../kucerp33.core/AllocationCounter.h"
+#include "../kucerp33.core/SendWindow.h"
+#include "../kucerp33.core/AckTracker.h"
+#include "../kucerp33.core/EventLoop.h"
+#include "../kucerp33.core/AsyncTransfer.h"
+#include "../kucerp33.core/Log.h"
+#include "../kucerp33.core/Metrics.h"
+#include "../kucerp33.core/Trace.h"
+#include "../kucerp33.core/PacketCapture.h"
 
 //constexpr std::string_view file = "sender.txt";
 constexpr std::string_view file = "sender.png";
 
-bool SendStopAndWait(UDP::Sender& sender, const UDP::FileSession& session)
+// Map the file and build chunks while sending instead of preloading it
+constexpr bool STREAM_FILE = true;
+// HASH goes after last DATA, file is hashed while it is sent (read only once)
+constexpr bool HASH_TRAILER = true;
+// HASH_SHA256, HASH_BLAKE3, HASH_XXH3_128 (fastest, not cryptographic) or HASH_MERKLE_SHA256.
+// Merkle root lets receiver repair only corrupted blocks. See kucerp33.tools for throughput
+constexpr uint32_t HASH_ALGORITHM = UDP::HASH_MERKLE_SHA256;
+// Checksum of every DATA packet: Crc32 (default), Crc32c (hardware), HeaderOnly or None.
+// Last two leave payload to UDP checksum and file hash, only for trusted links
+constexpr UDP::ChecksumPolicy CHECKSUM_POLICY = UDP::ChecksumPolicy::Crc32;
+// Timeline of transfers into sender.trace.json (Chrome trace events, open in Perfetto)
+constexpr bool TRACE_TRANSFERS = false;
+// Every sent and received datagram into sender.pcap, decode with "pcapdump" tool or kucerp33.lua in Wireshark
+constexpr bool CAPTURE_PACKETS = false;
+
+/// <summary>
+/// Percentiles of ACK RTT and delivery time of the transfer, see FileSession::latency
+/// </summary>
+/// <param name="session"></param>
+void PrintLatency(const UDP::FileSession& session)
 {
-    UDP::Receiver ackReceiver(UDP::RECEIVER_PORT_ACK);
+    std::cout << "Sender: Session " << std::hex << session.sessionId << std::dec << " latency\n";
+    session.latency.rtt.Print(std::cout, "  ACK RTT [us]");
+    session.latency.delivery.Print(std::cout, "  Delivery [us]");
+}
 
-    for (const auto& [seq, chunk] : session.chunks)
+/// <summary>
+/// After all chunks are delivered, receiver checks the hash. Until it says FACK/FNACK
+/// we answer its LEAF requests and send again chunks of corrupted blocks it NACKs.
+/// </summary>
+/// <param name="sender"></param>
+/// <param name="ackReceiver"></param>
+/// <param name="session"></param>
+/// <param name="metrics">repaired chunks count as resent</param>
+/// <param name="pending">message which already came (e.g. to ACK thread), handled first</param>
+/// <returns>true if receiver confirmed the file</returns>
+bool ServeRepairs(UDP::Sender& sender, UDP::Receiver& ackReceiver, UDP::FileSession& session,
+    UDP::TransferMetrics& metrics, const UDP::ControlMessage* pending = nullptr)
+{
+    // Receiver can take a while to finish hash, it is ~3 s without any message
+    constexpr uint32_t MAX_IDLE = 15;
+    uint32_t idle = 0;
+
+    while (idle < MAX_IDLE)
     {
-        bool delivered = false;
+        UDP::ControlMessage msg;
+        if (pending)
+        {
+            msg = *pending;
+            pending = nullptr;
+        }
+        else if (!ackReceiver.ReceiveControl(msg, UDP::ACK_RECEIVER_TIMEOUT))
+        {
+            ++idle;
+            continue;
+        }
+        idle = 0;
 
-        while (!delivered)
+        switch (msg.type)
         {
-            // We could not send anything
-            if (!sender.SendData(chunk)) return false;
+        case UDP::ControlType::FileAck:
+            std::cout << "Sender: Receiver confirmed the file\n";
+            return true;
 
-            bool isNack = false;
-            bool gotResponse = ackReceiver.ReceiveAckOrNack(seq, UDP::ACK_RECEIVER_TIMEOUT, isNack);
+        case UDP::ControlType::FileNack:
+            std::cerr << "Sender: Receiver rejected the file!\n";
+            return false;
 
-            if (!gotResponse)
-            {
-                std::cout << "Timeout, sending again seq=" << seq << "\n";
-                continue;
-            }
+        case UDP::ControlType::Leaf:
+            std::cout << "Sender: Receiver asked for leaf hashes from " << msg.value << "\n";
+            sender.SendData(session.GetLeafChunk(msg.value));
+            break;
 
-            if (isNack)
+        case UDP::ControlType::Nack:
+            if (msg.value < session.ChunkCount())
             {
-                std::cout << "NACK, sending again seq=" << seq << "\n";
-                continue;
+                LOG_EVENT(UDP::LogEvent::RepairResend, msg.value);
+                TRACE_INSTANT("Repair resend", "seq", msg.value);
+                const UDP::Chunk& chunk = session.GetChunk(msg.value);
+                if (sender.SendData(chunk)) metrics.PacketSent(chunk.packetSize, true);
             }
+            break;
 
-            delivered = true;
+        default:
+            break; // Late ACKs
         }
     }
 
-    return true;
+    std::cout << "Sender: No verdict about the file from receiver\n";
+    return false;
 }
 
-bool SendSelectiveRepeatOld(UDP::Sender& sender, const UDP::FileSession& session, int window) {
+bool SendStopAndWait(UDP::Sender& sender, UDP::FileSession& session)
+{
     UDP::Receiver ackReceiver(UDP::RECEIVER_PORT_ACK);
-    if (!ackReceiver.IsOk()) 
-    {
-        std::cerr << "Sender: ACK receiver could not be initialized!" << "\n";
-        return false;
-    }
-
-    if (session.chunks.empty()) return false;
-
-    // Max sequence number
-    size_t maxSeq = session.chunks.rbegin()->first;
-    size_t totalChunks = maxSeq + 1;
 
-    std::vector<bool> ackedChunks(totalChunks, false);
+    UDP::TransferMetrics& metrics = UDP::Metrics::Open(session.sessionId, UDP::TransferMetrics::Direction::Send);
+    TRACE_SCOPE("Send file", "session", session.sessionId);
 
-    // Properties for selective repeat
-    size_t baseSeq = 0;
-    size_t nextSeq = 0;
+    UDP::AllocationProbe probe("Sender (Stop-and-Wait)");
+    probe.Resume();
 
-    // New sequence stuff
-    while (baseSeq < totalChunks) 
+    for (size_t seq = 0; seq < session.ChunkCount(); ++seq)
     {
-        // we send window of packets
-        // -> we wait for 8? iterations of receive ACK for each sequence and 
-        // we check if sequence number is same as expected (or in expected array?)
-        // if not/timeout/nack, we mark as false and then we send another window
-        // of packets.
+        const UDP::Chunk& chunk = session.GetChunk(seq);
+        bool delivered = false;
+        uint32_t attempts = 0;
+        uint64_t firstSentAt = 0;
 
-        std::vector<UDP::Chunk> package;
-        package.reserve(window);
+        while (!delivered)
+        {
+            if (attempts > 0) TRACE_INSTANT("Retransmit", "seq", seq);
 
-    }
+            // We could not send anything
+            if (!sender.SendData(chunk))
+            {
+                UDP::Metrics::Close(metrics);
+                return false;
+            }
+            probe.CountPacket();
 
+            uint64_t sentAt = UDP::NowMicroseconds();
+            if (attempts == 0) firstSentAt = sentAt;
+            metrics.PacketSent(chunk.packetSize, attempts++ > 0);
+            metrics.Window(1);
 
+            bool isNack = false;
+            UDP::TraceSpan wait("ACK wait", "seq", seq);
+            bool gotResponse = ackReceiver.ReceiveAckOrNack(static_cast<uint32_t>(seq), UDP::ACK_RECEIVER_TIMEOUT, isNack);
+            wait.End();
 
-    // We cycle through all chunks
-    while (baseSeq < totalChunks) 
-    {
-        // We move window if needed
-        while (nextSeq < totalChunks && nextSeq < baseSeq + static_cast<size_t>(window)) 
-        {
-            // We check if packet with this sequence exists
-            if (session.chunks.contains(nextSeq)) 
+            if (!gotResponse)
             {
-                // We cant send packet
-                if (!sender.SendData(session.chunks.at(nextSeq))) return false; 
-
-                std::cout << "Sender: Sent packet with sequence " << nextSeq << "\n";
+                LOG_EVENT(UDP::LogEvent::StopAndWaitTimeout, seq);
+                TRACE_INSTANT("Timeout", "seq", seq);
+                metrics.Timeout();
+                continue;
             }
-            ++nextSeq;
-        }
-        // We wait for ACK/NACK
-        uint32_t ackSeq = 0;
-        bool isNack = false;
-        bool gotResponse = ackReceiver.ReceiveAnyAckOrNack(ackSeq, UDP::ACK_RECEIVER_TIMEOUT, isNack);
-
-        // timeout -> we send all NACK packets
-        if (!gotResponse) 
-        {
-            std::cout << "Timeout, sending packets again" << "\n";
 
-            for (size_t seq = baseSeq; seq < nextSeq; ++seq) 
+            if (isNack)
             {
-                if (seq < totalChunks && !ackedChunks[seq] && session.chunks.contains(seq))
-                {
-                    // We send packet
-                    if (!sender.SendData(session.chunks.at(seq))) return false;
-
-                    std::cout << "Sender: Resent packet with sequence " << seq << "\n";
-                }
+                LOG_EVENT(UDP::LogEvent::StopAndWaitNack, seq);
+                TRACE_INSTANT("NACK", "seq", seq);
+                metrics.NackReceived();
+                continue;
             }
 
-            continue;
-        }
-        
-        // We skip incorrect sequence number
-        // if its outside of range of sent packets then its wrong -> theoretically it can still mess up things,
-        // but idk how else to repair it
-        if (ackSeq >= totalChunks || 
-            ackSeq < baseSeq ||
-            ackSeq >= nextSeq || 
-            !session.chunks.contains(ackSeq))
-        {
-            std::cout << "Sender: Received incorrect ACK/NACK sequence: " << ackSeq << "\n";
-            continue;
-        }
-
-        // We got nack -> resent packet with sequence number
-        if (isNack) 
-        {
-            if (!sender.SendData(session.chunks.at(ackSeq))) return false;
-
-            std::cout << "Sender: NACK received. Resent packet with sequence " << ackSeq << "\n";
-        }
-
-        if (!isNack && !ackedChunks[ackSeq]) 
-        {
-            ackedChunks[ackSeq] = true;
-
-            std::cout << "Sender: ACK received:" << ackSeq << "\n";
+            // RTT only of packet sent once, otherwise we don't know which copy was acked
+            uint64_t ackedAt = UDP::NowMicroseconds();
+            uint64_t rtt = attempts == 1 ? ackedAt - sentAt : 0;
+            metrics.AckReceived(session.DataBytes(seq), rtt);
+            session.latency.AckReceived(rtt, ackedAt - firstSentAt);
+            delivered = true;
         }
-
-        // We move the window forward if possible
-        while (baseSeq < totalChunks && ackedChunks[baseSeq]) ++baseSeq;
     }
 
-    return true;
-}
+    probe.Pause();
+    probe.Report();
 
+    bool ok = ServeRepairs(sender, ackReceiver, session, metrics);
+    UDP::Metrics::Close(metrics);
+    PrintLatency(session);
+    return ok;
+}
 
-bool SendSelectiveRepeat(UDP::Sender& sender, const UDP::FileSession& session, int window)
+/// <summary>
+/// Transmit loop of selective repeat. ACK/NACK are received by AckTracker on its own thread,
+/// here they are only taken over into the window, so sending never waits for the socket.
+/// We sleep only when the whole window is in flight, until feedback or nearest timeout.
+/// </summary>
+bool SendSelectiveRepeat(UDP::Sender& sender, UDP::FileSession& session, int window)
 {
     UDP::Receiver ackReceiver(UDP::RECEIVER_PORT_ACK);
     if (!ackReceiver.IsOk())
@@ -168,151 +203,194 @@ bool SendSelectiveRepeat(UDP::Sender& sender, const UDP::FileSession& session, i
         return false;
     }
 
-    if (session.chunks.empty()) return false;
+    if (session.ChunkCount() == 0) return false;
+    if (window < 1) window = 1;
+    // Receiver drops chunks further ahead
+    window = (std::min)(window, static_cast<int>(UDP::FileSession::MAX_WINDOW));
 
-    // Biggest sequence number
-    size_t maxSeq = session.chunks.rbegin()->first;
-    size_t totalChunks = maxSeq + 1;
+    size_t totalChunks = session.ChunkCount();
 
-    // Mask of "ACKs"
-    std::vector<bool> delivered(totalChunks, false);
-    size_t deliveredCount = 0;
+    // Acked/in-flight/send time/retransmits of every sequence in the window
+    UDP::SendWindow state(totalChunks, static_cast<size_t>(window));
+    // Feedback from ACK thread
+    UDP::AckTracker acks(ackReceiver, static_cast<size_t>(window));
+    acks.Start();
 
-    size_t nextSeq = 0;
+    UDP::TransferMetrics& metrics = UDP::Metrics::Open(session.sessionId, UDP::TransferMetrics::Direction::Send);
+    TRACE_SCOPE("Send file", "session", session.sessionId);
 
-    // Buffer of unsucessful packets
-    std::vector<size_t> pendingResend;
+    UDP::AllocationProbe probe("Sender (Selective Repeat)");
+    probe.Resume();
 
-    while (deliveredCount < totalChunks)
+    uint64_t now = 0;
+    auto sendChunk = [&](size_t seq)
     {
-        // We create a window of packets and reserve it
-        std::vector<size_t> windowSeqs;
-        windowSeqs.reserve(static_cast<size_t>(window));
+        if (state.SendTime(seq)) TRACE_INSTANT("Retransmit", "seq", seq);
 
-        // We refill the window with unsucessful packets
-        // -> length of pedingResend will always be <= window
-        for (size_t seq : pendingResend)
+        const UDP::Chunk& chunk = session.GetChunk(seq);
+        if (!sender.SendData(chunk))
         {
-            if (windowSeqs.size() >= static_cast<size_t>(window))
-                break;
-
-            if (seq < totalChunks && !delivered[seq] && session.chunks.contains(seq))
-            {
-                windowSeqs.push_back(seq);
-            }
+            std::cerr << "Sender: SendData failed for seq=" << seq << "\n";
+            UDP::Metrics::Close(metrics);
+            return false;
         }
-        pendingResend.clear();
+        probe.CountPacket();
+        state.MarkSent(seq, now);
+        metrics.PacketSent(chunk.packetSize, state.Retransmits(seq) > 0);
+        return true;
+    };
 
-        // We fill the rest with new sequences
-        while (windowSeqs.size() < static_cast<size_t>(window) && nextSeq < totalChunks)
+    while (!state.IsDone())
+    {
+        uint32_t ackSeq = 0;
+        bool isNack = false;
+        uint64_t feedbackAt = UDP::NowMicroseconds();
+
+        // Everything ACK thread got since last time
+        while (acks.Next(ackSeq, isNack))
         {
-            if (!session.chunks.contains(nextSeq))
+            // Fallback if something goes wrong
+            if (ackSeq >= totalChunks)
             {
-                ++nextSeq;
+                LOG_EVENT(UDP::LogEvent::AckOutOfRange, ackSeq);
                 continue;
             }
 
-            if (!delivered[nextSeq])
+            // Just nack, sefl explanatory
+            if (isNack)
             {
-                windowSeqs.push_back(nextSeq);
+                if (!state.IsAcked(ackSeq))
+                {
+                    LOG_EVENT(UDP::LogEvent::NackResend, ackSeq);
+                    TRACE_INSTANT("NACK", "seq", ackSeq);
+                    metrics.NackReceived();
+                    state.MarkLost(ackSeq);
+                }
+                continue;
             }
 
-            ++nextSeq;
-        }
-
-        if (windowSeqs.empty()) break;
+            // Send time is gone once window moves, RTT only of packets sent once
+            uint64_t rtt = state.Retransmits(ackSeq) == 0 && state.SendTime(ackSeq) ? feedbackAt - state.SendTime(ackSeq) : 0;
+            uint64_t firstSentAt = state.FirstSendTime(ackSeq);
 
-        // We send the whole window
-        std::cout << "Sender: SENDING NEW BATCH!\n";
-        for (size_t seq : windowSeqs)
-        {
-            if (!session.chunks.contains(seq))
-                continue;
-
-            if (!sender.SendData(session.chunks.at(seq)))
+            // we correctly got ACK!
+            if (state.MarkAcked(ackSeq))
             {
-                std::cerr << "Sender: SendData failed for seq=" << seq << "\n";
-                return false;
+                LOG_EVENT(UDP::LogEvent::AckReceived, ackSeq);
+                metrics.AckReceived(session.DataBytes(ackSeq), rtt);
+                if (firstSentAt) session.latency.AckReceived(rtt, feedbackAt - firstSentAt);
             }
-
-            std::cout << "Sender: Sent packet with sequence " << seq << "\n";
         }
 
-        // Waiting set cuz some packets are just eh
-        std::unordered_set<size_t> waiting(windowSeqs.begin(), windowSeqs.end());
+        if (state.IsDone()) break;
+        acks.SetBase(state.Base());
+
+        now = UDP::NowMicroseconds();
+        UDP::TraceSpan round("Send window");
+        size_t sent = 0;
 
-        // We send all the packets in window
-        for (size_t seq : windowSeqs)
+        // Packets without ACK for too long are sent again
+        uint64_t deadline = now > UDP::ACK_RECEIVER_TIMEOUT ? now - UDP::ACK_RECEIVER_TIMEOUT : 0;
+        for (size_t seq = state.NextExpired(state.Base(), deadline); seq < state.Limit(); seq = state.NextExpired(seq + 1, deadline))
         {
-            if (seq >= totalChunks || delivered[seq]) continue;
+            LOG_EVENT(UDP::LogEvent::TimeoutResend, seq);
+            TRACE_INSTANT("Timeout", "seq", seq);
+            metrics.Timeout();
+            if (!sendChunk(seq)) return false;
+            ++sent;
+        }
 
-            uint32_t ackSeq = 0;
-            bool isNack = false;
+        // We fill the rest of window with new and NACKed packets
+        for (size_t seq = state.NextUnsent(state.Base()); seq < state.Limit(); seq = state.NextUnsent(seq + 1))
+        {
+            if (!sendChunk(seq)) return false;
+            ++sent;
 
-            bool gotResponse = ackReceiver.ReceiveAnyAckOrNack(
-                ackSeq,
-                UDP::ACK_RECEIVER_TIMEOUT,
-                isNack
-            );
+            LOG_EVENT(UDP::LogEvent::PacketSent, seq);
+        }
+        metrics.Window(state.InFlightCount());
+        round.SetArg("packets", sent);
+        round.End();
+
+        // Window is full. Oldest packet expires first unless it was sent again, then we just check sooner
+        uint64_t wait = UDP::ACK_RECEIVER_TIMEOUT;
+        uint64_t sentAt = state.SendTime(state.Base());
+        if (sentAt && sentAt + UDP::ACK_RECEIVER_TIMEOUT > now) wait = sentAt + UDP::ACK_RECEIVER_TIMEOUT - now;
+        TRACE_SCOPE("ACK wait", "in_flight", state.InFlightCount());
+        acks.WaitForFeedback(wait);
+    }
 
-            // Timeout
-            if (!gotResponse)
-            {
-                std::cout << "Sender: Timeout or CRC error for seq=" << seq << ", will resend in next window\n";
-                continue;
-            }
+    probe.Pause();
+    probe.Report();
 
-            // Fallback if something goes wrong
-            if (ackSeq >= totalChunks)
-            {
-                std::cout << "Sender: ACK/NACK for out-of-range seq=" << ackSeq << " ignored.\n";
-                continue;
-            }
+    acks.Stop();
 
-            // Just nack, sefl explanatory
-            if (isNack)
-            {
-                std::cout << "Sender: NACK for seq=" << ackSeq << ", will resend in next window\n";
-                pendingResend.push_back(ackSeq);
-            }
+    std::cout << "Sender: " << state.TotalRetransmits() << " packets sent again\n";
 
-            // we correctly got ACK!
-            if (!isNack && !delivered[ackSeq])
-            {
-                delivered[ackSeq] = true;
-                ++deliveredCount;
-                std::cout << "Sender: ACK received for seq=" << ackSeq << "\n";
-            }
+    // FACK or LEAF request may have come to ACK thread already
+    UDP::ControlMessage leftover;
+    bool ok = ServeRepairs(sender, ackReceiver, session, metrics, acks.Leftover(leftover) ? &leftover : nullptr);
+    UDP::Metrics::Close(metrics);
+    PrintLatency(session);
+    return ok;
+}
 
-            // We erase from waiting
-            auto it = waiting.find(ackSeq);
-            if (it != waiting.end())
-            {
-                waiting.erase(it);
-            }
-        }
+/// <summary>
+/// One file on the event loop, failure is reported when it is done
+/// </summary>
+UDP::Task<void> SendOneAsync(UDP::AsyncSender& sender, UDP::FileSession& session, size_t window, size_t& confirmed)
+{
+    bool ok = co_await sender.Send(session, window);
+    PrintLatency(session);
+    if (ok)
+    {
+        ++confirmed;
+    }
+    else
+    {
+        std::cerr << "Error: File " << session.fileName << " could not be sent.\n";
+    }
+}
 
-        // We refill pending
-        for (size_t seq : waiting)
-        {
-            if (seq < totalChunks && !delivered[seq])
-            {
-                std::cout << "Sender: Timeout for seq=" << seq
-                    << ", will resend in next window\n";
-                pendingResend.push_back(seq);
-            }
-        }
+/// <summary>
+/// All files at once as coroutines on this thread, ACKs go to transfers by their session id
+/// </summary>
+/// <param name="sender"></param>
+/// <param name="sessions"></param>
+/// <param name="window"></param>
+/// <returns>true if receiver confirmed every file</returns>
+bool SendManyAsync(UDP::Sender& sender, std::vector<std::unique_ptr<UDP::FileSession>>& sessions, size_t window)
+{
+    UDP::Receiver ackReceiver(UDP::RECEIVER_PORT_ACK);
+    if (!ackReceiver.IsOk())
+    {
+        std::cerr << "Sender: ACK receiver could not be initialized!\n";
+        return false;
     }
 
-    return true;
-}
+    UDP::EventLoop loop;
+    UDP::AsyncSender asyncSender(loop, sender, ackReceiver);
+
+    size_t confirmed = 0;
+    for (auto& session : sessions) loop.Spawn(SendOneAsync(asyncSender, *session, window, confirmed));
+    loop.Run();
 
+    std::cout << "Sender: " << confirmed << " of " << sessions.size() << " files confirmed\n";
+    return confirmed == sessions.size();
+}
 
 int main()
 {
     std::cout << "Sender Module Online\n";
     std::cout << "Hello World!\n";
 
+    // Every packet goes to the file, console gets only resends and problems
+    UDP::Log::Start("sender.klog");
+    // Scraped by node exporter textfile collector, JSON for anything else
+    UDP::Metrics::Start("sender.metrics.json", "sender.prom");
+    if (TRACE_TRANSFERS) UDP::Trace::Start("sender.trace.json", "sender", 1);
+    if (CAPTURE_PACKETS) UDP::PacketCapture::Start("sender.pcap");
+
     UDP::WindowsSocketInit winsocket;
     if (!winsocket.IsOk()) return 1;
 
@@ -329,6 +407,7 @@ int main()
         std::cout << "=============================\n";
         std::cout << "1) Stop-and-Wait\n";
         std::cout << "2) Selective Repeat\n";
+        std::cout << "3) Many files at once (one thread)\n";
         std::cout << "0) Quit\n";
         std::cout << "Select: ";
 
@@ -349,12 +428,43 @@ int main()
             break;
         }
 
-        if (choice != 1 && choice != 2)
+        if (choice != 1 && choice != 2 && choice != 3)
         {
             std::cout << "Invalid choice.\n";
             continue;
         }
 
+        if (choice == 3)
+        {
+            std::vector<std::unique_ptr<UDP::FileSession>> sessions;
+            std::cout << "Chose files, one per line, empty line ends: ";
+
+            std::string path;
+            while (std::getline(std::cin, path) && !path.empty())
+            {
+                auto session = std::make_unique<UDP::FileSession>();
+                if (!session->SetFromFile(path, STREAM_FILE, HASH_TRAILER, HASH_ALGORITHM, CHECKSUM_POLICY))
+                {
+                    std::cerr << "Error: File " << path << " could not be read.\n";
+                    continue;
+                }
+                sessions.push_back(std::move(session));
+            }
+
+            int window = 4;
+            std::cout << "Chose packet window: ";
+            while (!(std::cin >> window))
+            {
+                std::cout << "Not valid option, try again...\n";
+            }
+
+            if (!sessions.empty() && !SendManyAsync(sender, sessions, static_cast<size_t>((std::max)(window, 1))))
+            {
+                std::cerr << "Error: Not every file was sent.\n";
+            }
+            continue;
+        }
+
         std::cout << "Chose file: ";
         std::string path;
         std::getline(std::cin, path);
@@ -362,11 +472,12 @@ int main()
         if (path.empty()) path = file; // Default file
 
         UDP::FileSession session;
-        if (!session.SetFromFile(path))
+        if (!session.SetFromFile(path, STREAM_FILE, HASH_TRAILER, HASH_ALGORITHM, CHECKSUM_POLICY))
         {
             std::cerr << "Error: File could not be read.\n";
             continue;
         }
+        std::cout << "Session " << std::hex << std::setw(8) << std::setfill('0') << session.sessionId << std::dec << "\n";
 
         bool ok = false;
         if (choice == 1)
@@ -409,5 +520,9 @@ int main()
     }
     */
 
+    UDP::PacketCapture::Stop();
+    UDP::Trace::Stop();
+    UDP::Metrics::Stop();
+    UDP::Log::Stop();
     return 0;
 }
@@ -0,0 +1,151 @@
+﻿// CRC-32 throughput benchmark: every implementation this CPU supports on full sized packets
+// one by one, as a batch of received datagrams, copied into a packet buffer while
+// checksummed (chunk building), and on the whole buffer. CRC-32C (ChecksumPolicy::Crc32c)
+// has only single packet and whole buffer.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <algorithm>
+
+#include "Tools.h"
+#include "../kucerp33.core/Crc32.h"
+#include "../kucerp33.core/Crc32c.h"
+#include "../kucerp33.core/PacketHeader.h"
+#include "../kucerp33.core/UDPCommunication.h"
+
+static constexpr double MIN_SECONDS = 0.5;
+static constexpr size_t DEFAULT_MIB = 16;
+static constexpr size_t BATCH = 64;
+
+static volatile uint32_t CrcSink = 0;
+
+/// <summary>
+/// MB/s of run() repeated over the buffer for at least MIN_SECONDS
+/// </summary>
+/// <param name="bytes">bytes processed by one run</param>
+/// <param name="run">returns some CRC so the work is not optimized out</param>
+/// <returns></returns>
+template <typename Run>
+static double Measure(size_t bytes, Run run)
+{
+    using Clock = std::chrono::steady_clock;
+
+    uint64_t total = 0;
+    double seconds = 0;
+    Clock::time_point start = Clock::now();
+
+    do
+    {
+        CrcSink = CrcSink ^ run();
+        total += bytes;
+        seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (seconds < MIN_SECONDS);
+
+    return static_cast<double>(total) / 1e6 / seconds;
+}
+
+/// <summary>
+/// Runs all CRC implementations (forced one after another), automatically selected one is restored at the end.
+/// </summary>
+/// <param name="argc"></param>
+/// <param name="argv">[0] = buffer size in MiB</param>
+/// <returns></returns>
+int CrcBenchmark(int argc, char* argv[])
+{
+    size_t mib = DEFAULT_MIB;
+    if (argc > 0)
+    {
+        mib = static_cast<size_t>(std::strtoul(argv[0], nullptr, 10));
+        if (mib == 0)
+        {
+            std::cerr << "Buffer size has to be at least 1 MiB\n";
+            return 1;
+        }
+    }
+
+    std::vector<uint8_t> data(mib << 20);
+    uint32_t x = 0x12345678;
+    for (uint8_t& byte : data)
+    {
+        x = x * 1664525u + 1013904223u;
+        byte = static_cast<uint8_t>(x >> 24);
+    }
+
+    // Buffer seen as back to back full sized packets
+    const size_t packetCount = data.size() / UDP::PACKET_MAX_LENGTH;
+    std::vector<const uint8_t*> packets(packetCount);
+    std::vector<size_t> sizes(packetCount, UDP::PACKET_MAX_LENGTH);
+    for (size_t i = 0; i < packetCount; ++i) packets[i] = data.data() + i * UDP::PACKET_MAX_LENGTH;
+    const size_t packetBytes = packetCount * UDP::PACKET_MAX_LENGTH;
+
+    std::cout << "Buffer " << mib << " MiB, packets of " << UDP::PACKET_MAX_LENGTH
+        << " B one by one, in batches of " << BATCH << ", fused with copy and whole buffer\n";
+    std::cout << std::left << std::setw(18) << "Impl"
+        << std::right << std::setw(14) << "MB/s (packet)" << std::setw(14) << "MB/s (batch)"
+        << std::setw(14) << "MB/s (copy)" << std::setw(14) << "MB/s (whole)" << "\n";
+
+    const UDP::Crc32Impl active = UDP::Crc32::Implementation();
+    for (UDP::Crc32Impl impl : { UDP::Crc32Impl::Portable, UDP::Crc32Impl::PCLMUL })
+    {
+        if (!UDP::Crc32::SetImplementation(impl)) continue;
+
+        double single = Measure(packetBytes, [&]() {
+            uint32_t crc = 0;
+            for (size_t i = 0; i < packetCount; ++i) crc ^= UDP::ComputePacketCRC(packets[i], sizes[i]);
+            return crc;
+        });
+
+        double batch = Measure(packetBytes, [&]() {
+            uint32_t crcs[BATCH];
+            uint32_t crc = 0;
+            for (size_t i = 0; i < packetCount; i += BATCH)
+            {
+                size_t n = (std::min)(BATCH, packetCount - i);
+                UDP::ComputePacketCRCs(packets.data() + i, sizes.data() + i, n, crcs);
+                for (size_t j = 0; j < n; ++j) crc ^= crcs[j];
+            }
+            return crc;
+        });
+
+        uint8_t packet[UDP::PACKET_MAX_LENGTH];
+        double copy = Measure(packetBytes, [&]() {
+            uint32_t crc = 0;
+            for (size_t i = 0; i < packetCount; ++i) crc ^= UDP::Crc32::CopyAndCompute(packet, packets[i], sizes[i]);
+            return crc;
+        });
+
+        double whole = Measure(data.size(), [&]() { return UDP::Crc32::Compute(data.data(), data.size()); });
+
+        std::cout << std::left << std::setw(18) << UDP::Crc32::ImplementationName(impl)
+            << std::right << std::fixed << std::setprecision(0)
+            << std::setw(14) << single << std::setw(14) << batch << std::setw(14) << copy << std::setw(14) << whole << "\n";
+    }
+    UDP::Crc32::SetImplementation(active);
+
+    const UDP::Crc32cImpl activeC = UDP::Crc32c::Implementation();
+    for (UDP::Crc32cImpl impl : { UDP::Crc32cImpl::Portable, UDP::Crc32cImpl::SSE42 })
+    {
+        if (!UDP::Crc32c::SetImplementation(impl)) continue;
+
+        double single = Measure(packetBytes, [&]() {
+            uint32_t crc = 0;
+            for (size_t i = 0; i < packetCount; ++i)
+                crc ^= UDP::ComputePacketCRC(packets[i], sizes[i], UDP::ChecksumPolicy::Crc32c);
+            return crc;
+        });
+
+        double whole = Measure(data.size(), [&]() { return UDP::Crc32c::Compute(data.data(), data.size()); });
+
+        std::string name = std::string("CRC-32C ") + UDP::Crc32c::ImplementationName(impl);
+        std::cout << std::left << std::setw(18) << name
+            << std::right << std::fixed << std::setprecision(0)
+            << std::setw(14) << single << std::setw(14) << "-" << std::setw(14) << "-" << std::setw(14) << whole << "\n";
+    }
+    UDP::Crc32c::SetImplementation(activeC);
+
+    return 0;
+}
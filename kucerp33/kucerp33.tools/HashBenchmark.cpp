@@ -0,0 +1,127 @@
+﻿// Hash throughput benchmark: every algorithm selectable by HASH tag, with every
+// implementation this CPU supports, so the algorithm can be picked per deployment.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <string>
+#include <cstdlib>
+
+#include "Tools.h"
+#include "../kucerp33.core/FileHash.h"
+#include "../kucerp33.core/FileTransfer.h"
+
+// Every measurement repeats the whole buffer at least this long
+static constexpr double MIN_SECONDS = 0.5;
+static constexpr size_t DEFAULT_MIB = 64;
+
+static volatile uint8_t DigestSink = 0;
+
+/// <summary>
+/// MB/s of hashing data the way transfer does it: Reset, Update by updateSize bytes, Finish.
+/// </summary>
+/// <param name="algorithm">HASH tag</param>
+/// <param name="data"></param>
+/// <param name="updateSize">size of one Update, whole buffer at once if 0</param>
+/// <returns></returns>
+static double Measure(uint32_t algorithm, const std::vector<uint8_t>& data, size_t updateSize)
+{
+    using Clock = std::chrono::steady_clock;
+
+    UDP::FileHasher hasher;
+    const uint64_t merkleBlock = UDP::FileSession::MERKLE_BLOCK_CHUNKS * UDP::FileSession::PAYLOAD_CAPACITY;
+    if (updateSize == 0) updateSize = data.size();
+
+    uint64_t bytes = 0;
+    double seconds = 0;
+    Clock::time_point start = Clock::now();
+
+    do
+    {
+        hasher.Reset(algorithm, merkleBlock, data.size());
+        for (size_t offset = 0; offset < data.size(); offset += updateSize)
+        {
+            hasher.Update(data.data() + offset, (std::min)(updateSize, data.size() - offset));
+        }
+        DigestSink = DigestSink ^ hasher.Finish()[0];
+
+        bytes += data.size();
+        seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (seconds < MIN_SECONDS);
+
+    return static_cast<double>(bytes) / 1e6 / seconds;
+}
+
+static void PrintRow(uint32_t algorithm, const char* implementation, const std::vector<uint8_t>& data)
+{
+    double chunked = Measure(algorithm, data, UDP::FileSession::PAYLOAD_CAPACITY);
+    double whole = Measure(algorithm, data, 0);
+
+    std::cout << std::left << std::setw(16) << UDP::FileHasher::AlgorithmName(algorithm)
+        << std::setw(12) << implementation
+        << std::right << std::fixed << std::setprecision(0)
+        << std::setw(14) << chunked
+        << std::setw(14) << whole << "\n";
+}
+
+/// <summary>
+/// Runs all algorithms, each with all its implementations (forced one after another),
+/// automatically selected implementations are restored at the end.
+/// </summary>
+/// <param name="argc"></param>
+/// <param name="argv">[0] = buffer size in MiB</param>
+/// <returns></returns>
+int HashBenchmark(int argc, char* argv[])
+{
+    size_t mib = DEFAULT_MIB;
+    if (argc > 0)
+    {
+        mib = static_cast<size_t>(std::strtoul(argv[0], nullptr, 10));
+        if (mib == 0)
+        {
+            std::cerr << "Buffer size has to be at least 1 MiB\n";
+            return 1;
+        }
+    }
+
+    std::vector<uint8_t> data(mib << 20);
+    uint32_t x = 0x12345678;
+    for (uint8_t& byte : data)
+    {
+        x = x * 1664525u + 1013904223u;
+        byte = static_cast<uint8_t>(x >> 24);
+    }
+
+    std::cout << "Buffer " << mib << " MiB, Update by " << UDP::FileSession::PAYLOAD_CAPACITY
+        << " B (one DATA payload) and by whole buffer\n";
+    std::cout << std::left << std::setw(16) << "Algorithm" << std::setw(12) << "Impl"
+        << std::right << std::setw(14) << "MB/s (chunk)" << std::setw(14) << "MB/s (whole)" << "\n";
+
+    const UDP::Sha256Impl sha = UDP::Sha256::Implementation();
+    for (UDP::Sha256Impl impl : { UDP::Sha256Impl::Portable, UDP::Sha256Impl::AVX2, UDP::Sha256Impl::SHANI })
+    {
+        if (!UDP::Sha256::SetImplementation(impl)) continue;
+        PrintRow(UDP::HASH_SHA256, UDP::Sha256::ImplementationName(impl), data);
+        PrintRow(UDP::HASH_MERKLE_SHA256, UDP::Sha256::ImplementationName(impl), data);
+    }
+    UDP::Sha256::SetImplementation(sha);
+
+    const UDP::Blake3Impl blake = UDP::Blake3::Implementation();
+    for (UDP::Blake3Impl impl : { UDP::Blake3Impl::Portable, UDP::Blake3Impl::AVX2 })
+    {
+        if (!UDP::Blake3::SetImplementation(impl)) continue;
+        PrintRow(UDP::HASH_BLAKE3, UDP::Blake3::ImplementationName(impl), data);
+    }
+    UDP::Blake3::SetImplementation(blake);
+
+    const UDP::Xxh3Impl xxh = UDP::Xxh3::Implementation();
+    for (UDP::Xxh3Impl impl : { UDP::Xxh3Impl::Portable, UDP::Xxh3Impl::AVX2 })
+    {
+        if (!UDP::Xxh3::SetImplementation(impl)) continue;
+        PrintRow(UDP::HASH_XXH3_128, UDP::Xxh3::ImplementationName(impl), data);
+    }
+    UDP::Xxh3::SetImplementation(xxh);
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+﻿// Decoder of binary log written by sender and receiver (sender.klog, receiver.klog).
+// Records of all threads are merged by time and printed as the text they stand for.
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "Tools.h"
+#include "../kucerp33.core/Log.h"
+
+/// <summary>
+/// Prints log file as text, "-t" adds time since start [ms] and thread of every record
+/// </summary>
+/// <param name="argc"></param>
+/// <param name="argv">[0] = log file, [1] = -t</param>
+/// <returns></returns>
+int LogDump(int argc, char* argv[])
+{
+    std::string path;
+    bool times = false;
+    if (argc > 0)
+    {
+        path = argv[0];
+        times = argc > 1 && std::string(argv[1]) == "-t";
+    }
+    else
+    {
+        std::cout << "Log file: ";
+        std::getline(std::cin, path);
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        std::cerr << "LogDump: " << path << " could not be opened\n";
+        return 1;
+    }
+
+    UDP::LogFileHeader header;
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!file || header.magic != UDP::LogFileHeader::MAGIC)
+    {
+        std::cerr << "LogDump: " << path << " is not a log file\n";
+        return 1;
+    }
+    if (header.version != UDP::LogFileHeader::VERSION || header.recordSize != sizeof(UDP::LogRecord))
+    {
+        std::cerr << "LogDump: unsupported log version " << header.version << "\n";
+        return 1;
+    }
+
+    std::vector<UDP::LogRecord> records;
+    UDP::LogRecord record;
+    while (file.read(reinterpret_cast<char*>(&record), sizeof(record))) records.push_back(record);
+
+    // Every thread is in order already, stable sort keeps it so for equal times
+    std::stable_sort(records.begin(), records.end(),
+        [](const UDP::LogRecord& a, const UDP::LogRecord& b) { return a.time < b.time; });
+
+    std::string line;
+    for (const UDP::LogRecord& entry : records)
+    {
+        UDP::Log::Format(entry, line);
+        if (times)
+        {
+            std::cout << std::fixed << std::setprecision(3) << std::setw(12) << entry.time / 1e6
+                << " [" << std::setw(2) << static_cast<unsigned>(entry.thread) << "] ";
+        }
+        std::cout << line << "\n";
+    }
+
+    std::cerr << "LogDump: " << records.size() << " records\n";
+    return 0;
+}
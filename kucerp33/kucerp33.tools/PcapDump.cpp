@@ -0,0 +1,296 @@
+﻿// Decoder of packet capture written by sender and receiver (sender.pcap, receiver.pcap),
+// also of tcpdump/Wireshark captures of the same traffic. Every datagram is printed with
+// its header (CRC/SEQ/CMD/OFFSET/SESSION) or control message (ACK, NACK, LEAF, FACK, FNACK),
+// summary per session shows loss and retransmission patterns.
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
+#include "Tools.h"
+#include "../kucerp33.core/PacketCapture.h"
+#include "../kucerp33.core/PacketHeader.h"
+#include "../kucerp33.core/Crc32.h"
+
+struct SessionStats
+{
+    uint64_t chunks = 0;
+    uint64_t dataBytes = 0;
+    uint64_t repeated = 0;     // chunk with seq already seen in same direction
+    uint64_t crcFailures = 0;
+    uint64_t acks = 0;
+    uint64_t nacks = 0;
+    uint64_t leafRequests = 0;
+    uint64_t controlFailures = 0;
+    const char* verdict = "none";
+    UDP::ChecksumPolicy checksum = UDP::ChecksumPolicy::Crc32; // of DATA, from NAME
+    std::map<uint32_t, uint32_t> seqCount[2]; // per direction (0 = received, 1 = sent)
+    std::map<uint32_t, uint32_t> nackCount;
+};
+
+static uint32_t Swap32(uint32_t value)
+{
+    return (value >> 24) | ((value >> 8) & 0xFF00) | ((value << 8) & 0xFF0000) | (value << 24);
+}
+
+static std::string Address(const uint8_t* ip, const uint8_t* port)
+{
+    if (ip[0] == 0 && ip[1] == 0 && ip[2] == 0 && ip[3] == 0) return "local:" + std::to_string((port[0] << 8) | port[1]);
+    return std::to_string(ip[0]) + "." + std::to_string(ip[1]) + "." + std::to_string(ip[2]) + "." + std::to_string(ip[3])
+        + ":" + std::to_string((port[0] << 8) | port[1]);
+}
+
+static bool IsKnownCommand(uint32_t tag)
+{
+    switch (static_cast<UDP::Command>(tag))
+    {
+    case UDP::Command::Name:
+    case UDP::Command::Size:
+    case UDP::Command::Hash:
+    case UDP::Command::Data:
+    case UDP::Command::Stop:
+    case UDP::Command::Leaf:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/// <summary>
+/// Chunk of the transfer: header, CRC by checksum policy of the session
+/// </summary>
+static void DecodeChunk(const uint8_t* data, size_t size, bool sent, std::map<uint32_t, SessionStats>& sessions, bool print)
+{
+    UDP::PacketHeader header = UDP::HeaderView(data, size).Load();
+    SessionStats& stats = sessions[header.session];
+
+    if (header.command == UDP::Command::Name)
+    {
+        uint32_t policy = static_cast<uint32_t>(header.offset >> 32);
+        if (UDP::IsKnownChecksum(policy)) stats.checksum = static_cast<UDP::ChecksumPolicy>(policy);
+    }
+
+    UDP::ChecksumPolicy policy = header.command == UDP::Command::Data ? stats.checksum : UDP::ChecksumPolicy::Crc32;
+    bool crcOk = UDP::ComputePacketCRC(data, size, policy) == header.crc;
+
+    ++stats.chunks;
+    if (!crcOk) ++stats.crcFailures;
+    if (header.command == UDP::Command::Data && size > sizeof(UDP::PacketHeader)) stats.dataBytes += size - sizeof(UDP::PacketHeader);
+    // LEAF answers have seq past STOP, each is a new one
+    if (header.command != UDP::Command::Leaf && stats.seqCount[sent][header.seq]++ > 0) ++stats.repeated;
+
+    if (!print) return;
+
+    char tag[5];
+    UDP::TagToChars(static_cast<uint32_t>(header.command), tag);
+    std::cout << tag << " seq=" << header.seq << " offset=" << header.offset
+        << " session=" << std::hex << std::setw(8) << std::setfill('0') << header.session << std::dec << std::setfill(' ')
+        << " len=" << size << " crc=" << (crcOk ? "ok" : "BAD");
+    if (header.command == UDP::Command::Name)
+    {
+        std::cout << " name=\"" << std::string_view(reinterpret_cast<const char*>(data) + sizeof(header), size - sizeof(header)) << "\""
+            << " checksum=" << UDP::ChecksumName(stats.checksum);
+    }
+}
+
+/// <summary>
+/// Control message of receiver: 4 bytes CRC + text, session as "@hex" at the end
+/// </summary>
+static void DecodeControl(const uint8_t* data, size_t size, std::map<uint32_t, SessionStats>& sessions, bool print)
+{
+    uint32_t crc = 0;
+    std::memcpy(&crc, data, sizeof(crc));
+    std::string_view text(reinterpret_cast<const char*>(data) + sizeof(crc), size - sizeof(crc));
+    bool crcOk = UDP::Crc32::Compute(text.data(), text.size()) == crc;
+
+    // Session of broken message can't be trusted, it goes to session 0
+    uint32_t session = 0;
+    std::string_view body = text;
+    size_t at = text.find('@');
+    if (at != std::string_view::npos)
+    {
+        if (crcOk) std::from_chars(text.data() + at + 1, text.data() + text.size(), session, 16);
+        body = text.substr(0, at);
+    }
+
+    SessionStats& stats = sessions[session];
+    uint32_t value = 0;
+    size_t equals = body.find('=');
+    if (equals != std::string_view::npos) std::from_chars(body.data() + equals + 1, body.data() + body.size(), value);
+
+    if (!crcOk) ++stats.controlFailures;
+    else if (body.starts_with("ACK=")) ++stats.acks;
+    else if (body.starts_with("NACK="))
+    {
+        ++stats.nacks;
+        ++stats.nackCount[value];
+    }
+    else if (body.starts_with("LEAF=")) ++stats.leafRequests;
+    else if (body == "FACK") stats.verdict = "FACK";
+    else if (body == "FNACK") stats.verdict = "FNACK";
+
+    if (print) std::cout << text << " crc=" << (crcOk ? "ok" : "BAD");
+}
+
+static bool IsControl(const uint8_t* data, size_t size)
+{
+    if (size <= sizeof(uint32_t)) return false;
+    std::string_view text(reinterpret_cast<const char*>(data) + sizeof(uint32_t), size - sizeof(uint32_t));
+    return text.starts_with("ACK=") || text.starts_with("NACK=") || text.starts_with("LEAF=")
+        || text.starts_with("FACK") || text.starts_with("FNACK");
+}
+
+// Sequences with most copies, "seq x count"
+static void PrintTop(const char* label, const std::map<uint32_t, uint32_t>& counts, uint32_t minimum)
+{
+    std::vector<std::pair<uint32_t, uint32_t>> top;
+    for (const auto& [seq, count] : counts)
+    {
+        if (count >= minimum) top.emplace_back(seq, count);
+    }
+    if (top.empty()) return;
+
+    std::stable_sort(top.begin(), top.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+    std::cout << "    " << label << ":";
+    for (size_t i = 0; i < (std::min<size_t>)(top.size(), 10); ++i) std::cout << " " << top[i].first << "x" << top[i].second;
+    if (top.size() > 10) std::cout << " ... (" << top.size() << " seqs)";
+    std::cout << "\n";
+}
+
+/// <summary>
+/// Prints every datagram of the capture and summary per session, "-s" prints only the summary
+/// </summary>
+/// <param name="argc"></param>
+/// <param name="argv">[0] = pcap file, [1] = -s</param>
+/// <returns></returns>
+int PcapDump(int argc, char* argv[])
+{
+    std::string path;
+    bool summaryOnly = false;
+    if (argc > 0)
+    {
+        path = argv[0];
+        summaryOnly = argc > 1 && std::string(argv[1]) == "-s";
+    }
+    else
+    {
+        std::cout << "Capture file: ";
+        std::getline(std::cin, path);
+    }
+
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        std::cerr << "PcapDump: " << path << " could not be opened\n";
+        return 1;
+    }
+
+    UDP::PcapFileHeader header;
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+    bool swapped = false;
+    uint32_t magic = header.magic;
+    if (magic == Swap32(UDP::PcapFileHeader::MAGIC_NANOSECONDS) || magic == Swap32(UDP::PcapFileHeader::MAGIC_MICROSECONDS))
+    {
+        swapped = true;
+        magic = Swap32(magic);
+        header.linkType = Swap32(header.linkType);
+    }
+    if (!file || (magic != UDP::PcapFileHeader::MAGIC_NANOSECONDS && magic != UDP::PcapFileHeader::MAGIC_MICROSECONDS))
+    {
+        std::cerr << "PcapDump: " << path << " is not a pcap file\n";
+        return 1;
+    }
+    const uint32_t fractionPerSecond = magic == UDP::PcapFileHeader::MAGIC_NANOSECONDS ? 1000000000 : 1000000;
+
+    size_t linkHeader = 0;
+    switch (header.linkType)
+    {
+    case UDP::PcapFileHeader::LINKTYPE_NULL: linkHeader = 4; break;
+    case UDP::PcapFileHeader::LINKTYPE_ETHERNET: linkHeader = 14; break;
+    case UDP::PcapFileHeader::LINKTYPE_RAW:
+    case UDP::PcapFileHeader::LINKTYPE_IPV4: linkHeader = 0; break;
+    default:
+        std::cerr << "PcapDump: unsupported link type " << header.linkType << "\n";
+        return 1;
+    }
+
+    std::map<uint32_t, SessionStats> sessions;
+    std::vector<uint8_t> packet;
+    UDP::PcapRecordHeader record;
+    uint64_t packets = 0;
+    uint64_t skipped = 0;
+    double firstTime = -1.0;
+
+    while (file.read(reinterpret_cast<char*>(&record), sizeof(record)))
+    {
+        if (swapped)
+        {
+            record.seconds = Swap32(record.seconds);
+            record.fraction = Swap32(record.fraction);
+            record.capturedLength = Swap32(record.capturedLength);
+        }
+
+        packet.resize(record.capturedLength);
+        if (!file.read(reinterpret_cast<char*>(packet.data()), packet.size())) break;
+
+        // Link, IPv4 and UDP header, anything else is not ours
+        const uint8_t* ip = packet.data() + linkHeader;
+        size_t left = packet.size() > linkHeader ? packet.size() - linkHeader : 0;
+        if (header.linkType == UDP::PcapFileHeader::LINKTYPE_ETHERNET && (packet.size() < 14 || packet[12] != 0x08 || packet[13] != 0x00)) left = 0;
+        size_t ipHeader = left >= 20 ? size_t(ip[0] & 0x0F) * 4 : 0;
+        if (left < 20 || (ip[0] >> 4) != 4 || ip[9] != 17 || left < ipHeader + 8)
+        {
+            ++skipped;
+            continue;
+        }
+
+        const uint8_t* udp = ip + ipHeader;
+        size_t udpLength = (size_t(udp[4]) << 8) | udp[5];
+        const uint8_t* data = udp + 8;
+        size_t size = (std::min)(left - ipHeader - 8, udpLength >= 8 ? udpLength - 8 : 0);
+
+        bool sent = ip[12] == 0 && ip[13] == 0 && ip[14] == 0 && ip[15] == 0;
+        double time = record.seconds + static_cast<double>(record.fraction) / fractionPerSecond;
+        if (firstTime < 0) firstTime = time;
+        ++packets;
+
+        bool print = !summaryOnly;
+        if (print)
+        {
+            std::cout << std::fixed << std::setprecision(6) << std::setw(12) << time - firstTime << " "
+                << (sent ? "-> " + Address(ip + 16, udp + 2) : "<- " + Address(ip + 12, udp)) << "  ";
+        }
+
+        bool chunk = size >= sizeof(UDP::PacketHeader) && IsKnownCommand(static_cast<uint32_t>(UDP::HeaderView(data, size).Load().command));
+        if (IsControl(data, size)) DecodeControl(data, size, sessions, print);
+        else if (chunk) DecodeChunk(data, size, sent, sessions, print);
+        else if (print) std::cout << "unknown datagram, " << size << " bytes";
+
+        if (print) std::cout << "\n";
+    }
+
+    std::cout << "PcapDump: " << packets << " datagrams";
+    if (skipped) std::cout << ", " << skipped << " other packets skipped";
+    std::cout << "\n";
+
+    for (const auto& [session, stats] : sessions)
+    {
+        std::cout << "Session " << std::hex << std::setw(8) << std::setfill('0') << session << std::dec << std::setfill(' ')
+            << ": chunks=" << stats.chunks << " data_bytes=" << stats.dataBytes
+            << " repeated=" << stats.repeated << " crc_failures=" << stats.crcFailures
+            << " acks=" << stats.acks << " nacks=" << stats.nacks << " leaf_requests=" << stats.leafRequests
+            << " control_crc_failures=" << stats.controlFailures << " verdict=" << stats.verdict << "\n";
+        PrintTop("sent more than once", stats.seqCount[1], 2);
+        PrintTop("received more than once", stats.seqCount[0], 2);
+        PrintTop("NACKed", stats.nackCount, 1);
+    }
+    return 0;
+}
@@ -0,0 +1,147 @@
+﻿// Work-stealing scheduler benchmark: many transfers with very different sizes, every chunk
+// is a small task (CRC of a full sized packet). Tasks are submitted from outside the pool
+// and spawned by workers themselves (fork per transfer), compared to one thread doing
+// everything.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <atomic>
+#include <algorithm>
+
+#include "Tools.h"
+#include "../kucerp33.core/TaskScheduler.h"
+#include "../kucerp33.core/PacketHeader.h"
+#include "../kucerp33.core/UDPCommunication.h"
+
+static constexpr size_t TRANSFERS = 48;
+static constexpr size_t MAX_TRANSFER_CHUNKS = 4096;
+
+// One transfer: its chunks and tasks of them, root task forks the rest from a worker
+struct BenchTransfer
+{
+    size_t chunks = 0;
+    std::vector<UDP::TaskScheduler::Task> tasks;
+    UDP::TaskScheduler::Task root;
+    UDP::TaskScheduler* scheduler = nullptr;
+    UDP::TaskScheduler::Group* group = nullptr;
+};
+
+static std::vector<uint8_t> Packets;
+static std::atomic<uint32_t> CrcSink{ 0 };
+
+static void ChunkTask(UDP::TaskScheduler::Task& task, size_t)
+{
+    const uint8_t* packet = Packets.data() + (task.index % (Packets.size() / UDP::PACKET_MAX_LENGTH)) * UDP::PACKET_MAX_LENGTH;
+    CrcSink.fetch_xor(UDP::ComputePacketCRC(packet, UDP::PACKET_MAX_LENGTH), std::memory_order_relaxed);
+}
+
+static void ForkTask(UDP::TaskScheduler::Task& task, size_t)
+{
+    BenchTransfer& transfer = *static_cast<BenchTransfer*>(task.context);
+    for (UDP::TaskScheduler::Task& chunk : transfer.tasks) transfer.scheduler->Spawn(chunk, *transfer.group);
+}
+
+template <typename Run>
+static double Seconds(Run run)
+{
+    using Clock = std::chrono::steady_clock;
+    Clock::time_point start = Clock::now();
+    run();
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/// <summary>
+/// Single thread, submitted tasks and forked tasks on a scheduler of given size
+/// </summary>
+/// <param name="argc"></param>
+/// <param name="argv">[0] = worker threads, default is one per core but the calling one</param>
+/// <returns></returns>
+int SchedulerBenchmark(int argc, char* argv[])
+{
+    size_t threads = (std::max<size_t>)(1, UDP::TaskScheduler::DefaultThreads());
+    if (argc > 0)
+    {
+        threads = static_cast<size_t>(std::strtoul(argv[0], nullptr, 10));
+        if (threads == 0)
+        {
+            std::cerr << "Scheduler needs at least 1 worker\n";
+            return 1;
+        }
+    }
+
+    Packets.resize(256 * UDP::PACKET_MAX_LENGTH);
+    uint32_t x = 0x12345678;
+    for (uint8_t& byte : Packets)
+    {
+        x = x * 1664525u + 1013904223u;
+        byte = static_cast<uint8_t>(x >> 24);
+    }
+
+    // Sizes from a few chunks to MAX_TRANSFER_CHUNKS, so static split would leave cores idle
+    std::vector<BenchTransfer> transfers(TRANSFERS);
+    size_t total = 0;
+    for (size_t i = 0; i < transfers.size(); ++i)
+    {
+        x = x * 1664525u + 1013904223u;
+        transfers[i].chunks = (std::max<size_t>)(1, MAX_TRANSFER_CHUNKS >> (x >> 29));
+        transfers[i].tasks.resize(transfers[i].chunks);
+        for (size_t c = 0; c < transfers[i].chunks; ++c)
+        {
+            transfers[i].tasks[c].function = ChunkTask;
+            transfers[i].tasks[c].index = total + c;
+        }
+        total += transfers[i].chunks;
+    }
+
+    UDP::TaskScheduler scheduler(threads);
+    UDP::TaskScheduler::Task single;
+    single.function = ChunkTask;
+
+    double oneThread = Seconds([&]() {
+        for (size_t i = 0; i < total; ++i)
+        {
+            single.index = i;
+            ChunkTask(single, 0);
+        }
+    });
+
+    double submitted = Seconds([&]() {
+        UDP::TaskScheduler::Group group;
+        for (BenchTransfer& transfer : transfers)
+        {
+            for (UDP::TaskScheduler::Task& task : transfer.tasks) scheduler.Spawn(task, group);
+        }
+        scheduler.Wait(group);
+    });
+
+    double forked = Seconds([&]() {
+        UDP::TaskScheduler::Group group;
+        for (BenchTransfer& transfer : transfers)
+        {
+            transfer.scheduler = &scheduler;
+            transfer.group = &group;
+            transfer.root.function = ForkTask;
+            transfer.root.context = &transfer;
+            scheduler.Spawn(transfer.root, group);
+        }
+        scheduler.Wait(group);
+    });
+
+    std::cout << TRANSFERS << " transfers, " << total << " chunk tasks (CRC of " << UDP::PACKET_MAX_LENGTH
+        << " B), " << scheduler.Size() << " workers\n";
+    std::cout << std::left << std::setw(18) << "Mode" << std::right << std::setw(16) << "tasks/s"
+        << std::setw(10) << "speedup" << "\n";
+
+    auto row = [&](const char* mode, double seconds)
+    {
+        std::cout << std::left << std::setw(18) << mode << std::right << std::fixed << std::setprecision(0)
+            << std::setw(16) << total / seconds << std::setprecision(2) << std::setw(10) << oneThread / seconds << "\n";
+    };
+    row("one thread", oneThread);
+    row("submitted", submitted);
+    row("forked", forked);
+    return 0;
+}
@@ -0,0 +1,18 @@
+﻿#pragma once
+
+// Commands of kucerp33.tools, args are the ones after the command name
+
+// Throughput of every hash algorithm and implementation the CPU supports
+int HashBenchmark(int argc, char* argv[]);
+
+// CRC-32 throughput per implementation, packet by packet and batched
+int CrcBenchmark(int argc, char* argv[]);
+
+// Work-stealing scheduler: small tasks of many transfers
+int SchedulerBenchmark(int argc, char* argv[]);
+
+// Binary log of sender/receiver as text, merged by time
+int LogDump(int argc, char* argv[]);
+
+// Packet capture of sender/receiver (or tcpdump) decoded, with loss and retransmission summary
+int PcapDump(int argc, char* argv[]);
@@ -0,0 +1,191 @@
+-- Wireshark dissector of kucerp33 file transfer (UDP).
+--
+-- Chunk (sender -> receiver): CRC | SEQ | CMD | OFFSET | SESSION, 24 bytes little endian, then payload.
+-- CRC covers everything after itself, DATA use checksum policy announced in high half of NAME offset.
+-- Control (receiver -> sender): 4 bytes CRC-32 of text, then "ACK=<seq>", "NACK=<seq>", "LEAF=<leaf>",
+-- "FACK" or "FNACK", "@<session hex>" at the end.
+--
+-- Works on captures of sender/receiver (CAPTURE_PACKETS, sender.pcap) and on tcpdump/Wireshark ones.
+-- Install: copy into personal Lua plugins folder (Help > About Wireshark > Folders),
+-- or run once: wireshark -X lua_script:kucerp33.lua capture.pcap
+-- Filters: kucerp33.cmd == "DATA", kucerp33.retransmission, kucerp33.control.type == "NACK"
+
+local kucerp33 = Proto("kucerp33", "kucerp33 file transfer")
+
+local PORTS = { 14000, 14001, 15000, 15001 }
+
+local CHECKSUMS = { [0] = "CRC-32", [1] = "CRC-32C", [2] = "Header only", [3] = "None" }
+
+local f = kucerp33.fields
+f.crc = ProtoField.uint32("kucerp33.crc", "CRC", base.HEX)
+f.crc_ok = ProtoField.bool("kucerp33.crc.ok", "CRC correct")
+f.seq = ProtoField.uint32("kucerp33.seq", "Sequence")
+f.cmd = ProtoField.string("kucerp33.cmd", "Command")
+f.offset = ProtoField.uint64("kucerp33.offset", "Offset")
+f.session = ProtoField.uint32("kucerp33.session", "Session", base.HEX)
+f.payload = ProtoField.bytes("kucerp33.payload", "Payload")
+f.name = ProtoField.string("kucerp33.name", "File name")
+f.hash_algorithm = ProtoField.string("kucerp33.hash_algorithm", "Hash algorithm")
+f.checksum = ProtoField.string("kucerp33.checksum", "DATA checksum")
+f.size = ProtoField.uint64("kucerp33.size", "File size")
+f.retransmission = ProtoField.bool("kucerp33.retransmission", "Retransmission")
+f.original = ProtoField.framenum("kucerp33.original", "First sent in frame")
+f.control_type = ProtoField.string("kucerp33.control.type", "Control")
+f.control_value = ProtoField.uint32("kucerp33.control.value", "Value")
+f.control_text = ProtoField.string("kucerp33.control.text", "Text")
+
+local bad_crc = ProtoExpert.new("kucerp33.crc.bad", "Bad CRC", expert.group.CHECKSUM, expert.severity.ERROR)
+local repeated = ProtoExpert.new("kucerp33.retransmission.expert", "Chunk sent again", expert.group.SEQUENCE, expert.severity.NOTE)
+kucerp33.experts = { bad_crc, repeated }
+
+-- Filled on first pass: checksum policy per session (from NAME), first frame of every chunk
+local policies = {}
+local first_frame = {}
+
+function kucerp33.init()
+    policies = {}
+    first_frame = {}
+end
+
+local function make_table(polynomial)
+    local t = {}
+    for i = 0, 255 do
+        local c = i
+        for _ = 1, 8 do
+            if bit.band(c, 1) ~= 0 then c = bit.bxor(bit.rshift(c, 1), polynomial) else c = bit.rshift(c, 1) end
+        end
+        t[i] = c
+    end
+    return t
+end
+
+local CRC32 = make_table(0xEDB88320)
+local CRC32C = make_table(0x82F63B78)
+
+-- CRC of bytes [from, to) of tvb, reflected, init and final xor 0xFFFFFFFF
+local function crc(tvb, from, to, t)
+    local c = bit.bnot(0)
+    local bytes = tvb:bytes()
+    for i = from, to - 1 do
+        c = bit.bxor(t[bit.band(bit.bxor(c, bytes:get_index(i)), 0xFF)], bit.rshift(c, 8))
+    end
+    return bit.bnot(c)
+end
+
+local COMMANDS = { NAME = true, SIZE = true, HASH = true, DATA = true, STOP = true, LEAF = true }
+
+local function is_chunk(tvb)
+    return tvb:len() >= 24 and COMMANDS[tvb(8, 4):string()] ~= nil
+end
+
+local function is_control(tvb)
+    if tvb:len() <= 4 then return false end
+    local text = tvb(4):string()
+    return (text:find("^ACK=") or text:find("^NACK=") or text:find("^LEAF=") or text:find("^FN?ACK")) ~= nil
+end
+
+local function dissect_chunk(tvb, pinfo, tree)
+    local len = tvb:len()
+    local cmd = tvb(8, 4):string()
+    local seq = tvb(4, 4):le_uint()
+    local offset = tvb(12, 8):le_uint64()
+    local session = tvb(20, 4):le_uint()
+
+    local subtree = tree:add(kucerp33, tvb(), "kucerp33 " .. cmd .. ", Seq: " .. seq)
+
+    -- Checksum policy of DATA is known once NAME of the session went through
+    if cmd == "NAME" and not pinfo.visited then policies[session] = offset:higher() end
+    local policy = cmd == "DATA" and (policies[session] or 0) or 0
+
+    local stored = tvb(0, 4):le_uint()
+    local computed = 0
+    if policy == 1 then computed = crc(tvb, 4, len, CRC32C)
+    elseif policy == 2 then computed = crc(tvb, 4, 24, CRC32)
+    elseif policy == 0 then computed = crc(tvb, 4, len, CRC32) end
+    local crc_ok = bit.tobit(computed) == bit.tobit(stored)
+
+    local crc_item = subtree:add_le(f.crc, tvb(0, 4))
+    crc_item:add(f.crc_ok, crc_ok):set_generated()
+    if not crc_ok then crc_item:add_proto_expert_info(bad_crc) end
+
+    subtree:add_le(f.seq, tvb(4, 4))
+    subtree:add(f.cmd, tvb(8, 4))
+    subtree:add_le(f.offset, tvb(12, 8))
+    subtree:add_le(f.session, tvb(20, 4))
+
+    if cmd == "NAME" then
+        subtree:add(f.name, tvb(24))
+        subtree:add(f.hash_algorithm, tvb(12, 4))
+        subtree:add(f.checksum, tvb(16, 4), CHECKSUMS[offset:higher()] or "unknown")
+    elseif cmd == "HASH" then
+        subtree:add(f.hash_algorithm, tvb(12, 4))
+        if len > 24 then subtree:add(f.payload, tvb(24)) end
+    elseif cmd == "SIZE" and len >= 32 then
+        subtree:add_le(f.size, tvb(24, 8))
+    elseif len > 24 then
+        subtree:add(f.payload, tvb(24))
+    end
+
+    -- Same chunk in same direction again = retransmission (LEAF answers are always new)
+    local key = string.format("%08x:%d:%s>%s", session, seq, tostring(pinfo.src_port), tostring(pinfo.dst_port))
+    if cmd ~= "LEAF" then
+        if not pinfo.visited and first_frame[key] == nil then first_frame[key] = pinfo.number end
+        local first = first_frame[key]
+        if first ~= nil and first ~= pinfo.number then
+            subtree:add(f.retransmission, true):set_generated()
+            subtree:add(f.original, first):set_generated()
+            subtree:add_proto_expert_info(repeated)
+        end
+    end
+
+    pinfo.cols.info = string.format("%s seq=%d offset=%s session=%08x len=%d%s", cmd, seq, tostring(offset), session, len,
+        crc_ok and "" or " [BAD CRC]")
+end
+
+local function dissect_control(tvb, pinfo, tree)
+    local text = tvb(4):string()
+    local subtree = tree:add(kucerp33, tvb(), "kucerp33 control: " .. text)
+
+    local stored = tvb(0, 4):le_uint()
+    local crc_ok = bit.tobit(crc(tvb, 4, tvb:len(), CRC32)) == bit.tobit(stored)
+    local crc_item = subtree:add_le(f.crc, tvb(0, 4))
+    crc_item:add(f.crc_ok, crc_ok):set_generated()
+    if not crc_ok then crc_item:add_proto_expert_info(bad_crc) end
+
+    subtree:add(f.control_text, tvb(4))
+
+    local body, session = text:match("^([^@]*)@(%x+)$")
+    if body == nil then body = text end
+    local kind, value = body:match("^(%u+)=(%d+)$")
+    if kind == nil then kind = body end
+
+    subtree:add(f.control_type, kind):set_generated()
+    if value ~= nil then subtree:add(f.control_value, tonumber(value)):set_generated() end
+    if session ~= nil then subtree:add(f.session, tonumber(session, 16)):set_generated() end
+
+    pinfo.cols.info = text .. (crc_ok and "" or " [BAD CRC]")
+end
+
+function kucerp33.dissector(tvb, pinfo, tree)
+    if is_chunk(tvb) then
+        pinfo.cols.protocol = "KUCERP33"
+        dissect_chunk(tvb, pinfo, tree)
+        return tvb:len()
+    end
+    if is_control(tvb) then
+        pinfo.cols.protocol = "KUCERP33"
+        dissect_control(tvb, pinfo, tree)
+        return tvb:len()
+    end
+    return 0
+end
+
+-- Default ports, other ones (relay, NTB) are found by content
+local udp_port = DissectorTable.get("udp.port")
+for _, port in ipairs(PORTS) do udp_port:add(port, kucerp33) end
+
+kucerp33:register_heuristic("udp", function(tvb, pinfo, tree)
+    if not is_chunk(tvb) and not is_control(tvb) then return false end
+    kucerp33.dissector(tvb, pinfo, tree)
+    return true
+end)
@@ -0,0 +1,69 @@
+﻿// kucerp33.tools.cpp : Offline tools (benchmarks) for the transfer core.
+//
+
+#include <iostream>
+#include <string>
+#include <limits>
+
+#include "Tools.h"
+
+struct Tool
+{
+    const char* command;
+    const char* description;
+    int (*run)(int argc, char* argv[]);
+};
+
+static const Tool TOOLS[] = {
+    { "hash", "Hash throughput benchmark [MiB]", HashBenchmark },
+    { "crc", "CRC-32 throughput benchmark [MiB]", CrcBenchmark },
+    { "sched", "Task scheduler benchmark [workers]", SchedulerBenchmark },
+    { "logdump", "Binary log as text <file> [-t]", LogDump },
+    { "pcapdump", "Packet capture decoded <file> [-s]", PcapDump },
+};
+
+/// <summary>
+/// Tool is picked by first argument (kucerp33.tools hash 64), without it from menu.
+/// </summary>
+int main(int argc, char* argv[])
+{
+    if (argc > 1)
+    {
+        std::string command = argv[1];
+        for (const Tool& tool : TOOLS)
+        {
+            if (command == tool.command) return tool.run(argc - 2, argv + 2);
+        }
+
+        std::cerr << "Unknown tool: " << command << "\n";
+        for (const Tool& tool : TOOLS) std::cerr << "  " << tool.command << "  " << tool.description << "\n";
+        return 1;
+    }
+
+    while (true)
+    {
+        std::cout << "=============================\n";
+        std::cout << "   Tools\n";
+        std::cout << "=============================\n";
+        for (size_t i = 0; i < std::size(TOOLS); ++i)
+        {
+            std::cout << (i + 1) << ") " << TOOLS[i].description << "\n";
+        }
+        std::cout << "0) Quit\n";
+        std::cout << "Select: ";
+
+        size_t choice = 0;
+        if (!(std::cin >> choice))
+        {
+            std::cin.clear();
+            std::cin.ignore((std::numeric_limits<std::streamsize>::max)(), '\n');
+            continue;
+        }
+        std::cin.ignore((std::numeric_limits<std::streamsize>::max)(), '\n');
+
+        if (choice == 0) break;
+        if (choice <= std::size(TOOLS)) TOOLS[choice - 1].run(0, nullptr);
+    }
+
+    return 0;
+}